@@ -0,0 +1,161 @@
+/*
+ * SHORT CIRCUIT: CLOCK -- Time cached once per event loop iteration.
+ *
+ * Copyright (c) 2021, Alex O'Brien <3541ax@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Affero General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "clock.h"
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include <a3/str.h>
+#include <a3/util.h>
+
+// The ring is only touched by one thread, so each thread gets its own clock.
+static A3_THREAD_LOCAL struct timespec CLOCK_MONOTONIC_NOW = { 0, 0 };
+static A3_THREAD_LOCAL time_t          CLOCK_WALL_NOW      = 0;
+static A3_THREAD_LOCAL uint8_t         CLOCK_DATE[CLOCK_IMF_FIXDATE_LENGTH];
+static A3_THREAD_LOCAL time_t          CLOCK_DATE_TIME = -1;
+
+static uint8_t* clock_format_2(uint8_t* out, int n) {
+    assert(out);
+    assert(n >= 0 && n < 100);
+
+    *out++ = (uint8_t)('0' + n / 10);
+    *out++ = (uint8_t)('0' + n % 10);
+    return out;
+}
+
+// Format a time as an IMF-fixdate (RFC7231 § 7.1.1.1). out must have space for
+// CLOCK_IMF_FIXDATE_LENGTH bytes.
+size_t clock_format_imf_fixdate(uint8_t* out, time_t t) {
+    assert(out);
+
+    static const char DAYS[]   = "SunMonTueWedThuFriSat";
+    static const char MONTHS[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+
+    struct tm tm;
+    A3_UNWRAPND(gmtime_r(&t, &tm));
+
+    uint8_t* p = out;
+    memcpy(p, &DAYS[tm.tm_wday * 3], 3);
+    p += 3;
+    *p++ = ',';
+    *p++ = ' ';
+    p    = clock_format_2(p, tm.tm_mday);
+    *p++ = ' ';
+    memcpy(p, &MONTHS[tm.tm_mon * 3], 3);
+    p += 3;
+    *p++ = ' ';
+    p    = clock_format_2(p, (tm.tm_year + 1900) / 100);
+    p    = clock_format_2(p, (tm.tm_year + 1900) % 100);
+    *p++ = ' ';
+    p    = clock_format_2(p, tm.tm_hour);
+    *p++ = ':';
+    p    = clock_format_2(p, tm.tm_min);
+    *p++ = ':';
+    p    = clock_format_2(p, tm.tm_sec);
+    memcpy(p, " GMT", 4);
+    p += 4;
+
+    assert(p - out == CLOCK_IMF_FIXDATE_LENGTH);
+    return CLOCK_IMF_FIXDATE_LENGTH;
+}
+
+static bool clock_parse_digits(A3CString s, size_t pos, size_t n, int* out) {
+    assert(s.ptr);
+    assert(out);
+
+    int ret = 0;
+    for (size_t i = pos; i < pos + n; i++) {
+        if (s.ptr[i] < '0' || s.ptr[i] > '9')
+            return false;
+        ret = ret * 10 + (s.ptr[i] - '0');
+    }
+
+    *out = ret;
+    return true;
+}
+
+// Days since the epoch of a date in the proleptic Gregorian calendar. Months count from 1.
+static int64_t clock_days_from_civil(int64_t year, int month, int day) {
+    year -= month <= 2;
+    int64_t era = (year >= 0 ? year : year - 399) / 400;
+    int64_t yoe = year - era * 400;
+    int64_t doy = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+    int64_t doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + doe - 719468;
+}
+
+// Parse an IMF-fixdate, as written by clock_format_imf_fixdate. The day of the week is not checked.
+// The obsolete date formats of RFC7231 are not accepted.
+bool clock_parse_imf_fixdate(A3CString s, time_t* out) {
+    assert(out);
+
+    static const char MONTHS[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+
+    if (!s.ptr || s.len != CLOCK_IMF_FIXDATE_LENGTH || s.ptr[3] != ',' || s.ptr[4] != ' ' ||
+        s.ptr[7] != ' ' || s.ptr[11] != ' ' || s.ptr[16] != ' ' || s.ptr[19] != ':' ||
+        s.ptr[22] != ':' || memcmp(&s.ptr[25], " GMT", 4) != 0)
+        return false;
+
+    int month = 0;
+    while (month < 12 && memcmp(&s.ptr[8], &MONTHS[month * 3], 3) != 0)
+        month++;
+
+    int day, year, hour, min, sec;
+    if (month == 12 || !clock_parse_digits(s, 5, 2, &day) ||
+        !clock_parse_digits(s, 12, 4, &year) || !clock_parse_digits(s, 17, 2, &hour) ||
+        !clock_parse_digits(s, 20, 2, &min) || !clock_parse_digits(s, 23, 2, &sec) || !day ||
+        day > 31 || hour > 23 || min > 59 || sec > 60)
+        return false;
+
+    int64_t days = clock_days_from_civil(year, month + 1, day);
+    *out         = (time_t)(days * 86400 + hour * 3600 + min * 60 + sec);
+    return true;
+}
+
+// Read the time. Called once per iteration of the event loop, so everything handled in one
+// iteration sees the same time.
+void clock_refresh() {
+    A3_UNWRAPSD(clock_gettime(CLOCK_MONOTONIC, &CLOCK_MONOTONIC_NOW));
+
+    struct timespec wall;
+    A3_UNWRAPSD(clock_gettime(CLOCK_REALTIME, &wall));
+    CLOCK_WALL_NOW = wall.tv_sec;
+}
+
+struct timespec clock_monotonic() {
+    assert(CLOCK_MONOTONIC_NOW.tv_sec || CLOCK_MONOTONIC_NOW.tv_nsec);
+
+    return CLOCK_MONOTONIC_NOW;
+}
+
+time_t clock_wall() { return CLOCK_WALL_NOW; }
+
+// The current time, formatted for a Date header. Only re-rendered when the second changes.
+A3CString clock_date() {
+    if (CLOCK_DATE_TIME != CLOCK_WALL_NOW) {
+        clock_format_imf_fixdate(CLOCK_DATE, CLOCK_WALL_NOW);
+        CLOCK_DATE_TIME = CLOCK_WALL_NOW;
+    }
+
+    return (A3CString) { .ptr = CLOCK_DATE, .len = sizeof(CLOCK_DATE) };
+}
@@ -0,0 +1,37 @@
+/*
+ * SHORT CIRCUIT: CLOCK -- Time cached once per event loop iteration.
+ *
+ * Copyright (c) 2021, Alex O'Brien <3541ax@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Affero General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <a3/str.h>
+
+// "Sun, 06 Nov 1994 08:49:37 GMT"
+#define CLOCK_IMF_FIXDATE_LENGTH 29
+
+void            clock_refresh(void);
+struct timespec clock_monotonic(void);
+time_t          clock_wall(void);
+A3CString       clock_date(void);
+size_t          clock_format_imf_fixdate(uint8_t* out, time_t);
+bool            clock_parse_imf_fixdate(A3CString, time_t* out);
@@ -35,13 +35,38 @@
 
 #define EVENT_POOL_SIZE 7268
 
-#define FD_CACHE_SIZE 256
+#define FD_CACHE_SIZE            256
+#define FILE_NEGATIVE_CACHE_SIZE 1024
+#define FILE_NEGATIVE_CACHE_TTL  10
+#define FILE_HANDLE_HEADERS_MAX  256
+#define FILE_CONTENT_MAX         16384
+#define FILE_CONTENT_CACHE_SIZE  (16ULL * 1024 * 1024)
+#define FILE_CONTENT_MIN_HITS    2
+#define FILE_HIT_BUFFER_SIZE     256
+#define FILE_WORKERS_MAX         64
+#define FILE_BLOCK_SIZE          65536
+#define FILE_BLOCK_CACHE_SIZE    (64ULL * 1024 * 1024)
+#define FILE_BLOCK_MIN_HITS      2
+#define FILE_BLOCK_RANGE_MAX     8
+#define FILE_TREE_ENTRIES_MAX    (1 << 20)
+#define FILE_WATCH_BUF_SIZE      4096
+#define FILE_WATCH_FD_MAX        16
+#define FILE_WATCH_WALK_BATCH    1024
+#define FILE_ROOT_CHECK_BATCH    64
+#define FILE_WARM_BATCH          64
+#define FILE_WARM_TIME           10
+#define FILE_PREFETCH_SCAN_MAX   65536
+#define FILE_PREFETCH_LINKS_MAX  32
+#define FILE_PREFETCH_PAGES_MAX  1024
+#define FILE_PREFETCH_BATCH      16
+#define FILE_PREFETCH_INTERVAL   10
 
 #define URING_ENTRIES        2048
 #define URING_SQ_LEAVE_SPACE 10
 #define URING_SQE_RETRY_MAX  128
 
-#define CONNECTION_POOL_SIZE 1280
+#define CONNECTION_POOL_SIZE    1280
+#define CONNECTION_SEND_IOV_MAX (FILE_BLOCK_RANGE_MAX + 1)
 
 #ifndef NDEBUG
 #define CONNECTION_TIMEOUT 6000
@@ -55,12 +80,11 @@
 #define SEND_BUF_MAX_CAPACITY     20480
 
 #define HTTP_ERROR_BODY_MAX_LENGTH      512
+#define HTTP_ERROR_PAGE_MAX_LENGTH      65536
 #define HTTP_REQUEST_LINE_MAX_LENGTH    2048
 #define HTTP_REQUEST_HEADER_MAX_LENGTH  2048
+#define HTTP_REQUEST_HEADER_FIELDS_MAX  64
 #define HTTP_REQUEST_HOST_MAX_LENGTH    512
 #define HTTP_REQUEST_URI_MAX_LENGTH     512
+#define HTTP_REQUEST_TARGET_BUF_LENGTH  2048
 #define HTTP_REQUEST_CONTENT_MAX_LENGTH 10240
-
-#define HTTP_TIME_FORMAT     "%a, %d %b %Y %H:%M:%S GMT"
-#define HTTP_TIME_BUF_LENGTH 30
-#define HTTP_TIME_CACHE      13
@@ -0,0 +1,35 @@
+/*
+ * SHORT CIRCUIT: RUNTIME CONFIG -- Global configuration, with its defaults.
+ *
+ * Copyright (c) 2021, Alex O'Brien <3541ax@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Affero General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "config_runtime.h"
+
+#include <a3/log.h>
+
+#include "config.h"
+
+Config CONFIG = { .web_root      = DEFAULT_WEB_ROOT,
+                  .listen_port   = DEFAULT_LISTEN_PORT,
+                  .cache_entries = FD_CACHE_SIZE,
+                  .cache_fds     = FD_CACHE_SIZE,
+#ifdef NDEBUG
+                  .log_level = A3_LOG_WARN
+#else
+                  .log_level = A3_LOG_TRACE
+#endif
+};
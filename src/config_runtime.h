@@ -20,13 +20,30 @@
 #pragma once
 
 #include <netinet/in.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <time.h>
 
 #include <a3/str.h>
 
 typedef struct Config {
     A3CString web_root;
+    // The web root as given. It may be a link, which is resolved again when the root is switched.
+    A3CString web_root_link;
     int       log_level;
     in_port_t listen_port;
+    size_t    mem_soft_limit;
+    size_t    mem_hard_limit;
+    size_t    cache_entries;
+    size_t    cache_fds;
+    // When nonzero, cached files are revalidated after this many seconds instead of being watched.
+    time_t cache_ttl;
+    // Hot files are recorded here on exit, and warmed from here on startup.
+    A3CString cache_warm;
+    // When set, files are served from this pack instead of the web root.
+    A3CString pack;
+    // When set, the files HTML pages link to are opened before they are requested.
+    bool prefetch;
 } Config;
 
 extern Config CONFIG;
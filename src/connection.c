@@ -34,6 +34,7 @@
 #include <a3/log.h>
 #include <a3/util.h>
 
+#include "clock.h"
 #include "config.h"
 #include "event.h"
 #include "forward.h"
@@ -41,7 +42,9 @@
 #include "http/request.h"
 #include "http/response.h"
 #include "http/types.h"
+#include "iov.h"
 #include "listen.h"
+#include "mem.h"
 #include "timeout.h"
 
 #include <liburing/io_uring.h>
@@ -56,11 +59,44 @@ static TimeoutQueue connection_timeout_queue;
 
 void connection_timeout_init() { timeout_queue_init(&connection_timeout_queue); }
 
+// Buffers grow on demand, so bring the accounted size in line with their current capacity.
+static void connection_buf_account(Connection* conn) {
+    assert(conn);
+
+    size_t current = 0;
+    if (a3_buf_initialized(&conn->recv_buf))
+        current += conn->recv_buf.data.len;
+    if (a3_buf_initialized(&conn->send_buf))
+        current += conn->send_buf.data.len;
+
+    if (current > conn->buf_accounted)
+        mem_account(MEM_BUFFERS, current - conn->buf_accounted);
+    else
+        mem_unaccount(MEM_BUFFERS, conn->buf_accounted - current);
+    conn->buf_accounted = current;
+}
+
 bool connection_init(Connection* conn) {
     assert(conn);
 
-    A3_TRYB(a3_buf_init(&conn->recv_buf, RECV_BUF_INITIAL_CAPACITY, RECV_BUF_MAX_CAPACITY));
-    return a3_buf_init(&conn->send_buf, SEND_BUF_INITIAL_CAPACITY, SEND_BUF_MAX_CAPACITY);
+    bool ret =
+        a3_buf_init(&conn->recv_buf, RECV_BUF_INITIAL_CAPACITY, RECV_BUF_MAX_CAPACITY) &&
+        a3_buf_init(&conn->send_buf, SEND_BUF_INITIAL_CAPACITY, SEND_BUF_MAX_CAPACITY);
+    connection_buf_account(conn);
+
+    return ret;
+}
+
+void connection_destroy(Connection* conn) {
+    assert(conn);
+
+    if (a3_buf_initialized(&conn->recv_buf))
+        a3_buf_destroy(&conn->recv_buf);
+    if (a3_buf_initialized(&conn->send_buf))
+        a3_buf_destroy(&conn->send_buf);
+
+    mem_unaccount(MEM_BUFFERS, conn->buf_accounted);
+    conn->buf_accounted = 0;
 }
 
 bool connection_reset(Connection* conn, struct io_uring* uring) {
@@ -174,6 +210,7 @@ static void connection_recv_handle(EventTarget* target, struct io_uring* uring,
     }
 
     a3_buf_wrote(&conn->recv_buf, (size_t)status);
+    connection_buf_account(conn);
 
     connection_handler_call(conn, uring, ctx, success, status);
 }
@@ -202,6 +239,35 @@ static void connection_send_handle(EventTarget* target, struct io_uring* uring,
         connection_handler_call(conn, uring, ctx, success, status);
 }
 
+// Like connection_send_handle, for the send buffer followed by a body. A body of several parts
+// rarely fits in the socket buffer at once, so a short send is resumed where it stopped.
+static void connection_send_body_handle(EventTarget* target, struct io_uring* uring, void* ctx,
+                                        bool success, int32_t status) {
+    assert(target);
+    assert(uring);
+
+    Connection* conn = EVT_PTR(target, Connection);
+
+    if (status < 0) {
+        A3_ERRNO(-status, "sendmsg failed");
+        connection_drop(conn, uring);
+        return;
+    }
+    if (!success) {
+        A3_TRACE_F("Short sendmsg of %d. Resuming.", status);
+        CTRYB(conn, uring, status > 0 && iov_advance(&conn->send_msg, (size_t)status));
+        CTRYB(conn, uring,
+              event_sendmsg_submit(EVT(conn), uring, connection_send_body_handle, ctx,
+                                   conn->socket, &conn->send_msg, conn->send_flags, 0));
+        return;
+    }
+
+    a3_buf_read(&conn->send_buf, conn->send_head_len);
+
+    if (ctx)
+        connection_handler_call(conn, uring, ctx, success, status);
+}
+
 static void connection_splice_handle(EventTarget* target, struct io_uring* uring, void* ctx,
                                      bool success, int32_t status) {
     assert(target);
@@ -320,11 +386,36 @@ bool connection_send_submit(Connection* conn, struct io_uring* uring, Connection
                             uint32_t send_flags, uint8_t sqe_flags) {
     assert(conn);
     assert(uring);
+
+    connection_buf_account(conn);
     return event_send_submit(EVT(conn), uring, connection_send_handle, handler, conn->socket,
                              a3_buf_read_ptr(&conn->send_buf), send_flags, sqe_flags);
 }
 
-#define PIPE_BUF_SIZE 65536ULL
+// Send the contents of the send buffer, followed by a body which outlives the send (such as a
+// cached file), in one call. The body may be in several parts. Nothing may be linked after the
+// send, since what a short send leaves is sent again from its completion.
+bool connection_send_body_submit(Connection* conn, struct io_uring* uring,
+                                 ConnectionHandler handler, A3CString const* body,
+                                 size_t body_parts, uint32_t send_flags) {
+    assert(conn);
+    assert(uring);
+    assert(body);
+    assert(body_parts && body_parts < CONNECTION_SEND_IOV_MAX);
+
+    connection_buf_account(conn);
+    A3CString head    = a3_buf_read_ptr(&conn->send_buf);
+    conn->send_iov[0] = (struct iovec) { .iov_base = (void*)head.ptr, .iov_len = head.len };
+    for (size_t i = 0; i < body_parts; i++)
+        conn->send_iov[i + 1] =
+            (struct iovec) { .iov_base = (void*)body[i].ptr, .iov_len = body[i].len };
+    conn->send_msg = (struct msghdr) { .msg_iov = conn->send_iov, .msg_iovlen = body_parts + 1 };
+    conn->send_head_len = head.len;
+    conn->send_flags    = send_flags;
+
+    return event_sendmsg_submit(EVT(conn), uring, connection_send_body_handle, handler,
+                                conn->socket, &conn->send_msg, send_flags, 0);
+}
 
 // Wraps splice so it can be used without a pipe.
 bool connection_splice_submit(Connection* conn, struct io_uring* uring,
@@ -341,6 +432,7 @@ bool connection_splice_submit(Connection* conn, struct io_uring* uring,
             A3_ERRNO(errno, "unable to open pipe");
             return false;
         }
+        mem_account(MEM_PIPES, PIPE_BUF_SIZE);
     }
 
     for (size_t remaining = len; remaining > 0;) {
@@ -400,8 +492,7 @@ static bool connection_timeout_submit(Connection* conn, struct io_uring* uring,
     assert(conn);
     assert(uring);
 
-    struct timespec t;
-    A3_UNWRAPSD(clock_gettime(CLOCK_MONOTONIC, &t));
+    struct timespec t = clock_monotonic();
 
     conn->timeout.threshold.tv_sec  = t.tv_sec + delay;
     conn->timeout.threshold.tv_nsec = t.tv_nsec;
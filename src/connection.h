@@ -26,13 +26,18 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 
 #include <a3/buffer.h>
+#include <a3/str.h>
 
+#include "config.h"
 #include "event.h"
 #include "forward.h"
 #include "timeout.h"
 
+#define PIPE_BUF_SIZE 65536ULL
+
 typedef enum { SPLICE_IN, SPLICE_OUT } SpliceDirection;
 
 typedef bool (*ConnectionHandler)(Connection*, struct io_uring*, bool success, int32_t status);
@@ -46,6 +51,14 @@ typedef struct Connection {
 
     A3Buffer recv_buf;
     A3Buffer send_buf;
+    size_t   buf_accounted;
+
+    // For sends which gather the send buffer with a body held elsewhere. The message is advanced
+    // past whatever a short send got through.
+    struct iovec  send_iov[CONNECTION_SEND_IOV_MAX];
+    struct msghdr send_msg;
+    size_t        send_head_len;
+    uint32_t      send_flags;
 
     Timeout timeout;
 
@@ -63,11 +76,14 @@ void connection_timeout_init(void);
 
 bool connection_init(Connection*);
 bool connection_reset(Connection*, struct io_uring*);
+void connection_destroy(Connection*);
 
 Connection* connection_accept_submit(Listener*, struct io_uring*, ConnectionHandler);
 bool        connection_recv_submit(Connection*, struct io_uring*, ConnectionHandler);
 bool connection_send_submit(Connection*, struct io_uring*, ConnectionHandler, uint32_t send_flags,
                             uint8_t sqe_flags);
+bool connection_send_body_submit(Connection*, struct io_uring*, ConnectionHandler,
+                                 A3CString const* body, size_t body_parts, uint32_t send_flags);
 bool connection_splice_submit(Connection*, struct io_uring*, ConnectionSpliceHandler,
                               ConnectionHandler, fd src, size_t file_offset, size_t len,
                               uint8_t sqe_flags);
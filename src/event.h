@@ -19,11 +19,13 @@
 
 #pragma once
 
+#include <linux/openat2.h>
 #include <liburing.h>
 #include <netinet/in.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <sys/socket.h>
 #include <unistd.h>
 
 #include <a3/sll.h>
@@ -54,17 +56,21 @@ bool event_close_submit(EventTarget*, struct io_uring*, EventHandler, void* ctx,
                         uint32_t sqe_flags, bool fallback_sync);
 bool event_openat_submit(EventTarget*, struct io_uring*, EventHandler, void* ctx, fd dir,
                          A3CString path, int32_t open_flags, mode_t mode);
+bool event_openat2_submit(EventTarget*, struct io_uring*, EventHandler, void* ctx, fd dir,
+                          A3CString path, struct open_how*, uint32_t sqe_flags);
 bool event_read_submit(EventTarget*, struct io_uring*, EventHandler, void* ctx, fd file,
                        A3String out_data, size_t nbytes, off_t offset, uint32_t sqe_flags);
 bool event_recv_submit(EventTarget*, struct io_uring*, EventHandler, void* ctx, fd socket,
                        A3String out_data);
 bool event_send_submit(EventTarget*, struct io_uring*, EventHandler, void* ctx, fd socket,
                        A3CString data, uint32_t send_flags, uint32_t sqe_flags);
+bool event_sendmsg_submit(EventTarget*, struct io_uring*, EventHandler, void* ctx, fd socket,
+                          struct msghdr*, uint32_t send_flags, uint32_t sqe_flags);
 bool event_splice_submit(EventTarget*, struct io_uring*, EventHandler, void* ctx, fd in,
                          uint64_t off_in, fd out, size_t len, uint32_t splice_flags,
                          uint32_t sqe_flags);
-bool event_stat_submit(EventTarget*, struct io_uring*, EventHandler, void* ctx, A3CString path,
-                       uint32_t field_mask, struct statx*, uint32_t sqe_flags);
+bool event_stat_submit(EventTarget*, struct io_uring*, EventHandler, void* ctx, fd dir,
+                       A3CString path, uint32_t field_mask, struct statx*, uint32_t sqe_flags);
 bool event_timeout_submit(EventTarget*, struct io_uring*, EventHandler, void* ctx, Timespec*,
                           uint32_t timeout_flags);
 
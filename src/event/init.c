@@ -59,10 +59,14 @@ static void event_check_ops(struct io_uring* uring) {
     REQUIRE_OP(probe, IORING_OP_ACCEPT);
     REQUIRE_OP(probe, IORING_OP_ASYNC_CANCEL);
     REQUIRE_OP(probe, IORING_OP_CLOSE);
+    REQUIRE_OP(probe, IORING_OP_OPENAT);
+    REQUIRE_OP(probe, IORING_OP_OPENAT2);
     REQUIRE_OP(probe, IORING_OP_READ);
     REQUIRE_OP(probe, IORING_OP_RECV);
     REQUIRE_OP(probe, IORING_OP_SEND);
+    REQUIRE_OP(probe, IORING_OP_SENDMSG);
     REQUIRE_OP(probe, IORING_OP_SPLICE);
+    REQUIRE_OP(probe, IORING_OP_STATX);
     REQUIRE_OP(probe, IORING_OP_TIMEOUT);
 
     free(probe);
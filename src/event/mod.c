@@ -37,12 +37,14 @@
 #include "event.h"
 #include "event/internal.h"
 #include "forward.h"
+#include "mem.h"
 
 A3Pool* EVENT_POOL;
 
 static Event* event_new(EventTarget* target, EventHandler handler, void* handler_ctx,
                         int32_t expected_return, bool queue) {
     Event* event = (Event*)a3_pool_alloc_block(EVENT_POOL);
+    mem_account(MEM_EVENTS, sizeof(Event));
 
     event->success         = true;
     event->expected_return = expected_return;
@@ -65,6 +67,7 @@ Event* event_from_link(A3SLink* link) {
 void event_free(Event* event) {
     assert(event);
 
+    mem_unaccount(MEM_EVENTS, sizeof(Event));
     a3_pool_free_block(EVENT_POOL, event);
 }
 
@@ -149,6 +152,25 @@ bool event_openat_submit(EventTarget* target, struct io_uring* uring, EventHandl
     return event_submit(target, sqe, handler, handler_ctx, EXPECTED_STATUS_NONNEGATIVE, true);
 }
 
+// The open_how must stay valid until the SQE is submitted.
+bool event_openat2_submit(EventTarget* target, struct io_uring* uring, EventHandler handler,
+                          void* handler_ctx, fd dir, A3CString path, struct open_how* how,
+                          uint32_t sqe_flags) {
+    assert(target);
+    assert(uring);
+    assert(handler);
+    assert(path.ptr);
+    assert(how);
+
+    struct io_uring_sqe* sqe = event_get_sqe(uring);
+    A3_TRYB(sqe);
+
+    io_uring_prep_openat2(sqe, dir, a3_string_cstr(path), how);
+    io_uring_sqe_set_flags(sqe, sqe_flags);
+
+    return event_submit(target, sqe, handler, handler_ctx, EXPECTED_STATUS_NONNEGATIVE, true);
+}
+
 bool event_read_submit(EventTarget* target, struct io_uring* uring, EventHandler handler,
                        void* handler_ctx, fd file, A3String out_data, size_t nbytes, off_t offset,
                        uint32_t sqe_flags) {
@@ -203,6 +225,30 @@ bool event_send_submit(EventTarget* target, struct io_uring* uring, EventHandler
     return event_submit(target, sqe, handler, handler_ctx, (int32_t)data.len, true);
 }
 
+// The message must stay valid until the event completes. Anything short of the whole message is
+// a failure.
+bool event_sendmsg_submit(EventTarget* target, struct io_uring* uring, EventHandler handler,
+                          void* handler_ctx, fd socket, struct msghdr* msg, uint32_t send_flags,
+                          uint32_t sqe_flags) {
+    assert(target);
+    assert(uring);
+    assert(handler);
+    assert(socket >= 0);
+    assert(msg);
+
+    size_t len = 0;
+    for (size_t i = 0; i < msg->msg_iovlen; i++)
+        len += msg->msg_iov[i].iov_len;
+
+    struct io_uring_sqe* sqe = event_get_sqe(uring);
+    A3_TRYB(sqe);
+
+    io_uring_prep_sendmsg(sqe, socket, msg, send_flags);
+    io_uring_sqe_set_flags(sqe, sqe_flags);
+
+    return event_submit(target, sqe, handler, handler_ctx, (int32_t)len, true);
+}
+
 bool event_splice_submit(EventTarget* target, struct io_uring* uring, EventHandler handler,
                          void* handler_ctx, fd in, uint64_t off_in, fd out, size_t len,
                          uint32_t splice_flags, uint32_t sqe_flags) {
@@ -223,7 +269,7 @@ bool event_splice_submit(EventTarget* target, struct io_uring* uring, EventHandl
 }
 
 bool event_stat_submit(EventTarget* target, struct io_uring* uring, EventHandler handler,
-                       void* handler_ctx, A3CString path, uint32_t field_mask,
+                       void* handler_ctx, fd dir, A3CString path, uint32_t field_mask,
                        struct statx* statx_buf, uint32_t sqe_flags) {
     assert(target);
     assert(uring);
@@ -235,7 +281,7 @@ bool event_stat_submit(EventTarget* target, struct io_uring* uring, EventHandler
     struct io_uring_sqe* sqe = event_get_sqe(uring);
     A3_TRYB(sqe);
 
-    io_uring_prep_statx(sqe, -1, a3_string_cstr(path), 0, field_mask, statx_buf);
+    io_uring_prep_statx(sqe, dir, a3_string_cstr(path), 0, field_mask, statx_buf);
     io_uring_sqe_set_flags(sqe, sqe_flags);
 
     return event_submit(target, sqe, handler, handler_ctx, EXPECTED_STATUS_NONNEGATIVE, true);
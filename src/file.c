@@ -16,179 +16,1148 @@
  * You should have received a copy of the GNU Affero General Public License
  * along with this program. If not, see <https://www.gnu.org/licenses/>.
  */
+#define _GNU_SOURCE
 
 #include "file.h"
 
 #include <assert.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <liburing.h>
 #include <linux/stat.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/random.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
-#include <a3/cache.h>
+#include <a3/ht.h>
+#include <a3/ll.h>
 #include <a3/log.h>
+#include <a3/pool.h>
 #include <a3/sll.h>
 #include <a3/str.h>
 #include <a3/util.h>
 
+#include "clock.h"
 #include "config.h"
+#include "config_runtime.h"
 #include "event.h"
 #include "event/handle.h"
 #include "file_handle.h"
+#include "file_tree.h"
 #include "forward.h"
+#include "mem.h"
+#include "sketch.h"
 
 #define FILE_HANDLE_WAITING (-4242)
 
-typedef FileHandle* FileHandlePtr;
+// The web root. Every path in the cache is relative to it. Stats and opens resolved beneath a root
+// hold a reference to it until they complete, since io-wq may run a punted openat well after the
+// root has been switched away from. Replaced under the cache lock.
+typedef struct FileRoot {
+    fd            file;
+    atomic_size_t refs;
+} FileRoot;
 
-A3_CACHE_DEFINE_STRUCTS(A3CString, FileHandlePtr)
-A3_CACHE_DECLARE_METHODS(A3CString, FileHandlePtr)
-A3_CACHE_DEFINE_METHODS(A3CString, FileHandlePtr, a3_string_cptr, a3_string_len, a3_string_cmp)
-typedef A3_CACHE(A3CString, FileHandlePtr) FileCache;
+static FileRoot* FILE_ROOT = NULL;
 
-static FileCache FILE_CACHE;
+// A path relative to the root, in pieces, so that lookups need not join them.
+typedef struct FileKey {
+    A3CString dir;
+    A3CString sep;
+    A3CString name;
+} FileKey;
 
-static void file_evict_callback(void* uring, A3CString* key, FileHandle** value) {
-    assert(uring);
+// Handles are indexed by the hash of their path in an open-addressing table with linear probing.
+// Each slot has a 16-bit tag taken from the hash, kept in an array of its own, so most probes only
+// touch one cache line. Tag 0 marks an empty slot.
+static _Atomic(uint16_t)*    FILE_INDEX_TAGS;
+static _Atomic(FileHandle*)* FILE_INDEX_HANDLES;
+static size_t                FILE_INDEX_MASK;
+static uint64_t              FILE_HASH_SEED;
+
+// The cache is shared by every thread. Hits read the index without locking, under a sequence
+// count: writers hold FILE_CACHE_LOCK and make the count odd while they change the index, and a
+// reader which sees it odd or changed retries. Everything else belongs to the lock.
+static pthread_mutex_t FILE_CACHE_LOCK = PTHREAD_MUTEX_INITIALIZER;
+static atomic_uint     FILE_INDEX_SEQ;
+
+// Handles come from a slab. Ones freed while the ring is busy are closed in batches from the event
+// loop, rather than by whoever dropped the last reference. FILE_CLOSE_LOCK covers the slab and the
+// queue of released handles.
+static A3Pool*         FILE_HANDLE_POOL;
+static pthread_mutex_t FILE_CLOSE_LOCK = PTHREAD_MUTEX_INITIALIZER;
+static A3SLL           FILE_CLOSE_QUEUE;
+
+// A released handle may still be inspected by a lookup on another worker which found it just
+// before it left the index, so its memory is only reused once every worker has passed a quiescent
+// point since. Each release starts a new epoch. Workers publish the epoch they last saw between
+// iterations of their event loop, and are offline, holding nothing back, while they wait.
+#define FILE_EPOCH_OFFLINE UINT64_MAX
+static _Atomic(uint64_t) FILE_EPOCH = 1;
+static _Atomic(uint64_t) FILE_WORKER_EPOCHS[FILE_WORKERS_MAX];
+static atomic_size_t     FILE_WORKERS;
+
+// Hits are recorded by each worker, and applied to the eviction policy under the lock once per
+// iteration, so the hit path takes no lock. Hits past the end of the buffer are dropped.
+typedef struct FileWorker {
+    bool        registered;
+    size_t      id;
+    FileHandle* hits[FILE_HIT_BUFFER_SIZE];
+    size_t      n_hits;
+} FileWorker;
+
+static _Thread_local FileWorker FILE_WORKER;
+
+// Eviction follows W-TinyLFU: new entries land in a small LRU window, and when they leave it, they
+// only displace an entry of the main cache if the sketch says they are accessed more often. The
+// main cache is a segmented LRU, in which entries hit again are protected.
+static A3LL   FILE_CACHE_LRU[FILE_CACHE_SEGMENT_COUNT];
+static size_t FILE_CACHE_SEGMENT_ENTRIES[FILE_CACHE_SEGMENT_COUNT];
+static size_t FILE_CACHE_ENTRIES = 0;
+static size_t FILE_CACHE_FDS     = 0;
+static Sketch FILE_CACHE_SKETCH;
+
+// Bytes of file content held in memory, bounded by FILE_CONTENT_CACHE_SIZE. Content is freed with
+// its handle, so it leaves memory when the handle leaves the cache and its last user is done.
+static atomic_size_t FILE_CONTENT_BYTES;
+
+// Changed under the lock.
+static struct {
+    size_t evictions;
+    size_t rejections;
+} FILE_CACHE_STATS;
+
+// Lookups are counted by each worker in its own slot, so that hits, which take no lock, write no
+// shared line. Only the owner writes a slot, and readers sum them.
+typedef struct FileLookupStats {
+    _Alignas(64) atomic_size_t hits;
+    atomic_size_t misses;
+    atomic_size_t negative_hits;
+    atomic_size_t prefetches;
+} FileLookupStats;
+
+static FileLookupStats FILE_LOOKUP_STATS[FILE_WORKERS_MAX];
+
+static FileLookupStats* file_lookup_stats(void) {
+    assert(FILE_WORKER.registered);
+
+    return &FILE_LOOKUP_STATS[FILE_WORKER.id];
+}
+
+static void file_lookup_count(atomic_size_t* counter) {
+    assert(counter);
+
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + 1,
+                          memory_order_relaxed);
+}
+
+// Paths known not to exist are remembered separately, for a limited time, so that lookups of
+// missing files neither hit the disk nor take space from open files.
+typedef struct FileNegative {
+    A3String path;
+    time_t   expires;
+    A3LL     link;
+} FileNegative;
+
+typedef FileNegative* FileNegativePtr;
+
+A3_HT_DEFINE_STRUCTS(A3CString, FileNegativePtr)
+A3_HT_DECLARE_METHODS(A3CString, FileNegativePtr)
+A3_HT_DEFINE_METHODS(A3CString, FileNegativePtr, a3_string_cptr, a3_string_len, a3_string_cmp)
+
+// Keys are paths the client chose, so the table is keyed per process.
+static A3_HT(A3CString, FileNegativePtr) FILE_NEGATIVE;
+static uint8_t FILE_NEGATIVE_HASH_KEY[A3_HT_HASH_KEY_SIZE];
+static A3LL    FILE_NEGATIVE_FIFO;
+static size_t  FILE_NEGATIVE_ENTRIES = 0;
+
+static FileRoot* file_root_new(fd file) {
+    assert(file >= 0);
+
+    FileRoot* ret = NULL;
+    A3_UNWRAPN(ret, calloc(1, sizeof(*ret)));
+    ret->file = file;
+    atomic_init(&ret->refs, 1);
+    return ret;
+}
+
+static FileRoot* file_root_ref(FileRoot* root) {
+    assert(root);
+
+    atomic_fetch_add_explicit(&root->refs, 1, memory_order_relaxed);
+    return root;
+}
+
+static void file_root_unref(FileRoot* root) {
+    assert(root);
+
+    if (atomic_fetch_sub_explicit(&root->refs, 1, memory_order_acq_rel) != 1)
+        return;
+    close(root->file);
+    free(root);
+}
+
+// Shared by every lookup answered from the negative cache. It is never freed.
+static FileHandle FILE_HANDLE_ABSENT;
+
+void file_cache_init(A3CString root) {
+    assert(root.ptr);
+
+    fd root_fd = -1;
+    A3_UNWRAPS(root_fd, open(a3_string_cstr(root), O_PATH | O_DIRECTORY | O_CLOEXEC));
+    FILE_ROOT = file_root_new(root_fd);
+
+    // Keep the load factor at or below one half.
+    size_t index_size = 16;
+    while (index_size < CONFIG.cache_entries * 2 + 2)
+        index_size <<= 1;
+    FILE_INDEX_MASK = index_size - 1;
+    A3_UNWRAPN(FILE_INDEX_TAGS, calloc(index_size, sizeof(*FILE_INDEX_TAGS)));
+    A3_UNWRAPN(FILE_INDEX_HANDLES, calloc(index_size, sizeof(*FILE_INDEX_HANDLES)));
+    mem_account(MEM_FILE_CACHE,
+                index_size * (sizeof(*FILE_INDEX_TAGS) + sizeof(*FILE_INDEX_HANDLES)));
+    A3_UNWRAPND(getrandom(&FILE_HASH_SEED, sizeof(FILE_HASH_SEED), 0) ==
+                sizeof(FILE_HASH_SEED));
+
+    FILE_HANDLE_POOL =
+        A3_POOL_OF(FileHandle, CONFIG.cache_entries * 2, A3_POOL_ZERO_BLOCKS, NULL, NULL);
+    a3_sll_init(&FILE_CLOSE_QUEUE);
+
+    for (size_t i = 0; i < FILE_CACHE_SEGMENT_COUNT; i++)
+        a3_ll_init(&FILE_CACHE_LRU[i]);
+    sketch_init(&FILE_CACHE_SKETCH, CONFIG.cache_entries);
+
+    A3_UNWRAPND(getrandom(FILE_NEGATIVE_HASH_KEY, sizeof(FILE_NEGATIVE_HASH_KEY), 0) ==
+                (ssize_t)sizeof(FILE_NEGATIVE_HASH_KEY));
+    A3_HT_INIT(A3CString, FileNegativePtr)(&FILE_NEGATIVE, FILE_NEGATIVE_HASH_KEY,
+                                           A3_HT_ALLOW_GROWTH);
+    a3_ll_init(&FILE_NEGATIVE_FIFO);
+
+    atomic_init(&FILE_HANDLE_ABSENT.refs, 1);
+    FILE_HANDLE_ABSENT.path = A3_CS("");
+    FILE_HANDLE_ABSENT.file = -ENOENT;
+}
+
+// Every thread which looks up files registers once, before it starts serving.
+void file_cache_worker_register(void) {
+    assert(!FILE_WORKER.registered);
+
+    size_t id = atomic_fetch_add(&FILE_WORKERS, 1);
+    A3_UNWRAPND(id < FILE_WORKERS_MAX);
+    FILE_WORKER.registered = true;
+    FILE_WORKER.id         = id;
+    file_cache_quiescent();
+}
+
+// The calling worker holds no pointer to a handle it has not taken a reference on. Called when it
+// wakes, before it handles any events.
+void file_cache_quiescent(void) {
+    assert(FILE_WORKER.registered);
+
+    atomic_store(&FILE_WORKER_EPOCHS[FILE_WORKER.id], atomic_load(&FILE_EPOCH));
+    atomic_thread_fence(memory_order_seq_cst);
+}
+
+
+// Handles released at or before this epoch are no longer seen by any worker.
+static uint64_t file_epoch_safe(void) {
+    atomic_thread_fence(memory_order_seq_cst);
+
+    uint64_t ret     = FILE_EPOCH_OFFLINE;
+    size_t   workers = atomic_load(&FILE_WORKERS);
+    for (size_t i = 0; i < workers; i++)
+        ret = MIN(ret, atomic_load(&FILE_WORKER_EPOCHS[i]));
+
+    return ret;
+}
+
+static void file_negative_remove(FileNegative* entry) {
+    assert(entry);
+
+    A3_HT_DELETE(A3CString, FileNegativePtr)(&FILE_NEGATIVE, A3_S_CONST(entry->path));
+    a3_ll_remove(&entry->link);
+    FILE_NEGATIVE_ENTRIES--;
+
+    mem_unaccount(MEM_FILE_CACHE, sizeof(FileNegative) + entry->path.len);
+    a3_string_free(&entry->path);
+    free(entry);
+}
+
+static FileNegative* file_negative_oldest(void) {
+    A3LL* link = a3_ll_peek(&FILE_NEGATIVE_FIFO);
+    if (!link)
+        return NULL;
+    return A3_CONTAINER_OF(link, FileNegative, link);
+}
+
+// Entries all share one TTL, so the oldest are always the first to expire.
+static void file_negative_insert(A3CString path) {
+    assert(path.ptr);
+
+    time_t now = clock_monotonic().tv_sec;
+    for (FileNegative* oldest = file_negative_oldest();
+         oldest && (oldest->expires <= now || FILE_NEGATIVE_ENTRIES >= FILE_NEGATIVE_CACHE_SIZE);
+         oldest = file_negative_oldest())
+        file_negative_remove(oldest);
+
+    if (A3_HT_FIND(A3CString, FileNegativePtr)(&FILE_NEGATIVE, path))
+        return;
+
+    FileNegative* entry = NULL;
+    A3_UNWRAPN(entry, calloc(1, sizeof(FileNegative)));
+    entry->path    = a3_string_clone(path);
+    entry->expires = now + FILE_NEGATIVE_CACHE_TTL;
+    mem_account(MEM_FILE_CACHE, sizeof(FileNegative) + entry->path.len);
+
+    A3_HT_INSERT(A3CString, FileNegativePtr)(&FILE_NEGATIVE, A3_S_CONST(entry->path), entry);
+    a3_ll_enqueue(&FILE_NEGATIVE_FIFO, &entry->link);
+    FILE_NEGATIVE_ENTRIES++;
+}
+
+static bool file_negative_find(A3CString path) {
+    assert(path.ptr);
+
+    FileNegative** entry = A3_HT_FIND(A3CString, FileNegativePtr)(&FILE_NEGATIVE, path);
+    if (!entry)
+        return false;
+
+    if ((*entry)->expires <= clock_monotonic().tv_sec) {
+        file_negative_remove(*entry);
+        return false;
+    }
+
+    return true;
+}
+
+static FileKey file_key(FileHandle* dir, A3CString name) {
+    assert(name.ptr);
+
+    if (!dir || a3_string_cmp(dir->path, A3_CS(".")) == 0)
+        return (FileKey) { .dir = A3_CS(""), .sep = A3_CS(""), .name = name };
+
+    A3CString sep = dir->path.ptr[dir->path.len - 1] == '/' ? A3_CS("") : A3_CS("/");
+    return (FileKey) { .dir = dir->path, .sep = sep, .name = name };
+}
+
+static size_t file_key_len(FileKey* key) {
+    assert(key);
+    return key->dir.len + key->sep.len + key->name.len;
+}
+
+static bool file_key_eq(FileKey* key, A3CString path) {
     assert(key);
-    assert(key->ptr);
-    assert(value);
+    assert(path.ptr);
+
+    if (path.len != file_key_len(key))
+        return false;
+
+    const uint8_t* p = path.ptr;
+    return memcmp(p, key->dir.ptr, key->dir.len) == 0 &&
+           memcmp(&p[key->dir.len], key->sep.ptr, key->sep.len) == 0 &&
+           memcmp(&p[key->dir.len + key->sep.len], key->name.ptr, key->name.len) == 0;
+}
+
+static A3String file_key_join(FileKey* key) {
+    assert(key);
+
+    A3String ret = a3_string_alloc(file_key_len(key));
+    a3_string_concat(ret, 3, key->dir, key->sep, key->name);
+    return ret;
+}
+
+// FNV-1a, seeded per process, so that hashes can be extended one piece at a time.
+static uint64_t file_hash_extend(uint64_t hash, A3CString s) {
+    for (size_t i = 0; i < s.len; i++) {
+        hash ^= s.ptr[i];
+        hash *= 0x100000001B3ULL;
+    }
+
+    return hash;
+}
+
+static uint64_t file_hash(A3CString path) {
+    return file_hash_extend(0xCBF29CE484222325ULL ^ FILE_HASH_SEED, path);
+}
+
+// A directory's hash covers its path, so only the rest of the key needs hashing.
+static uint64_t file_key_hash(FileKey* key, FileHandle* dir) {
+    assert(key);
+
+    if (!key->dir.len)
+        return file_hash(key->name);
+    assert(dir);
+    return file_hash_extend(file_hash_extend(dir->hash, key->sep), key->name);
+}
+
+static uint16_t file_index_tag(uint64_t hash) { return (uint16_t)((hash >> 48) | 1); }
+
+static FileHandle* file_index_find(FileKey* key, uint64_t hash) {
+    assert(key);
+
+    uint16_t tag = file_index_tag(hash);
+    for (size_t i = hash & FILE_INDEX_MASK; FILE_INDEX_TAGS[i]; i = (i + 1) & FILE_INDEX_MASK) {
+        FileHandle* handle = FILE_INDEX_HANDLES[i];
+        if (FILE_INDEX_TAGS[i] == tag && handle->hash == hash && file_key_eq(key, handle->path))
+            return handle;
+    }
+
+    return NULL;
+}
+
+static void file_index_write_begin(void) {
+    atomic_fetch_add_explicit(&FILE_INDEX_SEQ, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+}
+
+static void file_index_write_end(void) {
+    atomic_fetch_add_explicit(&FILE_INDEX_SEQ, 1, memory_order_release);
+}
+
+static void file_index_insert(FileHandle* handle) {
+    assert(handle);
+
+    size_t i = handle->hash & FILE_INDEX_MASK;
+    while (FILE_INDEX_TAGS[i])
+        i = (i + 1) & FILE_INDEX_MASK;
+
+    file_index_write_begin();
+    FILE_INDEX_TAGS[i]    = file_index_tag(handle->hash);
+    FILE_INDEX_HANDLES[i] = handle;
+    file_index_write_end();
+}
+
+// Delete by shifting later members of the probe sequence back, so no tombstones are needed.
+static void file_index_delete(FileHandle* handle) {
+    assert(handle);
+
+    size_t i = handle->hash & FILE_INDEX_MASK;
+    while (FILE_INDEX_HANDLES[i] != handle) {
+        assert(FILE_INDEX_TAGS[i]);
+        i = (i + 1) & FILE_INDEX_MASK;
+    }
+
+    file_index_write_begin();
+    for (size_t j = (i + 1) & FILE_INDEX_MASK; FILE_INDEX_TAGS[j]; j = (j + 1) & FILE_INDEX_MASK) {
+        size_t home = FILE_INDEX_HANDLES[j]->hash & FILE_INDEX_MASK;
+        // Leave the entry where it is if its home lies cyclically in (i, j].
+        if (((j - home) & FILE_INDEX_MASK) < ((j - i) & FILE_INDEX_MASK))
+            continue;
+
+        FILE_INDEX_TAGS[i]    = FILE_INDEX_TAGS[j];
+        FILE_INDEX_HANDLES[i] = FILE_INDEX_HANDLES[j];
+        i                     = j;
+    }
+
+    FILE_INDEX_TAGS[i]    = 0;
+    FILE_INDEX_HANDLES[i] = NULL;
+    file_index_write_end();
+}
+
+void file_handle_ref(FileHandle* handle) {
+    assert(handle);
+    atomic_fetch_add_explicit(&handle->refs, 1, memory_order_relaxed);
+}
+
+// Take a reference to a handle found without the lock, unless its last one is already gone.
+static bool file_handle_ref_live(FileHandle* handle) {
+    assert(handle);
+
+    size_t refs = atomic_load_explicit(&handle->refs, memory_order_relaxed);
+    do {
+        if (!refs)
+            return false;
+    } while (!atomic_compare_exchange_weak_explicit(&handle->refs, &refs, refs + 1,
+                                                    memory_order_acquire, memory_order_relaxed));
+
+    return true;
+}
+
+// Find a cached handle without taking the lock. The handle is returned with a reference held.
+static FileHandle* file_index_lookup(FileKey* key, uint64_t hash, struct io_uring* uring) {
+    assert(key);
+    assert(uring);
+
+    for (;;) {
+        unsigned seq = atomic_load_explicit(&FILE_INDEX_SEQ, memory_order_acquire);
+        if (seq & 1)
+            continue;
+
+        // Handles in the index hold the cache's reference, so this only fails if one was removed.
+        FileHandle* handle = file_index_find(key, hash);
+        if (handle && !file_handle_ref_live(handle))
+            handle = NULL;
+
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&FILE_INDEX_SEQ, memory_order_relaxed) == seq)
+            return handle;
+        if (handle)
+            file_handle_close(handle, uring);
+    }
+}
+
+static size_t file_cache_window_capacity(void) { return MAX(CONFIG.cache_entries / 100, 1); }
+
+static size_t file_cache_main_capacity(void) {
+    return CONFIG.cache_entries - file_cache_window_capacity();
+}
+
+static size_t file_cache_protected_capacity(void) { return file_cache_main_capacity() * 4 / 5; }
+
+static FileHandle* file_cache_lru(FileCacheSegment segment) {
+    A3LL* link = a3_ll_peek(&FILE_CACHE_LRU[segment]);
+    if (!link)
+        return NULL;
+    return A3_CONTAINER_OF(link, FileHandle, lru_link);
+}
+
+// Move a cached handle to the most-recently-used end of a segment.
+static void file_cache_segment_move(FileHandle* handle, FileCacheSegment segment) {
+    assert(handle);
+    assert(handle->cached);
+
+    a3_ll_remove(&handle->lru_link);
+    FILE_CACHE_SEGMENT_ENTRIES[handle->segment]--;
+
+    a3_ll_enqueue(&FILE_CACHE_LRU[segment], &handle->lru_link);
+    FILE_CACHE_SEGMENT_ENTRIES[segment]++;
+    handle->segment = segment;
+}
+
+// Drop the cache's reference to a handle. Users which still hold it are unaffected.
+static void file_cache_remove(FileHandle* handle, struct io_uring* uring) {
+    assert(handle);
+    assert(handle->cached);
+    assert(uring);
+
+    file_index_delete(handle);
+    a3_ll_remove(&handle->lru_link);
+    FILE_CACHE_SEGMENT_ENTRIES[handle->segment]--;
+    handle->cached = false;
+    FILE_CACHE_ENTRIES--;
+    if (handle->file >= 0)
+        FILE_CACHE_FDS--;
+
+    file_handle_close(handle, uring);
+}
+
+static void file_cache_evict(FileHandle* handle, struct io_uring* uring) {
+    assert(handle);
+    assert(uring);
+
+    A3_TRACE_F("Evicting file " A3_S_F ".", A3_S_FORMAT(handle->path));
+    FILE_CACHE_STATS.evictions++;
+    file_cache_remove(handle, uring);
+}
+
+static void file_cache_protected_trim(void) {
+    while (FILE_CACHE_SEGMENT_ENTRIES[FILE_CACHE_PROTECTED] > file_cache_protected_capacity())
+        file_cache_segment_move(file_cache_lru(FILE_CACHE_PROTECTED), FILE_CACHE_PROBATION);
+}
+
+// The entry the main cache would give up first.
+static FileHandle* file_cache_main_victim(void) {
+    FileHandle* ret = file_cache_lru(FILE_CACHE_PROBATION);
+    return ret ? ret : file_cache_lru(FILE_CACHE_PROTECTED);
+}
+
+// Bring the cache back within its capacity.
+static void file_cache_balance(struct io_uring* uring) {
+    assert(uring);
+
+    while (FILE_CACHE_SEGMENT_ENTRIES[FILE_CACHE_WINDOW] > file_cache_window_capacity()) {
+        FileHandle* candidate = file_cache_lru(FILE_CACHE_WINDOW);
+        size_t      main_entries =
+            FILE_CACHE_SEGMENT_ENTRIES[FILE_CACHE_PROBATION] +
+            FILE_CACHE_SEGMENT_ENTRIES[FILE_CACHE_PROTECTED];
+
+        if (main_entries < file_cache_main_capacity()) {
+            file_cache_segment_move(candidate, FILE_CACHE_PROBATION);
+            continue;
+        }
+
+        FileHandle* victim = file_cache_main_victim();
+        if (sketch_admit(&FILE_CACHE_SKETCH, candidate->hash, victim->hash)) {
+            file_cache_evict(victim, uring);
+            file_cache_segment_move(candidate, FILE_CACHE_PROBATION);
+        } else {
+            FILE_CACHE_STATS.rejections++;
+            file_cache_evict(candidate, uring);
+        }
+    }
+
+    file_cache_protected_trim();
+
+    // Open files may be limited more tightly than entries.
+    while (FILE_CACHE_FDS > CONFIG.cache_fds) {
+        FileHandle* victim = file_cache_main_victim();
+        file_cache_evict(victim ? victim : file_cache_lru(FILE_CACHE_WINDOW), uring);
+    }
+}
+
+static void file_cache_insert(FileHandle* handle, struct io_uring* uring) {
+    assert(handle);
+    assert(!handle->cached);
+    assert(uring);
+
+    file_index_insert(handle);
+    a3_ll_enqueue(&FILE_CACHE_LRU[FILE_CACHE_WINDOW], &handle->lru_link);
+    FILE_CACHE_SEGMENT_ENTRIES[FILE_CACHE_WINDOW]++;
+    handle->segment = FILE_CACHE_WINDOW;
+    handle->cached  = true;
+    FILE_CACHE_ENTRIES++;
+    if (handle->file >= 0)
+        FILE_CACHE_FDS++;
+
+    file_cache_balance(uring);
+}
+
+static bool file_handle_content_fits(FileHandle* handle) {
+    assert(handle);
+
+    return handle->file >= 0 && S_ISREG(handle->stat.stx_mode) && handle->stat.stx_size &&
+           handle->stat.stx_size <= FILE_CONTENT_MAX;
+}
+
+// Decide whether a cached file is hot enough for its contents to be kept in memory. The sketch
+// belongs to the lock, so the decision is made here, and only read on the hit path.
+static void file_handle_content_check(FileHandle* handle) {
+    assert(handle);
+    assert(handle->cached);
+
+    if (file_handle_content_fits(handle) &&
+        sketch_estimate(&FILE_CACHE_SKETCH, handle->hash) >= FILE_CONTENT_MIN_HITS)
+        atomic_store_explicit(&handle->content_wanted, true, memory_order_relaxed);
+}
+
+static void file_cache_touch(FileHandle* handle) {
+    assert(handle);
+    assert(handle->cached);
+
+    sketch_increment(&FILE_CACHE_SKETCH, handle->hash);
+    file_cache_segment_move(handle, handle->segment == FILE_CACHE_WINDOW ? FILE_CACHE_WINDOW
+                                                                         : FILE_CACHE_PROTECTED);
+    file_cache_protected_trim();
+    file_handle_content_check(handle);
+}
+
+static void file_worker_hit(FileHandle* handle) {
+    assert(handle);
+    assert(FILE_WORKER.registered);
+
+    if (FILE_WORKER.n_hits < FILE_HIT_BUFFER_SIZE)
+        FILE_WORKER.hits[FILE_WORKER.n_hits++] = handle;
+}
+
+// Apply the hits this worker recorded since its last pass. It has not passed a quiescent point
+// since, so the handles are still allocated, though some may have left the cache.
+static void file_worker_hits_apply(void) {
+    if (!FILE_WORKER.n_hits)
+        return;
+
+    pthread_mutex_lock(&FILE_CACHE_LOCK);
+    for (size_t i = 0; i < FILE_WORKER.n_hits; i++) {
+        if (FILE_WORKER.hits[i]->cached)
+            file_cache_touch(FILE_WORKER.hits[i]);
+    }
+    pthread_mutex_unlock(&FILE_CACHE_LOCK);
+
+    FILE_WORKER.n_hits = 0;
+}
+
+// The waiter takes over a reference the caller already holds. Waiting on a published handle
+// requires the lock, which its completion takes before delivering. Waiters for the stat alone are
+// woken when it is known, or when the lookup fails.
+static void file_handle_wait(EventTarget* target, FileHandle* handle, FileHandleHandler handler,
+                             void* ctx, bool stat_only) {
+    assert(target);
+    assert(handle);
+    assert(handler);
+    assert(!stat_only || !handle->stat_known);
+
+    Event* event = event_create(target, handler, ctx);
+    a3_sll_push(stat_only ? &handle->stat_waiting : &handle->waiting, event_queue_link(event));
+}
+
+static EventTarget* file_handle_target(FileHandle* handle) {
+    assert(handle);
+
+    file_handle_ref(handle);
+    return EVT(handle);
+}
+
+// Failed lookups do not stay in the cache. Paths which do not exist are remembered in the negative
+// cache instead, and anything else is retried on the next request.
+static void file_handle_failed(FileHandle* handle, struct io_uring* uring) {
+    assert(handle);
+    assert(handle->file < 0);
+    assert(uring);
+
+    if (!handle->cached)
+        return;
+
+    if (handle->file == -ENOENT || handle->file == -ENOTDIR)
+        file_negative_insert(handle->path);
+    file_cache_remove(handle, uring);
+}
+
+// The open is over, so nothing more is resolved beneath the root or directory it used.
+static void file_handle_resolved(FileHandle* handle, struct io_uring* uring) {
+    assert(handle);
+    assert(uring);
+
+    if (handle->root)
+        file_root_unref(handle->root);
+    if (handle->dir)
+        file_handle_close(handle->dir, uring);
+    handle->root = NULL;
+    handle->dir  = NULL;
+}
+
+static void file_handle_complete(FileHandle* handle, struct io_uring* uring, int32_t status) {
+    assert(handle);
+    assert(file_handle_waiting(handle));
+    assert(uring);
+
+    file_handle_resolved(handle, uring);
+
+    // Once the status is set under the lock, no more waiters can be added, so the queue can be
+    // delivered without it.
+    pthread_mutex_lock(&FILE_CACHE_LOCK);
+    handle->file = status;
+    pthread_mutex_unlock(&FILE_CACHE_LOCK);
+    event_synth_deliver(&handle->stat_waiting, uring, status);
+    event_synth_deliver(&handle->waiting, uring, status);
+
+    pthread_mutex_lock(&FILE_CACHE_LOCK);
+    if (status < 0) {
+        file_handle_failed(handle, uring);
+    } else if (handle->cached) {
+        FILE_CACHE_FDS++;
+        file_handle_content_check(handle);
+        file_cache_balance(uring);
+    }
+    pthread_mutex_unlock(&FILE_CACHE_LOCK);
+}
+
+static void file_handle_stat_handle(EventTarget* target, struct io_uring* uring, void* ctx,
+                                    bool success, int32_t status) {
+    assert(target);
+    assert(uring);
+    (void)ctx;
+
+    FileHandle* handle = EVT_PTR(target, FileHandle);
+
+    // If there was an error, deliver it. Otherwise, wake those who only need the stat, and wait
+    // for the open.
+    if (!success) {
+        file_handle_complete(handle, uring, status);
+
+        // The linked open is canceled without reaching its handler, so drop its reference here.
+        event_cancel_all(EVT(handle));
+        file_handle_close(handle, uring);
+    } else {
+        pthread_mutex_lock(&FILE_CACHE_LOCK);
+        handle->stat_known = true;
+        pthread_mutex_unlock(&FILE_CACHE_LOCK);
+        event_synth_deliver(&handle->stat_waiting, uring, status);
+    }
+
+    // Unref only after delivery, so waiters cannot free the handle out from under the queue.
+    file_handle_close(handle, uring);
+}
+
+static void file_handle_openat_handle(EventTarget* target, struct io_uring* uring, void* ctx,
+                                      bool success, int32_t status) {
+    assert(target);
+    assert(uring);
+    (void)ctx;
+
+    (void)success;
+
+    FileHandle* handle = EVT_PTR(target, FileHandle);
+    file_handle_complete(handle, uring, status);
+    file_handle_close(handle, uring);
+}
+
+static void file_handle_free(FileHandle* handle) {
+    assert(handle);
+
+    if (handle->pooled)
+        a3_pool_free_block(FILE_HANDLE_POOL, handle);
+    else
+        free(handle);
+}
+
+// Allocate a handle for the given path and submit its stat and open. Both are resolved relative to
+// dir, or the root if there is none, using the last name_len bytes of the path. Called with the
+// cache lock held, since the root is read. The returned handle holds one reference, which is the
+// cache's.
+static FileHandle* file_handle_new(struct io_uring* uring, A3String path, FileHandle* dir,
+                                   size_t name_len, int32_t flags) {
+    assert(uring);
+    assert(path.ptr);
+    assert(name_len && name_len <= path.len);
+
+    // The slab is sized for the cache. Handles kept alive by users beyond that are rare.
+    pthread_mutex_lock(&FILE_CLOSE_LOCK);
+    FileHandle* handle = a3_pool_alloc_block(FILE_HANDLE_POOL);
+    pthread_mutex_unlock(&FILE_CLOSE_LOCK);
+    if (handle)
+        handle->pooled = true;
+    else
+        A3_UNWRAPN(handle, calloc(1, sizeof(FileHandle)));
+    atomic_init(&handle->refs, 1);
+    handle->path        = A3_S_CONST(path);
+    handle->file        = FILE_HANDLE_WAITING;
+    handle->flags       = flags;
+    handle->fresh_until = clock_monotonic().tv_sec + CONFIG.cache_ttl;
+    handle->hash        = file_hash(handle->path);
+    handle->how         = (struct open_how) { .flags   = (uint32_t)flags | O_CLOEXEC,
+                                              .resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS };
+    mem_account(MEM_FILE_CACHE, sizeof(FileHandle) + path.len);
+
+    fd dir_fd = -1;
+    if (dir) {
+        file_handle_ref(dir);
+        handle->dir = dir;
+        dir_fd      = file_handle_fd(dir);
+    } else {
+        handle->root = file_root_ref(FILE_ROOT);
+        dir_fd       = FILE_ROOT->file;
+    }
+
+    A3CString name = { .ptr = &path.ptr[path.len - name_len], .len = name_len };
+    if (!event_stat_submit(file_handle_target(handle), uring, file_handle_stat_handle, NULL, dir_fd,
+                           name, FILE_STATX_MASK, &handle->stat, IOSQE_IO_LINK) ||
+        !event_openat2_submit(file_handle_target(handle), uring, file_handle_openat_handle, NULL,
+                              dir_fd, name, &handle->how, 0)) {
+        A3_WARN("Unable to submit OPENAT event.");
+        file_handle_resolved(handle, uring);
+        mem_unaccount(MEM_FILE_CACHE, sizeof(FileHandle) + path.len);
+        a3_string_free(&path);
+        pthread_mutex_lock(&FILE_CLOSE_LOCK);
+        file_handle_free(handle);
+        pthread_mutex_unlock(&FILE_CLOSE_LOCK);
+        return NULL;
+    }
+
+    return handle;
+}
+
+// The replacement for a changed file is ready. Swap it in, unless the stale handle has already left
+// the cache.
+static void file_handle_replace_handle(EventTarget* target, struct io_uring* uring, void* ctx,
+                                       bool success, int32_t status) {
+    assert(target);
+    assert(uring);
+    assert(ctx);
+    (void)status;
+
+    FileHandle* handle      = EVT_PTR(target, FileHandle);
+    FileHandle* replacement = ctx;
+
+    pthread_mutex_lock(&FILE_CACHE_LOCK);
+    handle->revalidating = false;
+    bool swap            = handle->cached && success;
+    if (handle->cached)
+        file_cache_remove(handle, uring);
+
+    if (swap) {
+        A3_TRACE_F("Replacing changed file " A3_S_F ".", A3_S_FORMAT(handle->path));
+        file_cache_insert(replacement, uring);
+    } else {
+        // The reference the cache would have taken.
+        file_handle_close(replacement, uring);
+    }
+    pthread_mutex_unlock(&FILE_CACHE_LOCK);
+
+    file_handle_close(replacement, uring);
+    file_handle_close(handle, uring);
+}
+
+static bool file_stat_same(struct statx* a, struct statx* b) {
+    assert(a);
+    assert(b);
+
+    return a->stx_ino == b->stx_ino && a->stx_size == b->stx_size &&
+           a->stx_mtime.tv_sec == b->stx_mtime.tv_sec &&
+           a->stx_mtime.tv_nsec == b->stx_mtime.tv_nsec;
+}
+
+static void file_handle_revalidate_handle(EventTarget* target, struct io_uring* uring, void* ctx,
+                                          bool success, int32_t status) {
+    assert(target);
+    assert(uring);
+    assert(ctx);
+    (void)status;
+
+    FileHandle* handle = EVT_PTR(target, FileHandle);
+    file_root_unref(ctx);
+
+    if (!handle->cached) {
+        handle->revalidating = false;
+        file_handle_close(handle, uring);
+        return;
+    }
+
+    if (success && file_stat_same(&handle->stat, &handle->revalidate_stat)) {
+        handle->fresh_until  = clock_monotonic().tv_sec + CONFIG.cache_ttl;
+        handle->revalidating = false;
+        file_handle_close(handle, uring);
+        return;
+    }
+
+    // The file has changed. Keep serving the stale handle until the new one is open.
+    FileHandle* replacement = NULL;
+    if (success) {
+        pthread_mutex_lock(&FILE_CACHE_LOCK);
+        replacement = file_handle_new(uring, a3_string_clone(handle->path), NULL, handle->path.len,
+                                      handle->flags);
+        pthread_mutex_unlock(&FILE_CACHE_LOCK);
+    }
+    if (!replacement) {
+        pthread_mutex_lock(&FILE_CACHE_LOCK);
+        handle->revalidating = false;
+        if (handle->cached)
+            file_cache_remove(handle, uring);
+        pthread_mutex_unlock(&FILE_CACHE_LOCK);
+        file_handle_close(handle, uring);
+        return;
+    }
 
-    A3_TRACE_F("Evicting file " A3_S_F ".", A3_S_FORMAT(*key));
-    file_handle_close(*value, uring);
+    // This handler's reference on the stale handle passes to the replacement's waiter. The
+    // replacement is not yet published, so it can be waited on without the lock.
+    file_handle_ref(replacement);
+    file_handle_wait(target, replacement, file_handle_replace_handle, replacement, false);
 }
 
-void file_cache_init() {
-    A3_CACHE_INIT(A3CString, FileHandlePtr)
-    (&FILE_CACHE, FD_CACHE_SIZE, file_evict_callback);
+// Serve stale entries immediately, and check them in the background.
+static void file_handle_revalidate(FileHandle* handle, struct io_uring* uring) {
+    assert(handle);
+    assert(uring);
+
+    if (!CONFIG.cache_ttl || file_handle_waiting(handle) ||
+        clock_monotonic().tv_sec < handle->fresh_until ||
+        atomic_exchange(&handle->revalidating, true))
+        return;
+
+    A3_TRACE_F("Revalidating " A3_S_F ".", A3_S_FORMAT(handle->path));
+    pthread_mutex_lock(&FILE_CACHE_LOCK);
+    FileRoot* root = file_root_ref(FILE_ROOT);
+    pthread_mutex_unlock(&FILE_CACHE_LOCK);
+    if (!event_stat_submit(file_handle_target(handle), uring, file_handle_revalidate_handle, root,
+                           root->file, handle->path, FILE_STATX_MASK, &handle->revalidate_stat,
+                           0)) {
+        file_root_unref(root);
+        handle->revalidating = false;
+        file_handle_close(handle, uring);
+    }
 }
 
-static void file_handle_wait(EventTarget* target, FileHandle* handle, FileHandleHandler handler,
-                             void* ctx) {
+// The caller's reference on the handle is the one returned. A speculative hit is not a use of the
+// file, so it is neither counted nor recorded in the sketch.
+static FileHandle* file_cache_hit(EventTarget* target, struct io_uring* uring,
+                                  FileHandleHandler handler, void* ctx, FileHandle* handle,
+                                  bool speculative, bool stat_only) {
     assert(target);
-    assert(handle);
+    assert(uring);
     assert(handler);
+    assert(handle);
 
-    A3_REF(handle);
-    Event* event = event_create(target, handler, ctx);
-    a3_sll_push(&handle->waiting, event_queue_link(event));
-}
+    A3_TRACE_F("File cache hit (openat) on " A3_S_F ".", A3_S_FORMAT(handle->path));
+    if (!speculative) {
+        file_lookup_count(&file_lookup_stats()->hits);
+        file_worker_hit(handle);
+    }
+    file_handle_revalidate(handle, uring);
 
-static EventTarget* file_handle_target(FileHandle* handle) {
-    assert(handle);
+    // The handle is not ready, but an open request is in flight. Synthesize
+    // an event so the caller is notified when the file is opened.
+    if (file_handle_waiting(handle) && !(stat_only && handle->stat_known)) {
+        pthread_mutex_lock(&FILE_CACHE_LOCK);
+        if (file_handle_waiting(handle) && !(stat_only && handle->stat_known)) {
+            A3_TRACE("  Open in-flight. Waiting.");
+            file_handle_wait(target, handle, handler, ctx, stat_only);
+        }
+        pthread_mutex_unlock(&FILE_CACHE_LOCK);
+    }
 
-    A3_REF(handle);
-    return EVT(handle);
+    return handle;
 }
 
-static void file_handle_stat_handle(EventTarget* target, struct io_uring* uring, void* ctx,
-                                    bool success, int32_t status) {
-    assert(target);
-    assert(uring);
-    (void)ctx;
-
-    FileHandle* handle = EVT_PTR(target, FileHandle);
-    assert(file_handle_waiting(handle));
+// Whether a path is in the cache, without counting as a use of it.
+bool file_cache_contains(A3CString path) {
+    assert(path.ptr);
 
-    // Unref.
-    if (file_handle_close(handle, uring))
-        return;
+    FileKey key = file_key(NULL, path);
+    pthread_mutex_lock(&FILE_CACHE_LOCK);
+    bool ret = file_index_find(&key, file_hash(path));
+    pthread_mutex_unlock(&FILE_CACHE_LOCK);
 
-    // If there was an error, deliver it. Otherwise, wait for the open.
-    if (!success) {
-        handle->file = status;
-        event_synth_deliver(&handle->waiting, uring, status);
-    }
+    return ret;
 }
 
-static void file_handle_openat_handle(EventTarget* target, struct io_uring* uring, void* ctx,
-                                      bool success, int32_t status) {
-    assert(target);
+// Directories remember the last child opened through them (usually the index file), so repeated
+// lookups skip building the child's path.
+static void file_handle_child_set(FileHandle* dir, FileHandle* child, struct io_uring* uring) {
+    assert(dir);
+    assert(child);
     assert(uring);
-    (void)ctx;
-    (void)success;
 
-    FileHandle* handle = EVT_PTR(target, FileHandle);
-    assert(file_handle_waiting(handle));
-
-    // Unref.
-    if (file_handle_close(handle, uring))
+    if (dir->child == child)
         return;
 
-    handle->file = status;
-    event_synth_deliver(&handle->waiting, uring, status);
+    file_handle_ref(child);
+    FileHandle* old = atomic_exchange(&dir->child, child);
+    if (old)
+        file_handle_close(old, uring);
 }
 
-FileHandle* file_open(EventTarget* target, struct io_uring* uring, FileHandleHandler handler,
-                      void* ctx, A3CString path, int32_t flags) {
-    assert(handler);
-    return file_openat(target, uring, handler, ctx, NULL, path, flags);
+// Returns the remembered child with a reference held, if it matches.
+static FileHandle* file_handle_child(FileHandle* dir, A3CString name, int32_t flags) {
+    assert(dir);
+    assert(name.ptr);
+
+    FileHandle* child = dir->child;
+    if (!child || !child->cached || child->flags != flags || child->path.len < name.len)
+        return NULL;
+
+    A3CString child_name = { .ptr = &child->path.ptr[child->path.len - name.len],
+                             .len = name.len };
+    if (a3_string_cmp(child_name, name) != 0 || !file_handle_ref_live(child))
+        return NULL;
+    return child;
 }
 
-FileHandle* file_openat(EventTarget* target, struct io_uring* uring, FileHandleHandler handler,
-                        void* ctx, FileHandle* dir, A3CString name, int32_t flags) {
+// Paths are relative to the web root. Opens are resolved by the kernel beneath the web root, or
+// beneath the given directory. Speculative opens, made before anything asks for the file, are
+// counted apart from requests, and leave the sketch alone so they are not favoured for admission.
+// With stat_only, the handler is called once the stat is known, rather than once the file is open.
+static FileHandle* file_cache_open(EventTarget* target, struct io_uring* uring,
+                                   FileHandleHandler handler, void* ctx, FileHandle* dir,
+                                   A3CString name, int32_t flags, bool speculative,
+                                   bool stat_only) {
     assert(target);
     assert(uring);
     assert(handler);
     assert(name.ptr);
     assert(flags == O_RDONLY);
 
-    A3String path = A3_S_NULL;
+    FileHandle* handle = NULL;
+    if (dir && (handle = file_handle_child(dir, name, flags)))
+        return file_cache_hit(target, uring, handler, ctx, handle, speculative, stat_only);
 
-    if (dir) {
-        path = a3_string_alloc(dir->path.len + name.len + 1);
-        if (dir->path.ptr[dir->path.len - 1] == '/')
-            a3_string_concat(path, 2, dir->path, name);
-        else
-            a3_string_concat(path, 3, dir->path, A3_CS("/"), name);
-    } else {
-        path = a3_string_clone(name);
+    // Probe with the borrowed pieces of the path. It is only joined on a miss.
+    FileKey  key  = file_key(dir, name);
+    uint64_t hash = file_key_hash(&key, dir);
+    if ((handle = file_index_lookup(&key, hash, uring)) && handle->flags == flags) {
+        if (dir)
+            file_handle_child_set(dir, handle, uring);
+        return file_cache_hit(target, uring, handler, ctx, handle, speculative, stat_only);
+    } else if (handle) {
+        file_handle_close(handle, uring);
     }
 
-    FileHandle** handle_ptr =
-        A3_CACHE_FIND(A3CString, FileHandlePtr)(&FILE_CACHE, A3_S_CONST(path));
-    if (handle_ptr && (*handle_ptr)->flags == flags) {
-        FileHandle* handle = *handle_ptr;
-
-        A3_TRACE_F("File cache hit (openat) on " A3_S_F ".", A3_S_FORMAT(path));
-        a3_string_free(&path);
-
-        // The handle is not ready, but an open request is in flight. Synthesize
-        // an event so the caller is notified when the file is opened.
-        if (file_handle_waiting(handle)) {
-            A3_TRACE("  Open in-flight. Waiting.");
-            file_handle_wait(target, handle, handler, ctx);
-            return handle;
-        }
+    // Another thread may have missed on the same path in the meantime. If so, its open is waited
+    // on, rather than issuing another.
+    pthread_mutex_lock(&FILE_CACHE_LOCK);
+    handle = file_index_find(&key, hash);
+    if (handle && handle->flags != flags) {
+        file_cache_remove(handle, uring);
+    } else if (handle) {
+        file_handle_ref(handle);
+        pthread_mutex_unlock(&FILE_CACHE_LOCK);
+        if (dir)
+            file_handle_child_set(dir, handle, uring);
+        return file_cache_hit(target, uring, handler, ctx, handle, speculative, stat_only);
+    }
 
-        A3_REF(handle);
-        return handle;
+    A3String  path   = key.dir.len ? file_key_join(&key) : A3_S_NULL;
+    A3CString lookup = path.ptr ? A3_S_CONST(path) : name;
+    // Names missing from the index of the web root, or recently found to be missing, are answered
+    // without asking the kernel.
+    if (file_tree_find(lookup) == FILE_TREE_ABSENT || file_negative_find(lookup)) {
+        pthread_mutex_unlock(&FILE_CACHE_LOCK);
+        A3_TRACE_F("Negative cache hit (openat) on " A3_S_F ".", A3_S_FORMAT(lookup));
+        if (!speculative)
+            file_lookup_count(&file_lookup_stats()->negative_hits);
+        if (path.ptr)
+            a3_string_free(&path);
+        file_handle_ref(&FILE_HANDLE_ABSENT);
+        return &FILE_HANDLE_ABSENT;
     }
 
-    A3_TRACE_F("File cache miss (openat) on " A3_S_F ".", A3_S_FORMAT(path));
-    FileHandle* handle = NULL;
-    A3_UNWRAPN(handle, calloc(1, sizeof(FileHandle)));
-    A3_REF_INIT(handle);
-    handle->path = A3_S_CONST(path);
-    handle->file = FILE_HANDLE_WAITING;
-
-    if (!event_stat_submit(file_handle_target(handle), uring, file_handle_stat_handle, NULL,
-                           handle->path, FILE_STATX_MASK, &handle->stat, IOSQE_IO_LINK) ||
-        !event_openat_submit(file_handle_target(handle), uring, file_handle_openat_handle, NULL,
-                             dir ? file_handle_fd(dir) : -1, handle->path, flags, 0)) {
-        A3_WARN("Unable to submit OPENAT event.");
-        a3_string_free(&path);
-        free(handle);
+    A3_TRACE_F("File cache miss (openat) on " A3_S_F ".", A3_S_FORMAT(lookup));
+    if (speculative)
+        file_lookup_count(&file_lookup_stats()->prefetches);
+    else
+        file_lookup_count(&file_lookup_stats()->misses);
+    if (!path.ptr)
+        path = a3_string_clone(name);
+    handle = file_handle_new(uring, path, dir, name.len, flags);
+    if (!handle) {
+        pthread_mutex_unlock(&FILE_CACHE_LOCK);
         return NULL;
     }
+    if (!speculative)
+        sketch_increment(&FILE_CACHE_SKETCH, handle->hash);
 
-    file_handle_wait(target, handle, handler, ctx);
-    A3_CACHE_INSERT(A3CString, FileHandlePtr)(&FILE_CACHE, handle->path, handle, uring);
+    file_handle_ref(handle);
+    file_handle_wait(target, handle, handler, ctx, stat_only);
+    file_cache_insert(handle, uring);
+    pthread_mutex_unlock(&FILE_CACHE_LOCK);
+    if (dir)
+        file_handle_child_set(dir, handle, uring);
 
     return handle;
 }
 
+FileHandle* file_open(EventTarget* target, struct io_uring* uring, FileHandleHandler handler,
+                      void* ctx, A3CString path, int32_t flags) {
+    return file_cache_open(target, uring, handler, ctx, NULL, path, flags, false, false);
+}
+
+FileHandle* file_openat(EventTarget* target, struct io_uring* uring, FileHandleHandler handler,
+                        void* ctx, FileHandle* dir, A3CString name, int32_t flags) {
+    return file_cache_open(target, uring, handler, ctx, dir, name, flags, false, false);
+}
+
+FileHandle* file_open_speculative(EventTarget* target, struct io_uring* uring,
+                                  FileHandleHandler handler, void* ctx, A3CString path,
+                                  int32_t flags) {
+    return file_cache_open(target, uring, handler, ctx, NULL, path, flags, true, false);
+}
+
+// Like file_open, for requests which the file's metadata may answer. The handler is called as
+// soon as the stat is known, which may be before the open completes. If the caller turns out to
+// need the open, it waits with file_handle_open_wait.
+FileHandle* file_open_stat(EventTarget* target, struct io_uring* uring, FileHandleHandler handler,
+                           void* ctx, A3CString path, int32_t flags) {
+    return file_cache_open(target, uring, handler, ctx, NULL, path, flags, false, true);
+}
+
+// Wait for the open of a handle looked up with file_open_stat. Returns false if the open has
+// already completed, in which case the handler is not called.
+bool file_handle_open_wait(FileHandle* handle, EventTarget* target, FileHandleHandler handler,
+                           void* ctx) {
+    assert(handle);
+    assert(target);
+    assert(handler);
+
+    pthread_mutex_lock(&FILE_CACHE_LOCK);
+    bool ret = file_handle_waiting(handle);
+    if (ret)
+        file_handle_wait(target, handle, handler, ctx, false);
+    pthread_mutex_unlock(&FILE_CACHE_LOCK);
+
+    return ret;
+}
+
 fd file_handle_fd(FileHandle* handle) {
     assert(handle);
     assert(handle->file >= 0);
@@ -210,31 +1179,563 @@ A3CString file_handle_path(FileHandle* handle) {
     return handle->path;
 }
 
+static void file_handle_content_handle(EventTarget* target, struct io_uring* uring, void* ctx,
+                                       bool success, int32_t status) {
+    assert(target);
+    assert(uring);
+    assert(ctx);
+    (void)status;
+
+    FileHandle* handle  = EVT_PTR(target, FileHandle);
+    uint8_t*    content = ctx;
+
+    // A short read means the file changed under the handle, which is about to be dropped anyway.
+    if (success) {
+        atomic_store_explicit(&handle->content, content, memory_order_release);
+    } else {
+        atomic_fetch_sub(&FILE_CONTENT_BYTES, handle->content_len);
+        mem_unaccount(MEM_FILE_CACHE, handle->content_len);
+        free(content);
+    }
+
+    file_handle_close(handle, uring);
+}
+
+static bool file_handle_content_eligible(FileHandle* handle) {
+    assert(handle);
+
+    return handle->file >= 0 && handle->cached &&
+           atomic_load_explicit(&handle->content_wanted, memory_order_relaxed);
+}
+
+// The contents of the file, if they are held in memory. Otherwise, if the file is small and hot
+// enough, it is read in for later requests, and an empty string is returned.
+A3CString file_handle_content(FileHandle* handle, struct io_uring* uring) {
+    assert(handle);
+    assert(uring);
+
+    uint8_t* content = atomic_load_explicit(&handle->content, memory_order_acquire);
+    if (content)
+        return (A3CString) { .ptr = content, .len = handle->content_len };
+
+    if (atomic_load_explicit(&handle->content_loading, memory_order_relaxed) ||
+        !file_handle_content_eligible(handle) || atomic_exchange(&handle->content_loading, true))
+        return A3_CS_NULL;
+
+    // Only one attempt is made per handle, whatever its outcome.
+    size_t len = handle->stat.stx_size;
+    if (atomic_fetch_add(&FILE_CONTENT_BYTES, len) + len > FILE_CONTENT_CACHE_SIZE) {
+        atomic_fetch_sub(&FILE_CONTENT_BYTES, len);
+        return A3_CS_NULL;
+    }
+
+    A3_UNWRAPN(content, malloc(len));
+    handle->content_len = len;
+    mem_account(MEM_FILE_CACHE, len);
+    if (!event_read_submit(file_handle_target(handle), uring, file_handle_content_handle, content,
+                           handle->file, (A3String) { .ptr = content, .len = len }, len, 0, 0)) {
+        atomic_fetch_sub(&FILE_CONTENT_BYTES, len);
+        mem_unaccount(MEM_FILE_CACHE, len);
+        free(content);
+        file_handle_close(handle, uring);
+    }
+
+    return A3_CS_NULL;
+}
+
+// Files warmed from a manifest were hot in the last process, so their contents are read in now,
+// rather than after the sketch has seen enough requests in this one.
+void file_handle_content_warm(FileHandle* handle, struct io_uring* uring) {
+    assert(handle);
+    assert(uring);
+
+    if (!handle->cached || !file_handle_content_fits(handle))
+        return;
+
+    atomic_store_explicit(&handle->content_wanted, true, memory_order_relaxed);
+    file_handle_content(handle, uring);
+}
+
+// Headers cached by the user of the handle. Empty until they are published.
+A3CString file_handle_headers(FileHandle* handle) {
+    assert(handle);
+    return (A3CString) { .ptr = handle->headers,
+                         .len = atomic_load_explicit(&handle->headers_len, memory_order_acquire) };
+}
+
+// Space to build the cached headers in. Only the first caller gets it. The rest get a null string,
+// until the headers are published.
+A3String file_handle_headers_space(FileHandle* handle) {
+    assert(handle);
+
+    if (atomic_exchange_explicit(&handle->headers_claimed, true, memory_order_relaxed))
+        return A3_S_NULL;
+    return (A3String) { .ptr = handle->headers, .len = sizeof(handle->headers) };
+}
+
+void file_handle_headers_wrote(FileHandle* handle, size_t len) {
+    assert(handle);
+    assert(handle->headers_claimed);
+    assert(len <= sizeof(handle->headers));
+    atomic_store_explicit(&handle->headers_len, len, memory_order_release);
+}
+
 bool file_handle_waiting(FileHandle* handle) {
     assert(handle);
 
     return handle->file == FILE_HANDLE_WAITING;
 }
 
-// Returns true if the handle was freed.
+// Whether the stat of a handle is filled in, even if the open is still in flight.
+bool file_handle_stat_known(FileHandle* handle) {
+    assert(handle);
+
+    return handle->stat_known;
+}
+
+// Returns true if the handle was released, in which case it must not be used again. The fd is
+// closed and the memory freed later, by file_cache_reap, once no worker can still see it.
 bool file_handle_close(FileHandle* handle, struct io_uring* uring) {
     assert(handle);
-    assert(A3_REF_COUNT(handle));
     assert(uring);
 
-    A3_UNREF(handle);
-    if (A3_REF_COUNT(handle))
+    size_t refs = atomic_fetch_sub_explicit(&handle->refs, 1, memory_order_acq_rel);
+    assert(refs);
+    if (refs > 1)
         return false; // Other users remain.
+    assert(handle != &FILE_HANDLE_ABSENT);
 
-    if (handle->file >= 0)
-        event_close_submit(NULL, uring, NULL, NULL, handle->file, 0, EVENT_FALLBACK_ALLOW);
-    a3_string_free((A3String*)&handle->path);
-    free(handle);
+    // The queue is in order of release, since epochs are taken under the lock.
+    pthread_mutex_lock(&FILE_CLOSE_LOCK);
+    handle->retired = atomic_fetch_add(&FILE_EPOCH, 1) + 1;
+    a3_sll_enqueue(&FILE_CLOSE_QUEUE, &handle->close_link);
+    pthread_mutex_unlock(&FILE_CLOSE_LOCK);
+    return true;
+}
+
+// The oldest released handle, if no worker can still see it.
+static FileHandle* file_close_next(uint64_t safe) {
+    pthread_mutex_lock(&FILE_CLOSE_LOCK);
+    A3SLink* link = a3_sll_peek(&FILE_CLOSE_QUEUE);
+    if (link && A3_CONTAINER_OF(link, FileHandle, close_link)->retired <= safe)
+        a3_sll_dequeue(&FILE_CLOSE_QUEUE);
+    else
+        link = NULL;
+    pthread_mutex_unlock(&FILE_CLOSE_LOCK);
+
+    return link ? A3_CONTAINER_OF(link, FileHandle, close_link) : NULL;
+}
+
+static bool file_close_pending(void) {
+    pthread_mutex_lock(&FILE_CLOSE_LOCK);
+    bool ret = a3_sll_peek(&FILE_CLOSE_QUEUE);
+    pthread_mutex_unlock(&FILE_CLOSE_LOCK);
+
+    return ret;
+}
+
+// The calling worker is about to wait for events, and looks nothing up until it wakes.
+void file_cache_offline(void) {
+    assert(FILE_WORKER.registered);
+
+    file_worker_hits_apply();
+    atomic_store(&FILE_WORKER_EPOCHS[FILE_WORKER.id], FILE_EPOCH_OFFLINE);
+}
+
+// Apply this worker's hits, mark its quiescent point, and close and free the handles no worker can
+// still see. Called from the event loop, outside of any lookup.
+void file_cache_reap(struct io_uring* uring) {
+    assert(uring);
+
+    file_worker_hits_apply();
+    file_cache_quiescent();
+
+    uint64_t safe = file_epoch_safe();
+    for (FileHandle* handle = file_close_next(safe); handle; handle = file_close_next(safe)) {
+
+        if (handle->child)
+            file_handle_close(handle->child, uring);
+
+        if (handle->file >= 0)
+            event_close_submit(NULL, uring, NULL, NULL, handle->file, 0, EVENT_FALLBACK_ALLOW);
+        if (handle->content) {
+            atomic_fetch_sub(&FILE_CONTENT_BYTES, handle->content_len);
+            mem_unaccount(MEM_FILE_CACHE, handle->content_len);
+            free(handle->content);
+        }
+        mem_unaccount(MEM_FILE_CACHE, sizeof(FileHandle) + handle->path.len);
+        a3_string_free((A3String*)&handle->path);
+
+        pthread_mutex_lock(&FILE_CLOSE_LOCK);
+        file_handle_free(handle);
+        pthread_mutex_unlock(&FILE_CLOSE_LOCK);
+    }
+}
+
+// The bytes a handle releases once its last user is done with it.
+static size_t file_handle_footprint(FileHandle* handle) {
+    assert(handle);
+
+    size_t ret = sizeof(FileHandle) + handle->path.len;
+    if (atomic_load_explicit(&handle->content, memory_order_relaxed))
+        ret += handle->content_len;
+
+    return ret;
+}
+
+// Drop the coldest entries until about the given number of bytes is released: missing paths first,
+// then handles from the least recently used end of the probationary segment, the window, and the
+// protected segment, in that order. Returns the bytes released. Handles which are still in use
+// only give their memory back once they are released.
+size_t file_cache_trim(size_t bytes, struct io_uring* uring) {
+    assert(uring);
+
+    static const FileCacheSegment ORDER[] = { FILE_CACHE_PROBATION, FILE_CACHE_WINDOW,
+                                              FILE_CACHE_PROTECTED };
+
+    size_t ret = 0;
+
+    pthread_mutex_lock(&FILE_CACHE_LOCK);
+    while (ret < bytes && FILE_NEGATIVE_ENTRIES) {
+        FileNegative* oldest = file_negative_oldest();
+        ret += sizeof(FileNegative) + oldest->path.len;
+        file_negative_remove(oldest);
+    }
+
+    for (size_t i = 0; i < sizeof(ORDER) / sizeof(ORDER[0]) && ret < bytes; i++) {
+        for (FileHandle* handle = file_cache_lru(ORDER[i]); handle && ret < bytes;
+             handle             = file_cache_lru(ORDER[i])) {
+            ret += file_handle_footprint(handle);
+            file_cache_evict(handle, uring);
+        }
+    }
+    pthread_mutex_unlock(&FILE_CACHE_LOCK);
+
+    if (ret)
+        A3_DEBUG_F("Trimmed %zu byte(s) from the file cache.", ret);
+    return ret;
+}
+
+// Drop every cached handle to relieve memory pressure. Handles which are still in use stay alive
+// until they are released.
+void file_cache_shed(struct io_uring* uring) {
+    assert(uring);
+
+    pthread_mutex_lock(&FILE_CACHE_LOCK);
+    if (!FILE_CACHE_ENTRIES && !FILE_NEGATIVE_ENTRIES) {
+        pthread_mutex_unlock(&FILE_CACHE_LOCK);
+        return;
+    }
+
+    A3_DEBUG_F("Shedding %zu cached file(s) and %zu missing path(s).", FILE_CACHE_ENTRIES,
+               FILE_NEGATIVE_ENTRIES);
+    for (FileCacheSegment segment = 0; segment < FILE_CACHE_SEGMENT_COUNT; segment++)
+        for (FileHandle* handle = file_cache_lru(segment); handle; handle = file_cache_lru(segment))
+            file_cache_remove(handle, uring);
+    while (FILE_NEGATIVE_ENTRIES)
+        file_negative_remove(file_negative_oldest());
+    pthread_mutex_unlock(&FILE_CACHE_LOCK);
+}
+
+void file_cache_stats_dump(FILE* out) {
+    assert(out);
+
+    size_t hits          = 0;
+    size_t misses        = 0;
+    size_t negative_hits = 0;
+    size_t prefetches    = 0;
+    for (size_t i = 0; i < FILE_WORKERS_MAX; i++) {
+        FileLookupStats* stats = &FILE_LOOKUP_STATS[i];
+        hits += atomic_load_explicit(&stats->hits, memory_order_relaxed);
+        misses += atomic_load_explicit(&stats->misses, memory_order_relaxed);
+        negative_hits += atomic_load_explicit(&stats->negative_hits, memory_order_relaxed);
+        prefetches += atomic_load_explicit(&stats->prefetches, memory_order_relaxed);
+    }
+    size_t lookups = hits + misses;
+
+    pthread_mutex_lock(&FILE_CACHE_LOCK);
+    fprintf(out, "File cache:\n");
+    fprintf(out, "\t%-16s%zu of %zu (%zu fds of %zu)\n", "entries", FILE_CACHE_ENTRIES,
+            CONFIG.cache_entries, FILE_CACHE_FDS, CONFIG.cache_fds);
+    fprintf(out, "\t%-16s%zu\n", "hits", hits);
+    fprintf(out, "\t%-16s%zu\n", "misses", misses);
+    fprintf(out, "\t%-16s%.2f%%\n", "hit rate",
+            lookups ? 100.0 * (double)hits / (double)lookups : 0.0);
+    fprintf(out, "\t%-16s%zu\n", "negative hits", negative_hits);
+    fprintf(out, "\t%-16s%zu\n", "evictions", FILE_CACHE_STATS.evictions);
+    fprintf(out, "\t%-16s%zu\n", "rejections", FILE_CACHE_STATS.rejections);
+    fprintf(out, "\t%-16s%zu\n", "prefetches", prefetches);
+    fprintf(out, "\t%-16s%zu of %llu\n", "content bytes", (size_t)FILE_CONTENT_BYTES,
+            FILE_CONTENT_CACHE_SIZE);
+    pthread_mutex_unlock(&FILE_CACHE_LOCK);
+}
+
+// Write the paths of open cached files, hottest first, one per line.
+void file_cache_manifest_write(FILE* out) {
+    assert(out);
+
+    static const FileCacheSegment ORDER[] = { FILE_CACHE_PROTECTED, FILE_CACHE_PROBATION,
+                                              FILE_CACHE_WINDOW };
+
+    pthread_mutex_lock(&FILE_CACHE_LOCK);
+    for (size_t i = 0; i < sizeof(ORDER) / sizeof(ORDER[0]); i++) {
+        // Most recently used first.
+        A3LL* list = &FILE_CACHE_LRU[ORDER[i]];
+        for (A3LL* link = list->prev; link != list; link = link->prev) {
+            FileHandle* handle = A3_CONTAINER_OF(link, FileHandle, lru_link);
+            if (handle->file < 0 || memchr(handle->path.ptr, '\n', handle->path.len))
+                continue;
+            fprintf(out, A3_S_F "\n", A3_S_FORMAT(handle->path));
+        }
+    }
+    pthread_mutex_unlock(&FILE_CACHE_LOCK);
+}
+
+bool file_path_within(A3CString path, A3CString dir) {
+    assert(path.ptr);
+    assert(dir.ptr);
+
+    if (a3_string_cmp(dir, A3_CS(".")) == 0)
+        return true;
+
+    return path.len >= dir.len && memcmp(path.ptr, dir.ptr, dir.len) == 0 &&
+           (path.len == dir.len || path.ptr[dir.len] == '/');
+}
+
+static void file_cache_invalidate_locked(A3CString path, bool tree, struct io_uring* uring) {
+    assert(path.ptr && path.len);
+    assert(uring);
+
+    if (!tree) {
+        FileKey     key    = file_key(NULL, path);
+        FileHandle* handle = file_index_find(&key, file_hash(path));
+        if (handle) {
+            A3_TRACE_F("Invalidating file " A3_S_F ".", A3_S_FORMAT(path));
+            file_cache_remove(handle, uring);
+        }
+
+        FileNegative** negative = A3_HT_FIND(A3CString, FileNegativePtr)(&FILE_NEGATIVE, path);
+        if (negative)
+            file_negative_remove(*negative);
+        return;
+    }
+
+    FileHandle** victims   = NULL;
+    size_t       n_victims = 0;
+    A3_UNWRAPN(victims, calloc(MAX(FILE_CACHE_ENTRIES, 1), sizeof(*victims)));
+
+    for (size_t i = 0; i <= FILE_INDEX_MASK; i++) {
+        if (FILE_INDEX_TAGS[i] && file_path_within(FILE_INDEX_HANDLES[i]->path, path))
+            victims[n_victims++] = FILE_INDEX_HANDLES[i];
+    }
+
+    for (size_t i = 0; i < n_victims; i++) {
+        A3_TRACE_F("Invalidating file " A3_S_F ".", A3_S_FORMAT(victims[i]->path));
+        file_cache_remove(victims[i], uring);
+    }
+    free(victims);
+
+    // Anything missing below a directory which appeared may now exist.
+    FileNegative* negative_victims[FILE_NEGATIVE_CACHE_SIZE];
+    n_victims = 0;
+
+    A3_HT_FOR_EACH(A3CString, FileNegativePtr, &FILE_NEGATIVE, key, value) {
+        if (file_path_within(*key, path))
+            negative_victims[n_victims++] = *value;
+    }
+
+    for (size_t i = 0; i < n_victims; i++)
+        file_negative_remove(negative_victims[i]);
+}
+
+// Drop the entry for a path which has changed on disk. If the path is a directory, everything
+// under it is dropped as well.
+void file_cache_invalidate(A3CString path, bool tree, struct io_uring* uring) {
+    assert(path.ptr && path.len);
+    assert(uring);
+
+    pthread_mutex_lock(&FILE_CACHE_LOCK);
+    file_cache_invalidate_locked(path, tree, uring);
+    pthread_mutex_unlock(&FILE_CACHE_LOCK);
+}
+
+// A cached handle outlives a switch of the web root if the new root has the same file (the same
+// inode, unchanged) at its path. Each handle is checked with a statx on the ring, up to
+// FILE_ROOT_CHECK_BATCH at once, and until its check completes, it is served as it was.
+typedef struct FileRootSwitch {
+    EVENT_TARGET;
+
+    FileHandle** pending; // Each with a reference held.
+    size_t       n_pending;
+    size_t       in_flight;
+    uint64_t     generation;
+    size_t       checked;
+    size_t       kept;
+} FileRootSwitch;
+
+typedef struct FileRootCheck {
+    FileHandle*  handle;
+    FileRoot*    root;
+    uint64_t     generation;
+    struct statx stat;
+} FileRootCheck;
+
+static FileRootSwitch FILE_ROOT_SWITCH;
+
+static void file_root_check_submit(struct io_uring*);
+
+static void file_root_check_handle(EventTarget* target, struct io_uring* uring, void* ctx,
+                                   bool success, int32_t status) {
+    assert(target == EVT(&FILE_ROOT_SWITCH));
+    assert(uring);
+    assert(ctx);
+    (void)status;
+
+    FileRootCheck* check  = ctx;
+    FileHandle*    handle = check->handle;
+
+    // After a later switch, the handle is checked again against the root it brought.
+    pthread_mutex_lock(&FILE_CACHE_LOCK);
+    if (check->generation == FILE_ROOT_SWITCH.generation && handle->cached) {
+        if (success && file_stat_same(&handle->stat, &check->stat) &&
+            handle->stat.stx_dev_major == check->stat.stx_dev_major &&
+            handle->stat.stx_dev_minor == check->stat.stx_dev_minor) {
+            handle->fresh_until = clock_monotonic().tv_sec + CONFIG.cache_ttl;
+            FILE_ROOT_SWITCH.kept++;
+        } else {
+            file_cache_remove(handle, uring);
+        }
+    }
+    FILE_ROOT_SWITCH.in_flight--;
+    file_root_check_submit(uring);
+    pthread_mutex_unlock(&FILE_CACHE_LOCK);
+
+    file_root_unref(check->root);
+    file_handle_close(handle, uring);
+    free(check);
+}
+
+// Called with the cache lock held.
+static void file_root_check_submit(struct io_uring* uring) {
+    assert(uring);
+
+    while (FILE_ROOT_SWITCH.in_flight < FILE_ROOT_CHECK_BATCH && FILE_ROOT_SWITCH.n_pending) {
+        FileHandle* handle = FILE_ROOT_SWITCH.pending[--FILE_ROOT_SWITCH.n_pending];
+        if (!handle->cached) {
+            file_handle_close(handle, uring);
+            continue;
+        }
+
+        FileRootCheck* check = NULL;
+        A3_UNWRAPN(check, calloc(1, sizeof(*check)));
+        check->handle     = handle;
+        check->root       = file_root_ref(FILE_ROOT);
+        check->generation = FILE_ROOT_SWITCH.generation;
+        if (!event_stat_submit(EVT(&FILE_ROOT_SWITCH), uring, file_root_check_handle, check,
+                               check->root->file, handle->path, FILE_STATX_MASK, &check->stat,
+                               0)) {
+            file_cache_remove(handle, uring);
+            file_root_unref(check->root);
+            file_handle_close(handle, uring);
+            free(check);
+            continue;
+        }
+        FILE_ROOT_SWITCH.in_flight++;
+    }
+
+    if (FILE_ROOT_SWITCH.pending && !FILE_ROOT_SWITCH.n_pending && !FILE_ROOT_SWITCH.in_flight) {
+        A3_INFO_F("Kept %zu of %zu cached file(s) across the switch of web root.",
+                  FILE_ROOT_SWITCH.kept, FILE_ROOT_SWITCH.checked);
+        free(FILE_ROOT_SWITCH.pending);
+        FILE_ROOT_SWITCH.pending = NULL;
+    }
+}
+
+// Checks not yet submitted are dropped, along with their references.
+static void file_root_check_cancel(struct io_uring* uring) {
+    assert(uring);
+
+    while (FILE_ROOT_SWITCH.n_pending)
+        file_handle_close(FILE_ROOT_SWITCH.pending[--FILE_ROOT_SWITCH.n_pending], uring);
+    free(FILE_ROOT_SWITCH.pending);
+    FILE_ROOT_SWITCH.pending = NULL;
+}
+
+// Resolve new lookups beneath another web root. Users of existing handles are unaffected. Cached
+// handles for files which are the same under both roots stay, in place, and the rest are dropped
+// as their checks complete. The old root is closed once nothing in flight resolves beneath it.
+bool file_cache_root_switch(A3CString root, struct io_uring* uring) {
+    assert(root.ptr);
+    assert(uring);
+
+    fd new_root = open(a3_string_cstr(root), O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (new_root < 0) {
+        A3_ERRNO_F(errno, "Unable to open web root " A3_S_F ".", A3_S_FORMAT(root));
+        return false;
+    }
+
+    pthread_mutex_lock(&FILE_CACHE_LOCK);
+    file_root_unref(FILE_ROOT);
+    FILE_ROOT = file_root_new(new_root);
+
+    // Checks still pending from an earlier switch are replaced by this one's.
+    file_root_check_cancel(uring);
+    FILE_ROOT_SWITCH.generation++;
+    FILE_ROOT_SWITCH.checked = 0;
+    FILE_ROOT_SWITCH.kept    = 0;
+    A3_UNWRAPN(FILE_ROOT_SWITCH.pending,
+               calloc(MAX(FILE_CACHE_ENTRIES, 1), sizeof(*FILE_ROOT_SWITCH.pending)));
+
+    // Handles which are not open yet were resolved beneath the old root, so they go now.
+    size_t n_victims = 0;
+    for (size_t i = 0; i <= FILE_INDEX_MASK; i++) {
+        FileHandle* handle = FILE_INDEX_HANDLES[i];
+        if (!FILE_INDEX_TAGS[i])
+            continue;
+
+        file_handle_ref(handle);
+        FILE_ROOT_SWITCH.pending[FILE_ROOT_SWITCH.n_pending++] = handle;
+    }
+    for (size_t i = 0; i < FILE_ROOT_SWITCH.n_pending;) {
+        FileHandle* handle = FILE_ROOT_SWITCH.pending[i];
+        if (handle->file >= 0) {
+            i++;
+            continue;
+        }
+
+        file_cache_remove(handle, uring);
+        file_handle_close(handle, uring);
+        FILE_ROOT_SWITCH.pending[i] = FILE_ROOT_SWITCH.pending[--FILE_ROOT_SWITCH.n_pending];
+        n_victims++;
+    }
+    FILE_ROOT_SWITCH.checked = FILE_ROOT_SWITCH.n_pending;
+
+    // Anything missing from the old root may exist under the new one.
+    while (FILE_NEGATIVE_ENTRIES)
+        file_negative_remove(file_negative_oldest());
+
+    file_root_check_submit(uring);
+    pthread_mutex_unlock(&FILE_CACHE_LOCK);
+
+    A3_INFO_F("Switched web root to " A3_S_F ". Checking %zu cached file(s), and dropped %zu.",
+              A3_S_FORMAT(root), FILE_ROOT_SWITCH.checked, n_victims);
     return true;
 }
 
 void file_cache_destroy(struct io_uring* uring) {
     assert(uring);
 
-    A3_CACHE_CLEAR(A3CString, FileHandlePtr)(&FILE_CACHE, uring);
+    file_root_check_cancel(uring);
+    file_cache_shed(uring);
+    while (file_close_pending())
+        file_cache_reap(uring);
+    A3_HT_DESTROY(A3CString, FileNegativePtr)(&FILE_NEGATIVE);
+    sketch_destroy(&FILE_CACHE_SKETCH);
+
+    free(FILE_INDEX_TAGS);
+    free(FILE_INDEX_HANDLES);
+    a3_pool_free(FILE_HANDLE_POOL);
+
+    file_root_unref(FILE_ROOT);
+    FILE_ROOT = NULL;
 }
@@ -21,6 +21,7 @@
 
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdio.h>
 
 #include <a3/str.h>
 
@@ -34,15 +35,39 @@ typedef void (*FileHandleHandler)(EventTarget* target, struct io_uring*, void* c
 
 #define FILE_STATX_MASK (STATX_TYPE | STATX_MTIME | STATX_INO | STATX_SIZE)
 
-void        file_cache_init(void);
+void        file_cache_init(A3CString root);
+void        file_cache_worker_register(void);
+void        file_cache_quiescent(void);
+void        file_cache_offline(void);
 FileHandle* file_open(EventTarget*, struct io_uring*, FileHandleHandler, void* ctx, A3CString path,
                       int32_t flags);
+bool        file_cache_contains(A3CString path);
 FileHandle* file_openat(EventTarget*, struct io_uring*, FileHandleHandler, void* ctx,
                         FileHandle* dir, A3CString name, int32_t flags);
+FileHandle* file_open_speculative(EventTarget*, struct io_uring*, FileHandleHandler, void* ctx,
+                                  A3CString path, int32_t flags);
+FileHandle* file_open_stat(EventTarget*, struct io_uring*, FileHandleHandler, void* ctx,
+                           A3CString path, int32_t flags);
+bool file_handle_open_wait(FileHandle*, EventTarget*, FileHandleHandler, void* ctx);
+void        file_handle_ref(FileHandle*);
 fd          file_handle_fd(FileHandle*);
 fd          file_handle_fd_unchecked(FileHandle*);
 struct statx* file_handle_stat(FileHandle*);
 A3CString     file_handle_path(FileHandle*);
+A3CString     file_handle_content(FileHandle*, struct io_uring*);
+void          file_handle_content_warm(FileHandle*, struct io_uring*);
+A3CString     file_handle_headers(FileHandle*);
+A3String      file_handle_headers_space(FileHandle*);
+void          file_handle_headers_wrote(FileHandle*, size_t);
 bool          file_handle_waiting(FileHandle*);
+bool          file_handle_stat_known(FileHandle*);
 bool          file_handle_close(FileHandle*, struct io_uring*);
+void          file_cache_reap(struct io_uring*);
+size_t        file_cache_trim(size_t bytes, struct io_uring*);
+void          file_cache_shed(struct io_uring*);
+void          file_cache_invalidate(A3CString path, bool tree, struct io_uring*);
+bool          file_cache_root_switch(A3CString root, struct io_uring*);
 void          file_cache_destroy(struct io_uring*);
+void          file_cache_stats_dump(FILE*);
+void          file_cache_manifest_write(FILE*);
+bool          file_path_within(A3CString path, A3CString dir);
@@ -0,0 +1,397 @@
+/*
+ * SHORT CIRCUIT: FILE BLOCK -- Cache of hot blocks of large files.
+ *
+ * Copyright (c) 2021, Alex O'Brien <3541ax@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Affero General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "file_block.h"
+
+#include <assert.h>
+#include <liburing.h>
+#include <linux/stat.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/random.h>
+#include <sys/types.h>
+
+#include <a3/ll.h>
+#include <a3/log.h>
+#include <a3/str.h>
+#include <a3/util.h>
+
+#include "config.h"
+#include "event.h"
+#include "file.h"
+#include "forward.h"
+#include "mem.h"
+#include "sketch.h"
+
+// Blocks are keyed by the identity of the file version they came from, rather than by handle, so a
+// changed file never matches its old blocks, and a new handle for an unchanged file reuses them.
+typedef struct FileBlockId {
+    uint32_t dev_major;
+    uint32_t dev_minor;
+    uint64_t ino;
+    int64_t  mtime_sec;
+    uint32_t mtime_nsec;
+    uint64_t size;
+    uint64_t index;
+} FileBlockId;
+
+struct FileBlock {
+    EVENT_TARGET;
+
+    FileBlockId id;
+    uint64_t    hash;
+    size_t      refs;
+    bool        loaded;
+    bool        cached;
+
+    // The file the block is being read from. Only held until the read completes.
+    FileHandle* source;
+
+    uint8_t* data;
+    size_t   len;
+
+    struct FileBlock* next;
+    A3LL              lru_link;
+};
+
+// Everything here belongs to the lock. Blocks which are hit stay in memory on an LRU list, and a
+// block which missed is only read in if the sketch shows it to be requested more often than the
+// block it would displace.
+static pthread_mutex_t FILE_BLOCK_LOCK = PTHREAD_MUTEX_INITIALIZER;
+static FileBlock**     FILE_BLOCK_TABLE;
+static size_t          FILE_BLOCK_MASK;
+static uint64_t        FILE_BLOCK_SEED;
+static A3LL            FILE_BLOCK_LRU;
+static size_t          FILE_BLOCK_BYTES = 0;
+static Sketch          FILE_BLOCK_SKETCH;
+
+static struct {
+    size_t hits;
+    size_t misses;
+    size_t evictions;
+    size_t rejections;
+} FILE_BLOCK_STATS;
+
+static size_t file_block_capacity(void) { return FILE_BLOCK_CACHE_SIZE / FILE_BLOCK_SIZE; }
+
+void file_block_cache_init(void) {
+    size_t table_size = 16;
+    while (table_size < file_block_capacity() * 2)
+        table_size <<= 1;
+    FILE_BLOCK_MASK = table_size - 1;
+    A3_UNWRAPN(FILE_BLOCK_TABLE, calloc(table_size, sizeof(*FILE_BLOCK_TABLE)));
+    mem_account(MEM_FILE_CACHE, table_size * sizeof(*FILE_BLOCK_TABLE));
+
+    A3_UNWRAPND(getrandom(&FILE_BLOCK_SEED, sizeof(FILE_BLOCK_SEED), 0) ==
+                sizeof(FILE_BLOCK_SEED));
+    a3_ll_init(&FILE_BLOCK_LRU);
+    sketch_init(&FILE_BLOCK_SKETCH, file_block_capacity() * 4);
+}
+
+static FileBlockId file_block_id(FileHandle* file, uint64_t index) {
+    assert(file);
+
+    struct statx* stat = file_handle_stat(file);
+    return (FileBlockId) { .dev_major  = stat->stx_dev_major,
+                           .dev_minor  = stat->stx_dev_minor,
+                           .ino        = stat->stx_ino,
+                           .mtime_sec  = stat->stx_mtime.tv_sec,
+                           .mtime_nsec = stat->stx_mtime.tv_nsec,
+                           .size       = stat->stx_size,
+                           .index      = index };
+}
+
+static bool file_block_id_eq(FileBlockId const* a, FileBlockId const* b) {
+    assert(a);
+    assert(b);
+
+    return a->index == b->index && a->ino == b->ino && a->dev_major == b->dev_major &&
+           a->dev_minor == b->dev_minor && a->mtime_sec == b->mtime_sec &&
+           a->mtime_nsec == b->mtime_nsec && a->size == b->size;
+}
+
+static uint64_t file_block_mix(uint64_t hash, uint64_t value) {
+    hash ^= value;
+    hash *= 0xFF51AFD7ED558CCDULL;
+    return hash ^ (hash >> 33);
+}
+
+static uint64_t file_block_hash(FileBlockId const* id) {
+    assert(id);
+
+    uint64_t ret = file_block_mix(FILE_BLOCK_SEED, id->ino);
+    ret          = file_block_mix(ret, (uint64_t)id->dev_major << 32 | id->dev_minor);
+    ret          = file_block_mix(ret, (uint64_t)id->mtime_sec);
+    ret          = file_block_mix(ret, (uint64_t)id->mtime_nsec << 32 ^ id->size);
+    return file_block_mix(ret, id->index);
+}
+
+static FileBlock* file_block_lookup(FileBlockId const* id, uint64_t hash) {
+    assert(id);
+
+    for (FileBlock* block = FILE_BLOCK_TABLE[hash & FILE_BLOCK_MASK]; block; block = block->next)
+        if (block->hash == hash && file_block_id_eq(&block->id, id))
+            return block;
+
+    return NULL;
+}
+
+static void file_block_unref(FileBlock* block) {
+    assert(block);
+    assert(block->refs);
+
+    if (--block->refs)
+        return;
+
+    assert(!block->cached);
+    mem_unaccount(MEM_FILE_CACHE, sizeof(FileBlock) + block->len);
+    free(block->data);
+    free(block);
+}
+
+static void file_block_remove(FileBlock* block) {
+    assert(block);
+    assert(block->cached);
+
+    FileBlock** link = &FILE_BLOCK_TABLE[block->hash & FILE_BLOCK_MASK];
+    while (*link != block)
+        link = &(*link)->next;
+    *link = block->next;
+
+    a3_ll_remove(&block->lru_link);
+    block->cached = false;
+    FILE_BLOCK_BYTES -= block->len;
+    file_block_unref(block);
+}
+
+static FileBlock* file_block_lru(void) {
+    A3LL* link = a3_ll_peek(&FILE_BLOCK_LRU);
+    if (!link)
+        return NULL;
+    return A3_CONTAINER_OF(link, FileBlock, lru_link);
+}
+
+static void file_block_read_handle(EventTarget* target, struct io_uring* uring, void* ctx,
+                                   bool success, int32_t status) {
+    assert(target);
+    assert(uring);
+    (void)ctx;
+    (void)status;
+
+    FileBlock*  block  = EVT_PTR(target, FileBlock);
+    FileHandle* source = block->source;
+
+    pthread_mutex_lock(&FILE_BLOCK_LOCK);
+    block->source = NULL;
+    if (success)
+        block->loaded = true;
+    else if (block->cached)
+        file_block_remove(block);
+    file_block_unref(block);
+    pthread_mutex_unlock(&FILE_BLOCK_LOCK);
+
+    file_handle_close(source, uring);
+}
+
+// Read in a block which missed, if it is hot enough to earn the space.
+static void file_block_admit(FileHandle* file, struct io_uring* uring, FileBlockId const* id,
+                             uint64_t hash) {
+    assert(file);
+    assert(uring);
+    assert(id);
+
+    uint8_t frequency = sketch_estimate(&FILE_BLOCK_SKETCH, hash);
+    if (frequency < FILE_BLOCK_MIN_HITS)
+        return;
+
+    size_t len = (size_t)MIN(FILE_BLOCK_SIZE, id->size - id->index * FILE_BLOCK_SIZE);
+
+    // The candidate must beat every block it would displace, and is weighed against all of them
+    // before any is evicted, so that a rejection leaves the cache as it was.
+    size_t victims = 0;
+    size_t freed   = 0;
+    A3LL*  link    = a3_ll_peek(&FILE_BLOCK_LRU);
+    while (FILE_BLOCK_BYTES - freed + len > FILE_BLOCK_CACHE_SIZE) {
+        if (!link || link == &FILE_BLOCK_LRU)
+            return;
+        FileBlock* victim = A3_CONTAINER_OF(link, FileBlock, lru_link);
+        if (!sketch_admit(&FILE_BLOCK_SKETCH, hash, victim->hash)) {
+            FILE_BLOCK_STATS.rejections++;
+            return;
+        }
+        victims++;
+        freed += victim->len;
+        link = link->next;
+    }
+
+    while (victims--) {
+        FILE_BLOCK_STATS.evictions++;
+        file_block_remove(file_block_lru());
+    }
+
+    FileBlock* block = NULL;
+    A3_UNWRAPN(block, calloc(1, sizeof(FileBlock)));
+    A3_UNWRAPN(block->data, malloc(len));
+    block->id     = *id;
+    block->hash   = hash;
+    block->len    = len;
+    block->refs   = 2; // The cache's, and the read's.
+    block->cached = true;
+    block->source = file;
+    mem_account(MEM_FILE_CACHE, sizeof(FileBlock) + len);
+
+    FileBlock** bucket = &FILE_BLOCK_TABLE[hash & FILE_BLOCK_MASK];
+    block->next        = *bucket;
+    *bucket            = block;
+    a3_ll_enqueue(&FILE_BLOCK_LRU, &block->lru_link);
+    FILE_BLOCK_BYTES += len;
+
+    file_handle_ref(file);
+    if (!event_read_submit(EVT(block), uring, file_block_read_handle, NULL, file_handle_fd(file),
+                           (A3String) { .ptr = block->data, .len = len }, len,
+                           (off_t)(id->index * FILE_BLOCK_SIZE), 0)) {
+        file_block_remove(block);
+        file_block_unref(block);
+        file_handle_close(file, uring);
+    }
+}
+
+// Find the blocks which cover bytes first through last of the file, in order. If they are all in
+// memory, they are written to out with a reference held, and their number is returned. Otherwise,
+// nothing is returned, and missing blocks which are hot enough are read in for later requests.
+size_t file_block_find(FileHandle* file, struct io_uring* uring, uint64_t first, uint64_t last,
+                       FileBlock** out, size_t max) {
+    assert(file);
+    assert(uring);
+    assert(first <= last);
+    assert(out);
+
+    uint64_t first_index = first / FILE_BLOCK_SIZE;
+    uint64_t last_index  = last / FILE_BLOCK_SIZE;
+    if (last_index - first_index >= max)
+        return 0;
+
+    size_t ret      = 0;
+    bool   complete = true;
+
+    pthread_mutex_lock(&FILE_BLOCK_LOCK);
+    for (uint64_t index = first_index; index <= last_index; index++) {
+        FileBlockId id   = file_block_id(file, index);
+        uint64_t    hash = file_block_hash(&id);
+        sketch_increment(&FILE_BLOCK_SKETCH, hash);
+
+        FileBlock* block = file_block_lookup(&id, hash);
+        if (!block) {
+            complete = false;
+            file_block_admit(file, uring, &id, hash);
+            continue;
+        }
+        if (!block->loaded) {
+            complete = false;
+            continue;
+        }
+
+        a3_ll_remove(&block->lru_link);
+        a3_ll_enqueue(&FILE_BLOCK_LRU, &block->lru_link);
+        block->refs++;
+        out[ret++] = block;
+    }
+
+    if (!complete) {
+        FILE_BLOCK_STATS.misses++;
+        while (ret)
+            file_block_unref(out[--ret]);
+    } else {
+        FILE_BLOCK_STATS.hits++;
+    }
+    pthread_mutex_unlock(&FILE_BLOCK_LOCK);
+
+    return ret;
+}
+
+// The part of the block which lies within bytes first through last of the file.
+A3CString file_block_data(FileBlock* block, uint64_t first, uint64_t last) {
+    assert(block);
+    assert(block->loaded);
+
+    uint64_t start = block->id.index * FILE_BLOCK_SIZE;
+    uint64_t from  = MAX(first, start) - start;
+    uint64_t to    = MIN(last + 1, start + block->len) - start;
+    assert(from < to);
+
+    return (A3CString) { .ptr = &block->data[from], .len = (size_t)(to - from) };
+}
+
+void file_block_release(FileBlock* block) {
+    assert(block);
+
+    pthread_mutex_lock(&FILE_BLOCK_LOCK);
+    file_block_unref(block);
+    pthread_mutex_unlock(&FILE_BLOCK_LOCK);
+}
+
+// Drop the least recently used blocks until about the given number of bytes is released. Returns
+// the bytes released. Blocks still in use stay alive until they are released.
+size_t file_block_cache_trim(size_t bytes) {
+    size_t ret = 0;
+
+    pthread_mutex_lock(&FILE_BLOCK_LOCK);
+    for (FileBlock* block = file_block_lru(); block && ret < bytes; block = file_block_lru()) {
+        ret += sizeof(FileBlock) + block->len;
+        FILE_BLOCK_STATS.evictions++;
+        file_block_remove(block);
+    }
+    pthread_mutex_unlock(&FILE_BLOCK_LOCK);
+
+    if (ret)
+        A3_DEBUG_F("Trimmed %zu byte(s) of cached blocks.", ret);
+    return ret;
+}
+
+// Blocks still in use stay alive until they are released.
+void file_block_cache_shed(void) {
+    pthread_mutex_lock(&FILE_BLOCK_LOCK);
+    if (FILE_BLOCK_BYTES)
+        A3_DEBUG_F("Shedding %zu byte(s) of cached blocks.", FILE_BLOCK_BYTES);
+    for (FileBlock* block = file_block_lru(); block; block = file_block_lru())
+        file_block_remove(block);
+    pthread_mutex_unlock(&FILE_BLOCK_LOCK);
+}
+
+void file_block_cache_destroy(void) {
+    file_block_cache_shed();
+    sketch_destroy(&FILE_BLOCK_SKETCH);
+    free(FILE_BLOCK_TABLE);
+    FILE_BLOCK_TABLE = NULL;
+}
+
+void file_block_cache_stats_dump(FILE* out) {
+    assert(out);
+
+    pthread_mutex_lock(&FILE_BLOCK_LOCK);
+    fprintf(out, "Block cache:\n");
+    fprintf(out, "\t%-16s%zu of %llu\n", "bytes", FILE_BLOCK_BYTES, FILE_BLOCK_CACHE_SIZE);
+    fprintf(out, "\t%-16s%zu\n", "hits", FILE_BLOCK_STATS.hits);
+    fprintf(out, "\t%-16s%zu\n", "misses", FILE_BLOCK_STATS.misses);
+    fprintf(out, "\t%-16s%zu\n", "evictions", FILE_BLOCK_STATS.evictions);
+    fprintf(out, "\t%-16s%zu\n", "rejections", FILE_BLOCK_STATS.rejections);
+    pthread_mutex_unlock(&FILE_BLOCK_LOCK);
+}
@@ -0,0 +1,40 @@
+/*
+ * SHORT CIRCUIT: FILE BLOCK -- Cache of hot blocks of large files.
+ *
+ * Copyright (c) 2021, Alex O'Brien <3541ax@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Affero General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <liburing.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <a3/str.h>
+
+#include "file.h"
+#include "forward.h"
+
+void      file_block_cache_init(void);
+size_t    file_block_find(FileHandle*, struct io_uring*, uint64_t first, uint64_t last,
+                          FileBlock** out, size_t max);
+A3CString file_block_data(FileBlock*, uint64_t first, uint64_t last);
+void      file_block_release(FileBlock*);
+size_t    file_block_cache_trim(size_t bytes);
+void      file_block_cache_shed(void);
+void      file_block_cache_destroy(void);
+void      file_block_cache_stats_dump(FILE*);
@@ -19,24 +19,78 @@
 
 #pragma once
 
+#include <linux/openat2.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
 // Some weirdness on NixOS.
 #include <linux/stat.h>
 
-#include <a3/rc.h>
+#include <a3/ll.h>
 #include <a3/sll.h>
 #include <a3/str.h>
 
+#include "config.h"
 #include "event.h"
 #include "forward.h"
 
+typedef enum FileCacheSegment {
+    FILE_CACHE_WINDOW,
+    FILE_CACHE_PROBATION,
+    FILE_CACHE_PROTECTED,
+    FILE_CACHE_SEGMENT_COUNT
+} FileCacheSegment;
+
+// Handles are shared by every thread. Fields read on the hit path are atomic, and everything else
+// is written under the cache lock, or before the handle is published.
 typedef struct FileHandle {
-    A3_REFCOUNTED;
+    atomic_size_t refs;
     EVENT_TARGET;
     EventQueue waiting;
 
+    // Waiters which only need the stat are woken as soon as it is known, before the open.
     struct statx stat;
+    EventQueue   stat_waiting;
+    atomic_bool  stat_known;
+
+    A3CString       path;
+    _Atomic(fd)     file;
+    int32_t         flags;
+    struct open_how how;
+
+    // What the stat and open are resolved beneath, held until the open completes.
+    struct FileRoot*   root;
+    struct FileHandle* dir;
+
+    _Atomic(struct FileHandle*) child;
+
+    A3SLink  close_link;
+    uint64_t retired;
+    bool     pooled;
+
+    A3LL             lru_link;
+    FileCacheSegment segment;
+    uint64_t         hash;
+    atomic_bool      cached;
+
+    // Revalidation state, used when the cache has a TTL.
+    _Atomic(time_t) fresh_until;
+    atomic_bool     revalidating;
+    struct statx    revalidate_stat;
+
+    // The contents of a small file, read in once it proves hot. Published once the read completes,
+    // and freed with the handle.
+    _Atomic(uint8_t*) content;
+    size_t            content_len;
+    atomic_bool       content_wanted;
+    atomic_bool       content_loading;
 
-    A3CString path;
-    fd        file;
-    int32_t   flags;
+    // Response headers which depend only on the file, built on first use by whoever claims them,
+    // and published by the release of their length.
+    uint8_t       headers[FILE_HANDLE_HEADERS_MAX];
+    atomic_size_t headers_len;
+    atomic_bool   headers_claimed;
 } FileHandle;
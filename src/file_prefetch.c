@@ -0,0 +1,386 @@
+/*
+ * SHORT CIRCUIT: FILE PREFETCH -- Warm the files HTML pages link to.
+ *
+ * Copyright (c) 2021, Alex O'Brien <3541ax@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Affero General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "file_prefetch.h"
+
+#include <assert.h>
+#include <fcntl.h>
+#include <liburing.h>
+#include <linux/stat.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/random.h>
+#include <time.h>
+
+#include <a3/ll.h>
+#include <a3/log.h>
+#include <a3/str.h>
+#include <a3/util.h>
+
+#include "clock.h"
+#include "config.h"
+#include "event.h"
+#include "file.h"
+#include "forward.h"
+#include "html.h"
+#include "mem.h"
+
+// Like cached blocks, the links of a page are keyed by the identity of the file version they were
+// found in, so a changed page is scanned again, and an unchanged one is not, even after its handle
+// has left the cache.
+typedef struct FilePrefetchId {
+    uint32_t dev_major;
+    uint32_t dev_minor;
+    uint64_t ino;
+    int64_t  mtime_sec;
+    uint32_t mtime_nsec;
+    uint64_t size;
+} FilePrefetchId;
+
+typedef struct FilePrefetchPage {
+    EVENT_TARGET;
+
+    FilePrefetchId id;
+    uint64_t       hash;
+    size_t         refs;
+    bool           cached;
+    bool           scanned;
+    bool           queued;
+    time_t         warm_after;
+
+    // The page and its head, while it is being read.
+    FileHandle* source;
+    uint8_t*    buf;
+    size_t      buf_len;
+
+    A3String links[FILE_PREFETCH_LINKS_MAX];
+    size_t   n_links;
+    size_t   links_len;
+    size_t   next_link;
+
+    struct FilePrefetchPage* next;
+    A3LL                     fifo_link;
+    A3LL                     queue_link;
+} FilePrefetchPage;
+
+// Pages waiting to have their links opened. At most FILE_PREFETCH_BATCH opens are in flight, and
+// each one which completes submits the next, so warming never competes with requests for the ring.
+typedef struct FilePrefetch {
+    EVENT_TARGET;
+
+    A3LL        queue;
+    size_t      in_flight;
+    FileHandle* slots[FILE_PREFETCH_BATCH];
+} FilePrefetch;
+
+// Everything here belongs to the lock. Pages are dropped in the order they were scanned.
+static pthread_mutex_t    FILE_PREFETCH_LOCK = PTHREAD_MUTEX_INITIALIZER;
+static FilePrefetchPage** FILE_PREFETCH_TABLE;
+static size_t             FILE_PREFETCH_MASK;
+static uint64_t           FILE_PREFETCH_SEED;
+static A3LL               FILE_PREFETCH_FIFO;
+static size_t             FILE_PREFETCH_PAGES = 0;
+static FilePrefetch       PREFETCH;
+
+void file_prefetch_init(void) {
+    size_t table_size = 16;
+    while (table_size < FILE_PREFETCH_PAGES_MAX * 2)
+        table_size <<= 1;
+    FILE_PREFETCH_MASK = table_size - 1;
+    A3_UNWRAPN(FILE_PREFETCH_TABLE, calloc(table_size, sizeof(*FILE_PREFETCH_TABLE)));
+    mem_account(MEM_FILE_CACHE, table_size * sizeof(*FILE_PREFETCH_TABLE));
+
+    A3_UNWRAPND(getrandom(&FILE_PREFETCH_SEED, sizeof(FILE_PREFETCH_SEED), 0) ==
+                sizeof(FILE_PREFETCH_SEED));
+    a3_ll_init(&FILE_PREFETCH_FIFO);
+    a3_ll_init(&PREFETCH.queue);
+}
+
+static FilePrefetchId file_prefetch_id(FileHandle* file) {
+    assert(file);
+
+    struct statx* stat = file_handle_stat(file);
+    return (FilePrefetchId) { .dev_major  = stat->stx_dev_major,
+                              .dev_minor  = stat->stx_dev_minor,
+                              .ino        = stat->stx_ino,
+                              .mtime_sec  = stat->stx_mtime.tv_sec,
+                              .mtime_nsec = stat->stx_mtime.tv_nsec,
+                              .size       = stat->stx_size };
+}
+
+static bool file_prefetch_id_eq(FilePrefetchId const* a, FilePrefetchId const* b) {
+    assert(a);
+    assert(b);
+
+    return a->ino == b->ino && a->dev_major == b->dev_major && a->dev_minor == b->dev_minor &&
+           a->mtime_sec == b->mtime_sec && a->mtime_nsec == b->mtime_nsec && a->size == b->size;
+}
+
+static uint64_t file_prefetch_mix(uint64_t hash, uint64_t value) {
+    hash ^= value;
+    hash *= 0xFF51AFD7ED558CCDULL;
+    return hash ^ (hash >> 33);
+}
+
+static uint64_t file_prefetch_hash(FilePrefetchId const* id) {
+    assert(id);
+
+    uint64_t ret = file_prefetch_mix(FILE_PREFETCH_SEED, id->ino);
+    ret          = file_prefetch_mix(ret, (uint64_t)id->dev_major << 32 | id->dev_minor);
+    ret          = file_prefetch_mix(ret, (uint64_t)id->mtime_sec);
+    return file_prefetch_mix(ret, (uint64_t)id->mtime_nsec << 32 ^ id->size);
+}
+
+static FilePrefetchPage* file_prefetch_lookup(FilePrefetchId const* id, uint64_t hash) {
+    assert(id);
+
+    for (FilePrefetchPage* page = FILE_PREFETCH_TABLE[hash & FILE_PREFETCH_MASK]; page;
+         page                   = page->next)
+        if (page->hash == hash && file_prefetch_id_eq(&page->id, id))
+            return page;
+
+    return NULL;
+}
+
+static void file_prefetch_unref(FilePrefetchPage* page) {
+    assert(page);
+    assert(page->refs);
+
+    if (--page->refs)
+        return;
+
+    assert(!page->cached && !page->queued);
+    for (size_t i = 0; i < page->n_links; i++)
+        a3_string_free(&page->links[i]);
+    mem_unaccount(MEM_FILE_CACHE, sizeof(FilePrefetchPage) + page->links_len);
+    free(page);
+}
+
+static void file_prefetch_remove(FilePrefetchPage* page) {
+    assert(page);
+    assert(page->cached);
+
+    FilePrefetchPage** link = &FILE_PREFETCH_TABLE[page->hash & FILE_PREFETCH_MASK];
+    while (*link != page)
+        link = &(*link)->next;
+    *link = page->next;
+
+    a3_ll_remove(&page->fifo_link);
+    page->cached = false;
+    FILE_PREFETCH_PAGES--;
+    file_prefetch_unref(page);
+}
+
+static void file_prefetch_dequeue(FilePrefetchPage* page) {
+    assert(page);
+    assert(page->queued);
+
+    a3_ll_remove(&page->queue_link);
+    page->queued = false;
+    file_prefetch_unref(page);
+}
+
+static void file_prefetch_enqueue(FilePrefetchPage* page) {
+    assert(page);
+    assert(page->scanned);
+
+    if (page->queued || !page->n_links || clock_monotonic().tv_sec < page->warm_after)
+        return;
+
+    page->queued     = true;
+    page->next_link  = 0;
+    page->warm_after = clock_monotonic().tv_sec + FILE_PREFETCH_INTERVAL;
+    page->refs++;
+    a3_ll_enqueue(&PREFETCH.queue, &page->queue_link);
+}
+
+static void file_prefetch_submit(struct io_uring*);
+
+static void file_prefetch_open_handle(EventTarget* target, struct io_uring* uring, void* ctx,
+                                      bool success, int32_t status) {
+    assert(target == EVT(&PREFETCH));
+    assert(uring);
+    assert(ctx);
+    (void)status;
+
+    FileHandle** slot = ctx;
+    FileHandle*  file = *slot;
+
+    pthread_mutex_lock(&FILE_PREFETCH_LOCK);
+    *slot = NULL;
+    PREFETCH.in_flight--;
+    pthread_mutex_unlock(&FILE_PREFETCH_LOCK);
+
+    // Small files which have been requested before are read into memory as well.
+    if (success)
+        file_handle_content(file, uring);
+    file_handle_close(file, uring);
+
+    file_prefetch_submit(uring);
+}
+
+// Open the next links which are not yet cached. Pages are given up on under memory pressure.
+static void file_prefetch_submit(struct io_uring* uring) {
+    assert(uring);
+
+    pthread_mutex_lock(&FILE_PREFETCH_LOCK);
+    while (PREFETCH.in_flight < FILE_PREFETCH_BATCH) {
+        A3LL* link = a3_ll_peek(&PREFETCH.queue);
+        if (!link)
+            break;
+
+        FilePrefetchPage* page = A3_CONTAINER_OF(link, FilePrefetchPage, queue_link);
+        if (page->next_link >= page->n_links || mem_pressure() != MEM_PRESSURE_NONE) {
+            file_prefetch_dequeue(page);
+            continue;
+        }
+
+        A3CString path = A3_S_CONST(page->links[page->next_link++]);
+        if (file_cache_contains(path))
+            continue;
+
+        size_t slot = 0;
+        while (PREFETCH.slots[slot])
+            slot++;
+
+        A3_TRACE_F("Prefetching " A3_S_F ".", A3_S_FORMAT(path));
+        FileHandle* file = file_open_speculative(EVT(&PREFETCH), uring, file_prefetch_open_handle,
+                                                 &PREFETCH.slots[slot], path, O_RDONLY);
+        if (!file)
+            continue;
+        if (!file_handle_waiting(file)) {
+            file_handle_close(file, uring);
+            continue;
+        }
+
+        PREFETCH.slots[slot] = file;
+        PREFETCH.in_flight++;
+    }
+    pthread_mutex_unlock(&FILE_PREFETCH_LOCK);
+}
+
+static void file_prefetch_read_handle(EventTarget* target, struct io_uring* uring, void* ctx,
+                                      bool success, int32_t status) {
+    assert(target);
+    assert(uring);
+    (void)ctx;
+    (void)status;
+
+    FilePrefetchPage* page   = EVT_PTR(target, FilePrefetchPage);
+    FileHandle*       source = page->source;
+
+    // Until it is marked as scanned, the page's links belong to this handler.
+    A3CString html = { .ptr = page->buf, .len = success ? page->buf_len : 0 };
+    page->n_links  = html_links_scan(html, file_handle_path(source), page->links,
+                                     FILE_PREFETCH_LINKS_MAX);
+    for (size_t i = 0; i < page->n_links; i++)
+        page->links_len += page->links[i].len;
+    A3_TRACE_F("Found %zu link(s) in " A3_S_F ".", page->n_links,
+               A3_S_FORMAT(file_handle_path(source)));
+
+    mem_unaccount(MEM_FILE_CACHE, page->buf_len);
+    mem_account(MEM_FILE_CACHE, page->links_len);
+    free(page->buf);
+    page->buf    = NULL;
+    page->source = NULL;
+
+    pthread_mutex_lock(&FILE_PREFETCH_LOCK);
+    page->scanned = true;
+    if (page->cached)
+        file_prefetch_enqueue(page);
+    file_prefetch_unref(page);
+    pthread_mutex_unlock(&FILE_PREFETCH_LOCK);
+
+    file_handle_close(source, uring);
+    file_prefetch_submit(uring);
+}
+
+// Called when an HTML page is served. The first time a version of the page is seen, its head is
+// read and scanned for links in the background. The files it links to are then opened, if they are
+// not already cached, and again at most every FILE_PREFETCH_INTERVAL seconds.
+void file_prefetch_page(FileHandle* file, struct io_uring* uring) {
+    assert(file);
+    assert(uring);
+
+    FilePrefetchId id   = file_prefetch_id(file);
+    uint64_t       hash = file_prefetch_hash(&id);
+    if (!id.size)
+        return;
+
+    pthread_mutex_lock(&FILE_PREFETCH_LOCK);
+    FilePrefetchPage* page = file_prefetch_lookup(&id, hash);
+    if (page) {
+        if (page->scanned)
+            file_prefetch_enqueue(page);
+        pthread_mutex_unlock(&FILE_PREFETCH_LOCK);
+        file_prefetch_submit(uring);
+        return;
+    }
+
+    while (FILE_PREFETCH_PAGES >= FILE_PREFETCH_PAGES_MAX)
+        file_prefetch_remove(
+            A3_CONTAINER_OF(a3_ll_peek(&FILE_PREFETCH_FIFO), FilePrefetchPage, fifo_link));
+
+    A3_UNWRAPN(page, calloc(1, sizeof(FilePrefetchPage)));
+    page->id      = id;
+    page->hash    = hash;
+    page->refs    = 2; // The table's, and the read's.
+    page->cached  = true;
+    page->source  = file;
+    page->buf_len = (size_t)MIN(id.size, FILE_PREFETCH_SCAN_MAX);
+    A3_UNWRAPN(page->buf, malloc(page->buf_len));
+    mem_account(MEM_FILE_CACHE, sizeof(FilePrefetchPage) + page->buf_len);
+
+    FilePrefetchPage** bucket = &FILE_PREFETCH_TABLE[hash & FILE_PREFETCH_MASK];
+    page->next                = *bucket;
+    *bucket                   = page;
+    a3_ll_enqueue(&FILE_PREFETCH_FIFO, &page->fifo_link);
+    FILE_PREFETCH_PAGES++;
+
+    file_handle_ref(file);
+    if (!event_read_submit(EVT(page), uring, file_prefetch_read_handle, NULL, file_handle_fd(file),
+                           (A3String) { .ptr = page->buf, .len = page->buf_len }, page->buf_len,
+                           0, 0)) {
+        mem_unaccount(MEM_FILE_CACHE, page->buf_len);
+        free(page->buf);
+        file_prefetch_remove(page);
+        file_prefetch_unref(page);
+        file_handle_close(file, uring);
+    }
+    pthread_mutex_unlock(&FILE_PREFETCH_LOCK);
+}
+
+// Pages still being read, or with opens in flight, are left to the exit.
+void file_prefetch_destroy(void) {
+    if (!FILE_PREFETCH_TABLE)
+        return;
+
+    pthread_mutex_lock(&FILE_PREFETCH_LOCK);
+    for (A3LL* link = a3_ll_peek(&PREFETCH.queue); link; link = a3_ll_peek(&PREFETCH.queue))
+        file_prefetch_dequeue(A3_CONTAINER_OF(link, FilePrefetchPage, queue_link));
+    for (A3LL* link = a3_ll_peek(&FILE_PREFETCH_FIFO); link; link = a3_ll_peek(&FILE_PREFETCH_FIFO))
+        file_prefetch_remove(A3_CONTAINER_OF(link, FilePrefetchPage, fifo_link));
+    pthread_mutex_unlock(&FILE_PREFETCH_LOCK);
+
+    free(FILE_PREFETCH_TABLE);
+    FILE_PREFETCH_TABLE = NULL;
+}
@@ -0,0 +1,254 @@
+/*
+ * SHORT CIRCUIT: FILE TREE -- Index of the names under the web root.
+ *
+ * Copyright (c) 2021, Alex O'Brien <3541ax@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Affero General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "file_tree.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <a3/ht.h>
+#include <a3/log.h>
+#include <a3/str.h>
+#include <a3/util.h>
+
+#include "config.h"
+#include "file.h"
+#include "mem.h"
+
+// Every name under the web root, relative to it, as the file cache keys them. The tree is built
+// by the watcher as it walks the root, and kept current from inotify events, so a name which is
+// not in it does not exist. Only the watcher writes to it, but any thread may look up.
+typedef struct FileTreeEntry {
+    A3String     path;
+    FileTreeKind kind;
+} FileTreeEntry;
+
+typedef FileTreeEntry* FileTreeEntryPtr;
+
+A3_HT_DEFINE_STRUCTS(A3CString, FileTreeEntryPtr)
+A3_HT_DECLARE_METHODS(A3CString, FileTreeEntryPtr)
+A3_HT_DEFINE_METHODS(A3CString, FileTreeEntryPtr, a3_string_cptr, a3_string_len, a3_string_cmp)
+
+static struct {
+    pthread_rwlock_t lock;
+    A3_HT(A3CString, FileTreeEntryPtr) entries;
+    size_t n_entries;
+    bool   initialized;
+    // Lookups only answer once a complete walk has been indexed, and until the tree is cleared.
+    bool ready;
+    bool full;
+} TREE = { .lock = PTHREAD_RWLOCK_INITIALIZER };
+
+void file_tree_init(void) {
+    assert(!TREE.initialized);
+
+    A3_HT_INIT(A3CString, FileTreeEntryPtr)(&TREE.entries, A3_HT_NO_HASH_KEY, A3_HT_ALLOW_GROWTH);
+    TREE.initialized = true;
+}
+
+static void file_tree_entry_free(FileTreeEntry* entry) {
+    assert(entry);
+
+    mem_unaccount(MEM_FILE_CACHE, sizeof(FileTreeEntry) + entry->path.len);
+    a3_string_free(&entry->path);
+    free(entry);
+}
+
+static void file_tree_delete(FileTreeEntry* entry) {
+    assert(entry);
+
+    A3_HT_DELETE(A3CString, FileTreeEntryPtr)(&TREE.entries, A3_S_CONST(entry->path));
+    TREE.n_entries--;
+    file_tree_entry_free(entry);
+}
+
+// Remove every entry below path, and path itself if self is set. A path of "." covers the root.
+static void file_tree_delete_within(A3CString path, bool self) {
+    assert(path.ptr);
+
+    FileTreeEntry** victims   = NULL;
+    size_t          n_victims = 0;
+    A3_UNWRAPN(victims, calloc(MAX(TREE.n_entries, 1), sizeof(*victims)));
+
+    A3_HT_FOR_EACH(A3CString, FileTreeEntryPtr, &TREE.entries, key, value) {
+        if (file_path_within(*key, path) && (self || a3_string_cmp(*key, path) != 0))
+            victims[n_victims++] = *value;
+    }
+
+    for (size_t i = 0; i < n_victims; i++)
+        file_tree_delete(victims[i]);
+    free(victims);
+}
+
+void file_tree_add(A3CString path, FileTreeKind kind) {
+    assert(path.ptr && path.len);
+    assert(kind != FILE_TREE_ABSENT);
+
+    pthread_rwlock_wrlock(&TREE.lock);
+    if (!TREE.initialized || TREE.full)
+        goto done;
+
+    FileTreeEntry** existing = A3_HT_FIND(A3CString, FileTreeEntryPtr)(&TREE.entries, path);
+    if (existing) {
+        // A directory replaced by something else takes its children with it.
+        if ((*existing)->kind == FILE_TREE_DIR && kind != FILE_TREE_DIR)
+            file_tree_delete_within(path, false);
+        (*existing)->kind = kind;
+        goto done;
+    }
+
+    // A partial tree would answer that names it has not seen yet are missing.
+    if (TREE.n_entries >= FILE_TREE_ENTRIES_MAX) {
+        A3_WARN("The web root has too many files to index. Missing files will be looked up.");
+        file_tree_delete_within(A3_CS("."), true);
+        TREE.ready = false;
+        TREE.full  = true;
+        goto done;
+    }
+
+    FileTreeEntry* entry = NULL;
+    A3_UNWRAPN(entry, calloc(1, sizeof(FileTreeEntry)));
+    entry->path = a3_string_clone(path);
+    entry->kind = kind;
+    mem_account(MEM_FILE_CACHE, sizeof(FileTreeEntry) + entry->path.len);
+
+    A3_HT_INSERT(A3CString, FileTreeEntryPtr)(&TREE.entries, A3_S_CONST(entry->path), entry);
+    TREE.n_entries++;
+
+done:
+    pthread_rwlock_unlock(&TREE.lock);
+}
+
+// Remove a name which has left the tree, along with everything below it.
+void file_tree_remove(A3CString path) {
+    assert(path.ptr && path.len);
+
+    pthread_rwlock_wrlock(&TREE.lock);
+    if (!TREE.initialized)
+        goto done;
+
+    FileTreeEntry** entry = A3_HT_FIND(A3CString, FileTreeEntryPtr)(&TREE.entries, path);
+    if (entry && (*entry)->kind != FILE_TREE_DIR)
+        file_tree_delete(*entry);
+    else if (entry)
+        file_tree_delete_within(path, true);
+
+done:
+    pthread_rwlock_unlock(&TREE.lock);
+}
+
+// Forget everything, when events may have been lost. Lookups are not answered until the root has
+// been walked again.
+void file_tree_clear(void) {
+    pthread_rwlock_wrlock(&TREE.lock);
+    if (TREE.initialized)
+        file_tree_delete_within(A3_CS("."), true);
+    TREE.ready = false;
+    TREE.full  = false;
+    pthread_rwlock_unlock(&TREE.lock);
+}
+
+void file_tree_ready(void) {
+    pthread_rwlock_wrlock(&TREE.lock);
+    TREE.ready = TREE.initialized && !TREE.full;
+    pthread_rwlock_unlock(&TREE.lock);
+}
+
+// Only paths in the form produced by uri_path_relative, without empty or dot segments, are
+// answered. Anything else is left to the kernel.
+static bool file_tree_path_is_clean(A3CString path) {
+    assert(path.ptr);
+
+    if (a3_string_cmp(path, A3_CS(".")) == 0)
+        return true;
+
+    for (size_t start = 0, end; start <= path.len; start = end + 1) {
+        for (end = start; end < path.len && path.ptr[end] != '/'; end++)
+            ;
+
+        size_t len = end - start;
+        if (!len || (len == 1 && path.ptr[start] == '.') ||
+            (len == 2 && path.ptr[start] == '.' && path.ptr[start + 1] == '.'))
+            return false;
+    }
+
+    return true;
+}
+
+static A3CString file_tree_parent(A3CString path) {
+    assert(path.ptr && path.len);
+
+    for (size_t i = path.len; i > 0; i--) {
+        if (path.ptr[i - 1] == '/')
+            return (A3CString) { .ptr = path.ptr, .len = i - 1 };
+    }
+
+    return A3_CS(".");
+}
+
+static FileTreeKind file_tree_find_locked(A3CString path) {
+    assert(path.ptr);
+
+    // A trailing slash only resolves to a directory.
+    bool dir = false;
+    if (path.len > 1 && path.ptr[path.len - 1] == '/') {
+        path.len--;
+        dir = true;
+    }
+    if (!path.len || !file_tree_path_is_clean(path))
+        return FILE_TREE_UNKNOWN;
+
+    FileTreeEntry** entry = A3_HT_FIND(A3CString, FileTreeEntryPtr)(&TREE.entries, path);
+    if (entry)
+        return dir && (*entry)->kind == FILE_TREE_FILE ? FILE_TREE_ABSENT : (*entry)->kind;
+
+    // A missing name is only known to be absent if the nearest ancestor which is present is a
+    // directory or a file, rather than, say, a link which might point anywhere.
+    while (a3_string_cmp(path, A3_CS(".")) != 0) {
+        path  = file_tree_parent(path);
+        entry = A3_HT_FIND(A3CString, FileTreeEntryPtr)(&TREE.entries, path);
+        if (entry)
+            return (*entry)->kind == FILE_TREE_UNKNOWN ? FILE_TREE_UNKNOWN : FILE_TREE_ABSENT;
+    }
+
+    return FILE_TREE_UNKNOWN;
+}
+
+FileTreeKind file_tree_find(A3CString path) {
+    assert(path.ptr);
+
+    pthread_rwlock_rdlock(&TREE.lock);
+    FileTreeKind ret = TREE.ready ? file_tree_find_locked(path) : FILE_TREE_UNKNOWN;
+    pthread_rwlock_unlock(&TREE.lock);
+
+    return ret;
+}
+
+void file_tree_destroy(void) {
+    if (!TREE.initialized)
+        return;
+
+    file_tree_clear();
+    A3_HT_DESTROY(A3CString, FileTreeEntryPtr)(&TREE.entries);
+    TREE.initialized = false;
+}
@@ -0,0 +1,39 @@
+/*
+ * SHORT CIRCUIT: FILE TREE -- Index of the names under the web root.
+ *
+ * Copyright (c) 2021, Alex O'Brien <3541ax@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Affero General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <a3/str.h>
+
+// FILE_TREE_UNKNOWN is also used for names which exist, but which only the kernel can resolve,
+// such as symbolic links.
+typedef enum FileTreeKind {
+    FILE_TREE_UNKNOWN,
+    FILE_TREE_ABSENT,
+    FILE_TREE_FILE,
+    FILE_TREE_DIR,
+} FileTreeKind;
+
+void         file_tree_init(void);
+void         file_tree_add(A3CString path, FileTreeKind);
+void         file_tree_remove(A3CString path);
+void         file_tree_clear(void);
+void         file_tree_ready(void);
+FileTreeKind file_tree_find(A3CString path);
+void         file_tree_destroy(void);
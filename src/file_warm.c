@@ -0,0 +1,267 @@
+/*
+ * SHORT CIRCUIT: FILE WARM -- Populate the file cache at startup.
+ *
+ * Copyright (c) 2021, Alex O'Brien <3541ax@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Affero General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+#define _GNU_SOURCE
+
+#include "file_warm.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <liburing.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include <a3/log.h>
+#include <a3/str.h>
+#include <a3/util.h>
+
+#include "clock.h"
+#include "config.h"
+#include "config_runtime.h"
+#include "event.h"
+#include "file.h"
+#include "forward.h"
+#include "mem.h"
+#include "uri.h"
+
+// Paths to warm, hottest first. Up to FILE_WARM_BATCH opens are in flight at once, and each one
+// which completes submits the next, until the paths, the time, or the memory budget run out.
+// Paths from a manifest were hot in the last process, so their contents are read in as well.
+typedef struct FileWarm {
+    EVENT_TARGET;
+
+    A3CString   root;
+    A3String*   paths;
+    bool        from_manifest;
+    size_t      n_paths;
+    size_t      next;
+    size_t      in_flight;
+    size_t      warmed;
+    time_t      deadline;
+    FileHandle* slots[FILE_WARM_BATCH];
+} FileWarm;
+
+static FileWarm WARM;
+
+// Warming more files than can stay open would only evict the first ones.
+static size_t file_warm_limit(void) { return MIN(CONFIG.cache_entries, CONFIG.cache_fds); }
+
+static bool file_warm_add(A3CString path) {
+    assert(path.ptr);
+
+    if (WARM.n_paths >= file_warm_limit())
+        return false;
+
+    WARM.paths[WARM.n_paths++] = a3_string_clone(path);
+    return true;
+}
+
+static int file_warm_walk_cb(const char* path, const struct stat* s, int type, struct FTW* ftw) {
+    (void)ftw;
+
+    if (type != FTW_F || !S_ISREG(s->st_mode))
+        return 0;
+    clock_refresh();
+    if (clock_monotonic().tv_sec >= WARM.deadline)
+        return 1;
+
+    size_t skip = WARM.root.len + (WARM.root.ptr[WARM.root.len - 1] != '/');
+    return !file_warm_add(a3_cstring_from(&path[skip]));
+}
+
+// With no manifest, there is nothing to say which files are hot, so take them in directory order.
+static void file_warm_walk(void) {
+    if (nftw(a3_string_cstr(WARM.root), file_warm_walk_cb, FILE_WATCH_FD_MAX, FTW_PHYS) < 0)
+        A3_ERRNO_F(errno, "Unable to walk " A3_S_F ".", A3_S_FORMAT(WARM.root));
+}
+
+// The manifest holds one path per line, relative to the web root. Lines are used as cache keys, so
+// any which a request could not have produced are skipped. Returns false if there is no manifest.
+static bool file_warm_read(A3CString manifest) {
+    assert(manifest.ptr);
+
+    FILE* in = fopen(a3_string_cstr(manifest), "r");
+    if (!in) {
+        if (errno != ENOENT)
+            A3_ERRNO_F(errno, "Unable to read " A3_S_F ".", A3_S_FORMAT(manifest));
+        return false;
+    }
+
+    char*   line     = NULL;
+    size_t  line_cap = 0;
+    ssize_t len      = 0;
+    while ((len = getline(&line, &line_cap, in)) > 0) {
+        if (line[len - 1] == '\n')
+            line[--len] = '\0';
+        A3CString path = { .ptr = (uint8_t*)line, .len = (size_t)len };
+        if (!uri_path_is_canonical(path)) {
+            A3_WARN_F("Skipping non-canonical path " A3_S_F " in manifest.", A3_S_FORMAT(path));
+            continue;
+        }
+        if (!file_warm_add(path))
+            break;
+    }
+
+    free(line);
+    fclose(in);
+    return true;
+}
+
+static void file_warm_done(struct io_uring* uring) {
+    assert(uring);
+
+    A3_DEBUG_F("Warmed %zu of %zu file(s).", WARM.warmed, WARM.n_paths);
+    file_warm_destroy(uring);
+}
+
+static void file_warm_opened(FileHandle* handle, struct io_uring* uring) {
+    assert(handle);
+    assert(uring);
+
+    WARM.warmed++;
+    if (WARM.from_manifest)
+        file_handle_content_warm(handle, uring);
+}
+
+static void file_warm_submit(struct io_uring*);
+
+static void file_warm_handle(EventTarget* target, struct io_uring* uring, void* ctx, bool success,
+                             int32_t status) {
+    assert(target == EVT(&WARM));
+    assert(uring);
+    assert(ctx);
+    (void)status;
+
+    // The warm-up was abandoned at shutdown, and the handle already closed.
+    FileHandle** slot = ctx;
+    if (!*slot)
+        return;
+
+    if (success)
+        file_warm_opened(*slot, uring);
+    file_handle_close(*slot, uring);
+    *slot = NULL;
+    WARM.in_flight--;
+
+    file_warm_submit(uring);
+}
+
+static void file_warm_submit(struct io_uring* uring) {
+    assert(uring);
+
+    while (WARM.in_flight < FILE_WARM_BATCH && WARM.next < WARM.n_paths) {
+        if (clock_monotonic().tv_sec >= WARM.deadline || mem_pressure() != MEM_PRESSURE_NONE) {
+            A3_WARN("File cache warm-up is over budget. Stopping early.");
+            WARM.next = WARM.n_paths;
+            break;
+        }
+
+        size_t slot = 0;
+        while (WARM.slots[slot])
+            slot++;
+
+        FileHandle* handle =
+            file_open(EVT(&WARM), uring, file_warm_handle, &WARM.slots[slot],
+                      A3_S_CONST(WARM.paths[WARM.next++]), O_RDONLY);
+        if (!handle)
+            continue;
+
+        if (!file_handle_waiting(handle)) {
+            if (file_handle_fd_unchecked(handle) >= 0)
+                file_warm_opened(handle, uring);
+            file_handle_close(handle, uring);
+            continue;
+        }
+
+        WARM.slots[slot] = handle;
+        WARM.in_flight++;
+    }
+
+    if (WARM.paths && !WARM.in_flight && WARM.next >= WARM.n_paths)
+        file_warm_done(uring);
+}
+
+void file_warm_init(struct io_uring* uring, A3CString root, A3CString manifest) {
+    assert(uring);
+    assert(root.ptr);
+    assert(manifest.ptr);
+
+    clock_refresh();
+    WARM.root     = root;
+    WARM.deadline = clock_monotonic().tv_sec + FILE_WARM_TIME;
+    A3_UNWRAPN(WARM.paths, calloc(file_warm_limit(), sizeof(*WARM.paths)));
+
+    WARM.from_manifest = file_warm_read(manifest);
+    if (!WARM.from_manifest)
+        file_warm_walk();
+
+    A3_DEBUG_F("Warming %zu file(s).", WARM.n_paths);
+    file_warm_submit(uring);
+}
+
+// Record the hottest cached files for the next process to warm. The manifest is replaced
+// atomically, so a crash while writing leaves the previous one.
+void file_warm_save(A3CString manifest) {
+    assert(manifest.ptr);
+
+    A3String tmp = a3_string_alloc(manifest.len + 4);
+    a3_string_concat(tmp, 2, manifest, A3_CS(".tmp"));
+
+    FILE* out = fopen(a3_string_cstr(tmp), "w");
+    if (!out) {
+        A3_ERRNO_F(errno, "Unable to write " A3_S_F ".", A3_S_FORMAT(tmp));
+        a3_string_free(&tmp);
+        return;
+    }
+
+    file_cache_manifest_write(out);
+    if (fclose(out) != 0 ||
+        rename(a3_string_cstr(tmp), a3_string_cstr(manifest)) < 0)
+        A3_ERRNO_F(errno, "Unable to write " A3_S_F ".", A3_S_FORMAT(manifest));
+
+    a3_string_free(&tmp);
+}
+
+// Whether the warm-up is still running.
+bool file_warm_pending(void) { return WARM.paths != NULL; }
+
+void file_warm_destroy(struct io_uring* uring) {
+    assert(uring);
+
+    for (size_t i = 0; i < FILE_WARM_BATCH; i++) {
+        if (WARM.slots[i])
+            file_handle_close(WARM.slots[i], uring);
+        WARM.slots[i] = NULL;
+    }
+    WARM.in_flight = 0;
+
+    for (size_t i = 0; i < WARM.n_paths; i++)
+        a3_string_free(&WARM.paths[i]);
+    free(WARM.paths);
+    WARM.paths   = NULL;
+    WARM.n_paths = 0;
+    WARM.next    = 0;
+}
@@ -0,0 +1,471 @@
+/*
+ * SHORT CIRCUIT: FILE WATCH -- Keep the file cache coherent with the web root.
+ *
+ * Copyright (c) 2021, Alex O'Brien <3541ax@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Affero General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+#define _GNU_SOURCE
+
+#include "file_watch.h"
+
+#include <assert.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <liburing.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <a3/log.h>
+#include <a3/str.h>
+#include <a3/util.h>
+
+#include "config.h"
+#include "event.h"
+#include "file.h"
+#include "file_tree.h"
+#include "forward.h"
+
+#define FILE_WATCH_MASK                                                                            \
+    (IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_DELETE_SELF | IN_MODIFY |            \
+     IN_MOVE_SELF | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR)
+
+// Every directory under the web root carries a watch. Events name the changed entry relative to
+// its directory, so the directory path for each watch descriptor is kept here. Like the keys of the
+// file cache, these are relative to the root.
+typedef struct FileWatch {
+    EVENT_TARGET;
+
+    A3CString root;
+    fd        inotify;
+    A3String* dirs;
+    size_t    dirs_cap;
+
+    // When the root is given as a link, its directory is watched as well, so that pointing the link
+    // at another directory can be noticed.
+    int       link_wd;
+    A3CString link_name;
+    bool      link_moved;
+
+    // Directories still to be walked, as absolute paths. A walk of the whole root is done
+    // FILE_WATCH_WALK_BATCH entries at a time, between passes of the event loop, and the index is
+    // not ready until it is done, so lookups go to the kernel meanwhile.
+    A3String* walk;
+    size_t    walk_len;
+    size_t    walk_cap;
+    bool      walk_full;
+    bool      walk_scheduled;
+
+    _Alignas(struct inotify_event) uint8_t buf[FILE_WATCH_BUF_SIZE];
+} FileWatch;
+
+static FileWatch WATCH = { .inotify = -1, .link_wd = -1 };
+
+static A3String file_watch_join(A3CString dir, A3CString name) {
+    assert(dir.ptr);
+    assert(name.ptr);
+
+    if (a3_string_cmp(dir, A3_CS(".")) == 0)
+        return a3_string_clone(name);
+
+    A3String ret = a3_string_alloc(dir.len + name.len + 1);
+    a3_string_concat(ret, 3, dir, A3_CS("/"), name);
+    return ret;
+}
+
+static A3CString file_watch_relative(A3CString path) {
+    assert(path.ptr);
+    assert(path.len >= WATCH.root.len);
+
+    if (path.len == WATCH.root.len)
+        return A3_CS(".");
+
+    size_t skip = WATCH.root.len + (WATCH.root.ptr[WATCH.root.len - 1] != '/');
+    return (A3CString) { .ptr = &path.ptr[skip], .len = path.len - skip };
+}
+
+static FileTreeKind file_watch_kind(mode_t mode) {
+    return S_ISREG(mode) ? FILE_TREE_FILE : FILE_TREE_UNKNOWN;
+}
+
+static void file_watch_dir_add(A3CString path) {
+    assert(path.ptr);
+
+    A3CString relative = file_watch_relative(path);
+
+    int wd = inotify_add_watch(WATCH.inotify, a3_string_cstr(path), FILE_WATCH_MASK);
+    if (wd < 0) {
+        // Without a watch, changes below this directory go unnoticed until eviction, and the index
+        // cannot say what is missing from it.
+        A3_ERRNO_F(errno, "Unable to watch " A3_S_F ".", A3_S_FORMAT(path));
+        file_tree_add(relative, FILE_TREE_UNKNOWN);
+        return;
+    }
+
+    if ((size_t)wd >= WATCH.dirs_cap) {
+        size_t new_cap = MAX(WATCH.dirs_cap * 2, (size_t)wd + 1);
+        A3_UNWRAPN(WATCH.dirs, realloc(WATCH.dirs, new_cap * sizeof(*WATCH.dirs)));
+        memset(&WATCH.dirs[WATCH.dirs_cap], 0, (new_cap - WATCH.dirs_cap) * sizeof(*WATCH.dirs));
+        WATCH.dirs_cap = new_cap;
+    }
+
+    // Watching a directory twice yields the same descriptor.
+    if (WATCH.dirs[wd].ptr)
+        a3_string_free(&WATCH.dirs[wd]);
+    WATCH.dirs[wd] = a3_string_clone(relative);
+    file_tree_add(relative, FILE_TREE_DIR);
+}
+
+static void file_watch_walk_push(A3String path) {
+    assert(path.ptr);
+
+    if (WATCH.walk_len == WATCH.walk_cap) {
+        WATCH.walk_cap = MAX(WATCH.walk_cap * 2, 64);
+        A3_UNWRAPN(WATCH.walk, realloc(WATCH.walk, WATCH.walk_cap * sizeof(*WATCH.walk)));
+    }
+    WATCH.walk[WATCH.walk_len++] = path;
+}
+
+static void file_watch_walk_clear(void) {
+    while (WATCH.walk_len)
+        a3_string_free(&WATCH.walk[--WATCH.walk_len]);
+}
+
+static FileTreeKind file_watch_entry_kind(DIR* dir, struct dirent* entry) {
+    assert(dir);
+    assert(entry);
+
+    switch (entry->d_type) {
+    case DT_DIR:
+        return FILE_TREE_DIR;
+    case DT_REG:
+        return FILE_TREE_FILE;
+    case DT_UNKNOWN: {
+        struct stat s;
+        if (fstatat(dirfd(dir), entry->d_name, &s, AT_SYMLINK_NOFOLLOW) < 0)
+            return FILE_TREE_UNKNOWN;
+        return S_ISDIR(s.st_mode) ? FILE_TREE_DIR : file_watch_kind(s.st_mode);
+    }
+    default:
+        return FILE_TREE_UNKNOWN;
+    }
+}
+
+// Watch the next directories on the stack, and index their entries, until about budget entries
+// have been seen. The walk also fills the index of the web root. Directories which cannot be read
+// are left for the kernel to resolve, as are links. Returns true if the walk is not over.
+static bool file_watch_walk_step(size_t budget) {
+    while (WATCH.walk_len && budget) {
+        A3String path = WATCH.walk[--WATCH.walk_len];
+        file_watch_dir_add(A3_S_CONST(path));
+
+        DIR* dir = opendir(a3_string_cstr(A3_S_CONST(path)));
+        if (!dir) {
+            A3_ERRNO_F(errno, "Unable to walk " A3_S_F ".", A3_S_FORMAT(path));
+            file_tree_add(file_watch_relative(A3_S_CONST(path)), FILE_TREE_UNKNOWN);
+            a3_string_free(&path);
+            continue;
+        }
+
+        bool           slash = path.ptr[path.len - 1] == '/';
+        struct dirent* entry;
+        while ((entry = readdir(dir))) {
+            A3CString name = a3_cstring_from(entry->d_name);
+            if (a3_string_cmp(name, A3_CS(".")) == 0 || a3_string_cmp(name, A3_CS("..")) == 0)
+                continue;
+
+            A3String child = a3_string_alloc(path.len + !slash + name.len);
+            a3_string_concat(child, 3, path, slash ? A3_CS("") : A3_CS("/"), name);
+
+            FileTreeKind kind = file_watch_entry_kind(dir, entry);
+            if (kind == FILE_TREE_DIR) {
+                file_watch_walk_push(child);
+            } else {
+                file_tree_add(file_watch_relative(A3_S_CONST(child)), kind);
+                a3_string_free(&child);
+            }
+            if (budget)
+                budget--;
+        }
+
+        closedir(dir);
+        a3_string_free(&path);
+    }
+
+    if (WATCH.walk_len)
+        return true;
+
+    if (WATCH.walk_full) {
+        WATCH.walk_full = false;
+        file_tree_ready();
+    }
+    return false;
+}
+
+// Walk a directory which has appeared under the root. It is done at once, so that the index
+// knows its contents before the next lookup, unless a walk of the whole root is under way.
+static void file_watch_walk(A3CString path) {
+    assert(path.ptr);
+
+    file_watch_walk_push(a3_string_clone(path));
+    if (!WATCH.walk_full)
+        file_watch_walk_step(SIZE_MAX);
+}
+
+static void file_watch_walk_schedule(struct io_uring*);
+
+static void file_watch_walk_handle(EventTarget* target, struct io_uring* uring, void* ctx,
+                                   bool success, int32_t status) {
+    assert(target == EVT(&WATCH));
+    assert(uring);
+    (void)ctx;
+    (void)success;
+    (void)status;
+
+    WATCH.walk_scheduled = false;
+    if (file_watch_walk_step(FILE_WATCH_WALK_BATCH))
+        file_watch_walk_schedule(uring);
+}
+
+// Continue the walk once the event loop has handled whatever else is ready.
+static void file_watch_walk_schedule(struct io_uring* uring) {
+    assert(uring);
+
+    static Timespec NOW = { .tv_sec = 0, .tv_nsec = 0 };
+
+    if (WATCH.walk_scheduled)
+        return;
+    if (!event_timeout_submit(EVT(&WATCH), uring, file_watch_walk_handle, NULL, &NOW, 0)) {
+        A3_WARN("Unable to schedule the walk of the web root. Finishing it now.");
+        file_watch_walk_step(SIZE_MAX);
+        return;
+    }
+    WATCH.walk_scheduled = true;
+}
+
+// Index the whole root again, from nothing. Lookups go to the kernel until the walk is done.
+static void file_watch_walk_full(struct io_uring* uring) {
+    file_watch_walk_clear();
+    file_tree_clear();
+    WATCH.walk_full = true;
+    file_watch_walk_push(a3_string_clone(WATCH.root));
+
+    if (uring)
+        file_watch_walk_schedule(uring);
+    else
+        file_watch_walk_step(SIZE_MAX);
+}
+
+// Stop watching a directory which has left the tree, along with everything below it.
+static void file_watch_forget(A3CString path) {
+    assert(path.ptr);
+
+    for (size_t wd = 0; wd < WATCH.dirs_cap; wd++) {
+        if (!WATCH.dirs[wd].ptr || !file_path_within(A3_S_CONST(WATCH.dirs[wd]), path))
+            continue;
+
+        inotify_rm_watch(WATCH.inotify, (int)wd);
+        a3_string_free(&WATCH.dirs[wd]);
+    }
+}
+
+static void file_watch_event(struct inotify_event* event, struct io_uring* uring) {
+    assert(event);
+    assert(uring);
+
+    if (event->mask & IN_Q_OVERFLOW) {
+        A3_WARN("inotify queue overflowed. Dropping the file cache and reindexing the web root.");
+        file_cache_shed(uring);
+        file_watch_walk_full(uring);
+        // A change to the link may have been lost as well.
+        WATCH.link_moved = WATCH.link_wd >= 0;
+        return;
+    }
+
+    if (event->wd == WATCH.link_wd) {
+        if (event->len && a3_string_cmp(a3_cstring_from(event->name), WATCH.link_name) == 0)
+            WATCH.link_moved = true;
+        return;
+    }
+
+    if (event->wd < 0 || (size_t)event->wd >= WATCH.dirs_cap || !WATCH.dirs[event->wd].ptr)
+        return;
+    A3CString dir = A3_S_CONST(WATCH.dirs[event->wd]);
+
+    if (event->mask & IN_IGNORED) {
+        a3_string_free(&WATCH.dirs[event->wd]);
+        return;
+    }
+
+    if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) {
+        file_tree_remove(dir);
+        file_cache_invalidate(dir, true, uring);
+        A3String path = a3_string_clone(dir);
+        file_watch_forget(A3_S_CONST(path));
+        a3_string_free(&path);
+        return;
+    }
+
+    if (!event->len)
+        return;
+
+    A3String path = file_watch_join(dir, a3_cstring_from(event->name));
+
+    A3_TRACE_F("Change to " A3_S_F ".", A3_S_FORMAT(path));
+    bool is_dir = event->mask & IN_ISDIR;
+    file_cache_invalidate(A3_S_CONST(path), is_dir, uring);
+
+    if (event->mask & (IN_DELETE | IN_MOVED_FROM))
+        file_tree_remove(A3_S_CONST(path));
+
+    if (is_dir && (event->mask & IN_MOVED_FROM))
+        file_watch_forget(A3_S_CONST(path));
+    else if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+        A3String absolute = file_watch_join(WATCH.root, A3_S_CONST(path));
+        struct stat s;
+        if (is_dir)
+            file_watch_walk(A3_S_CONST(absolute));
+        else if (lstat(a3_string_cstr(A3_S_CONST(absolute)), &s) == 0)
+            file_tree_add(A3_S_CONST(path), S_ISDIR(s.st_mode) ? FILE_TREE_UNKNOWN
+                                                               : file_watch_kind(s.st_mode));
+        a3_string_free(&absolute);
+    }
+
+    a3_string_free(&path);
+}
+
+static bool file_watch_read_submit(struct io_uring*);
+
+static void file_watch_read_handle(EventTarget* target, struct io_uring* uring, void* ctx,
+                                   bool success, int32_t status) {
+    assert(target == EVT(&WATCH));
+    assert(uring);
+    (void)ctx;
+    (void)success;
+
+    // Reads of inotify descriptors are rarely full, so any positive status is data.
+    if (status < 0 && status != -EINTR) {
+        A3_ERRNO(-status, "Unable to read file change events. Dropping the file cache.");
+        file_cache_shed(uring);
+        return;
+    }
+
+    for (size_t offset = 0; status > 0 && offset < (size_t)status;) {
+        struct inotify_event* event = (struct inotify_event*)&WATCH.buf[offset];
+        offset += sizeof(*event) + event->len;
+        file_watch_event(event, uring);
+    }
+
+    if (!file_watch_read_submit(uring))
+        A3_ERROR("Unable to resubmit inotify read. The file cache may become stale.");
+}
+
+static bool file_watch_read_submit(struct io_uring* uring) {
+    assert(uring);
+
+    return event_read_submit(EVT(&WATCH), uring, file_watch_read_handle, NULL, WATCH.inotify,
+                             (A3String) { .ptr = WATCH.buf, .len = sizeof(WATCH.buf) },
+                             sizeof(WATCH.buf), 0, 0);
+}
+
+// Only a link in the last component of the path is watched.
+static void file_watch_link_add(A3CString link) {
+    assert(link.ptr);
+
+    struct stat s;
+    if (lstat(a3_string_cstr(link), &s) < 0 || !S_ISLNK(s.st_mode))
+        return;
+
+    size_t dir_len = link.len;
+    while (dir_len && link.ptr[dir_len - 1] != '/')
+        dir_len--;
+    A3CString parent = dir_len ? (A3CString) { .ptr = link.ptr, .len = MAX(dir_len - 1, 1) }
+                               : A3_CS(".");
+    A3String  dir    = a3_string_clone(parent);
+    WATCH.link_name = (A3CString) { .ptr = &link.ptr[dir_len], .len = link.len - dir_len };
+
+    WATCH.link_wd = inotify_add_watch(WATCH.inotify, a3_string_cstr(A3_S_CONST(dir)),
+                                      IN_CREATE | IN_MOVED_TO | IN_ONLYDIR);
+    if (WATCH.link_wd < 0)
+        A3_ERRNO_F(errno, "Unable to watch " A3_S_F ". Changes to the web root need SIGHUP.",
+                   A3_S_FORMAT(dir));
+    a3_string_free(&dir);
+}
+
+void file_watch_init(struct io_uring* uring, A3CString root, A3CString link) {
+    assert(uring);
+    assert(root.ptr);
+    assert(link.ptr);
+
+    // Blocking, so that the ring waits for events rather than failing with EAGAIN.
+    WATCH.root = root;
+    A3_UNWRAPS(WATCH.inotify, inotify_init1(IN_CLOEXEC));
+    file_tree_init();
+    file_watch_walk_full(NULL);
+    file_watch_link_add(link);
+
+    A3_UNWRAPND(file_watch_read_submit(uring));
+}
+
+// Returns true once after the link to the web root has changed.
+bool file_watch_link_moved(void) {
+    bool ret         = WATCH.link_moved;
+    WATCH.link_moved = false;
+    return ret;
+}
+
+// Watch and index another root in place of the current one, in batches. Events already queued for
+// the old watches are ignored.
+void file_watch_root_switch(A3CString root, struct io_uring* uring) {
+    assert(root.ptr);
+    assert(uring);
+
+    for (size_t wd = 0; wd < WATCH.dirs_cap; wd++) {
+        if (!WATCH.dirs[wd].ptr)
+            continue;
+
+        inotify_rm_watch(WATCH.inotify, (int)wd);
+        a3_string_free(&WATCH.dirs[wd]);
+    }
+
+    WATCH.root = root;
+    file_watch_walk_full(uring);
+}
+
+void file_watch_destroy(void) {
+    file_tree_destroy();
+
+    file_watch_walk_clear();
+    free(WATCH.walk);
+    WATCH.walk     = NULL;
+    WATCH.walk_cap = 0;
+
+    for (size_t wd = 0; wd < WATCH.dirs_cap; wd++)
+        if (WATCH.dirs[wd].ptr)
+            a3_string_free(&WATCH.dirs[wd]);
+    free(WATCH.dirs);
+    WATCH.dirs     = NULL;
+    WATCH.dirs_cap = 0;
+
+    if (WATCH.inotify >= 0)
+        close(WATCH.inotify);
+    WATCH.inotify = -1;
+}
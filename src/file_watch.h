@@ -0,0 +1,30 @@
+/*
+ * SHORT CIRCUIT: FILE WATCH -- Keep the file cache coherent with the web root.
+ *
+ * Copyright (c) 2021, Alex O'Brien <3541ax@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Affero General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <liburing.h>
+#include <stdbool.h>
+
+#include <a3/str.h>
+
+void file_watch_init(struct io_uring*, A3CString root, A3CString link);
+bool file_watch_link_moved(void);
+void file_watch_root_switch(A3CString root, struct io_uring*);
+void file_watch_destroy(void);
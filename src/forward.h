@@ -39,6 +39,10 @@ typedef struct Event Event;
 typedef struct A3SLL EventQueue;
 typedef struct A3SLL EventTarget;
 
+// file_block.h
+struct FileBlock;
+typedef struct FileBlock FileBlock;
+
 // http_connection.h
 struct HttpConnection;
 typedef struct HttpConnection HttpConnection;
@@ -0,0 +1,214 @@
+/*
+ * SHORT CIRCUIT: HTML -- Subresource links in HTML documents.
+ *
+ * Copyright (c) 2021, Alex O'Brien <3541ax@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Affero General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "html.h"
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <a3/str.h>
+#include <a3/util.h>
+
+#include "uri.h"
+
+// Attributes naming files which a browser fetches as soon as it parses the tag. Links only count
+// for some relations, since most name other pages.
+static const struct {
+    A3CString tag;
+    A3CString attr;
+} HTML_LINK_ATTRS[] = {
+    { A3_CS("img"), A3_CS("src") },
+    { A3_CS("link"), A3_CS("href") },
+    { A3_CS("script"), A3_CS("src") },
+};
+
+static const A3CString HTML_LINK_RELS[] = { A3_CS("icon"), A3_CS("modulepreload"),
+                                            A3_CS("preload"), A3_CS("stylesheet") };
+
+static bool html_space(uint8_t c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\f';
+}
+
+static bool html_name_char(uint8_t c) {
+    return !html_space(c) && c != '=' && c != '>' && c != '/' && c != '"' && c != '\'';
+}
+
+static A3CString html_slice(A3CString html, size_t start, size_t end) {
+    return (A3CString) { .ptr = &html.ptr[start], .len = end - start };
+}
+
+static size_t html_find(A3CString html, size_t start, A3CString needle) {
+    for (size_t i = start; i + needle.len <= html.len; i++)
+        if (a3_string_cmpi(html_slice(html, i, i + needle.len), needle) == 0)
+            return i;
+
+    return html.len;
+}
+
+static bool html_rel_wanted(A3CString rel) {
+    for (size_t start = 0, end = 0; start < rel.len; start = end + 1) {
+        for (end = start; end < rel.len && !html_space(rel.ptr[end]); end++)
+            ;
+
+        A3CString token = html_slice(rel, start, end);
+        for (size_t i = 0; i < sizeof(HTML_LINK_RELS) / sizeof(*HTML_LINK_RELS); i++)
+            if (a3_string_cmpi(token, HTML_LINK_RELS[i]) == 0)
+                return true;
+    }
+
+    return false;
+}
+
+// Resolve a reference against the page, and add the path it names, relative to the web root.
+// References to other origins, and ones which cannot be resolved, are skipped.
+static size_t html_link_add(A3CString ref, A3CString page, A3String* out, size_t n, size_t max) {
+    assert(ref.ptr);
+    assert(page.ptr);
+    assert(out);
+
+    while (ref.len && html_space(*ref.ptr)) {
+        ref.ptr++;
+        ref.len--;
+    }
+    while (ref.len && html_space(ref.ptr[ref.len - 1]))
+        ref.len--;
+    if (!ref.len || n >= max || *ref.ptr == '#' || (ref.len >= 2 && !memcmp(ref.ptr, "//", 2)))
+        return n;
+
+    for (size_t i = 0; i < ref.len && !strchr("/?#", ref.ptr[i]); i++)
+        if (ref.ptr[i] == ':')
+            return n;
+
+    bool      absolute = *ref.ptr == '/';
+    A3CString prefix   = absolute ? A3_CS("") : A3_CS("/");
+    A3CString dir      = { .ptr = page.ptr, .len = absolute ? 0 : page.len };
+    while (dir.len && dir.ptr[dir.len - 1] != '/')
+        dir.len--;
+
+    A3String joined = a3_string_alloc(prefix.len + dir.len + ref.len);
+    a3_string_concat(joined, 3, prefix, dir, ref);
+
+    Uri      uri;
+    A3String path = A3_S_NULL;
+    if (uri_parse(&uri, joined) == URI_PARSE_SUCCESS && uri.scheme == URI_SCHEME_UNSPECIFIED) {
+        A3String buf = a3_string_alloc(uri.path.len + 1);
+        if (!(path = uri_path_relative(&uri, buf)).ptr)
+            a3_string_free(&buf);
+    }
+    a3_string_free(&joined);
+
+    if (!path.ptr)
+        return n;
+    bool duplicate = a3_string_cmp(path, A3_CS(".")) == 0;
+    for (size_t i = 0; i < n && !duplicate; i++)
+        duplicate = a3_string_cmp(out[i], path) == 0;
+    if (duplicate) {
+        a3_string_free(&path);
+        return n;
+    }
+
+    out[n] = path;
+    return n + 1;
+}
+
+// Find the files an HTML document loads along with itself, such as its stylesheets, scripts, and
+// images. Relative references are resolved against page, the document's own path relative to the
+// web root. Up to max paths are written to out, and the number written is returned. The caller
+// owns the paths.
+size_t html_links_scan(A3CString html, A3CString page, A3String* out, size_t max) {
+    assert(html.ptr || !html.len);
+    assert(page.ptr);
+    assert(out);
+
+    size_t n = 0;
+    for (size_t i = 0; i < html.len && n < max;) {
+        if (html.ptr[i++] != '<')
+            continue;
+
+        if (html.len - i >= 3 && !memcmp(&html.ptr[i], "!--", 3)) {
+            i = html_find(html, i + 3, A3_CS("-->"));
+            continue;
+        }
+
+        size_t tag_start = i;
+        while (i < html.len && html_name_char(html.ptr[i]))
+            i++;
+        A3CString tag = html_slice(html, tag_start, i);
+
+        A3CString link = A3_CS_NULL;
+        A3CString rel  = A3_CS_NULL;
+        while (i < html.len && html.ptr[i] != '>') {
+            if (!html_name_char(html.ptr[i])) {
+                i++;
+                continue;
+            }
+
+            size_t name_start = i;
+            while (i < html.len && html_name_char(html.ptr[i]))
+                i++;
+            A3CString name = html_slice(html, name_start, i);
+
+            while (i < html.len && html_space(html.ptr[i]))
+                i++;
+            if (i >= html.len || html.ptr[i] != '=')
+                continue;
+            for (i++; i < html.len && html_space(html.ptr[i]); i++)
+                ;
+
+            A3CString value;
+            if (i < html.len && (html.ptr[i] == '"' || html.ptr[i] == '\'')) {
+                uint8_t quote = html.ptr[i++];
+                size_t  start = i;
+                while (i < html.len && html.ptr[i] != quote)
+                    i++;
+                value = html_slice(html, start, i);
+                i     = MIN(i + 1, html.len);
+            } else {
+                size_t start = i;
+                while (i < html.len && !html_space(html.ptr[i]) && html.ptr[i] != '>')
+                    i++;
+                value = html_slice(html, start, i);
+            }
+
+            if (a3_string_cmpi(name, A3_CS("rel")) == 0)
+                rel = value;
+            for (size_t j = 0; j < sizeof(HTML_LINK_ATTRS) / sizeof(*HTML_LINK_ATTRS); j++)
+                if (a3_string_cmpi(tag, HTML_LINK_ATTRS[j].tag) == 0 &&
+                    a3_string_cmpi(name, HTML_LINK_ATTRS[j].attr) == 0)
+                    link = value;
+        }
+
+        // A tag cut off by the end of the input may be missing its relation.
+        if (i >= html.len)
+            break;
+        if (link.ptr && (a3_string_cmpi(tag, A3_CS("link")) != 0 || html_rel_wanted(rel)))
+            n = html_link_add(link, page, out, n, max);
+
+        // Scripts and styles are not markup, so nothing in them is a tag.
+        if (a3_string_cmpi(tag, A3_CS("script")) == 0)
+            i = html_find(html, i, A3_CS("</script"));
+        else if (a3_string_cmpi(tag, A3_CS("style")) == 0)
+            i = html_find(html, i, A3_CS("</style"));
+    }
+
+    return n;
+}
@@ -36,6 +36,7 @@
 #include "file.h"
 #include "forward.h"
 #include "http/types.h"
+#include "mem.h"
 
 static A3Pool* HTTP_CONNECTION_POOL = NULL;
 
@@ -46,6 +47,7 @@ static void connection_pool_free_cb(void* slot) {
     if (conn->conn.pipe[0] || conn->conn.pipe[1]) {
         close(conn->conn.pipe[0]);
         close(conn->conn.pipe[1]);
+        mem_unaccount(MEM_PIPES, PIPE_BUF_SIZE);
     }
 }
 
@@ -56,6 +58,8 @@ void http_connection_pool_init() {
 
 HttpConnection* http_connection_new() {
     HttpConnection* ret = a3_pool_alloc_block(HTTP_CONNECTION_POOL);
+    if (ret)
+        mem_account(MEM_CONNECTIONS, sizeof(HttpConnection));
 
     if (ret && !http_connection_init(ret))
         http_connection_free(ret, NULL);
@@ -85,12 +89,9 @@ void http_connection_free(HttpConnection* conn, struct io_uring* uring) {
     }
 
     http_connection_reset(conn, uring);
+    connection_destroy(&conn->conn);
 
-    if (a3_buf_initialized(&conn->conn.recv_buf))
-        a3_buf_destroy(&conn->conn.recv_buf);
-    if (a3_buf_initialized(&conn->conn.send_buf))
-        a3_buf_destroy(&conn->conn.send_buf);
-
+    mem_unaccount(MEM_CONNECTIONS, sizeof(HttpConnection));
     a3_pool_free_block(HTTP_CONNECTION_POOL, conn);
 }
 
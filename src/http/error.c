@@ -0,0 +1,196 @@
+/*
+ * SHORT CIRCUIT: HTTP ERROR -- Pre-rendered error responses.
+ *
+ * Copyright (c) 2021, Alex O'Brien <3541ax@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Affero General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "http/error.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <a3/log.h>
+#include <a3/str.h>
+#include <a3/util.h>
+
+#include "clock.h"
+#include "config.h"
+#include "config_runtime.h"
+#include "http/serialize.h"
+#include "http/types.h"
+#include "mem.h"
+
+// A complete response, with a placeholder where the Date goes. It never changes once rendered.
+typedef struct HttpErrorResponse {
+    uint8_t* data;
+    size_t   len;
+    size_t   head_len;
+    size_t   date_offset;
+} HttpErrorResponse;
+
+static HttpErrorResponse HTTP_ERROR_RESPONSES[HTTP_VERSION_COUNT][HTTP_STATUS_COUNT][2];
+static A3String          HTTP_ERROR_PAGES[HTTP_STATUS_COUNT];
+
+static bool http_error_status_is_error(HttpStatus status) {
+    return status > HTTP_STATUS_INVALID && status < HTTP_STATUS_COUNT &&
+           http_status_code(status) >= 400;
+}
+
+// Load <code>.html from the web root, if it exists.
+static A3String http_error_page_load(HttpStatus status) {
+    char path[PATH_MAX];
+    int  len = snprintf(path, sizeof(path), A3_S_F "/%u.html", A3_S_FORMAT(CONFIG.web_root),
+                        http_status_code(status));
+    if (len < 0 || (size_t)len >= sizeof(path))
+        return A3_S_NULL;
+
+    int file = open(path, O_RDONLY | O_CLOEXEC);
+    if (file < 0) {
+        if (errno != ENOENT)
+            A3_WARN_F("Unable to open error page %s.", path);
+        return A3_S_NULL;
+    }
+
+    A3String    ret = A3_S_NULL;
+    struct stat st;
+    if (fstat(file, &st) < 0 || !S_ISREG(st.st_mode) || !st.st_size ||
+        (size_t)st.st_size > HTTP_ERROR_PAGE_MAX_LENGTH) {
+        A3_WARN_F("Ignoring error page %s.", path);
+        goto done;
+    }
+
+    ret = a3_string_alloc((size_t)st.st_size);
+    for (size_t pos = 0; pos < ret.len;) {
+        ssize_t rc = read(file, &ret.ptr[pos], ret.len - pos);
+        if (rc <= 0) {
+            if (rc < 0 && errno == EINTR)
+                continue;
+            A3_WARN_F("Unable to read error page %s.", path);
+            a3_string_free(&ret);
+            goto done;
+        }
+        pos += (size_t)rc;
+    }
+    A3_DEBUG_F("Loaded error page %s.", path);
+
+done:
+    close(file);
+    return ret;
+}
+
+static A3CString http_error_default_body(HttpStatus status, HttpVersion version,
+                                         uint8_t body[HTTP_ERROR_BODY_MAX_LENGTH]) {
+    uint16_t status_code = http_status_code(status);
+
+    // TODO: De-uglify. Probably should load a template from somewhere.
+    int len = snprintf((char*)body, HTTP_ERROR_BODY_MAX_LENGTH,
+                       "<!DOCTYPE html>\n"
+                       "<html>\n"
+                       "<head>\n"
+                       "<title>Error: %d</title>\n"
+                       "</head>\n"
+                       "<body>\n"
+                       "<h1>%s Error %d</h1>\n"
+                       "<p>%s.</p>\n"
+                       "</body>\n"
+                       "</html>\n",
+                       status_code, http_version_string(version).ptr, status_code,
+                       http_status_reason(status).ptr);
+    A3_UNWRAPND(len > 0 && len < HTTP_ERROR_BODY_MAX_LENGTH);
+
+    return (A3CString) { .ptr = body, .len = (size_t)len };
+}
+
+static void http_error_render(HttpErrorResponse* resp, HttpStatus status, HttpVersion version,
+                              bool close) {
+    assert(resp);
+
+    uint8_t   default_body[HTTP_ERROR_BODY_MAX_LENGTH];
+    A3CString body = HTTP_ERROR_PAGES[status].ptr
+                         ? A3_S_CONST(HTTP_ERROR_PAGES[status])
+                         : http_error_default_body(status, version, default_body);
+
+    // The date is a placeholder of the right length, replaced in each copy of the head.
+    uint8_t          date[CLOCK_IMF_FIXDATE_LENGTH];
+    HttpResponseHead head = { .version        = version,
+                              .status         = status,
+                              .keep_alive     = !close,
+                              .content_type   = HTTP_CONTENT_TYPE_TEXT_HTML,
+                              .content_length = (ssize_t)body.len,
+                              .date           = { .ptr = date, .len = sizeof(date) },
+                              .extra          = A3_CS_NULL };
+    memset(date, ' ', sizeof(date));
+
+    resp->head_len    = http_serialize_head_len(&head);
+    resp->len         = resp->head_len + body.len;
+    resp->date_offset = http_serialize_date_offset(&head);
+    A3_UNWRAPN(resp->data, malloc(resp->len));
+    mem_account(MEM_BUFFERS, resp->len);
+
+    http_serialize_head_to(resp->data, &head);
+    memcpy(&resp->data[resp->head_len], body.ptr, body.len);
+}
+
+// Render every error response, so that sending one only takes a copy of its head.
+void http_error_init() {
+    for (HttpStatus status = HTTP_STATUS_INVALID + 1; status < HTTP_STATUS_COUNT; status++)
+        if (http_error_status_is_error(status))
+            HTTP_ERROR_PAGES[status] = http_error_page_load(status);
+
+    for (HttpVersion version = HTTP_VERSION_INVALID + 1; version < HTTP_VERSION_UNKNOWN;
+         version++) {
+        for (HttpStatus status = HTTP_STATUS_INVALID + 1; status < HTTP_STATUS_COUNT; status++) {
+            if (!http_error_status_is_error(status))
+                continue;
+            for (size_t close = 0; close < 2; close++)
+                http_error_render(&HTTP_ERROR_RESPONSES[version][status][close], status, version,
+                                  close);
+        }
+    }
+}
+
+// Write the head of the response for an error, with the current date, and get its body. The
+// body is shared by every send of the response, so it must not be written to.
+bool http_error_response(A3Buffer* out, HttpStatus status, HttpVersion version, bool close,
+                         bool head, A3CString* body) {
+    assert(out);
+    assert(http_error_status_is_error(status));
+    assert(version > HTTP_VERSION_INVALID && version < HTTP_VERSION_UNKNOWN);
+    assert(body);
+
+    HttpErrorResponse const* resp = &HTTP_ERROR_RESPONSES[version][status][close];
+    assert(resp->data);
+
+    A3CString date = clock_date();
+    A3_TRYB(a3_buf_write_str(out, (A3CString) { .ptr = resp->data, .len = resp->date_offset }));
+    A3_TRYB(a3_buf_write_str(out, date));
+    A3_TRYB(a3_buf_write_str(out, (A3CString) { .ptr = &resp->data[resp->date_offset + date.len],
+                                                .len = resp->head_len - resp->date_offset -
+                                                       date.len }));
+
+    *body = (A3CString) { .ptr = &resp->data[resp->head_len],
+                          .len = head ? 0 : resp->len - resp->head_len };
+    return true;
+}
@@ -0,0 +1,31 @@
+/*
+ * SHORT CIRCUIT: HTTP ERROR -- Pre-rendered error responses.
+ *
+ * Copyright (c) 2021, Alex O'Brien <3541ax@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Affero General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+
+#include <a3/buffer.h>
+#include <a3/str.h>
+
+#include "http/types.h"
+
+void http_error_init(void);
+bool http_error_response(A3Buffer* out, HttpStatus, HttpVersion, bool close, bool head,
+                         A3CString* body);
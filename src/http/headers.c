@@ -18,13 +18,46 @@
  */
 
 #include "http/headers.h"
-#include "http/types.h"
+
+#include <assert.h>
+#include <limits.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/random.h>
+#include <sys/types.h>
+#include <time.h>
 
 #include <a3/ht.h>
 #include <a3/str.h>
+#include <a3/util.h>
+
+#include "clock.h"
+#include "config.h"
+#include "http/types.h"
+#include "mem.h"
+
+// Fields are stored as 16-bit offsets into the receive buffer.
+_Static_assert(RECV_BUF_MAX_CAPACITY <= UINT16_MAX, "Receive buffer too large for header offsets.");
+_Static_assert(HTTP_REQUEST_HEADER_FIELDS_MAX < UINT16_MAX, "Too many header fields.");
+
+// Key comparisons made by this thread's generic tables. Unlike timings, these are deterministic,
+// so tests can check that names chosen to collide cost no more than any others.
+static A3_THREAD_LOCAL size_t HTTP_HEADERS_COMPARISONS = 0;
+
+static int http_headers_key_cmp(A3CString a, A3CString b) {
+    HTTP_HEADERS_COMPARISONS++;
+    return a3_string_cmp(a, b);
+}
 
 A3_HT_DECLARE_METHODS(A3CString, A3String)
-A3_HT_DEFINE_METHODS(A3CString, A3String, a3_string_cptr, a3_string_len, a3_string_cmp)
+A3_HT_DEFINE_METHODS(A3CString, A3String, a3_string_cptr, a3_string_len, http_headers_key_cmp)
+
+// Keyed so that clients can't choose names which collide in the generic table.
+static uint8_t HTTP_HEADERS_HASH_KEY[A3_HT_HASH_KEY_SIZE];
+
+#define _HEADER(H, N) [H] = A3_CS(N),
+static const A3CString HTTP_HEADER_KNOWN_NAMES[] = { HTTP_HEADER_KNOWN_ENUM };
+#undef _HEADER
 
 static bool http_headers_combine(A3String* current_value, A3String new_value) {
     assert(current_value);
@@ -39,56 +72,286 @@ static bool http_headers_combine(A3String* current_value, A3String new_value) {
     return true;
 }
 
+static A3CString http_header_field_name(HttpHeaders* headers, HttpHeaderField* field) {
+    assert(headers);
+    assert(headers->base);
+    assert(field);
+
+    return (A3CString) { .ptr = headers->base + field->name, .len = field->name_len };
+}
+
+static A3CString http_header_field_value(HttpHeaders* headers, HttpHeaderField* field) {
+    assert(headers);
+    assert(headers->base);
+    assert(field);
+
+    return (A3CString) { .ptr = headers->base + field->value, .len = field->value_len };
+}
+
+void http_headers_key_init() {
+    A3_UNWRAPND(getrandom(HTTP_HEADERS_HASH_KEY, sizeof(HTTP_HEADERS_HASH_KEY), 0) ==
+                (ssize_t)sizeof(HTTP_HEADERS_HASH_KEY));
+}
+
+// Use a fixed key, so tests can compare how the same names are placed under different keys.
+void http_headers_key_set(const uint8_t key[A3_HT_HASH_KEY_SIZE]) {
+    assert(key);
+
+    memcpy(HTTP_HEADERS_HASH_KEY, key, sizeof(HTTP_HEADERS_HASH_KEY));
+}
+
+size_t http_headers_comparisons() { return HTTP_HEADERS_COMPARISONS; }
+
 void http_headers_init(HttpHeaders* headers) {
     assert(headers);
 
-    A3_HT_INIT(A3CString, A3String)(&headers->headers, A3_HT_NO_HASH_KEY, A3_HT_ALLOW_GROWTH);
-    A3_HT_SET_DUPLICATE_CB(A3CString, A3String)(&headers->headers, http_headers_combine);
+    memset(headers, 0, sizeof(*headers));
 }
 
 void http_headers_destroy(HttpHeaders* headers) {
     assert(headers);
 
-    A3_HT_FOR_EACH(A3CString, A3String, &headers->headers, key, value) {
-        a3_string_free((A3String*)key);
-        a3_string_free((A3String*)value);
+    for (size_t i = 0; i < HTTP_HEADER_KNOWN_COUNT; i++)
+        if (headers->combined[i].ptr)
+            a3_string_free(&headers->combined[i]);
+
+    if (headers->table_built) {
+        A3_HT_FOR_EACH(A3CString, A3String, &headers->table, key, value) {
+            a3_string_free((A3String*)key);
+            a3_string_free((A3String*)value);
+        }
+
+        A3_HT_DESTROY(A3CString, A3String)(&headers->table);
+        headers->table_built = false;
     }
 
-    A3_HT_DESTROY(A3CString, A3String)(&headers->headers);
+    mem_unaccount(MEM_HEADERS, headers->accounted);
+    headers->accounted = 0;
 }
 
+// Field offsets are relative to the start of the header block, which stays at the head of the
+// receive buffer until the whole block has arrived. The buffer may move when it grows, so this
+// must be called with the current position of the block before fields are added or read.
+void http_headers_rebase(HttpHeaders* headers, const uint8_t* base) {
+    assert(headers);
+    assert(base);
+
+    headers->base = base;
+}
+
+// Recognize a known header name with a perfect hash on its length and first and last bytes. The
+// function was chosen so the known names (and some likely future ones) do not collide.
+HttpHeaderKnown http_header_known(A3CString name) {
+#define HTTP_HEADER_KNOWN_SLOTS 16
+    static uint8_t SLOTS[HTTP_HEADER_KNOWN_SLOTS] = { 0 };
+    static bool    initialized                    = false;
+
+#define HTTP_HEADER_KNOWN_HASH(NAME)                                                               \
+    ((((NAME).len << 2) + ((NAME).ptr[0] | 0x20) + ((NAME).ptr[(NAME).len - 1] | 0x20)) %          \
+     HTTP_HEADER_KNOWN_SLOTS)
+
+    if (!initialized) {
+        memset(SLOTS, HTTP_HEADER_UNKNOWN, sizeof(SLOTS));
+        for (uint8_t h = 0; h < HTTP_HEADER_KNOWN_COUNT; h++) {
+            size_t slot = HTTP_HEADER_KNOWN_HASH(HTTP_HEADER_KNOWN_NAMES[h]);
+            assert(SLOTS[slot] == HTTP_HEADER_UNKNOWN);
+            SLOTS[slot] = h;
+        }
+        initialized = true;
+    }
+
+    if (!name.ptr || !name.len)
+        return HTTP_HEADER_UNKNOWN;
+
+    HttpHeaderKnown ret = SLOTS[HTTP_HEADER_KNOWN_HASH(name)];
+    if (ret == HTTP_HEADER_UNKNOWN || a3_string_cmpi(name, HTTP_HEADER_KNOWN_NAMES[ret]) != 0)
+        return HTTP_HEADER_UNKNOWN;
+    return ret;
+
+#undef HTTP_HEADER_KNOWN_HASH
+#undef HTTP_HEADER_KNOWN_SLOTS
+}
+
+// Record a header. The name and value must point into the block passed to http_headers_rebase.
+// Returns false if there are too many headers.
 bool http_header_add(HttpHeaders* headers, A3CString name, A3CString value) {
     assert(headers);
-    assert(name.ptr);
-    assert(value.ptr);
+    assert(headers->base);
+    assert(name.ptr && name.ptr >= headers->base);
+    assert(value.ptr && value.ptr >= headers->base);
+    assert(!headers->table_built);
 
-    A3String key = a3_string_to_lowercase(name);
+    if (headers->n_fields >= HTTP_REQUEST_HEADER_FIELDS_MAX)
+        return false;
 
-    return A3_HT_INSERT(A3CString, A3String)(&headers->headers, A3_S_CONST(key),
-                                             a3_string_clone(value));
+    uint16_t         index = headers->n_fields++;
+    HttpHeaderField* field = &headers->fields[index];
+    field->name            = (uint16_t)(name.ptr - headers->base);
+    field->name_len        = (uint16_t)name.len;
+    field->value           = (uint16_t)(value.ptr - headers->base);
+    field->value_len       = (uint16_t)value.len;
+    field->next            = 0;
+    field->known           = (uint8_t)http_header_known(name);
+
+    if (field->known != HTTP_HEADER_UNKNOWN) {
+        uint16_t last = headers->known_last[field->known];
+        if (last)
+            headers->fields[last - 1].next = (uint16_t)(index + 1);
+        else
+            headers->known_first[field->known] = (uint16_t)(index + 1);
+        headers->known_last[field->known] = (uint16_t)(index + 1);
+    }
+
+    return true;
+}
+
+size_t http_header_count(HttpHeaders* headers, HttpHeaderKnown header) {
+    assert(headers);
+    assert(header < HTTP_HEADER_KNOWN_COUNT);
+
+    size_t ret = 0;
+    for (uint16_t i = headers->known_first[header]; i; i = headers->fields[i - 1].next)
+        ret++;
+
+    return ret;
 }
 
-A3String http_header_get(HttpHeaders* headers, A3CString name) {
+// Get the value of a known header. Repeated instances are joined with commas the first time they
+// are asked for. A single instance is returned in place.
+A3CString http_header_get_known(HttpHeaders* headers, HttpHeaderKnown header) {
+    assert(headers);
+    assert(header < HTTP_HEADER_KNOWN_COUNT);
+
+    uint16_t first = headers->known_first[header];
+    if (!first)
+        return A3_CS_NULL;
+
+    HttpHeaderField* field = &headers->fields[first - 1];
+    if (!field->next)
+        return http_header_field_value(headers, field);
+    if (headers->combined[header].ptr)
+        return A3_S_CONST(headers->combined[header]);
+
+    size_t len = 0;
+    for (uint16_t i = first; i; i = headers->fields[i - 1].next)
+        len += headers->fields[i - 1].value_len + 1;
+
+    A3String combined = a3_string_alloc(len - 1);
+    size_t   pos      = 0;
+    for (uint16_t i = first; i; i = headers->fields[i - 1].next) {
+        A3CString value = http_header_field_value(headers, &headers->fields[i - 1]);
+        if (pos)
+            combined.ptr[pos++] = ',';
+        memcpy(&combined.ptr[pos], value.ptr, value.len);
+        pos += value.len;
+    }
+
+    mem_account(MEM_HEADERS, combined.len);
+    headers->accounted += combined.len;
+    headers->combined[header] = combined;
+
+    return A3_S_CONST(combined);
+}
+
+// Build the generic table of every header. Only needed for headers which are not known.
+static void http_headers_table_build(HttpHeaders* headers) {
+    assert(headers);
+    assert(!headers->table_built);
+
+    A3_HT_INIT(A3CString, A3String)(&headers->table, HTTP_HEADERS_HASH_KEY, A3_HT_ALLOW_GROWTH);
+    A3_HT_SET_DUPLICATE_CB(A3CString, A3String)(&headers->table, http_headers_combine);
+    headers->table_built = true;
+
+    for (uint16_t i = 0; i < headers->n_fields; i++) {
+        A3CString name  = http_header_field_name(headers, &headers->fields[i]);
+        A3CString value = http_header_field_value(headers, &headers->fields[i]);
+
+        // Duplicates are combined, so this slightly overestimates.
+        mem_account(MEM_HEADERS, name.len + value.len);
+        headers->accounted += name.len + value.len;
+
+        A3String key = a3_string_to_lowercase(name);
+        A3_HT_INSERT(A3CString, A3String)(&headers->table, A3_S_CONST(key),
+                                          a3_string_clone(value));
+    }
+}
+
+A3CString http_header_get(HttpHeaders* headers, A3CString name) {
     assert(headers);
     assert(name.ptr);
 
+    HttpHeaderKnown known = http_header_known(name);
+    if (known != HTTP_HEADER_UNKNOWN)
+        return http_header_get_known(headers, known);
+
+    if (!headers->table_built)
+        http_headers_table_build(headers);
+
     A3String key = a3_string_to_lowercase(name);
 
-    A3String* ret = A3_HT_FIND(A3CString, A3String)(&headers->headers, A3_S_CONST(key));
+    A3String* ret = A3_HT_FIND(A3CString, A3String)(&headers->table, A3_S_CONST(key));
     a3_string_free(&key);
     if (!ret)
-        return A3_S_NULL;
-    return *ret;
+        return A3_CS_NULL;
+    return A3_S_CONST(*ret);
+}
+
+void http_header_values_init(HttpHeaderValues* values, HttpHeaders* headers,
+                             HttpHeaderKnown header) {
+    assert(values);
+    assert(headers);
+    assert(header < HTTP_HEADER_KNOWN_COUNT);
+
+    values->headers = headers;
+    values->next    = headers->known_first[header];
+    values->rest    = A3_CS_NULL;
+}
+
+static bool http_is_ows(uint8_t c) { return c == ' ' || c == '\t'; }
+
+// Get the next element of a comma-separated header list, with surrounding whitespace removed.
+// Empty elements are skipped, per RFC7230 § 7.
+A3CString http_header_values_next(HttpHeaderValues* values) {
+    assert(values);
+
+    for (;;) {
+        if (!values->rest.ptr) {
+            if (!values->next)
+                return A3_CS_NULL;
+
+            HttpHeaderField* field = &values->headers->fields[values->next - 1];
+            values->rest           = http_header_field_value(values->headers, field);
+            values->next           = field->next;
+        }
+
+        const uint8_t* comma = memchr(values->rest.ptr, ',', values->rest.len);
+        A3CString      ret   = values->rest;
+        if (comma) {
+            ret.len      = (size_t)(comma - ret.ptr);
+            values->rest = (A3CString) { .ptr = comma + 1, .len = values->rest.len - ret.len - 1 };
+        } else {
+            values->rest = A3_CS_NULL;
+        }
+
+        while (ret.len && http_is_ows(*ret.ptr)) {
+            ret.ptr++;
+            ret.len--;
+        }
+        while (ret.len && http_is_ows(ret.ptr[ret.len - 1]))
+            ret.len--;
+
+        if (ret.len)
+            return ret;
+    }
 }
 
 HttpConnectionType http_header_connection(HttpHeaders* headers) {
     assert(headers);
 
-    A3String* connection = A3_HT_FIND(A3CString, A3String)(&headers->headers, A3_CS("connection"));
-    if (!connection)
+    A3CString conn = http_header_get_known(headers, HTTP_HEADER_CONNECTION);
+    if (!conn.ptr)
         return HTTP_CONNECTION_TYPE_UNSPECIFIED;
 
-    A3CString conn = A3_S_CONST(*connection);
     if (a3_string_cmpi(conn, A3_CS("Keep-Alive")) == 0)
         return HTTP_CONNECTION_TYPE_KEEP_ALIVE;
     else if (a3_string_cmpi(conn, A3_CS("Close")) == 0)
@@ -102,7 +365,7 @@ HttpTransferEncoding http_header_transfer_encodings(HttpHeaders* headers) {
 
     HttpTransferEncoding ret = HTTP_TRANSFER_ENCODING_INVALID;
 
-    HTTP_HEADER_FOR_EACH_VALUE(headers, A3_CS("Transfer-Encoding"), encoding) {
+    HTTP_HEADER_FOR_EACH_VALUE(headers, HTTP_HEADER_TRANSFER_ENCODING, encoding) {
         HttpTransferEncoding new_encoding = http_transfer_encoding_parse(encoding);
         if (!new_encoding)
             return HTTP_TRANSFER_ENCODING_INVALID;
@@ -119,12 +382,17 @@ ssize_t http_header_content_length(HttpHeaders* headers) {
 
     ssize_t ret = HTTP_CONTENT_LENGTH_UNSPECIFIED;
 
-    HTTP_HEADER_FOR_EACH_VALUE(headers, A3_CS("Content-Length"), content_length) {
-        char*   endptr     = NULL;
-        ssize_t new_length = strtol(a3_string_cstr(content_length), &endptr, 10);
+    HTTP_HEADER_FOR_EACH_VALUE(headers, HTTP_HEADER_CONTENT_LENGTH, content_length) {
+        // Values are not NUL-terminated, so this can't use strtol.
+        ssize_t new_length = 0;
+        for (size_t i = 0; i < content_length.len; i++) {
+            uint8_t c = content_length.ptr[i];
+            if (c < '0' || c > '9' || new_length > (SSIZE_MAX - 9) / 10)
+                return HTTP_CONTENT_LENGTH_INVALID;
+            new_length = new_length * 10 + (c - '0');
+        }
 
-        if (*endptr != '\0' || (ret != HTTP_CONTENT_LENGTH_UNSPECIFIED && ret != new_length) ||
-            new_length < 0)
+        if (ret != HTTP_CONTENT_LENGTH_UNSPECIFIED && ret != new_length)
             return HTTP_CONTENT_LENGTH_INVALID;
 
         ret = new_length;
@@ -132,3 +400,183 @@ ssize_t http_header_content_length(HttpHeaders* headers) {
 
     return ret;
 }
+
+// Parse a decimal number, advancing past it. Returns false if there are no digits, or on overflow.
+static bool http_header_range_number(A3CString* s, uint64_t* out) {
+    assert(s);
+    assert(out);
+
+    size_t   i   = 0;
+    uint64_t ret = 0;
+    for (; i < s->len && s->ptr[i] >= '0' && s->ptr[i] <= '9'; i++) {
+        if (ret > (UINT64_MAX - 9) / 10)
+            return false;
+        ret = ret * 10 + (uint64_t)(s->ptr[i] - '0');
+    }
+
+    *out = ret;
+    s->ptr += i;
+    s->len -= i;
+    return i > 0;
+}
+
+// Only a single byte range is supported. Anything else, including a set of several ranges, is
+// ignored, which RFC 7233 allows.
+HttpRangeResult http_header_range(HttpHeaders* headers, uint64_t size, HttpRange* out) {
+    assert(headers);
+    assert(out);
+
+    static const A3CString UNIT = A3_CS("bytes=");
+
+    A3CString value = http_header_get_known(headers, HTTP_HEADER_RANGE);
+    if (!value.ptr || value.len <= UNIT.len)
+        return HTTP_RANGE_NONE;
+    A3CString unit = { .ptr = value.ptr, .len = UNIT.len };
+    if (a3_string_cmpi(unit, UNIT) != 0)
+        return HTTP_RANGE_NONE;
+    A3CString spec = { .ptr = value.ptr + UNIT.len, .len = value.len - UNIT.len };
+
+    uint64_t first  = 0;
+    uint64_t last   = UINT64_MAX;
+    bool     suffix = spec.ptr[0] == '-';
+    if (!suffix && !http_header_range_number(&spec, &first))
+        return HTTP_RANGE_NONE;
+    if (!spec.len || spec.ptr[0] != '-')
+        return HTTP_RANGE_NONE;
+    spec.ptr++;
+    spec.len--;
+    if (spec.len && !http_header_range_number(&spec, &last))
+        return HTTP_RANGE_NONE;
+    if (spec.len || (suffix && last == UINT64_MAX) || (!suffix && last < first))
+        return HTTP_RANGE_NONE;
+
+    if (suffix) {
+        // The last n bytes.
+        if (!last || !size)
+            return HTTP_RANGE_UNSATISFIABLE;
+        out->first = size - MIN(last, size);
+        out->last  = size - 1;
+        return HTTP_RANGE_SATISFIABLE;
+    }
+
+    if (first >= size)
+        return HTTP_RANGE_UNSATISFIABLE;
+    out->first = first;
+    out->last  = MIN(last, size - 1);
+    return HTTP_RANGE_SATISFIABLE;
+}
+
+// Whether a weight parameter rules its coding out. Anything other than q=0 is acceptable.
+static bool http_header_weight_zero(A3CString params) {
+    assert(params.ptr);
+
+    for (;;) {
+        while (params.len && (http_is_ows(*params.ptr) || *params.ptr == ';')) {
+            params.ptr++;
+            params.len--;
+        }
+        if (params.len < 2)
+            return false;
+
+        const uint8_t* end   = memchr(params.ptr, ';', params.len);
+        A3CString      param = { .ptr = params.ptr,
+                                 .len = end ? (size_t)(end - params.ptr) : params.len };
+        params.ptr += param.len;
+        params.len -= param.len;
+
+        if ((param.ptr[0] | 0x20) != 'q' || param.ptr[1] != '=')
+            continue;
+
+        for (size_t i = 2; i < param.len; i++) {
+            if (param.ptr[i] != '0' && param.ptr[i] != '.')
+                return false;
+        }
+        return true;
+    }
+}
+
+// Whether Accept-Encoding allows the given content coding, by name or with "*".
+bool http_header_accepts_encoding(HttpHeaders* headers, A3CString coding) {
+    assert(headers);
+    assert(coding.ptr);
+
+    bool ret = false;
+    HTTP_HEADER_FOR_EACH_VALUE(headers, HTTP_HEADER_ACCEPT_ENCODING, value) {
+        const uint8_t* semi   = memchr(value.ptr, ';', value.len);
+        A3CString      name   = value;
+        A3CString      params = A3_CS("");
+        if (semi) {
+            name.len = (size_t)(semi - value.ptr);
+            params   = (A3CString) { .ptr = semi, .len = value.len - name.len };
+        }
+        while (name.len && http_is_ows(name.ptr[name.len - 1]))
+            name.len--;
+
+        // A named coding takes precedence over the wildcard.
+        if (a3_string_cmpi(name, coding) == 0)
+            return !http_header_weight_zero(params);
+        if (a3_string_cmp(name, A3_CS("*")) == 0)
+            ret = !http_header_weight_zero(params);
+    }
+
+    return ret;
+}
+
+static bool http_header_etag_weak(A3CString tag) {
+    return tag.len >= 2 && tag.ptr[0] == 'W' && tag.ptr[1] == '/';
+}
+
+// Whether If-Match or If-None-Match lists the given entity tag, or is "*", which matches any
+// current representation. If-None-Match compares weakly, ignoring "W/" on either side, and
+// If-Match strongly, so that weak tags match nothing (RFC7232 § 2.3.2).
+bool http_header_etag_matches(HttpHeaders* headers, HttpHeaderKnown header, A3CString etag) {
+    assert(headers);
+    assert(header == HTTP_HEADER_IF_MATCH || header == HTTP_HEADER_IF_NONE_MATCH);
+
+    bool weak = header == HTTP_HEADER_IF_NONE_MATCH;
+    if (etag.ptr && http_header_etag_weak(etag)) {
+        if (!weak)
+            etag = A3_CS_NULL;
+        else
+            etag = (A3CString) { .ptr = etag.ptr + 2, .len = etag.len - 2 };
+    }
+
+    HTTP_HEADER_FOR_EACH_VALUE(headers, header, value) {
+        if (a3_string_cmp(value, A3_CS("*")) == 0)
+            return true;
+
+        if (http_header_etag_weak(value)) {
+            if (!weak)
+                continue;
+            value = (A3CString) { .ptr = value.ptr + 2, .len = value.len - 2 };
+        }
+        if (etag.ptr && a3_string_cmp(value, etag) == 0)
+            return true;
+    }
+
+    return false;
+}
+
+// A date header, such as If-Modified-Since. Returns false if it is absent or not a valid date, in
+// which case the header is ignored (RFC7232 § 3.3).
+bool http_header_date(HttpHeaders* headers, HttpHeaderKnown header, time_t* out) {
+    assert(headers);
+    assert(out);
+
+    return clock_parse_imf_fixdate(http_header_get_known(headers, header), out);
+}
+
+// Whether a range may be served under If-Range (RFC7233 § 3.2), which only allows it if the
+// validator given is still current. A date must be exactly the Last-Modified date, and a weak tag
+// never matches.
+bool http_header_if_range(HttpHeaders* headers, A3CString etag, A3CString last_modified) {
+    assert(headers);
+
+    A3CString value = http_header_get_known(headers, HTTP_HEADER_IF_RANGE);
+    if (!value.ptr)
+        return true;
+
+    if (value.len && value.ptr[0] == '"')
+        return etag.ptr && !http_header_etag_weak(etag) && a3_string_cmp(value, etag) == 0;
+    return last_modified.ptr && a3_string_cmp(value, last_modified) == 0;
+}
@@ -19,34 +19,117 @@
 
 #pragma once
 
-#include <a3/buffer.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+
 #include <a3/ht.h>
 #include <a3/str.h>
 
+#include "config.h"
 #include "forward.h"
 #include "http/types.h"
 
+// Headers which are recognized while scanning, and can be looked up without building the generic
+// table. Names must be lowercase.
+#define HTTP_HEADER_KNOWN_ENUM                                                                     \
+    _HEADER(HTTP_HEADER_ACCEPT_ENCODING, "accept-encoding")                                        \
+    _HEADER(HTTP_HEADER_CONNECTION, "connection")                                                  \
+    _HEADER(HTTP_HEADER_CONTENT_LENGTH, "content-length")                                          \
+    _HEADER(HTTP_HEADER_HOST, "host")                                                              \
+    _HEADER(HTTP_HEADER_IF_MATCH, "if-match")                                                      \
+    _HEADER(HTTP_HEADER_IF_MODIFIED_SINCE, "if-modified-since")                                    \
+    _HEADER(HTTP_HEADER_IF_NONE_MATCH, "if-none-match")                                            \
+    _HEADER(HTTP_HEADER_IF_RANGE, "if-range")                                                      \
+    _HEADER(HTTP_HEADER_IF_UNMODIFIED_SINCE, "if-unmodified-since")                                \
+    _HEADER(HTTP_HEADER_RANGE, "range")                                                            \
+    _HEADER(HTTP_HEADER_TRANSFER_ENCODING, "transfer-encoding")
+
+typedef enum HttpHeaderKnown {
+#define _HEADER(H, N) H,
+    HTTP_HEADER_KNOWN_ENUM
+#undef _HEADER
+    HTTP_HEADER_KNOWN_COUNT,
+    HTTP_HEADER_UNKNOWN = HTTP_HEADER_KNOWN_COUNT,
+} HttpHeaderKnown;
+
 A3_HT_DEFINE_STRUCTS(A3CString, A3String)
 
+// A header field, stored as offsets into the receive buffer rather than as a copy.
+typedef struct HttpHeaderField {
+    uint16_t name;
+    uint16_t name_len;
+    uint16_t value;
+    uint16_t value_len;
+    uint16_t next; // Index + 1 of the next field with the same known name, or 0.
+    uint8_t  known;
+} HttpHeaderField;
+
 typedef struct HttpHeaders {
-    A3_HT(A3CString, A3String) headers;
+    const uint8_t*  base;
+    HttpHeaderField fields[HTTP_REQUEST_HEADER_FIELDS_MAX];
+    uint16_t        n_fields;
+
+    // Index + 1 of the first and last field with each known name, or 0.
+    uint16_t known_first[HTTP_HEADER_KNOWN_COUNT];
+    uint16_t known_last[HTTP_HEADER_KNOWN_COUNT];
+    // Values of repeated headers, joined on first use.
+    A3String combined[HTTP_HEADER_KNOWN_COUNT];
+
+    // Every header, keyed by lowercase name. Only built when a header which is not known is
+    // looked up.
+    A3_HT(A3CString, A3String) table;
+    bool   table_built;
+    size_t accounted;
 } HttpHeaders;
 
+// An inclusive range of bytes.
+typedef struct HttpRange {
+    uint64_t first;
+    uint64_t last;
+} HttpRange;
+
+typedef enum HttpRangeResult {
+    HTTP_RANGE_NONE, // Absent, or not understood. The whole representation is sent.
+    HTTP_RANGE_SATISFIABLE,
+    HTTP_RANGE_UNSATISFIABLE,
+} HttpRangeResult;
+
+typedef struct HttpHeaderValues {
+    HttpHeaders* headers;
+    uint16_t     next;
+    A3CString    rest;
+} HttpHeaderValues;
+
+void http_headers_key_init(void);
+void http_headers_key_set(const uint8_t key[A3_HT_HASH_KEY_SIZE]);
+size_t http_headers_comparisons(void);
 void http_headers_init(HttpHeaders*);
 void http_headers_destroy(HttpHeaders*);
+void http_headers_rebase(HttpHeaders*, const uint8_t* base);
+
+HttpHeaderKnown http_header_known(A3CString name);
+bool            http_header_add(HttpHeaders*, A3CString name, A3CString value);
+size_t          http_header_count(HttpHeaders*, HttpHeaderKnown);
+A3CString       http_header_get_known(HttpHeaders*, HttpHeaderKnown);
+A3CString       http_header_get(HttpHeaders*, A3CString name);
 
-bool     http_header_add(HttpHeaders*, A3CString name, A3CString value);
-A3String http_header_get(HttpHeaders*, A3CString name);
+void      http_header_values_init(HttpHeaderValues*, HttpHeaders*, HttpHeaderKnown);
+A3CString http_header_values_next(HttpHeaderValues*);
 
 HttpConnectionType   http_header_connection(HttpHeaders*);
 HttpTransferEncoding http_header_transfer_encodings(HttpHeaders*);
 ssize_t              http_header_content_length(HttpHeaders*);
+HttpRangeResult      http_header_range(HttpHeaders*, uint64_t size, HttpRange* out);
+bool                 http_header_accepts_encoding(HttpHeaders*, A3CString coding);
+bool                 http_header_etag_matches(HttpHeaders*, HttpHeaderKnown, A3CString etag);
+bool                 http_header_date(HttpHeaders*, HttpHeaderKnown, time_t* out);
+bool                 http_header_if_range(HttpHeaders*, A3CString etag, A3CString last_modified);
 
-#define HTTP_HEADER_FOR_EACH_VALUE(HEADERS, NAME, VAL)                                             \
-    A3String _header_val = http_header_get((HEADERS), (NAME));                                     \
-    A3Buffer _header_buf = {                                                                       \
-        .data = _header_val, .tail = _header_val.len, .head = 0, .max_cap = _header_val.len        \
-    };                                                                                             \
-    for (A3CString VAL = A3_S_CONST(a3_buf_token_next(&_header_buf, A3_CS(","), A3_PRES_END_NO));  \
-         VAL.ptr && a3_buf_len(&_header_buf);                                                      \
-         VAL = A3_S_CONST(a3_buf_token_next(&_header_buf, A3_CS(","), A3_PRES_END_NO)))
+// Iterate over the comma-separated elements of every instance of a known header.
+#define HTTP_HEADER_FOR_EACH_VALUE(HEADERS, KNOWN, VAL)                                            \
+    HttpHeaderValues _header_values;                                                               \
+    http_header_values_init(&_header_values, (HEADERS), (KNOWN));                                  \
+    for (A3CString VAL = http_header_values_next(&_header_values); VAL.ptr;                        \
+         VAL           = http_header_values_next(&_header_values))
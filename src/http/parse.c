@@ -24,6 +24,7 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/types.h>
 
 #include <a3/buffer.h>
@@ -32,13 +33,13 @@
 #include <a3/util.h>
 
 #include "config.h"
-#include "config_runtime.h"
 #include "connection.h"
 #include "forward.h"
 #include "http/connection.h"
 #include "http/headers.h"
 #include "http/request.h"
 #include "http/response.h"
+#include "http/scan.h"
 #include "http/types.h"
 #include "uri.h"
 
@@ -48,6 +49,15 @@ static inline A3Buffer* http_request_recv_buf(HttpRequest* req) {
     return &http_request_connection(req)->conn.recv_buf;
 }
 
+// Mutable view of the unread part of the receive buffer.
+static inline A3String http_request_unread(A3Buffer* buf) {
+    assert(buf);
+
+    return (A3String) { .ptr = buf->data.ptr + buf->head, .len = a3_buf_len(buf) };
+}
+
+static inline bool http_is_ows(uint8_t c) { return c == ' ' || c == '\t'; }
+
 // Try to parse the first line of the HTTP request.
 HttpRequestStateResult http_request_first_line_parse(HttpRequest* req, struct io_uring* uring) {
     assert(req);
@@ -57,18 +67,28 @@ HttpRequestStateResult http_request_first_line_parse(HttpRequest* req, struct io
     HttpConnection* conn = http_request_connection(req);
     HttpResponse*   resp = http_request_response(req);
 
-    // If no CRLF has appeared so far, and the length of the data is
-    // permissible, bail and wait for more.
-    if (!a3_buf_memmem(buf, HTTP_NEWLINE).ptr) {
-        if (a3_buf_len(buf) < HTTP_REQUEST_LINE_MAX_LENGTH)
+    A3String  data = http_request_unread(buf);
+    HttpLine* line = &req->line;
+    switch (http_scan_line(A3_S_CONST(data), ' ', line)) {
+    case HTTP_SCAN_INCOMPLETE:
+        // If no CRLF has appeared so far, and the length of the data is permissible, bail and
+        // wait for more.
+        if (data.len < HTTP_REQUEST_LINE_MAX_LENGTH)
             return HTTP_REQUEST_STATE_NEED_DATA;
         A3_RET_MAP(
             http_response_error_submit(resp, uring, HTTP_STATUS_URI_TOO_LONG, HTTP_RESPONSE_CLOSE),
             HTTP_REQUEST_STATE_BAIL, HTTP_REQUEST_STATE_ERROR);
+    case HTTP_SCAN_INVALID:
+        A3_TRACE("Got an invalid byte in the request line.");
+        A3_RET_MAP(
+            http_response_error_submit(resp, uring, HTTP_STATUS_BAD_REQUEST, HTTP_RESPONSE_CLOSE),
+            HTTP_REQUEST_STATE_BAIL, HTTP_REQUEST_STATE_ERROR);
+    case HTTP_SCAN_LINE:
+        break;
     }
 
-    conn->method = http_request_method_parse(
-        A3_S_CONST(a3_buf_token_next(buf, A3_CS(" \r\n"), A3_PRES_END_NO)));
+    // <method> SP <target> SP <version>
+    conn->method = http_request_method_parse((A3CString) { .ptr = data.ptr, .len = line->delim });
     switch (conn->method) {
     case HTTP_METHOD_INVALID:
         A3_TRACE("Got an invalid method.");
@@ -85,12 +105,26 @@ HttpRequestStateResult http_request_first_line_parse(HttpRequest* req, struct io
         break;
     }
 
-    A3String target_str = a3_buf_token_next(buf, A3_CS(" \r\n"), A3_PRES_END_NO);
-    if (!target_str.ptr)
+    size_t         target_start = line->delim + 1;
+    const uint8_t* target_end =
+        target_start < line->end ? memchr(&data.ptr[target_start], ' ', line->end - target_start)
+                                : NULL;
+    if (!target_end || target_end == &data.ptr[target_start])
         A3_RET_MAP(
             http_response_error_submit(resp, uring, HTTP_STATUS_BAD_REQUEST, HTTP_RESPONSE_CLOSE),
             HTTP_REQUEST_STATE_BAIL, HTTP_REQUEST_STATE_ERROR);
-    switch (uri_parse(&req->target, target_str)) {
+    size_t version_start = (size_t)(target_end - data.ptr) + 1;
+
+    // The target is copied out, since the receive buffer can move before the response is sent. The
+    // relative path of the target file is written after it.
+    size_t target_len = version_start - 1 - target_start;
+    if (target_len > HTTP_REQUEST_URI_MAX_LENGTH || target_len * 2 + 1 > sizeof(req->target_buf))
+        A3_RET_MAP(
+            http_response_error_submit(resp, uring, HTTP_STATUS_URI_TOO_LONG, HTTP_RESPONSE_CLOSE),
+            HTTP_REQUEST_STATE_BAIL, HTTP_REQUEST_STATE_ERROR);
+    memcpy(req->target_buf, &data.ptr[target_start], target_len);
+
+    switch (uri_parse(&req->target, (A3String) { .ptr = req->target_buf, .len = target_len })) {
     case URI_PARSE_ERROR:
     case URI_PARSE_BAD_URI:
         A3_RET_MAP(
@@ -104,17 +138,20 @@ HttpRequestStateResult http_request_first_line_parse(HttpRequest* req, struct io
         break;
     }
 
-    req->target_path = uri_path_if_contained(&req->target, CONFIG.web_root);
+    // Normalization only shrinks the target, so the path fits after it.
+    req->target_path =
+        uri_path_relative(&req->target, (A3String) { .ptr = &req->target_buf[target_len],
+                                                     .len = sizeof(req->target_buf) - target_len });
     if (!req->target_path.ptr)
         A3_RET_MAP(
             http_response_error_submit(resp, uring, HTTP_STATUS_NOT_FOUND, HTTP_RESPONSE_ALLOW),
             HTTP_REQUEST_STATE_BAIL, HTTP_REQUEST_STATE_ERROR);
 
-    // Need to only eat one "\r\n".
-    conn->version =
-        http_version_parse(A3_S_CONST(a3_buf_token_next(buf, HTTP_NEWLINE, A3_PRES_END_YES)));
-    if (!a3_buf_consume(buf, HTTP_NEWLINE) || conn->version == HTTP_VERSION_INVALID ||
-        conn->version == HTTP_VERSION_UNKNOWN ||
+    conn->version = http_version_parse(
+        (A3CString) { .ptr = &data.ptr[version_start], .len = line->end - version_start });
+    a3_buf_read(buf, line->end + HTTP_NEWLINE.len);
+    http_line_reset(line);
+    if (conn->version == HTTP_VERSION_INVALID || conn->version == HTTP_VERSION_UNKNOWN ||
         (conn->version == HTCPCP_VERSION_10 && conn->method != HTTP_METHOD_BREW)) {
         A3_TRACE("Got a bad HTTP version.");
         A3_RET_MAP(http_response_error_submit(resp, uring,
@@ -141,37 +178,60 @@ HttpRequestStateResult http_request_headers_add(HttpRequest* req, struct io_urin
     A3Buffer*     buf  = http_request_recv_buf(req);
     HttpResponse* resp = http_request_response(req);
 
-    if (!a3_buf_memmem(buf, HTTP_NEWLINE).ptr) {
-        if (a3_buf_len(buf) < HTTP_REQUEST_HEADER_MAX_LENGTH)
-            return HTTP_REQUEST_STATE_NEED_DATA;
-        A3_RET_MAP(http_response_error_submit(resp, uring, HTTP_STATUS_HEADER_TOO_LARGE,
-                                              HTTP_RESPONSE_CLOSE),
-                   HTTP_REQUEST_STATE_BAIL, HTTP_REQUEST_STATE_ERROR);
-    }
-
-    if (!a3_buf_consume(buf, HTTP_NEWLINE)) {
-        while (buf->data.ptr[buf->head] != '\r' && buf->head != buf->tail) {
-            if (!a3_buf_memmem(buf, HTTP_NEWLINE).ptr)
+    // Header lines are left in the buffer until the whole block has arrived, so that the stored
+    // headers can refer to them in place. The buffer may have moved since the last call.
+    A3String block = http_request_unread(buf);
+    http_headers_rebase(&req->headers, block.ptr);
+
+    for (HttpLine* line = &req->line;; http_line_reset(line)) {
+        A3String data = { .ptr = block.ptr + req->header_block,
+                          .len = block.len - req->header_block };
+        switch (http_scan_line(A3_S_CONST(data), ':', line)) {
+        case HTTP_SCAN_INCOMPLETE:
+            if (data.len < HTTP_REQUEST_HEADER_MAX_LENGTH && block.len < RECV_BUF_MAX_CAPACITY)
                 return HTTP_REQUEST_STATE_NEED_DATA;
+            A3_RET_MAP(http_response_error_submit(resp, uring, HTTP_STATUS_HEADER_TOO_LARGE,
+                                                  HTTP_RESPONSE_CLOSE),
+                       HTTP_REQUEST_STATE_BAIL, HTTP_REQUEST_STATE_ERROR);
+        case HTTP_SCAN_INVALID:
+            A3_RET_MAP(http_response_error_submit(resp, uring, HTTP_STATUS_BAD_REQUEST,
+                                                  HTTP_RESPONSE_CLOSE),
+                       HTTP_REQUEST_STATE_BAIL, HTTP_REQUEST_STATE_ERROR);
+        case HTTP_SCAN_LINE:
+            break;
+        }
 
-            A3CString name  = A3_S_CONST(a3_buf_token_next(buf, A3_CS(": "), A3_PRES_END_NO));
-            A3CString value = A3_S_CONST(a3_buf_token_next(buf, HTTP_NEWLINE, A3_PRES_END_YES));
-            A3_TRYB_MAP(a3_buf_consume(buf, HTTP_NEWLINE), HTTP_REQUEST_STATE_ERROR);
+        // An empty line ends the header block.
+        if (!line->end) {
+            a3_buf_read(buf, req->header_block + HTTP_NEWLINE.len);
+            req->header_block = 0;
+            http_line_reset(line);
+            break;
+        }
 
-            // RFC7230 § 5.4: Invalid field-value -> 400.
-            if (!name.ptr || !value.ptr)
-                A3_RET_MAP(http_response_error_submit(resp, uring, HTTP_STATUS_BAD_REQUEST,
-                                                      HTTP_RESPONSE_CLOSE),
-                           HTTP_REQUEST_STATE_BAIL, HTTP_REQUEST_STATE_ERROR);
+        // RFC7230 § 3.2.4: No whitespace is allowed between the field name and the colon, and
+        // obsolete line folding is rejected. Both are invalid field-values -> 400 (§ 5.4).
+        if (line->delim == line->end || !line->delim || http_is_ows(data.ptr[0]) ||
+            http_is_ows(data.ptr[line->delim - 1]))
+            A3_RET_MAP(http_response_error_submit(resp, uring, HTTP_STATUS_BAD_REQUEST,
+                                                  HTTP_RESPONSE_CLOSE),
+                       HTTP_REQUEST_STATE_BAIL, HTTP_REQUEST_STATE_ERROR);
 
-            if (!http_header_add(&req->headers, name, value))
-                A3_RET_MAP(http_response_error_submit(resp, uring, HTTP_STATUS_SERVER_ERROR,
-                                                      HTTP_RESPONSE_CLOSE),
-                           HTTP_REQUEST_STATE_BAIL, HTTP_REQUEST_STATE_ERROR);
-        }
+        size_t value_start = line->delim + 1;
+        size_t value_end   = line->end;
+        while (value_start < value_end && http_is_ows(data.ptr[value_start]))
+            value_start++;
+        while (value_end > value_start && http_is_ows(data.ptr[value_end - 1]))
+            value_end--;
+
+        A3CString name  = { .ptr = data.ptr, .len = line->delim };
+        A3CString value = { .ptr = &data.ptr[value_start], .len = value_end - value_start };
+        if (!http_header_add(&req->headers, name, value))
+            A3_RET_MAP(http_response_error_submit(resp, uring, HTTP_STATUS_HEADER_TOO_LARGE,
+                                                  HTTP_RESPONSE_CLOSE),
+                       HTTP_REQUEST_STATE_BAIL, HTTP_REQUEST_STATE_ERROR);
 
-        if (!a3_buf_consume(buf, HTTP_NEWLINE))
-            return HTTP_REQUEST_STATE_NEED_DATA;
+        req->header_block += line->end + HTTP_NEWLINE.len;
     }
 
     http_request_connection(req)->state = HTTP_CONNECTION_ADDED_HEADERS;
@@ -202,9 +262,10 @@ HttpRequestStateResult http_request_headers_parse(HttpRequest* req, struct io_ur
             HTTP_REQUEST_STATE_BAIL, HTTP_REQUEST_STATE_ERROR);
     }
 
-    req->host = A3_S_CONST(http_header_get(headers, A3_CS("Host")));
+    req->host = http_header_get_known(headers, HTTP_HEADER_HOST);
     // RFC7230 § 5.4: more than one Host header -> 400.
-    if (req->host.ptr && a3_string_rchr(req->host, ',').ptr) {
+    if (http_header_count(headers, HTTP_HEADER_HOST) > 1 ||
+        (req->host.ptr && a3_string_rchr(req->host, ',').ptr)) {
         req->host = A3_CS_NULL;
         A3_RET_MAP(
             http_response_error_submit(resp, uring, HTTP_STATUS_BAD_REQUEST, HTTP_RESPONSE_CLOSE),
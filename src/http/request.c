@@ -21,6 +21,8 @@
 
 #include <assert.h>
 #include <liburing.h>
+#include <stddef.h>
+#include <string.h>
 
 #include <a3/log.h>
 #include <a3/str.h>
@@ -86,18 +88,16 @@ void http_request_init(HttpRequest* req) {
     req->transfer_encodings = HTTP_TRANSFER_ENCODING_IDENTITY;
     req->content_length     = HTTP_CONTENT_LENGTH_UNSPECIFIED;
     http_headers_init(&req->headers);
+    http_line_reset(&req->line);
 }
 
 void http_request_reset(HttpRequest* req) {
     assert(req);
 
-    if (uri_is_initialized(&req->target))
-        uri_free(&req->target);
-    if (req->target_path.ptr)
-        a3_string_free(&req->target_path);
     http_headers_destroy(&req->headers);
 
-    memset(req, 0, sizeof(*req));
+    memset(req, 0, offsetof(HttpRequest, target_buf));
+    http_line_reset(&req->line);
 }
 
 // Try to parse as much of the HTTP request as possible.
@@ -19,23 +19,32 @@
 
 #pragma once
 
+#include <stdint.h>
 #include <sys/types.h>
 
 #include <a3/str.h>
 
+#include "config.h"
 #include "forward.h"
 #include "http/headers.h"
+#include "http/scan.h"
 #include "http/types.h"
 #include "uri.h"
 
 typedef struct HttpRequest {
     HttpHeaders headers;
+    HttpLine    line;
+    size_t      header_block;
 
     Uri                  target;
     A3CString            host;
     A3String             target_path;
     ssize_t              content_length;
     HttpTransferEncoding transfer_encodings;
+
+    // The request target is copied here and normalized in place, and the path of the target file
+    // is built after it. Must be last, since it isn't cleared on reset.
+    uint8_t target_buf[HTTP_REQUEST_TARGET_BUF_LENGTH];
 } HttpRequest;
 
 HttpConnection* http_request_connection(HttpRequest*);
@@ -23,13 +23,11 @@
 #include <fcntl.h>
 #include <liburing.h>
 #include <linux/stat.h>
-#include <stdarg.h>
 #include <stdbool.h>
 #include <stdint.h>
-#include <stdio.h>
+#include <string.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
-#include <time.h>
 #include <unistd.h>
 
 #include <a3/buffer.h>
@@ -37,13 +35,21 @@
 #include <a3/str.h>
 #include <a3/util.h>
 
+#include "clock.h"
 #include "config.h"
+#include "config_runtime.h"
 #include "connection.h"
 #include "event.h"
 #include "file.h"
+#include "file_block.h"
+#include "file_prefetch.h"
+#include "file_tree.h"
 #include "http/connection.h"
+#include "http/error.h"
 #include "http/request.h"
+#include "http/serialize.h"
 #include "http/types.h"
+#include "pack.h"
 
 #include <liburing/io_uring.h>
 
@@ -60,17 +66,31 @@ static inline A3Buffer* http_response_send_buf(HttpResponse* resp) {
     return &http_response_connection(resp)->conn.send_buf;
 }
 
+// The descriptor the body is spliced from.
+static fd http_response_body_fd(HttpConnection* conn) {
+    assert(conn);
+
+    return conn->target_file ? file_handle_fd(conn->target_file) : pack_fd();
+}
+
 void http_response_init(HttpResponse* resp) {
     assert(resp);
 
     resp->content_type       = HTTP_CONTENT_TYPE_TEXT_HTML;
     resp->transfer_encodings = HTTP_TRANSFER_ENCODING_IDENTITY;
     resp->body_sent          = 0;
+    resp->body_offset        = 0;
+    resp->body_len           = 0;
+    resp->n_blocks           = 0;
+    resp->stat_only          = false;
+    resp->index              = false;
 }
 
 void http_response_reset(HttpResponse* resp) {
     assert(resp);
 
+    for (size_t i = 0; i < resp->n_blocks; i++)
+        file_block_release(resp->blocks[i]);
     http_response_init(resp);
 }
 
@@ -123,11 +143,11 @@ static bool http_response_splice_chain_handle(Connection* connection, struct io_
         }
 
         size_t sent      = conn->response.body_sent;
-        size_t remaining = file_handle_stat(conn->target_file)->stx_size - sent;
+        size_t remaining = conn->response.body_len - sent;
         A3_TRYB(connection_splice_retry(
             &conn->conn, uring, http_response_splice_chain_handle, http_response_splice_handle,
-            file_handle_fd(conn->target_file), (size_t)status, sent, remaining,
-            !http_connection_keep_alive(conn) ? IOSQE_IO_LINK : 0));
+            http_response_body_fd(conn), (size_t)status, conn->response.body_offset + sent,
+            remaining, !http_connection_keep_alive(conn) ? IOSQE_IO_LINK : 0));
         if (!http_connection_keep_alive(conn))
             return http_connection_close_submit(conn, uring);
         return true;
@@ -146,175 +166,335 @@ static bool http_response_splice_handle(Connection* connection, struct io_uring*
     return http_response_handle(connection, uring, success, status);
 }
 
-// Write the status line to the send buffer.
-static bool http_response_prep_status_line(HttpResponse* resp, HttpStatus status) {
+// The default head for a response, with the connection closed if necessary.
+static HttpResponseHead http_response_head(HttpResponse* resp, HttpStatus status,
+                                           ssize_t content_length, bool close) {
     assert(resp);
-    assert(status != HTTP_STATUS_INVALID);
 
-    A3Buffer* buf         = http_response_send_buf(resp);
-    uint16_t  status_code = http_status_code(status);
+    HttpConnection* conn = http_response_connection(resp);
 
-    A3_TRYB(a3_buf_write_str(buf, http_version_string(http_response_connection(resp)->version)));
-    A3_TRYB(a3_buf_write_byte(buf, ' '));
-    A3_TRYB(a3_buf_write_num(buf, status_code));
-    A3_TRYB(a3_buf_write_byte(buf, ' '));
+    if (close || !http_connection_keep_alive(conn) || content_length < 0)
+        conn->connection_type = HTTP_CONNECTION_TYPE_CLOSE;
 
-    A3CString reason = http_status_reason(status);
-    if (!reason.ptr) {
-        A3_WARN_F("Invalid HTTP status %d.", status_code);
-        return false;
-    }
-    A3_TRYB(a3_buf_write_str(buf, reason));
-    return a3_buf_write_str(buf, HTTP_NEWLINE);
+    return (HttpResponseHead) { .version        = conn->version,
+                                .status         = status,
+                                .keep_alive     = http_connection_keep_alive(conn),
+                                .content_type   = resp->content_type,
+                                .content_length = content_length,
+                                .date           = clock_date(),
+                                .extra          = A3_CS_NULL };
 }
 
-static bool http_response_prep_header(HttpResponse* resp, A3CString name, A3CString value) {
+// Write the status line and headers to the send buffer, ending the header block.
+static bool http_response_prep_head(HttpResponse* resp, HttpResponseHead const* head) {
     assert(resp);
-    assert(name.ptr);
-    assert(value.ptr);
+    assert(head);
+
+    return http_serialize_head(http_response_send_buf(resp), head);
+}
 
-    A3Buffer* buf = http_response_send_buf(resp);
+static uint8_t* http_response_append(uint8_t* out, A3CString str) {
+    assert(out);
+    assert(str.ptr);
 
-    A3_TRYB(a3_buf_write_str(buf, name));
-    A3_TRYB(a3_buf_write_str(buf, A3_CS(": ")));
-    A3_TRYB(a3_buf_write_str(buf, value));
-    return a3_buf_write_str(buf, HTTP_NEWLINE);
+    memcpy(out, str.ptr, str.len);
+    return out + str.len;
 }
 
-A3_FORMAT_FN(3, 4)
-static bool http_response_prep_header_fmt(HttpResponse* resp, A3CString name, const char* fmt,
-                                          ...) {
-    assert(resp);
-    assert(name.ptr);
-    assert(fmt);
+// The headers which only depend on the file. They don't change until the file does, so they are
+// built once and kept with the handle. Content-Length comes first, so that partial responses can
+// skip it. Requests which race the first one to build them use their own copy, in scratch.
+static A3CString http_response_file_headers(FileHandle* file, uint8_t* scratch) {
+    assert(file);
+    assert(scratch);
+
+    A3CString ret = file_handle_headers(file);
+    if (ret.len)
+        return ret;
+
+    struct statx* stat  = file_handle_stat(file);
+    A3String      space = file_handle_headers_space(file);
+    bool          own   = space.ptr;
+    if (!own)
+        space = (A3String) { .ptr = scratch, .len = FILE_HANDLE_HEADERS_MAX };
+    uint8_t* p = space.ptr;
+
+    p = http_response_append(p, A3_CS("Content-Length: "));
+    p += http_serialize_dec(p, stat->stx_size);
+    p = http_response_append(p, HTTP_NEWLINE);
+    p = http_response_append(p, A3_CS("Content-Type: "));
+    p = http_response_append(
+        p, http_content_type_name(http_content_type_from_path(file_handle_path(file))));
+    p = http_response_append(p, HTTP_NEWLINE);
+    p = http_response_append(p, A3_CS("Accept-Ranges: bytes"));
+    p = http_response_append(p, HTTP_NEWLINE);
+    p = http_response_append(p, A3_CS("Last-Modified: "));
+    p += clock_format_imf_fixdate(p, stat->stx_mtime.tv_sec);
+    p = http_response_append(p, HTTP_NEWLINE);
+    p = http_response_append(p, A3_CS("Etag: \""));
+    p += http_serialize_dec(p, stat->stx_ino);
+    *p++ = 'X';
+    p += http_serialize_hex(p, (uint64_t)stat->stx_mtime.tv_sec);
+    *p++ = 'X';
+    p += http_serialize_hex(p, (uint64_t)stat->stx_size);
+    *p++ = '"';
+    p = http_response_append(p, HTTP_NEWLINE);
+
+    assert((size_t)(p - space.ptr) <= space.len);
+    if (!own)
+        return (A3CString) { .ptr = space.ptr, .len = (size_t)(p - space.ptr) };
+    file_handle_headers_wrote(file, (size_t)(p - space.ptr));
+
+    return file_handle_headers(file);
+}
 
-    A3Buffer* buf = http_response_send_buf(resp);
-    A3_TRYB(a3_buf_write_str(buf, name));
-    A3_TRYB(a3_buf_write_str(buf, A3_CS(": ")));
+// A representation's headers, less Content-Length, which comes first.
+static A3CString http_response_headers_partial(A3CString headers) {
+    assert(headers.ptr);
 
-    va_list args;
-    va_start(args, fmt);
+    uint8_t* end = memchr(headers.ptr, '\n', headers.len);
+    assert(end);
 
-    bool ret = a3_buf_write_vfmt(buf, fmt, args);
-    ret      = ret && a3_buf_write_str(buf, HTTP_NEWLINE);
+    size_t skip = (size_t)(end + 1 - headers.ptr);
+    return (A3CString) { .ptr = headers.ptr + skip, .len = headers.len - skip };
+}
 
-    va_end(args);
-    return ret;
+// Headers for a response covering part of a representation of the given size. Written to out,
+// which must have space for HTTP_RESPONSE_RANGE_HEADERS_MAX bytes.
+#define HTTP_RESPONSE_RANGE_HEADERS_MAX (FILE_HANDLE_HEADERS_MAX + 96)
+static A3CString http_response_range_headers(uint8_t* out, A3CString headers, uint64_t size,
+                                             HttpRange range) {
+    assert(out);
+    assert(headers.ptr);
+    assert(headers.len <= FILE_HANDLE_HEADERS_MAX);
+
+    uint8_t* p = out;
+    p          = http_response_append(p, A3_CS("Content-Range: bytes "));
+    if (range.first <= range.last) {
+        p += http_serialize_dec(p, range.first);
+        *p++ = '-';
+        p += http_serialize_dec(p, range.last);
+    } else {
+        *p++ = '*';
+    }
+    *p++ = '/';
+    p += http_serialize_dec(p, size);
+    p = http_response_append(p, HTTP_NEWLINE);
+    p = http_response_append(p, http_response_headers_partial(headers));
+    assert(p - out <= HTTP_RESPONSE_RANGE_HEADERS_MAX);
+
+    return (A3CString) { .ptr = out, .len = (size_t)(p - out) };
 }
 
-static bool http_response_prep_header_num(HttpResponse* resp, A3CString name, size_t value) {
+// Send a response which is only a head.
+static bool http_response_head_submit(HttpResponse* resp, struct io_uring* uring,
+                                      HttpResponseHead const* head) {
     assert(resp);
-    assert(name.ptr);
+    assert(uring);
+    assert(head);
 
-    A3Buffer* buf = http_response_send_buf(resp);
+    HttpConnection* conn = http_response_connection(resp);
 
-    A3_TRYB(a3_buf_write_str(buf, name));
-    A3_TRYB(a3_buf_write_str(buf, A3_CS(": ")));
-    A3_TRYB(a3_buf_write_num(buf, value));
-    return a3_buf_write_str(buf, HTTP_NEWLINE);
+    A3_TRYB(http_response_prep_head(resp, head));
+    A3_TRYB(connection_send_submit(&conn->conn, uring, http_response_handle, 0,
+                                   !http_connection_keep_alive(conn) ? IOSQE_IO_LINK : 0));
+    if (!http_connection_keep_alive(conn))
+        return http_connection_close_submit(conn, uring);
+    return true;
 }
 
-static bool http_response_prep_header_timestamp(HttpResponse* resp, A3CString name, time_t tv) {
+// Answer a range which lies outside the representation.
+static bool http_response_range_error_submit(HttpResponse* resp, struct io_uring* uring,
+                                             A3CString headers, uint64_t size) {
     assert(resp);
+    assert(uring);
 
-    static A3_THREAD_LOCAL struct {
-        time_t  tv;
-        uint8_t buf[HTTP_TIME_BUF_LENGTH];
-        size_t  len;
-    } TIMES[HTTP_TIME_CACHE] = { { 0, { '\0' }, 0 } };
+    uint8_t extra[HTTP_RESPONSE_RANGE_HEADERS_MAX];
 
-    size_t i = (size_t)tv % HTTP_TIME_CACHE;
-    if (TIMES[i].tv != tv)
-        A3_UNWRAPN(TIMES[i].len, strftime((char*)TIMES[i].buf, HTTP_TIME_BUF_LENGTH,
-                                          HTTP_TIME_FORMAT, gmtime(&tv)));
+    HttpResponseHead head =
+        http_response_head(resp, HTTP_STATUS_RANGE_NOT_SATISFIABLE, 0, HTTP_RESPONSE_ALLOW);
+    head.content_type = HTTP_CONTENT_TYPE_INVALID;
+    head.extra =
+        http_response_range_headers(extra, headers, size, (HttpRange) { .first = 1, .last = 0 });
 
-    return http_response_prep_header(resp, name,
-                                     (A3CString) { .ptr = TIMES[i].buf, .len = TIMES[i].len });
+    return http_response_head_submit(resp, uring, &head);
 }
 
-static bool http_response_prep_header_date(HttpResponse* resp) {
-    assert(resp);
+// The value of a header in a block built for a representation, or a null string.
+static A3CString http_response_header_find(A3CString headers, A3CString name) {
+    assert(headers.ptr);
+    assert(name.ptr);
 
-    static A3_THREAD_LOCAL uint8_t   DATE_BUF[HTTP_TIME_BUF_LENGTH] = { '\0' };
-    static A3_THREAD_LOCAL A3CString DATE                           = A3_CS_NULL;
-    static A3_THREAD_LOCAL time_t    LAST_TIME                      = 0;
+    for (const uint8_t *line = headers.ptr, *end = NULL; line < headers.ptr + headers.len;
+         line = end + 1) {
+        A3_UNWRAPN(end, memchr(line, '\n', (size_t)(headers.ptr + headers.len - line)));
 
-    time_t current = time(NULL);
-    if (current - LAST_TIME > 2 || !DATE.ptr) {
-        A3_UNWRAPN(DATE.len, strftime((char*)DATE_BUF, HTTP_TIME_BUF_LENGTH, HTTP_TIME_FORMAT,
-                                      gmtime(&current)));
-        DATE.ptr  = DATE_BUF;
-        LAST_TIME = current;
+        A3CString key = { .ptr = line, .len = name.len };
+        if ((size_t)(end - line) > name.len + 2 && line[name.len] == ':' &&
+            a3_string_cmpi(key, name) == 0)
+            return (A3CString) { .ptr = line + name.len + 2,
+                                 .len = (size_t)(end - line) - name.len - 3 };
     }
 
-    return http_response_prep_header(resp, A3_CS("Date"), DATE);
+    return A3_CS_NULL;
 }
 
-// Write the default status line and headers to the send buffer.
-static bool http_response_prep_default_headers(HttpResponse* resp, HttpStatus status,
-                                               ssize_t content_length, bool close) {
+// Evaluate the request's preconditions against the validators in a representation's headers, in
+// the order given by RFC7232 § 6. Returns the status to answer with instead of the representation,
+// or HTTP_STATUS_OK.
+static HttpStatus http_response_preconditions(HttpResponse* resp, A3CString headers) {
     assert(resp);
+    assert(headers.ptr);
 
     HttpConnection* conn = http_response_connection(resp);
+    HttpHeaders*    req  = &conn->request.headers;
+    if (!http_header_count(req, HTTP_HEADER_IF_MATCH) &&
+        !http_header_count(req, HTTP_HEADER_IF_MODIFIED_SINCE) &&
+        !http_header_count(req, HTTP_HEADER_IF_NONE_MATCH) &&
+        !http_header_count(req, HTTP_HEADER_IF_UNMODIFIED_SINCE))
+        return HTTP_STATUS_OK;
+
+    A3CString etag     = http_response_header_find(headers, A3_CS("Etag"));
+    time_t    modified = 0;
+    time_t    date     = 0;
+    bool      dated =
+        clock_parse_imf_fixdate(http_response_header_find(headers, A3_CS("Last-Modified")),
+                                &modified);
+
+    if (http_header_count(req, HTTP_HEADER_IF_MATCH)) {
+        if (!http_header_etag_matches(req, HTTP_HEADER_IF_MATCH, etag))
+            return HTTP_STATUS_PRECONDITION_FAILED;
+    } else if (dated && http_header_date(req, HTTP_HEADER_IF_UNMODIFIED_SINCE, &date) &&
+               modified > date) {
+        return HTTP_STATUS_PRECONDITION_FAILED;
+    }
 
-    A3_TRYB(http_response_prep_status_line(resp, status));
-    A3_TRYB(http_response_prep_header_date(resp));
-    if (close || !http_connection_keep_alive(conn) || content_length < 0) {
-        conn->connection_type = HTTP_CONNECTION_TYPE_CLOSE;
-        A3_TRYB(http_response_prep_header(resp, A3_CS("Connection"), A3_CS("Close")));
-    } else {
-        A3_TRYB(http_response_prep_header(resp, A3_CS("Connection"), A3_CS("Keep-Alive")));
+    bool safe = conn->method == HTTP_METHOD_GET || conn->method == HTTP_METHOD_HEAD;
+    if (http_header_count(req, HTTP_HEADER_IF_NONE_MATCH)) {
+        if (http_header_etag_matches(req, HTTP_HEADER_IF_NONE_MATCH, etag))
+            return safe ? HTTP_STATUS_NOT_MODIFIED : HTTP_STATUS_PRECONDITION_FAILED;
+    } else if (safe && dated && http_header_date(req, HTTP_HEADER_IF_MODIFIED_SINCE, &date) &&
+               modified <= date) {
+        return HTTP_STATUS_NOT_MODIFIED;
     }
-    if (content_length >= 0)
-        A3_TRYB(
-            http_response_prep_header_num(resp, A3_CS("Content-Length"), (size_t)content_length));
-    A3_TRYB(http_response_prep_header(resp, A3_CS("Content-Type"),
-                                      http_content_type_name(resp->content_type)));
 
-    return true;
+    return HTTP_STATUS_OK;
 }
 
-// Done writing headers.
-static bool http_response_prep_headers_done(HttpResponse* resp) {
+// Answer a request whose preconditions decided the status. A 304 carries the headers a cache needs
+// to update its stored response, and nothing else.
+static bool http_response_condition_submit(HttpResponse* resp, struct io_uring* uring,
+                                           HttpStatus status, A3CString headers) {
     assert(resp);
+    assert(uring);
+    assert(headers.ptr);
+
+    static const A3CString KEPT[] = { A3_CS("Cache-Control"), A3_CS("Etag"), A3_CS("Expires"),
+                                      A3_CS("Last-Modified"), A3_CS("Vary") };
+
+    if (status != HTTP_STATUS_NOT_MODIFIED)
+        return http_response_error_submit(resp, uring, status, HTTP_RESPONSE_ALLOW);
+
+    uint8_t  extra[FILE_HANDLE_HEADERS_MAX];
+    uint8_t* p = extra;
+    for (size_t i = 0; i < sizeof(KEPT) / sizeof(*KEPT); i++) {
+        A3CString value = http_response_header_find(headers, KEPT[i]);
+        if (!value.ptr)
+            continue;
+
+        p    = http_response_append(p, KEPT[i]);
+        *p++ = ':';
+        *p++ = ' ';
+        p    = http_response_append(p, value);
+        p    = http_response_append(p, HTTP_NEWLINE);
+    }
+    assert((size_t)(p - extra) <= headers.len);
 
-    return a3_buf_write_str(http_response_send_buf(resp), HTTP_NEWLINE);
+    HttpResponseHead head =
+        http_response_head(resp, HTTP_STATUS_NOT_MODIFIED, 0, HTTP_RESPONSE_ALLOW);
+    head.content_type   = HTTP_CONTENT_TYPE_INVALID;
+    head.content_length = HTTP_CONTENT_LENGTH_UNSPECIFIED;
+    head.extra          = (A3CString) { .ptr = extra, .len = (size_t)(p - extra) };
+
+    return http_response_head_submit(resp, uring, &head);
 }
 
-// Write out a response body to the send buffer.
-static bool http_response_prep_body(HttpResponse* resp, A3CString body) {
+// Work out which part of a representation of the given size is sent. The body's offset is
+// relative to the start of the representation.
+static HttpRangeResult http_response_range_select(HttpResponse* resp, A3CString headers,
+                                                  uint64_t size, HttpRange* range) {
     assert(resp);
+    assert(headers.ptr);
+    assert(range);
 
-    return a3_buf_write_str(http_response_send_buf(resp), body);
+    HttpConnection* conn = http_response_connection(resp);
+    HttpHeaders*    req  = &conn->request.headers;
+
+    *range = (HttpRange) { .first = 0, .last = size - 1 };
+    HttpRangeResult ret =
+        conn->method == HTTP_METHOD_GET ? http_header_range(req, size, range) : HTTP_RANGE_NONE;
+    if (ret != HTTP_RANGE_NONE &&
+        !http_header_if_range(req, http_response_header_find(headers, A3_CS("Etag")),
+                              http_response_header_find(headers, A3_CS("Last-Modified"))))
+        ret = HTTP_RANGE_NONE;
+    resp->body_offset   = ret == HTTP_RANGE_SATISFIABLE ? range->first : 0;
+    resp->body_len      = ret == HTTP_RANGE_SATISFIABLE ? range->last - range->first + 1 : size;
+
+    return ret;
 }
 
-static A3CString http_response_error_make_body(HttpResponse* resp, HttpStatus status) {
+// Write the head for a representation whose headers begin with Content-Length, narrowed to the
+// selected range if there is one.
+static bool http_response_representation_head(HttpResponse* resp, A3CString headers,
+                                               uint64_t size, HttpRangeResult ranged,
+                                               HttpRange range) {
     assert(resp);
-    assert(status != HTTP_STATUS_INVALID);
+    assert(headers.ptr);
+
+    uint8_t          extra[HTTP_RESPONSE_RANGE_HEADERS_MAX];
+    HttpResponseHead head =
+        http_response_head(resp, HTTP_STATUS_OK, (ssize_t)size, HTTP_RESPONSE_ALLOW);
+    head.content_type   = HTTP_CONTENT_TYPE_INVALID;
+    head.content_length = HTTP_CONTENT_LENGTH_UNSPECIFIED;
+    head.extra          = headers;
+    if (ranged == HTTP_RANGE_SATISFIABLE) {
+        head.status         = HTTP_STATUS_PARTIAL_CONTENT;
+        head.content_length = (ssize_t)resp->body_len;
+        head.extra          = http_response_range_headers(extra, headers, size, range);
+    }
 
-    static uint8_t  body[HTTP_ERROR_BODY_MAX_LENGTH] = { '\0' };
-    ssize_t         len                              = 0;
-    uint16_t        status_code                      = http_status_code(status);
-    HttpConnection* conn                             = http_response_connection(resp);
-
-    // TODO: De-uglify. Probably should load a template from somewhere.
-    if ((len = snprintf((char*)body, HTTP_ERROR_BODY_MAX_LENGTH,
-                        "<!DOCTYPE html>\n"
-                        "<html>\n"
-                        "<head>\n"
-                        "<title>Error: %d</title>\n"
-                        "</head>\n"
-                        "<body>\n"
-                        "<h1>%s Error %d</h1>\n"
-                        "<p>%s.</p>\n"
-                        "</body>\n"
-                        "</html>\n",
-                        status_code, http_version_string(conn->version).ptr, status_code,
-                        http_status_reason(status).ptr)) > HTTP_ERROR_BODY_MAX_LENGTH ||
-        len < 0)
-        return A3_CS_NULL;
-
-    return (A3CString) { .ptr = body, .len = (size_t)len };
+    return http_response_prep_head(resp, &head);
+}
+
+// Find the body in memory, either in the whole-file content cache or in cached blocks. Returns the
+// number of parts written to out, or 0 if the body has to come from disk.
+static size_t http_response_body_cached(HttpResponse* resp, struct io_uring* uring,
+                                        A3CString* out) {
+    assert(resp);
+    assert(uring);
+    assert(out);
+
+    HttpConnection* conn    = http_response_connection(resp);
+    uint64_t        first   = resp->body_offset;
+    uint64_t        last    = resp->body_offset + resp->body_len - 1;
+    A3CString       content = file_handle_content(conn->target_file, uring);
+    if (content.ptr) {
+        out[0] = (A3CString) { .ptr = content.ptr + first, .len = (size_t)resp->body_len };
+        return 1;
+    }
+
+    // Whole-file responses for large files are left to splice. Caching every block of them would
+    // only push out the hot ranges.
+    if (file_handle_stat(conn->target_file)->stx_size <= FILE_CONTENT_MAX ||
+        (first == 0 && resp->body_len == file_handle_stat(conn->target_file)->stx_size))
+        return 0;
+
+    resp->n_blocks = file_block_find(conn->target_file, uring, first, last, resp->blocks,
+                                     FILE_BLOCK_RANGE_MAX);
+    for (size_t i = 0; i < resp->n_blocks; i++)
+        out[i] = file_block_data(resp->blocks[i], first, last);
+
+    return resp->n_blocks;
 }
 
 // Submit a write event for an HTTP error response.
@@ -337,22 +517,14 @@ bool http_response_error_submit(HttpResponse* resp, struct io_uring* uring, Http
     resp->content_type = HTTP_CONTENT_TYPE_TEXT_HTML;
     if (conn->version == HTTP_VERSION_INVALID || conn->version == HTTP_VERSION_UNKNOWN)
         conn->version = HTTP_VERSION_11;
-
-    A3CString body = http_response_error_make_body(resp, status);
-    A3_TRYB(body.ptr);
-
-    A3_TRYB(http_response_prep_default_headers(resp, status, (ssize_t)body.len, close));
-    A3_TRYB(http_response_prep_headers_done(resp));
-
-    if (conn->method != HTTP_METHOD_HEAD)
-        A3_TRYB(http_response_prep_body(resp, body));
-
-    A3_TRYB(connection_send_submit(&conn->conn, uring, close ? NULL : http_response_handle, 0,
-                                   close ? IOSQE_IO_LINK : 0));
     if (close)
-        return http_connection_close_submit(conn, uring);
+        conn->connection_type = HTTP_CONNECTION_TYPE_CLOSE;
 
-    return true;
+    // Once everything is out, http_response_handle closes the connection if need be.
+    A3CString body;
+    A3_TRYB(http_error_response(http_response_send_buf(resp), status, conn->version, close,
+                                conn->method == HTTP_METHOD_HEAD, &body));
+    return connection_send_body_submit(&conn->conn, uring, http_response_handle, &body, 1, 0);
 }
 
 static void http_response_file_open_handle(EventTarget* target, struct io_uring* uring, void* ctx,
@@ -372,34 +544,225 @@ static void http_response_file_open_handle(EventTarget* target, struct io_uring*
     http_connection_free(conn, uring);
 }
 
+// Send the head, followed by the body. Bodies held in memory are given as parts, and go out with
+// the head in one send. Otherwise, the body is spliced from its file.
+static bool http_response_body_submit(HttpResponse* resp, struct io_uring* uring,
+                                      A3CString const* parts, size_t n_parts) {
+    assert(resp);
+    assert(uring);
+
+    HttpConnection* conn = http_response_connection(resp);
+    bool            body = conn->method != HTTP_METHOD_HEAD && resp->body_len;
+
+    // A short send is resumed from its completion, so the close cannot be linked after it. Once
+    // everything is out, http_response_handle closes the connection if need be.
+    if (n_parts)
+        return connection_send_body_submit(&conn->conn, uring, http_response_handle, parts,
+                                           n_parts, 0);
+
+    // TODO: Perhaps instead of just sending here, it would be better to write into the same pipe
+    // that is used for splice.
+    A3_TRYB(connection_send_submit(
+        &conn->conn, uring, body ? NULL : http_response_handle, body ? MSG_MORE : 0,
+        (body || !http_connection_keep_alive(conn)) ? IOSQE_IO_LINK : 0));
+    if (!body)
+        goto done;
+
+    // TODO: This will not work for TLS.
+    A3_TRYB(connection_splice_submit(&conn->conn, uring, http_response_splice_chain_handle,
+                                     http_response_splice_handle, http_response_body_fd(conn),
+                                     resp->body_offset, resp->body_len,
+                                     !http_connection_keep_alive(conn) ? IOSQE_IO_LINK : 0));
+
+done:
+    if (!http_connection_keep_alive(conn))
+        return http_connection_close_submit(conn, uring);
+    return true;
+}
+
+// Serve a request from the pack. Directories are packed under their path without a trailing slash,
+// as aliases of their index file.
+static bool http_response_pack_submit(HttpResponse* resp, struct io_uring* uring) {
+    assert(resp);
+    assert(uring);
+
+    HttpConnection* conn = http_response_connection(resp);
+    A3CString       path = A3_S_CONST(conn->request.target_path);
+    if (path.len > 1 && path.ptr[path.len - 1] == '/')
+        path.len--;
+
+    PackEntry const* entry = pack_find(path);
+    if (!entry)
+        return http_response_error_submit(resp, uring, HTTP_STATUS_NOT_FOUND, HTTP_RESPONSE_ALLOW);
+
+    PackBody const* body = &entry->bodies[PACK_VARIANT_IDENTITY];
+    if (pack_body_present(&entry->bodies[PACK_VARIANT_GZIP]) &&
+        http_header_accepts_encoding(&conn->request.headers, A3_CS("gzip")))
+        body = &entry->bodies[PACK_VARIANT_GZIP];
+
+    conn->state = HTTP_CONNECTION_RESPONDING;
+
+    A3CString  headers   = pack_body_headers(body);
+    HttpStatus condition = http_response_preconditions(resp, headers);
+    if (condition != HTTP_STATUS_OK)
+        return http_response_condition_submit(resp, uring, condition, headers);
+
+    HttpRange       range;
+    HttpRangeResult ranged = http_response_range_select(resp, headers, body->size, &range);
+    if (ranged == HTTP_RANGE_UNSATISFIABLE)
+        return http_response_range_error_submit(resp, uring, headers, body->size);
+    A3_TRYB(http_response_representation_head(resp, headers, body->size, ranged, range));
+
+    // Small bodies are sent straight from the mapping. Larger ones are spliced, so that the ring
+    // does not stall on faulting them in.
+    A3CString part = { .ptr = pack_body_content(body).ptr + resp->body_offset,
+                       .len = (size_t)resp->body_len };
+    bool      send = conn->method != HTTP_METHOD_HEAD && resp->body_len &&
+                resp->body_len <= FILE_CONTENT_MAX;
+    resp->body_offset += body->offset;
+
+    return http_response_body_submit(resp, uring, &part, send ? 1 : 0);
+}
+
+// Answer with the representation of the target file, or a head alone if the request's conditions
+// or method call for no body. The file need not be open unless there is a body.
+static bool http_response_representation_submit(HttpResponse* resp, struct io_uring* uring) {
+    assert(resp);
+    assert(uring);
+
+    HttpConnection* conn = http_response_connection(resp);
+    struct statx*   stat = file_handle_stat(conn->target_file);
+
+    conn->state = HTTP_CONNECTION_RESPONDING;
+
+    // Conditional requests are answered from the headers kept with the handle, without touching
+    // the file.
+    uint8_t    scratch[FILE_HANDLE_HEADERS_MAX];
+    A3CString  headers   = http_response_file_headers(conn->target_file, scratch);
+    HttpStatus condition = http_response_preconditions(resp, headers);
+    if (condition != HTTP_STATUS_OK)
+        return http_response_condition_submit(resp, uring, condition, headers);
+
+    HttpRange       range;
+    HttpRangeResult ranged = http_response_range_select(resp, headers, stat->stx_size, &range);
+    if (ranged == HTTP_RANGE_UNSATISFIABLE)
+        return http_response_range_error_submit(resp, uring, headers, stat->stx_size);
+    A3_TRYB(http_response_representation_head(resp, headers, stat->stx_size, ranged, range));
+
+    bool      body = conn->method != HTTP_METHOD_HEAD && resp->body_len;
+    A3CString parts[FILE_BLOCK_RANGE_MAX];
+    size_t    n_parts = body ? http_response_body_cached(resp, uring, parts) : 0;
+
+    return http_response_body_submit(resp, uring, parts, n_parts);
+}
+
+// Whether the request may be answered without the body, from the file's metadata alone.
+static bool http_response_stat_may_answer(HttpConnection* conn) {
+    assert(conn);
+
+    HttpHeaders* req = &conn->request.headers;
+    return conn->method == HTTP_METHOD_HEAD ||
+           http_header_count(req, HTTP_HEADER_IF_NONE_MATCH) ||
+           http_header_count(req, HTTP_HEADER_IF_MODIFIED_SINCE);
+}
+
+// The stat of the target is known, but its open is still in flight. Answer now if no body is
+// needed, and otherwise, wait for the open.
+static bool http_response_stat_submit(HttpResponse* resp, struct io_uring* uring) {
+    assert(resp);
+    assert(uring);
+
+    HttpConnection* conn = http_response_connection(resp);
+    resp->stat_only      = false;
+
+    if (S_ISREG(file_handle_stat(conn->target_file)->stx_mode)) {
+        uint8_t   scratch[FILE_HANDLE_HEADERS_MAX];
+        A3CString headers = http_response_file_headers(conn->target_file, scratch);
+        if (conn->method == HTTP_METHOD_HEAD ||
+            http_response_preconditions(resp, headers) != HTTP_STATUS_OK)
+            return http_response_representation_submit(resp, uring);
+    }
+
+    if (file_handle_open_wait(conn->target_file, EVT(&conn->conn), http_response_file_open_handle,
+                              NULL))
+        return true;
+    return http_response_file_submit(resp, uring);
+}
+
+// The path of a directory's index file, written into out. Returns a null string if it does not fit.
+static A3CString http_response_index_path(A3CString dir, A3String out) {
+    assert(dir.ptr && dir.len);
+    assert(out.ptr);
+
+    A3CString sep = dir.ptr[dir.len - 1] == '/' ? A3_CS("") : A3_CS("/");
+    A3_TRYB_MAP(dir.len + sep.len + INDEX_FILENAME.len <= out.len, A3_CS_NULL);
+
+    memcpy(out.ptr, dir.ptr, dir.len);
+    memcpy(&out.ptr[dir.len], sep.ptr, sep.len);
+    memcpy(&out.ptr[dir.len + sep.len], INDEX_FILENAME.ptr, INDEX_FILENAME.len);
+
+    return (A3CString) { .ptr = out.ptr, .len = dir.len + sep.len + INDEX_FILENAME.len };
+}
+
 bool http_response_file_submit(HttpResponse* resp, struct io_uring* uring) {
     assert(resp);
     assert(uring);
 
+    if (pack_loaded())
+        return http_response_pack_submit(resp, uring);
+
     HttpConnection* conn = http_response_connection(resp);
 
+    // A directory which the index of the root knows about is served from its index file, which is
+    // looked up directly rather than after an open and statx of the directory. Revalidations and
+    // HEAD requests need only the stat, so they do not wait for the open. A statx is not confined
+    // to the web root the way the open is, so this is only done for names which the index of the
+    // root knows to be regular files.
     if (!conn->target_file) {
-        conn->state       = HTTP_CONNECTION_OPENING_FILE;
-        conn->target_file = file_open(EVT(&conn->conn), uring, http_response_file_open_handle, NULL,
-                                      A3_S_CONST(conn->request.target_path), O_RDONLY);
+        uint8_t      index_buf[HTTP_REQUEST_TARGET_BUF_LENGTH];
+        A3CString    path = A3_S_CONST(conn->request.target_path);
+        FileTreeKind kind = file_tree_find(path);
+        if (kind == FILE_TREE_DIR) {
+            A3CString index = http_response_index_path(
+                path, (A3String) { .ptr = index_buf, .len = sizeof(index_buf) });
+            FileTreeKind index_kind = index.ptr ? file_tree_find(index) : FILE_TREE_UNKNOWN;
+            if (index_kind == FILE_TREE_FILE || index_kind == FILE_TREE_ABSENT) {
+                path        = index;
+                kind        = index_kind;
+                resp->index = true;
+            }
+        }
+
+        conn->state     = HTTP_CONNECTION_OPENING_FILE;
+        resp->stat_only = http_response_stat_may_answer(conn) && kind == FILE_TREE_FILE;
+        if (resp->stat_only)
+            conn->target_file = file_open_stat(EVT(&conn->conn), uring,
+                                               http_response_file_open_handle, NULL, path,
+                                               O_RDONLY);
+        else
+            conn->target_file = file_open(EVT(&conn->conn), uring, http_response_file_open_handle,
+                                          NULL, path, O_RDONLY);
     }
 
     if (!conn->target_file)
         return http_response_error_submit(resp, uring, HTTP_STATUS_SERVER_ERROR,
                                           HTTP_RESPONSE_ALLOW);
 
-    if (file_handle_waiting(conn->target_file))
+    if (file_handle_waiting(conn->target_file)) {
+        if (resp->stat_only && file_handle_stat_known(conn->target_file))
+            return http_response_stat_submit(resp, uring);
         return true;
+    }
+    resp->stat_only = false;
 
     fd target_file = file_handle_fd_unchecked(conn->target_file);
     if (target_file < 0)
         return http_response_error_submit(resp, uring, HTTP_STATUS_NOT_FOUND, HTTP_RESPONSE_ALLOW);
 
-    bool          index = false;
-    struct statx* stat  = file_handle_stat(conn->target_file);
+    struct statx* stat = file_handle_stat(conn->target_file);
     assert(stat->stx_mask & FILE_STATX_MASK);
 
-    if (S_ISDIR(stat->stx_mode)) {
+    if (S_ISDIR(stat->stx_mode) && !resp->index) {
         FileHandle* index_file =
             file_openat(EVT(&conn->conn), uring, http_response_file_open_handle, NULL,
                         conn->target_file, INDEX_FILENAME, O_RDONLY);
@@ -409,6 +772,7 @@ bool http_response_file_submit(HttpResponse* resp, struct io_uring* uring) {
 
         file_handle_close(conn->target_file, uring);
         conn->target_file = index_file;
+        resp->index       = true;
         if (file_handle_waiting(conn->target_file))
             return true;
 
@@ -423,39 +787,9 @@ bool http_response_file_submit(HttpResponse* resp, struct io_uring* uring) {
     if (!S_ISREG(stat->stx_mode))
         return http_response_error_submit(resp, uring, HTTP_STATUS_NOT_FOUND, HTTP_RESPONSE_ALLOW);
 
-    conn->state = HTTP_CONNECTION_RESPONDING;
-
-    if (index)
-        resp->content_type = HTTP_CONTENT_TYPE_TEXT_HTML;
-    else
-        resp->content_type = http_content_type_from_path(file_handle_path(conn->target_file));
-
-    A3_TRYB(http_response_prep_default_headers(resp, HTTP_STATUS_OK, (ssize_t)stat->stx_size,
-                                               HTTP_RESPONSE_ALLOW));
-    A3_TRYB(
-        http_response_prep_header_timestamp(resp, A3_CS("Last-Modified"), stat->stx_mtime.tv_sec));
-    A3_TRYB(http_response_prep_header_fmt(resp, A3_CS("Etag"), "\"%lluX%lX%lX\"", stat->stx_ino,
-                                          (uint64_t)stat->stx_mtime.tv_sec,
-                                          (uint64_t)stat->stx_size));
-    A3_TRYB(http_response_prep_headers_done(resp));
-
-    bool body = conn->method != HTTP_METHOD_HEAD;
-    // TODO: Perhaps instead of just sending here, it would be better to write into the same pipe
-    // that is used for splice.
-    A3_TRYB(connection_send_submit(
-        &conn->conn, uring, body ? NULL : http_response_handle, body ? MSG_MORE : 0,
-        (body || !http_connection_keep_alive(conn)) ? IOSQE_IO_LINK : 0));
-    if (!body)
-        goto done;
+    if (CONFIG.prefetch && http_content_type_from_path(file_handle_path(conn->target_file)) ==
+                               HTTP_CONTENT_TYPE_TEXT_HTML)
+        file_prefetch_page(conn->target_file, uring);
 
-    // TODO: This will not work for TLS.
-    A3_TRYB(connection_splice_submit(&conn->conn, uring, http_response_splice_chain_handle,
-                                     http_response_splice_handle, target_file, /* offset */ 0,
-                                     stat->stx_size,
-                                     !http_connection_keep_alive(conn) ? IOSQE_IO_LINK : 0));
-
-done:
-    if (!http_connection_keep_alive(conn))
-        return http_connection_close_submit(conn, uring);
-    return true;
+    return http_response_representation_submit(resp, uring);
 }
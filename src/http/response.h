@@ -20,7 +20,10 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
+#include "config.h"
 #include "forward.h"
 #include "http/types.h"
 
@@ -28,6 +31,19 @@ typedef struct HttpResponse {
     HttpContentType      content_type;
     HttpTransferEncoding transfer_encodings;
     size_t               body_sent;
+
+    // The part of the file which is sent. All of it, unless a range was requested.
+    uint64_t body_offset;
+    uint64_t body_len;
+
+    // Cached blocks the body is sent from, held until the response is done.
+    FileBlock* blocks[FILE_BLOCK_RANGE_MAX];
+    size_t     n_blocks;
+
+    // The file was looked up for its stat alone, and the open has not been waited on.
+    bool stat_only;
+    // The target is already the index file of the requested directory.
+    bool index;
 } HttpResponse;
 
 void http_response_init(HttpResponse*);
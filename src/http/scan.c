@@ -0,0 +1,194 @@
+/*
+ * SHORT CIRCUIT: HTTP SCAN -- Vectorized delimiter scanning for request parsing.
+ *
+ * Copyright (c) 2021, Alex O'Brien <3541ax@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Affero General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "http/scan.h"
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <a3/log.h>
+#include <a3/str.h>
+#include <a3/util.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HTTP_SCAN_X86
+#endif
+
+// Each implementation returns the offset of the first byte which is either a control character
+// other than HTAB, DEL, or the given delimiter. If there is no such byte, len is returned. A
+// delimiter of '\0' matches nothing extra, since NUL is already a control character.
+typedef size_t (*HttpScanFn)(const uint8_t* data, size_t len, uint8_t delim);
+
+static bool http_scan_is_ctl(uint8_t c) { return (c < 0x20 && c != '\t') || c == 0x7f; }
+
+static size_t http_scan_scalar(const uint8_t* data, size_t len, uint8_t delim) {
+    assert(data || !len);
+
+    for (size_t i = 0; i < len; i++)
+        if (http_scan_is_ctl(data[i]) || data[i] == delim)
+            return i;
+
+    return len;
+}
+
+#ifdef HTTP_SCAN_X86
+// PCMPESTRI can match against up to 8 byte ranges in one instruction, which covers everything of
+// interest here.
+__attribute__((target("sse4.2"))) static size_t http_scan_sse42(const uint8_t* data, size_t len,
+                                                                 uint8_t delim) {
+    assert(data || !len);
+
+    const __m128i ranges =
+        _mm_setr_epi8(0x00, 0x08, 0x0a, 0x1f, 0x7f, 0x7f, (char)delim, (char)delim, 0, 0, 0, 0, 0,
+                      0, 0, 0);
+
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i*)(const void*)(data + i));
+        int     index = _mm_cmpestri(ranges, 8, block, 16,
+                                     _SIDD_UBYTE_OPS | _SIDD_CMP_RANGES | _SIDD_LEAST_SIGNIFICANT);
+        if (index != 16)
+            return i + (size_t)index;
+    }
+
+    return i + http_scan_scalar(data + i, len - i, delim);
+}
+
+__attribute__((target("avx2"))) static size_t http_scan_avx2(const uint8_t* data, size_t len,
+                                                              uint8_t delim) {
+    assert(data || !len);
+
+    const __m256i ctl_max = _mm256_set1_epi8(0x1f);
+    const __m256i tab     = _mm256_set1_epi8('\t');
+    const __m256i del     = _mm256_set1_epi8(0x7f);
+    const __m256i needle  = _mm256_set1_epi8((char)delim);
+
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i*)(const void*)(data + i));
+
+        // Unsigned c <= 0x1f, without HTAB.
+        __m256i ctl = _mm256_cmpeq_epi8(_mm256_min_epu8(block, ctl_max), block);
+        ctl         = _mm256_andnot_si256(_mm256_cmpeq_epi8(block, tab), ctl);
+
+        __m256i hits = _mm256_or_si256(ctl, _mm256_cmpeq_epi8(block, del));
+        hits         = _mm256_or_si256(hits, _mm256_cmpeq_epi8(block, needle));
+
+        uint32_t mask = (uint32_t)_mm256_movemask_epi8(hits);
+        if (mask)
+            return i + (size_t)__builtin_ctz(mask);
+    }
+
+    return i + http_scan_sse42(data + i, len - i, delim);
+}
+#endif
+
+static HttpScanFn HTTP_SCAN = http_scan_scalar;
+
+// Use the given implementation, if the running CPU supports it.
+bool http_scan_select(HttpScanImpl impl) {
+    switch (impl) {
+    case HTTP_SCAN_IMPL_SCALAR:
+        HTTP_SCAN = http_scan_scalar;
+        return true;
+#ifdef HTTP_SCAN_X86
+    case HTTP_SCAN_IMPL_SSE42:
+        __builtin_cpu_init();
+        if (!__builtin_cpu_supports("sse4.2"))
+            return false;
+        HTTP_SCAN = http_scan_sse42;
+        return true;
+    case HTTP_SCAN_IMPL_AVX2:
+        __builtin_cpu_init();
+        if (!__builtin_cpu_supports("avx2"))
+            return false;
+        HTTP_SCAN = http_scan_avx2;
+        return true;
+#endif
+    default:
+        return false;
+    }
+}
+
+// Pick the best implementation for the running CPU.
+void http_scan_init() {
+    if (http_scan_select(HTTP_SCAN_IMPL_AVX2)) {
+        A3_DEBUG("Using AVX2 request scanner.");
+        return;
+    }
+    if (http_scan_select(HTTP_SCAN_IMPL_SSE42)) {
+        A3_DEBUG("Using SSE4.2 request scanner.");
+        return;
+    }
+
+    A3_DEBUG("Using scalar request scanner.");
+    http_scan_select(HTTP_SCAN_IMPL_SCALAR);
+}
+
+void http_line_reset(HttpLine* line) {
+    assert(line);
+
+    line->delim   = SIZE_MAX;
+    line->end     = 0;
+    line->scanned = 0;
+}
+
+// Find the end of the first line in data, and the first occurrence of delim before it. Bare CR,
+// bare LF, and other control characters make the line invalid. If the line is incomplete, the
+// next call picks up where this one left off, so data must start at the same place and the line
+// must not have been reset in between.
+HttpScanResult http_scan_line(A3CString data, uint8_t delim, HttpLine* line) {
+    assert(data.ptr || !data.len);
+    assert(delim && !http_scan_is_ctl(delim));
+    assert(line);
+    assert(line->scanned <= data.len);
+
+    for (size_t pos = line->scanned;;) {
+        // Once the delimiter has been seen, only the end of the line matters.
+        pos += HTTP_SCAN(data.ptr + pos, data.len - pos, line->delim == SIZE_MAX ? delim : '\0');
+        if (pos >= data.len) {
+            line->scanned = data.len;
+            return HTTP_SCAN_INCOMPLETE;
+        }
+
+        uint8_t c = data.ptr[pos];
+        if (c == delim && line->delim == SIZE_MAX) {
+            line->delim = pos++;
+            continue;
+        }
+
+        if (c != '\r')
+            return HTTP_SCAN_INVALID;
+        if (pos + 1 >= data.len) {
+            // Look at the CR again once the LF arrives.
+            line->scanned = pos;
+            return HTTP_SCAN_INCOMPLETE;
+        }
+        if (data.ptr[pos + 1] != '\n')
+            return HTTP_SCAN_INVALID;
+
+        line->end = pos;
+        if (line->delim == SIZE_MAX)
+            line->delim = pos;
+        return HTTP_SCAN_LINE;
+    }
+}
@@ -0,0 +1,52 @@
+/*
+ * SHORT CIRCUIT: HTTP SCAN -- Vectorized delimiter scanning for request parsing.
+ *
+ * Copyright (c) 2021, Alex O'Brien <3541ax@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Affero General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <a3/str.h>
+
+typedef enum HttpScanImpl {
+    HTTP_SCAN_IMPL_SCALAR,
+    HTTP_SCAN_IMPL_SSE42,
+    HTTP_SCAN_IMPL_AVX2,
+} HttpScanImpl;
+
+typedef enum HttpScanResult {
+    HTTP_SCAN_INCOMPLETE,
+    HTTP_SCAN_INVALID,
+    HTTP_SCAN_LINE,
+} HttpScanResult;
+
+// A single CRLF-terminated line. Offsets are relative to the start of the scanned data. A partial
+// line remembers how far it has been scanned, so the scan can resume when more data arrives
+// instead of starting over.
+typedef struct HttpLine {
+    size_t delim;   // First occurrence of the delimiter, or end if there is none.
+    size_t end;     // Position of the terminating CR.
+    size_t scanned; // Everything before this has already been scanned.
+} HttpLine;
+
+void           http_scan_init(void);
+bool           http_scan_select(HttpScanImpl);
+void           http_line_reset(HttpLine*);
+HttpScanResult http_scan_line(A3CString data, uint8_t delim, HttpLine*);
@@ -0,0 +1,229 @@
+/*
+ * SHORT CIRCUIT: HTTP SERIALIZE -- Response header serialization from precomputed fragments.
+ *
+ * Copyright (c) 2021, Alex O'Brien <3541ax@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Affero General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "http/serialize.h"
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <a3/buffer.h>
+#include <a3/str.h>
+#include <a3/util.h>
+
+#include "http/types.h"
+
+#define HTTP_SERIALIZE_FRAGMENT_MAX 96
+
+typedef struct HttpFragment {
+    uint8_t len;
+    uint8_t data[HTTP_SERIALIZE_FRAGMENT_MAX];
+} HttpFragment;
+
+// "<version> <code> <reason>\r\nConnection: <type>\r\n", for each combination.
+static HttpFragment HTTP_STATUS_FRAGMENTS[HTTP_VERSION_COUNT][HTTP_STATUS_COUNT][2];
+// "Content-Type: <type>\r\n".
+static HttpFragment HTTP_CONTENT_TYPE_FRAGMENTS[HTTP_CONTENT_TYPE_COUNT];
+static bool         HTTP_SERIALIZE_INITIALIZED = false;
+
+#define DATE_PREFIX           A3_CS("Date: ")
+#define CONTENT_LENGTH_PREFIX A3_CS("Content-Length: ")
+
+static void http_fragment_append(HttpFragment* frag, A3CString str) {
+    assert(frag);
+    assert(str.ptr || !str.len);
+    assert(frag->len + str.len <= HTTP_SERIALIZE_FRAGMENT_MAX);
+
+    memcpy(&frag->data[frag->len], str.ptr, str.len);
+    frag->len = (uint8_t)(frag->len + str.len);
+}
+
+static A3CString http_fragment_str(HttpFragment const* frag) {
+    assert(frag);
+
+    return (A3CString) { .ptr = frag->data, .len = frag->len };
+}
+
+void http_serialize_init() {
+    for (HttpVersion v = HTTP_VERSION_INVALID + 1; v < HTTP_VERSION_UNKNOWN; v++) {
+        for (HttpStatus status = HTTP_STATUS_INVALID + 1; status < HTTP_STATUS_COUNT; status++) {
+            uint8_t   code_buf[HTTP_SERIALIZE_NUM_MAX];
+            A3CString code = { .ptr = code_buf,
+                               .len = http_serialize_dec(code_buf, http_status_code(status)) };
+
+            for (size_t keep_alive = 0; keep_alive < 2; keep_alive++) {
+                HttpFragment* frag = &HTTP_STATUS_FRAGMENTS[v][status][keep_alive];
+
+                http_fragment_append(frag, http_version_string(v));
+                http_fragment_append(frag, A3_CS(" "));
+                http_fragment_append(frag, code);
+                http_fragment_append(frag, A3_CS(" "));
+                http_fragment_append(frag, http_status_reason(status));
+                http_fragment_append(frag, HTTP_NEWLINE);
+                http_fragment_append(frag, A3_CS("Connection: "));
+                http_fragment_append(frag, keep_alive ? A3_CS("Keep-Alive") : A3_CS("Close"));
+                http_fragment_append(frag, HTTP_NEWLINE);
+            }
+        }
+    }
+
+    for (HttpContentType t = HTTP_CONTENT_TYPE_INVALID + 1; t < HTTP_CONTENT_TYPE_COUNT; t++) {
+        HttpFragment* frag = &HTTP_CONTENT_TYPE_FRAGMENTS[t];
+        http_fragment_append(frag, A3_CS("Content-Type: "));
+        http_fragment_append(frag, http_content_type_name(t));
+        http_fragment_append(frag, HTTP_NEWLINE);
+    }
+
+    HTTP_SERIALIZE_INITIALIZED = true;
+}
+
+// Write the decimal representation of a number, two digits at a time. Returns the length.
+size_t http_serialize_dec(uint8_t* out, uint64_t n) {
+    assert(out);
+
+    static const char DIGITS[] = "00010203040506070809"
+                                 "10111213141516171819"
+                                 "20212223242526272829"
+                                 "30313233343536373839"
+                                 "40414243444546474849"
+                                 "50515253545556575859"
+                                 "60616263646566676869"
+                                 "70717273747576777879"
+                                 "80818283848586878889"
+                                 "90919293949596979899";
+
+    uint8_t tmp[HTTP_SERIALIZE_NUM_MAX];
+    size_t  pos = sizeof(tmp);
+    while (n >= 100) {
+        size_t i = (size_t)(n % 100) * 2;
+        n /= 100;
+        tmp[--pos] = (uint8_t)DIGITS[i + 1];
+        tmp[--pos] = (uint8_t)DIGITS[i];
+    }
+    if (n >= 10) {
+        tmp[--pos] = (uint8_t)DIGITS[n * 2 + 1];
+        tmp[--pos] = (uint8_t)DIGITS[n * 2];
+    } else {
+        tmp[--pos] = (uint8_t)('0' + n);
+    }
+
+    size_t len = sizeof(tmp) - pos;
+    memcpy(out, &tmp[pos], len);
+    return len;
+}
+
+// Write the uppercase hexadecimal representation of a number. Returns the length.
+size_t http_serialize_hex(uint8_t* out, uint64_t n) {
+    assert(out);
+
+    static const char DIGITS[] = "0123456789ABCDEF";
+
+    size_t len = 1;
+    for (uint64_t rest = n >> 4; rest; rest >>= 4)
+        len++;
+    for (size_t i = len; i > 0; i--, n >>= 4)
+        out[i - 1] = (uint8_t)DIGITS[n & 0xF];
+
+    return len;
+}
+
+static HttpFragment const* http_serialize_status(HttpResponseHead const* head) {
+    assert(head);
+    assert(HTTP_SERIALIZE_INITIALIZED);
+    assert(head->version > HTTP_VERSION_INVALID && head->version < HTTP_VERSION_UNKNOWN);
+    assert(head->status > HTTP_STATUS_INVALID && head->status < HTTP_STATUS_COUNT);
+
+    return &HTTP_STATUS_FRAGMENTS[head->version][head->status][head->keep_alive];
+}
+
+// The exact length of the serialized head, including the blank line which ends it.
+size_t http_serialize_head_len(HttpResponseHead const* head) {
+    assert(head);
+    assert(head->content_type < HTTP_CONTENT_TYPE_COUNT);
+
+    size_t ret = http_serialize_status(head)->len;
+    if (head->date.ptr)
+        ret += DATE_PREFIX.len + head->date.len + HTTP_NEWLINE.len;
+    if (head->content_length >= 0) {
+        uint8_t num[HTTP_SERIALIZE_NUM_MAX];
+        ret += CONTENT_LENGTH_PREFIX.len + http_serialize_dec(num, (uint64_t)head->content_length) +
+               HTTP_NEWLINE.len;
+    }
+    ret += HTTP_CONTENT_TYPE_FRAGMENTS[head->content_type].len;
+    ret += head->extra.len + HTTP_NEWLINE.len;
+
+    return ret;
+}
+
+// The offset of the Date value in the serialized head.
+size_t http_serialize_date_offset(HttpResponseHead const* head) {
+    assert(head);
+    assert(head->date.ptr);
+
+    return http_serialize_status(head)->len + DATE_PREFIX.len;
+}
+
+// Write the head to out, which must have space for http_serialize_head_len bytes.
+void http_serialize_head_to(uint8_t* out, HttpResponseHead const* head) {
+    assert(out);
+    assert(head);
+
+#define WRITE(S)                                                                                   \
+    do {                                                                                           \
+        A3CString _s = (S);                                                                        \
+        memcpy(out, _s.ptr, _s.len);                                                               \
+        out += _s.len;                                                                             \
+    } while (0)
+
+    WRITE(http_fragment_str(http_serialize_status(head)));
+    if (head->date.ptr) {
+        WRITE(DATE_PREFIX);
+        WRITE(head->date);
+        WRITE(HTTP_NEWLINE);
+    }
+    if (head->content_length >= 0) {
+        WRITE(CONTENT_LENGTH_PREFIX);
+        out += http_serialize_dec(out, (uint64_t)head->content_length);
+        WRITE(HTTP_NEWLINE);
+    }
+    WRITE(http_fragment_str(&HTTP_CONTENT_TYPE_FRAGMENTS[head->content_type]));
+    if (head->extra.len)
+        WRITE(head->extra);
+    WRITE(HTTP_NEWLINE);
+
+#undef WRITE
+}
+
+// Write the head to the buffer with a single bounds check.
+bool http_serialize_head(A3Buffer* buf, HttpResponseHead const* head) {
+    assert(buf);
+    assert(head);
+
+    size_t len = http_serialize_head_len(head);
+    A3_TRYB(a3_buf_ensure_cap(buf, len));
+
+    A3String space = a3_buf_write_ptr(buf);
+    A3_TRYB(space.len >= len);
+
+    http_serialize_head_to(space.ptr, head);
+    a3_buf_wrote(buf, len);
+
+    return true;
+}
@@ -0,0 +1,51 @@
+/*
+ * SHORT CIRCUIT: HTTP SERIALIZE -- Response header serialization from precomputed fragments.
+ *
+ * Copyright (c) 2021, Alex O'Brien <3541ax@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Affero General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <a3/buffer.h>
+#include <a3/str.h>
+
+#include "http/types.h"
+
+// Enough for any 64-bit integer in decimal or hexadecimal.
+#define HTTP_SERIALIZE_NUM_MAX 20
+
+typedef struct HttpResponseHead {
+    HttpVersion     version;
+    HttpStatus      status;
+    bool            keep_alive;
+    HttpContentType content_type;   // Omitted if invalid.
+    ssize_t         content_length; // Omitted if negative.
+    A3CString       date;
+    A3CString       extra; // Complete header lines to add after the standard ones.
+} HttpResponseHead;
+
+void   http_serialize_init(void);
+size_t http_serialize_dec(uint8_t* out, uint64_t);
+size_t http_serialize_hex(uint8_t* out, uint64_t);
+size_t http_serialize_head_len(HttpResponseHead const*);
+size_t http_serialize_date_offset(HttpResponseHead const*);
+void   http_serialize_head_to(uint8_t* out, HttpResponseHead const*);
+bool   http_serialize_head(A3Buffer*, HttpResponseHead const*);
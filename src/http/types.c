@@ -21,12 +21,47 @@
 #include "http/types.h"
 
 #include <assert.h>
+#include <stdbool.h>
 #include <stddef.h>
 
+#include <a3/log.h>
 #include <a3/str.h>
 #include <a3/util.h>
 
-HttpMethod http_request_method_parse(A3CString str) {
+// Known tokens are dispatched on their length and final byte, so that recognizing one costs a
+// single comparison no matter how many candidates there are. The slot function is collision-free
+// for the tokens below, which is checked when the tables are built.
+#define HTTP_DISPATCH_SLOTS 8
+
+static A3CString   HTTP_METHOD_SLOT_NAMES[HTTP_DISPATCH_SLOTS];
+static HttpMethod  HTTP_METHOD_SLOTS[HTTP_DISPATCH_SLOTS];
+static A3CString   HTTP_VERSION_SLOT_NAMES[HTTP_DISPATCH_SLOTS];
+static HttpVersion HTTP_VERSION_SLOTS[HTTP_DISPATCH_SLOTS];
+
+#define _VERSION(V, S) [V] = A3_CS(S),
+static const A3CString HTTP_VERSION_STRINGS[] = { HTTP_VERSION_ENUM };
+#undef _VERSION
+
+static size_t http_dispatch_slot(A3CString str) {
+    assert(str.ptr && str.len);
+
+    return (str.len + (str.ptr[str.len - 1] | 0x20)) % HTTP_DISPATCH_SLOTS;
+}
+
+static size_t http_dispatch_insert(A3CString* slots, A3CString token) {
+    assert(slots);
+
+    size_t slot = http_dispatch_slot(token);
+    if (slots[slot].ptr)
+        A3_PANIC_FMT("HTTP tokens " A3_S_F " and " A3_S_F " share a dispatch slot.",
+                     A3_S_FORMAT(slots[slot]), A3_S_FORMAT(token));
+    slots[slot] = token;
+
+    return slot;
+}
+
+// Build the dispatch tables. Called once, before any request is parsed.
+void http_types_init() {
 #define _METHOD(M, N) { M, A3_CS(N) },
     static const struct {
         HttpMethod method;
@@ -34,34 +69,45 @@ HttpMethod http_request_method_parse(A3CString str) {
     } HTTP_METHOD_NAMES[] = { HTTP_METHOD_ENUM };
 #undef _METHOD
 
-    if (!str.ptr || !*str.ptr)
+    for (size_t i = 0; i < sizeof(HTTP_METHOD_NAMES) / sizeof(HTTP_METHOD_NAMES[0]); i++) {
+        HttpMethod method = HTTP_METHOD_NAMES[i].method;
+        if (method == HTTP_METHOD_INVALID || method == HTTP_METHOD_UNKNOWN)
+            continue;
+        size_t slot = http_dispatch_insert(HTTP_METHOD_SLOT_NAMES, HTTP_METHOD_NAMES[i].name);
+        HTTP_METHOD_SLOTS[slot] = method;
+    }
+
+    for (HttpVersion v = HTTP_VERSION_INVALID + 1; v < HTTP_VERSION_UNKNOWN; v++) {
+        size_t slot = http_dispatch_insert(HTTP_VERSION_SLOT_NAMES, HTTP_VERSION_STRINGS[v]);
+        HTTP_VERSION_SLOTS[slot] = v;
+    }
+}
+
+HttpMethod http_request_method_parse(A3CString str) {
+    if (!str.ptr || !*str.ptr || !str.len)
         return HTTP_METHOD_INVALID;
 
     A3_TRYB_MAP(str.ptr && a3_string_isascii(str), HTTP_METHOD_INVALID);
 
-    for (size_t i = 0; i < sizeof(HTTP_METHOD_NAMES) / sizeof(HTTP_METHOD_NAMES[0]); i++) {
-        if (a3_string_cmpi(str, HTTP_METHOD_NAMES[i].name) == 0)
-            return HTTP_METHOD_NAMES[i].method;
-    }
+    size_t slot = http_dispatch_slot(str);
+    if (HTTP_METHOD_SLOT_NAMES[slot].ptr && a3_string_cmpi(str, HTTP_METHOD_SLOT_NAMES[slot]) == 0)
+        return HTTP_METHOD_SLOTS[slot];
 
     return HTTP_METHOD_UNKNOWN;
 }
 
-#define _VERSION(V, S) [V] = A3_CS(S),
-static const A3CString HTTP_VERSION_STRINGS[] = { HTTP_VERSION_ENUM };
-#undef _VERSION
-
 A3CString http_version_string(HttpVersion version) { return HTTP_VERSION_STRINGS[version]; }
 
 HttpVersion http_version_parse(A3CString str) {
-    if (!str.ptr || !*str.ptr)
+    if (!str.ptr || !*str.ptr || !str.len)
         return HTTP_VERSION_INVALID;
 
     A3_TRYB_MAP(str.ptr && a3_string_isascii(str), HTTP_VERSION_INVALID);
 
-    for (HttpVersion v = HTTP_VERSION_INVALID + 1; v < HTTP_VERSION_UNKNOWN; v++)
-        if (a3_string_cmpi(str, HTTP_VERSION_STRINGS[v]) == 0)
-            return v;
+    size_t slot = http_dispatch_slot(str);
+    if (HTTP_VERSION_SLOT_NAMES[slot].ptr &&
+        a3_string_cmpi(str, HTTP_VERSION_SLOT_NAMES[slot]) == 0)
+        return HTTP_VERSION_SLOTS[slot];
 
     return HTTP_VERSION_UNKNOWN;
 }
@@ -49,6 +49,7 @@ typedef enum HttpVersion {
 #define _VERSION(V, S) V,
     HTTP_VERSION_ENUM
 #undef _VERSION
+    HTTP_VERSION_COUNT
 } HttpVersion;
 
 #define HTTP_CONTENT_TYPE_ENUM                                                                     \
@@ -73,16 +74,21 @@ typedef enum HttpContentType {
 #define _CTYPE(T, S) T,
     HTTP_CONTENT_TYPE_ENUM
 #undef _CTYPE
+    HTTP_CONTENT_TYPE_COUNT
 } HttpContentType;
 
 #define HTTP_STATUS_ENUM                                                                           \
     _STATUS(0, HTTP_STATUS_INVALID, "Invalid error")                                               \
     _STATUS(200, HTTP_STATUS_OK, "OK")                                                             \
+    _STATUS(206, HTTP_STATUS_PARTIAL_CONTENT, "Partial Content")                                   \
+    _STATUS(304, HTTP_STATUS_NOT_MODIFIED, "Not Modified")                                         \
     _STATUS(400, HTTP_STATUS_BAD_REQUEST, "Bad Request")                                           \
     _STATUS(404, HTTP_STATUS_NOT_FOUND, "Not Found")                                               \
     _STATUS(408, HTTP_STATUS_TIMEOUT, "Request Timeout")                                           \
+    _STATUS(412, HTTP_STATUS_PRECONDITION_FAILED, "Precondition Failed")                           \
     _STATUS(413, HTTP_STATUS_PAYLOAD_TOO_LARGE, "Payload Too Large")                               \
     _STATUS(414, HTTP_STATUS_URI_TOO_LONG, "URI Too Long")                                         \
+    _STATUS(416, HTTP_STATUS_RANGE_NOT_SATISFIABLE, "Range Not Satisfiable")                       \
     _STATUS(418, HTCPCP_STATUS_IM_A_TEAPOT, "I'm a teapot")                                        \
     _STATUS(431, HTTP_STATUS_HEADER_TOO_LARGE, "Request Header Fields Too Large")                  \
     _STATUS(500, HTTP_STATUS_SERVER_ERROR, "Internal Server Error")                                \
@@ -93,6 +99,7 @@ typedef enum HttpStatus {
 #define _STATUS(CODE, TYPE, REASON) TYPE,
     HTTP_STATUS_ENUM
 #undef _STATUS
+    HTTP_STATUS_COUNT
 } HttpStatus;
 
 #define HTTP_CONNECTION_TYPE_ENUM                                                                  \
@@ -141,6 +148,7 @@ typedef enum HttpRequestStateResult {
     HTTP_REQUEST_STATE_DONE
 } HttpRequestStateResult;
 
+void                 http_types_init(void);
 HttpMethod           http_request_method_parse(A3CString str);
 HttpVersion          http_version_parse(A3CString str);
 HttpContentType      http_content_type_from_path(A3CString);
@@ -0,0 +1,51 @@
+/*
+ * SHORT CIRCUIT: IOV -- Scatter/gather I/O helpers.
+ *
+ * Copyright (c) 2021, Alex O'Brien <3541ax@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Affero General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "iov.h"
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <a3/util.h>
+
+// Move a message past the bytes a short send or write got through, so the rest can be resubmitted.
+// The iovecs are changed in place. Returns true if anything is left.
+bool iov_advance(struct msghdr* msg, size_t sent) {
+    assert(msg);
+
+    while (msg->msg_iovlen && (sent || !msg->msg_iov->iov_len)) {
+        struct iovec* iov = msg->msg_iov;
+        size_t        n   = MIN(sent, iov->iov_len);
+
+        iov->iov_base = (uint8_t*)iov->iov_base + n;
+        iov->iov_len -= n;
+        sent -= n;
+        if (!iov->iov_len) {
+            msg->msg_iov++;
+            msg->msg_iovlen--;
+        }
+    }
+    assert(!sent);
+
+    return msg->msg_iovlen;
+}
@@ -21,11 +21,13 @@
  * final interface.
  */
 
+#include <assert.h>
 #include <errno.h>
 #include <getopt.h>
 #include <liburing.h>
 #include <signal.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/stat.h>
@@ -35,32 +37,89 @@
 #include <a3/str.h>
 #include <a3/util.h>
 
+#include "clock.h"
 #include "config.h"
 #include "config_runtime.h"
 #include "connection.h"
 #include "event.h"
 #include "event/handle.h"
 #include "file.h"
+#include "file_block.h"
+#include "file_prefetch.h"
+#include "file_warm.h"
+#include "file_watch.h"
 #include "forward.h"
 #include "http/connection.h"
+#include "http/error.h"
+#include "http/headers.h"
+#include "http/scan.h"
+#include "http/serialize.h"
+#include "http/types.h"
 #include "listen.h"
+#include "mem.h"
+#include "pack.h"
 
-Config CONFIG = { .web_root    = DEFAULT_WEB_ROOT,
-                  .listen_port = DEFAULT_LISTEN_PORT,
-#ifdef NDEBUG
-                  .log_level = A3_LOG_WARN
-#else
-                  .log_level = A3_LOG_TRACE
-#endif
-};
-
-static bool cont = true;
+static volatile sig_atomic_t cont        = true;
+static volatile sig_atomic_t dump_stats  = false;
+static volatile sig_atomic_t switch_root = false;
 
 static void sigint_handle(int no) {
     (void)no;
     cont = false;
 }
 
+static void sigusr1_handle(int no) {
+    (void)no;
+    dump_stats = true;
+}
+
+static void sighup_handle(int no) {
+    (void)no;
+    switch_root = true;
+}
+
+// Print runtime statistics. Triggered by SIGUSR1.
+static void stats_dump(void) {
+    fprintf(stderr, "Short Circuit (sc) %s statistics:\n", SC_VERSION);
+    mem_stats_dump(stderr);
+    file_cache_stats_dump(stderr);
+    file_block_cache_stats_dump(stderr);
+    fflush(stderr);
+}
+
+// Resolve the web root again, and serve from there if it has moved. Triggered by SIGHUP, or by a
+// change to the link naming the root.
+static void web_root_switch(struct io_uring* uring) {
+    assert(uring);
+
+    // The previous root is only freed after the next switch.
+    static char* retired = NULL;
+
+    if (CONFIG.pack.ptr) {
+        A3_WARN("Serving a pack. Restart to serve a new one.");
+        return;
+    }
+
+    char* resolved = realpath(a3_string_cstr(CONFIG.web_root_link), NULL);
+    if (!resolved) {
+        A3_ERRNO_F(errno, "Unable to resolve web root " A3_S_F ".",
+                   A3_S_FORMAT(CONFIG.web_root_link));
+        return;
+    }
+
+    A3CString root = a3_cstring_from(resolved);
+    if (a3_string_cmp(root, CONFIG.web_root) == 0 || !file_cache_root_switch(root, uring)) {
+        free(resolved);
+        return;
+    }
+    if (!CONFIG.cache_ttl)
+        file_watch_root_switch(root, uring);
+
+    free(retired);
+    retired         = (char*)CONFIG.web_root.ptr;
+    CONFIG.web_root = root;
+}
+
 static void webroot_check_exists(A3CString root) {
     struct stat s;
 
@@ -74,7 +133,20 @@ static void usage(void) {
     fprintf(stderr, "USAGE:\n\n"
                     "sc [options] [web root]\n"
                     "Options:\n"
+                    "\t    --cache-entries <N>\tCache up to N files. (Default is 256).\n"
+                    "\t    --cache-fds <N>\tKeep up to N cached files open. (Default is 256).\n"
+                    "\t    --cache-ttl <SEC>\tRevalidate cached files after SEC seconds, instead\n"
+                    "\t\t\t\tof watching for changes (for network filesystems).\n"
+                    "\t    --cache-warm <FILE>\tWarm the cache from the files listed in FILE (or\n"
+                    "\t\t\t\tthe web root, if it is missing), and list the hottest\n"
+                    "\t\t\t\tfiles in it on exit.\n"
                     "\t-h, --help\t\tShow this message and exit.\n"
+                    "\t    --mem-hard <MiB>\tStop accepting connections above this much memory.\n"
+                    "\t    --mem-soft <MiB>\tShed cached data above this much memory.\n"
+                    "\t    --pack <FILE>\tServe files from a pack built by sc-pack, instead\n"
+                    "\t\t\t\tof the web root.\n"
+                    "\t    --prefetch\t\tOpen the files HTML pages link to before they are\n"
+                    "\t\t\t\trequested.\n"
                     "\t-p, --port <PORT>\tSpecify the port to listen on. (Default is 8000).\n"
                     "\t-q, --quiet\t\tBe quieter (more 'q's for more silence).\n"
                     "\t-v, --verbose\t\tPrint verbose output (more 'v's for even more output).\n"
@@ -99,16 +171,78 @@ static void version(void) {
     exit(EXIT_SUCCESS);
 }
 
-enum { OPT_HELP, OPT_PORT, OPT_QUIET, OPT_VERBOSE, OPT_VERSION, _OPT_COUNT };
+enum {
+    OPT_CACHE_ENTRIES,
+    OPT_CACHE_FDS,
+    OPT_CACHE_TTL,
+    OPT_CACHE_WARM,
+    OPT_HELP,
+    OPT_MEM_HARD,
+    OPT_MEM_SOFT,
+    OPT_PACK,
+    OPT_PREFETCH,
+    OPT_PORT,
+    OPT_QUIET,
+    OPT_VERBOSE,
+    OPT_VERSION,
+    _OPT_COUNT
+};
+
+static size_t config_parse_mib(const char* arg) {
+    assert(arg);
+
+    char*    endptr = NULL;
+    uint64_t mib    = strtoull(arg, &endptr, 10);
+    if (*endptr != '\0' || mib > SIZE_MAX / 1024 / 1024) {
+        A3_ERROR("Invalid memory limit.");
+        exit(EXIT_FAILURE);
+    }
+
+    return (size_t)mib * 1024 * 1024;
+}
+
+static size_t config_parse_count(const char* arg, size_t min) {
+    assert(arg);
+
+    char*    endptr = NULL;
+    uint64_t count  = strtoull(arg, &endptr, 10);
+    if (*endptr != '\0' || count < min || count > UINT32_MAX) {
+        A3_ERROR_F("Invalid count. At least %zu is required.", min);
+        exit(EXIT_FAILURE);
+    }
+
+    return (size_t)count;
+}
+
+static time_t config_parse_seconds(const char* arg) {
+    assert(arg);
+
+    char*    endptr  = NULL;
+    uint64_t seconds = strtoull(arg, &endptr, 10);
+    if (*endptr != '\0' || !seconds || seconds > INT32_MAX) {
+        A3_ERROR("Invalid cache TTL.");
+        exit(EXIT_FAILURE);
+    }
+
+    return (time_t)seconds;
+}
 
 static void config_parse(int argc, char** argv) {
     static struct option options[] = {
-        [OPT_HELP]    = { "help", no_argument, NULL, 'h' },
-        [OPT_PORT]    = { "port", required_argument, NULL, 'p' },
-        [OPT_QUIET]   = { "quiet", no_argument, NULL, 'q' },
-        [OPT_VERBOSE] = { "verbose", no_argument, NULL, 'v' },
-        [OPT_VERSION] = { "version", no_argument, NULL, '\0' },
-        [_OPT_COUNT]  = { 0, 0, 0, 0 },
+        [OPT_CACHE_ENTRIES] = { "cache-entries", required_argument, NULL, '\0' },
+        [OPT_CACHE_FDS]     = { "cache-fds", required_argument, NULL, '\0' },
+        [OPT_CACHE_TTL]     = { "cache-ttl", required_argument, NULL, '\0' },
+        [OPT_CACHE_WARM]    = { "cache-warm", required_argument, NULL, '\0' },
+        [OPT_HELP]          = { "help", no_argument, NULL, 'h' },
+        [OPT_MEM_HARD]      = { "mem-hard", required_argument, NULL, '\0' },
+        [OPT_MEM_SOFT]      = { "mem-soft", required_argument, NULL, '\0' },
+        [OPT_PACK]          = { "pack", required_argument, NULL, '\0' },
+        [OPT_PREFETCH]      = { "prefetch", no_argument, NULL, '\0' },
+        [OPT_PORT]          = { "port", required_argument, NULL, 'p' },
+        [OPT_QUIET]         = { "quiet", no_argument, NULL, 'q' },
+        [OPT_VERBOSE]       = { "verbose", no_argument, NULL, 'v' },
+        [OPT_VERSION]       = { "version", no_argument, NULL, '\0' },
+        [_OPT_COUNT]        = { 0, 0, 0, 0 },
     };
 
     int      opt;
@@ -139,6 +273,30 @@ static void config_parse(int argc, char** argv) {
         default:
             if (opt == 0) {
                 switch (longindex) {
+                case OPT_CACHE_ENTRIES:
+                    CONFIG.cache_entries = config_parse_count(optarg, 2);
+                    break;
+                case OPT_CACHE_FDS:
+                    CONFIG.cache_fds = config_parse_count(optarg, 1);
+                    break;
+                case OPT_CACHE_TTL:
+                    CONFIG.cache_ttl = config_parse_seconds(optarg);
+                    break;
+                case OPT_CACHE_WARM:
+                    CONFIG.cache_warm = a3_cstring_from(optarg);
+                    break;
+                case OPT_MEM_HARD:
+                    CONFIG.mem_hard_limit = config_parse_mib(optarg);
+                    break;
+                case OPT_MEM_SOFT:
+                    CONFIG.mem_soft_limit = config_parse_mib(optarg);
+                    break;
+                case OPT_PACK:
+                    CONFIG.pack = a3_cstring_from(optarg);
+                    break;
+                case OPT_PREFETCH:
+                    CONFIG.prefetch = true;
+                    break;
                 case OPT_VERSION:
                     version();
                     break;
@@ -164,7 +322,14 @@ static void config_parse(int argc, char** argv) {
         CONFIG.web_root = a3_cstring_from(argv[optind]);
     }
 
-    CONFIG.web_root = a3_cstring_from(realpath(a3_string_cstr(CONFIG.web_root), NULL));
+    CONFIG.web_root_link = CONFIG.web_root;
+    CONFIG.web_root      = a3_cstring_from(realpath(a3_string_cstr(CONFIG.web_root), NULL));
+
+    if (CONFIG.mem_soft_limit && CONFIG.mem_hard_limit &&
+        CONFIG.mem_soft_limit > CONFIG.mem_hard_limit) {
+        A3_WARN("Soft memory limit is above the hard limit. Lowering it.");
+        CONFIG.mem_soft_limit = CONFIG.mem_hard_limit;
+    }
 }
 
 int main(int argc, char** argv) {
@@ -178,10 +343,41 @@ int main(int argc, char** argv) {
     srand((uint32_t)time(NULL));
 
     webroot_check_exists(CONFIG.web_root);
+    http_types_init();
+    http_scan_init();
+    http_headers_key_init();
+    http_serialize_init();
+    http_error_init();
     http_connection_pool_init();
-    file_cache_init();
+    file_cache_init(CONFIG.web_root);
+    file_cache_worker_register();
+    file_block_cache_init();
+    if (CONFIG.prefetch)
+        file_prefetch_init();
     connection_timeout_init();
     struct io_uring uring = event_init();
+    // A pack replaces the files under the web root, so there is nothing to watch or warm.
+    if (CONFIG.pack.ptr && !pack_open(CONFIG.pack))
+        exit(EXIT_FAILURE);
+    if (!CONFIG.cache_ttl && !CONFIG.pack.ptr)
+        file_watch_init(&uring, CONFIG.web_root, CONFIG.web_root_link);
+    if (CONFIG.cache_warm.ptr && !CONFIG.pack.ptr)
+        file_warm_init(&uring, CONFIG.web_root, CONFIG.cache_warm);
+
+    // Accept nothing until the warm-up is over, so the first requests find the cache warm. It is
+    // bounded by FILE_WARM_TIME.
+    EventQueue queue;
+    event_queue_init(&queue);
+    while (file_warm_pending()) {
+        int rc = io_uring_submit_and_wait(&uring, 1);
+        if (rc < 0 && rc != -EINTR) {
+            A3_ERRNO(-rc, "Unable to warm the file cache.");
+            break;
+        }
+
+        clock_refresh();
+        event_handle_all(&queue, &uring);
+    }
 
     Listener* listeners   = NULL;
     size_t    n_listeners = 0;
@@ -196,34 +392,73 @@ int main(int argc, char** argv) {
 
     A3_UNWRAPND(signal(SIGINT, sigint_handle) != SIG_ERR);
     A3_UNWRAPND(signal(SIGPIPE, SIG_IGN) != SIG_ERR);
+    A3_UNWRAPND(signal(SIGUSR1, sigusr1_handle) != SIG_ERR);
+    A3_UNWRAPND(signal(SIGHUP, sighup_handle) != SIG_ERR);
     A3_TRACE("Entering event loop.");
 
 #ifdef PROFILE
     time_t init_time = time(NULL);
 #endif
 
-    EventQueue queue;
-    event_queue_init(&queue);
+    MemPressure last_pressure = MEM_PRESSURE_NONE;
+    clock_refresh();
     while (cont) {
         struct io_uring_cqe* cqe;
         int                  rc;
+        file_cache_offline();
 #ifdef PROFILE
         Timespec timeout = { .tv_sec = 1, .tv_nsec = 0 };
-        if (((rc = io_uring_wait_cqe_timeout(&uring, &cqe, &timeout)) < 0 && rc != -ETIME) ||
+        if (((rc = io_uring_wait_cqe_timeout(&uring, &cqe, &timeout)) < 0 && rc != -ETIME &&
+             rc != -EINTR) ||
             time(NULL) > init_time + 20) {
             if (rc < 0)
                 a3_log_error(-rc, "Breaking event loop.");
             break;
         }
 #else
-        if ((rc = io_uring_wait_cqe(&uring, &cqe)) < 0 && rc != -ETIME) {
+        if ((rc = io_uring_wait_cqe(&uring, &cqe)) < 0 && rc != -ETIME && rc != -EINTR) {
             A3_ERRNO(-rc, "Breaking event loop.");
             break;
         }
 #endif
 
+        file_cache_quiescent();
+        clock_refresh();
+
+        if (dump_stats) {
+            dump_stats = false;
+            stats_dump();
+        }
+
+        if (switch_root || file_watch_link_moved()) {
+            switch_root = false;
+            web_root_switch(&uring);
+        }
+
         event_handle_all(&queue, &uring);
-        listener_accept_all(listeners, n_listeners, &uring);
+
+        // Shed cached data before refusing new connections outright.
+        MemPressure pressure = mem_pressure();
+        if (pressure != last_pressure) {
+            if (pressure > last_pressure)
+                A3_WARN_F("Memory usage (%zu bytes) is over the %s limit.", mem_usage_total(),
+                          (pressure == MEM_PRESSURE_HARD) ? "hard" : "soft");
+            last_pressure = pressure;
+        }
+        if (pressure == MEM_PRESSURE_HARD) {
+            file_cache_shed(&uring);
+            file_block_cache_shed();
+        } else if (pressure == MEM_PRESSURE_SOFT) {
+            // Only give back what is over the limit, coldest first. Blocks go before open files,
+            // since they are larger, and can be read again from files which stay open.
+            size_t excess  = mem_soft_excess();
+            size_t trimmed = file_block_cache_trim(excess);
+            if (trimmed < excess)
+                file_cache_trim(excess - trimmed, &uring);
+        }
+        if (pressure < MEM_PRESSURE_HARD)
+            listener_accept_all(listeners, n_listeners, &uring);
+        file_cache_reap(&uring);
 
         if (io_uring_sq_ready(&uring) > 0) {
             int ev = io_uring_submit(&uring);
@@ -234,7 +469,14 @@ int main(int argc, char** argv) {
 
     http_connection_pool_free();
     free(listeners);
+    file_watch_destroy();
+    if (CONFIG.cache_warm.ptr && !CONFIG.pack.ptr)
+        file_warm_save(CONFIG.cache_warm);
+    file_warm_destroy(&uring);
+    file_prefetch_destroy();
+    file_block_cache_destroy();
     file_cache_destroy(&uring);
+    pack_close();
 
     return EXIT_SUCCESS;
 }
@@ -0,0 +1,84 @@
+/*
+ * SHORT CIRCUIT: MEM -- Memory accounting and budgets.
+ *
+ * Copyright (c) 2021, Alex O'Brien <3541ax@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Affero General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "mem.h"
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#include "config_runtime.h"
+
+// Bytes currently attributed to each subsystem. This only tracks memory owned by the server
+// itself, so it will always be somewhat lower than the RSS.
+static size_t MEM_USAGE[MEM_SUBSYSTEM_COUNT] = { 0 };
+static size_t MEM_TOTAL                      = 0;
+
+void mem_account(MemSubsystem subsystem, size_t bytes) {
+    assert(subsystem < MEM_SUBSYSTEM_COUNT);
+
+    MEM_USAGE[subsystem] += bytes;
+    MEM_TOTAL += bytes;
+}
+
+void mem_unaccount(MemSubsystem subsystem, size_t bytes) {
+    assert(subsystem < MEM_SUBSYSTEM_COUNT);
+    assert(MEM_USAGE[subsystem] >= bytes);
+
+    MEM_USAGE[subsystem] -= bytes;
+    MEM_TOTAL -= bytes;
+}
+
+size_t mem_usage(MemSubsystem subsystem) {
+    assert(subsystem < MEM_SUBSYSTEM_COUNT);
+
+    return MEM_USAGE[subsystem];
+}
+
+size_t mem_usage_total() { return MEM_TOTAL; }
+
+// A limit of 0 means no limit.
+MemPressure mem_pressure() {
+    if (CONFIG.mem_hard_limit && MEM_TOTAL >= CONFIG.mem_hard_limit)
+        return MEM_PRESSURE_HARD;
+    if (CONFIG.mem_soft_limit && MEM_TOTAL >= CONFIG.mem_soft_limit)
+        return MEM_PRESSURE_SOFT;
+    return MEM_PRESSURE_NONE;
+}
+
+// Bytes which have to be released to bring usage back under the soft limit.
+size_t mem_soft_excess() {
+    if (!CONFIG.mem_soft_limit || MEM_TOTAL < CONFIG.mem_soft_limit)
+        return 0;
+    return MEM_TOTAL - CONFIG.mem_soft_limit + 1;
+}
+
+void mem_stats_dump(FILE* out) {
+    assert(out);
+
+#define _MEM(S, N) [S] = N,
+    static const char* MEM_SUBSYSTEM_NAMES[] = { MEM_SUBSYSTEM_ENUM };
+#undef _MEM
+
+    fprintf(out, "Memory:\n");
+    for (size_t i = 0; i < MEM_SUBSYSTEM_COUNT; i++)
+        fprintf(out, "\t%-16s%zu\n", MEM_SUBSYSTEM_NAMES[i], MEM_USAGE[i]);
+    fprintf(out, "\t%-16s%zu (soft limit %zu, hard limit %zu)\n", "total", MEM_TOTAL,
+            CONFIG.mem_soft_limit, CONFIG.mem_hard_limit);
+}
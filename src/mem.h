@@ -0,0 +1,52 @@
+/*
+ * SHORT CIRCUIT: MEM -- Memory accounting and budgets.
+ *
+ * Copyright (c) 2021, Alex O'Brien <3541ax@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Affero General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdio.h>
+
+#define MEM_SUBSYSTEM_ENUM                                                                         \
+    _MEM(MEM_CONNECTIONS, "connections")                                                           \
+    _MEM(MEM_BUFFERS, "buffers")                                                                   \
+    _MEM(MEM_FILE_CACHE, "file cache")                                                             \
+    _MEM(MEM_HEADERS, "headers")                                                                   \
+    _MEM(MEM_EVENTS, "events")                                                                     \
+    _MEM(MEM_PIPES, "pipes")
+
+typedef enum MemSubsystem {
+#define _MEM(S, N) S,
+    MEM_SUBSYSTEM_ENUM
+#undef _MEM
+    MEM_SUBSYSTEM_COUNT
+} MemSubsystem;
+
+typedef enum MemPressure {
+    MEM_PRESSURE_NONE,
+    MEM_PRESSURE_SOFT,
+    MEM_PRESSURE_HARD,
+} MemPressure;
+
+void        mem_account(MemSubsystem, size_t bytes);
+void        mem_unaccount(MemSubsystem, size_t bytes);
+size_t      mem_usage(MemSubsystem);
+size_t      mem_usage_total(void);
+MemPressure mem_pressure(void);
+size_t      mem_soft_excess(void);
+void        mem_stats_dump(FILE*);
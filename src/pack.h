@@ -0,0 +1,36 @@
+/*
+ * SHORT CIRCUIT: PACK -- Serve a packed web root from one mapped file.
+ *
+ * Copyright (c) 2021, Alex O'Brien <3541ax@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Affero General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+
+#include <a3/str.h>
+
+#include "forward.h"
+#include "pack/format.h"
+
+bool             pack_open(A3CString path);
+bool             pack_loaded(void);
+PackEntry const* pack_find(A3CString path);
+bool             pack_body_present(PackBody const*);
+A3CString        pack_body_headers(PackBody const*);
+A3CString        pack_body_content(PackBody const*);
+fd               pack_fd(void);
+void             pack_close(void);
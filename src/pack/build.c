@@ -0,0 +1,510 @@
+/*
+ * SHORT CIRCUIT: PACK BUILD -- Build a pack from a web root.
+ *
+ * Copyright (c) 2021, Alex O'Brien <3541ax@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Affero General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+#define _GNU_SOURCE
+
+#include "pack/build.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <a3/log.h>
+#include <a3/str.h>
+#include <a3/util.h>
+
+#include "clock.h"
+#include "config.h"
+#include "forward.h"
+#include "http/serialize.h"
+#include "http/types.h"
+#include "pack/format.h"
+
+#define PACK_BUILD_FD_MAX    16
+#define PACK_BUILD_BUF_SIZE  65536
+#define PACK_BUILD_SEEDS_MAX 64
+
+typedef struct PackFile {
+    A3String    path; // Relative to the root.
+    struct stat stat;
+    uint64_t    hash; // Of the content, for the ETag.
+    uint64_t    offset;
+
+    // The precompressed variant of this file, found as a sibling with ".gz" appended, or the file
+    // this is the variant of.
+    struct PackFile* gzip;
+    bool             variant;
+
+    A3String headers[PACK_VARIANT_COUNT];
+    uint64_t headers_offset[PACK_VARIANT_COUNT];
+} PackFile;
+
+typedef struct PackBuildEntry {
+    A3CString path;
+    uint64_t  path_offset;
+    PackFile* file;
+    uint64_t  hash;
+    uint32_t  bucket;
+    uint32_t  slot;
+} PackBuildEntry;
+
+static struct {
+    A3CString       root;
+    fd              root_fd;
+    PackFile*       files;
+    size_t          n_files;
+    size_t          files_cap;
+    PackBuildEntry* entries;
+    uint32_t        n_entries;
+} BUILD = { .root_fd = -1 };
+
+static void pack_build_fail(const char* what, A3CString path) {
+    A3_ERRNO_F(errno, "Unable to %s " A3_S_F ".", what, A3_S_FORMAT(path));
+    exit(EXIT_FAILURE);
+}
+
+static int pack_build_walk_cb(const char* path, const struct stat* s, int type, struct FTW* ftw) {
+    (void)ftw;
+
+    if (type == FTW_SL || type == FTW_SLN) {
+        A3_WARN_F("Skipping symbolic link %s.", path);
+        return 0;
+    }
+    if (type != FTW_F || !S_ISREG(s->st_mode))
+        return 0;
+
+    if (BUILD.n_files == BUILD.files_cap) {
+        BUILD.files_cap = MAX(BUILD.files_cap * 2, 64);
+        A3_UNWRAPN(BUILD.files, realloc(BUILD.files, BUILD.files_cap * sizeof(PackFile)));
+    }
+
+    PackFile* file = &BUILD.files[BUILD.n_files++];
+    memset(file, 0, sizeof(*file));
+    file->path = a3_string_clone(a3_cstring_from(&path[BUILD.root.len + 1]));
+    file->stat = *s;
+
+    return 0;
+}
+
+static int pack_build_file_cmp(const void* a, const void* b) {
+    return a3_string_cmp(A3_S_CONST(((PackFile const*)a)->path),
+                         A3_S_CONST(((PackFile const*)b)->path));
+}
+
+static PackFile* pack_build_file_find(A3CString path) {
+    PackFile key = { .path = { .ptr = (uint8_t*)path.ptr, .len = path.len } };
+    return bsearch(&key, BUILD.files, BUILD.n_files, sizeof(PackFile), pack_build_file_cmp);
+}
+
+// Files are kept sorted by path, so that packs of the same tree come out the same.
+static void pack_build_collect(void) {
+    if (nftw(a3_string_cstr(BUILD.root), pack_build_walk_cb, PACK_BUILD_FD_MAX, FTW_PHYS) < 0)
+        pack_build_fail("walk", BUILD.root);
+    qsort(BUILD.files, BUILD.n_files, sizeof(PackFile), pack_build_file_cmp);
+
+    static const A3CString GZIP_SUFFIX = A3_CS(".gz");
+    for (size_t i = 0; i < BUILD.n_files; i++) {
+        PackFile* file = &BUILD.files[i];
+        A3CString path = A3_S_CONST(file->path);
+        if (path.len <= GZIP_SUFFIX.len ||
+            memcmp(&path.ptr[path.len - GZIP_SUFFIX.len], GZIP_SUFFIX.ptr, GZIP_SUFFIX.len) != 0)
+            continue;
+
+        A3CString base_path = { .ptr = path.ptr, .len = path.len - GZIP_SUFFIX.len };
+        PackFile* base      = pack_build_file_find(base_path);
+        if (!base)
+            continue;
+        base->gzip    = file;
+        file->gzip    = base;
+        file->variant = true;
+    }
+}
+
+static uint64_t pack_build_hash_extend(uint64_t hash, const uint8_t* data, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        hash ^= data[i];
+        hash *= 0x100000001B3ULL;
+    }
+
+    return hash;
+}
+
+static void pack_build_hash_file(PackFile* file) {
+    assert(file);
+
+    static uint8_t BUF[PACK_BUILD_BUF_SIZE];
+
+    fd in = openat(BUILD.root_fd, a3_string_cstr(A3_S_CONST(file->path)), O_RDONLY | O_CLOEXEC);
+    if (in < 0)
+        pack_build_fail("open", A3_S_CONST(file->path));
+
+    file->hash = 0xCBF29CE484222325ULL;
+    ssize_t len;
+    while ((len = read(in, BUF, sizeof(BUF))) > 0)
+        file->hash = pack_build_hash_extend(file->hash, BUF, (size_t)len);
+    if (len < 0)
+        pack_build_fail("read", A3_S_CONST(file->path));
+
+    close(in);
+}
+
+static uint8_t* pack_build_append(uint8_t* out, A3CString str) {
+    memcpy(out, str.ptr, str.len);
+    return out + str.len;
+}
+
+// The same headers the server builds for a file, with a strong ETag from the content.
+static A3String pack_build_headers(PackFile* identity, PackVariant variant) {
+    assert(identity);
+
+    PackFile* file = variant == PACK_VARIANT_GZIP ? identity->gzip : identity;
+    uint8_t   buf[FILE_HANDLE_HEADERS_MAX];
+    uint8_t*  p = buf;
+
+    p = pack_build_append(p, A3_CS("Content-Length: "));
+    p += http_serialize_dec(p, (uint64_t)file->stat.st_size);
+    p = pack_build_append(p, HTTP_NEWLINE);
+    p = pack_build_append(p, A3_CS("Content-Type: "));
+    p = pack_build_append(
+        p, http_content_type_name(http_content_type_from_path(A3_S_CONST(identity->path))));
+    p = pack_build_append(p, HTTP_NEWLINE);
+    p = pack_build_append(p, A3_CS("Accept-Ranges: bytes"));
+    p = pack_build_append(p, HTTP_NEWLINE);
+    p = pack_build_append(p, A3_CS("Last-Modified: "));
+    p += clock_format_imf_fixdate(p, identity->stat.st_mtime);
+    p = pack_build_append(p, HTTP_NEWLINE);
+    p = pack_build_append(p, A3_CS("Etag: \""));
+    p += http_serialize_hex(p, file->hash);
+    *p++ = '"';
+    p    = pack_build_append(p, HTTP_NEWLINE);
+    if (variant == PACK_VARIANT_GZIP) {
+        p = pack_build_append(p, A3_CS("Content-Encoding: gzip"));
+        p = pack_build_append(p, HTTP_NEWLINE);
+    }
+    if (identity->gzip) {
+        p = pack_build_append(p, A3_CS("Vary: Accept-Encoding"));
+        p = pack_build_append(p, HTTP_NEWLINE);
+    }
+    assert(p - buf <= FILE_HANDLE_HEADERS_MAX);
+
+    A3CString ret = { .ptr = buf, .len = (size_t)(p - buf) };
+    return a3_string_clone(ret);
+}
+
+// Every file gets an entry, except precompressed variants, which hang off the file they encode.
+// A directory with an index file gets an entry too.
+static void pack_build_entries(void) {
+    size_t n = 0;
+    A3_UNWRAPN(BUILD.entries, calloc(MAX(BUILD.n_files * 2, 1), sizeof(PackBuildEntry)));
+
+    for (size_t i = 0; i < BUILD.n_files; i++) {
+        PackFile* file = &BUILD.files[i];
+        if (file->variant)
+            continue;
+
+        A3CString path     = A3_S_CONST(file->path);
+        BUILD.entries[n++] = (PackBuildEntry) { .path = path, .file = file };
+
+        A3CString name = a3_string_rchr(path, '/');
+        name           = name.ptr ? (A3CString) { .ptr = name.ptr + 1, .len = name.len - 1 } : path;
+        if (a3_string_cmp(name, INDEX_FILENAME) != 0)
+            continue;
+
+        A3CString dir = A3_CS(".");
+        if (path.len > name.len)
+            dir = (A3CString) { .ptr = path.ptr, .len = path.len - name.len - 1 };
+        BUILD.entries[n++] = (PackBuildEntry) { .path = dir, .file = file };
+    }
+
+    if (n > UINT32_MAX) {
+        A3_ERROR("Too many files to pack.");
+        exit(EXIT_FAILURE);
+    }
+    BUILD.n_entries = (uint32_t)n;
+}
+
+static int pack_build_bucket_cmp(const void* a, const void* b) {
+    uint32_t const* x = a;
+    uint32_t const* y = b;
+    return (x[1] < y[1]) - (x[1] > y[1]);
+}
+
+// Place every entry in a slot of its own. Buckets are placed largest first, while most slots are
+// still free, each by trying displacements until all of its entries land in free slots.
+static bool pack_build_index(uint64_t seed, uint32_t n_buckets, uint32_t* displacements) {
+    assert(displacements);
+
+    uint32_t  n = BUILD.n_entries;
+    uint32_t* counts;
+    uint32_t* order;
+    uint32_t* members;
+    uint32_t* slots;
+    bool*     taken;
+    A3_UNWRAPN(counts, calloc(n_buckets + 1, sizeof(uint32_t)));
+    A3_UNWRAPN(order, calloc(n_buckets * 2, sizeof(uint32_t)));
+    A3_UNWRAPN(members, calloc(MAX(n, 1), sizeof(uint32_t)));
+    A3_UNWRAPN(slots, calloc(MAX(n, 1), sizeof(uint32_t)));
+    A3_UNWRAPN(taken, calloc(MAX(n, 1), sizeof(bool)));
+
+    for (uint32_t i = 0; i < n; i++) {
+        PackBuildEntry* entry = &BUILD.entries[i];
+        entry->hash           = pack_hash(seed, entry->path);
+        entry->bucket         = (uint32_t)(entry->hash % n_buckets);
+        counts[entry->bucket + 1]++;
+    }
+
+    // Group entries by bucket, with counts turned into starting offsets.
+    for (uint32_t b = 0; b < n_buckets; b++) {
+        order[b * 2]     = b;
+        order[b * 2 + 1] = counts[b + 1];
+        counts[b + 1] += counts[b];
+    }
+    uint32_t* fill;
+    A3_UNWRAPN(fill, calloc(n_buckets, sizeof(uint32_t)));
+    for (uint32_t i = 0; i < n; i++) {
+        uint32_t b                     = BUILD.entries[i].bucket;
+        members[counts[b] + fill[b]++] = i;
+    }
+    free(fill);
+    qsort(order, n_buckets, sizeof(uint32_t) * 2, pack_build_bucket_cmp);
+
+    bool     ret        = true;
+    uint64_t search_max = (uint64_t)n * 16 + 1024;
+    for (uint32_t o = 0; o < n_buckets && order[o * 2 + 1]; o++) {
+        uint32_t  b    = order[o * 2];
+        uint32_t  size = order[o * 2 + 1];
+        uint32_t* m    = &members[counts[b]];
+
+        bool placed = false;
+        for (uint64_t d = 0; d < search_max && d <= UINT32_MAX && !placed; d++) {
+            placed = true;
+            for (uint32_t i = 0; i < size && placed; i++) {
+                slots[i] = pack_slot(BUILD.entries[m[i]].hash, (uint32_t)d, n);
+                placed   = !taken[slots[i]];
+                for (uint32_t j = 0; j < i && placed; j++)
+                    placed = slots[j] != slots[i];
+            }
+
+            if (placed)
+                displacements[b] = (uint32_t)d;
+        }
+
+        if (!placed) {
+            ret = false;
+            break;
+        }
+        for (uint32_t i = 0; i < size; i++) {
+            taken[slots[i]]          = true;
+            BUILD.entries[m[i]].slot = slots[i];
+        }
+    }
+
+    free(counts);
+    free(order);
+    free(members);
+    free(slots);
+    free(taken);
+    return ret;
+}
+
+static void pack_build_write(fd out, A3CString out_path, const void* data, size_t len,
+                             uint64_t offset) {
+    const uint8_t* p = data;
+    while (len) {
+        ssize_t written = pwrite(out, p, len, (off_t)offset);
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written <= 0)
+            pack_build_fail("write", out_path);
+        p += written;
+        len -= (size_t)written;
+        offset += (uint64_t)written;
+    }
+}
+
+static void pack_build_copy(fd out, PackFile* file) {
+    assert(file);
+
+    fd in = openat(BUILD.root_fd, a3_string_cstr(A3_S_CONST(file->path)), O_RDONLY | O_CLOEXEC);
+    if (in < 0)
+        pack_build_fail("open", A3_S_CONST(file->path));
+
+    loff_t in_offset  = 0;
+    loff_t out_offset = (loff_t)file->offset;
+    size_t remaining  = (size_t)file->stat.st_size;
+    while (remaining) {
+        ssize_t copied = copy_file_range(in, &in_offset, out, &out_offset, remaining, 0);
+        if (copied < 0 && errno == EINTR)
+            continue;
+        if (copied < 0)
+            pack_build_fail("copy", A3_S_CONST(file->path));
+        if (!copied) {
+            A3_ERROR_F(A3_S_F " changed while it was being packed.",
+                       A3_S_FORMAT(file->path));
+            exit(EXIT_FAILURE);
+        }
+        remaining -= (size_t)copied;
+    }
+
+    close(in);
+}
+
+static void pack_build_write_pack(A3CString out_path) {
+    uint32_t  n_buckets = BUILD.n_entries / 4 + 1;
+    uint32_t* displacements;
+    A3_UNWRAPN(displacements, calloc(n_buckets, sizeof(uint32_t)));
+
+    // Seeds are tried in order, so packs of the same tree come out the same.
+    uint64_t seed = 0;
+    while (!pack_build_index(seed, n_buckets, displacements)) {
+        if (++seed == PACK_BUILD_SEEDS_MAX) {
+            A3_ERROR("Unable to build the path index.");
+            exit(EXIT_FAILURE);
+        }
+        memset(displacements, 0, n_buckets * sizeof(uint32_t));
+    }
+
+    // Lay out the paths and headers after the index, and the contents after them.
+    uint64_t offset =
+        pack_entries_offset(n_buckets) + (uint64_t)BUILD.n_entries * sizeof(PackEntry);
+    for (uint32_t i = 0; i < BUILD.n_entries; i++) {
+        BUILD.entries[i].path_offset = offset;
+        offset += BUILD.entries[i].path.len;
+    }
+    for (size_t i = 0; i < BUILD.n_files; i++) {
+        PackFile* file = &BUILD.files[i];
+        if (file->variant)
+            continue;
+
+        for (PackVariant v = PACK_VARIANT_IDENTITY; v < PACK_VARIANT_COUNT; v++) {
+            if (v == PACK_VARIANT_GZIP && !file->gzip)
+                continue;
+            file->headers[v]        = pack_build_headers(file, v);
+            file->headers_offset[v] = offset;
+            offset += file->headers[v].len;
+        }
+    }
+    for (size_t i = 0; i < BUILD.n_files; i++) {
+        offset                = (offset + PACK_ALIGN - 1) & ~(uint64_t)(PACK_ALIGN - 1);
+        BUILD.files[i].offset = offset;
+        offset += (uint64_t)BUILD.files[i].stat.st_size;
+    }
+
+    PackHeader header = { .version   = PACK_VERSION,
+                          .n_entries = BUILD.n_entries,
+                          .n_buckets = n_buckets,
+                          .seed      = seed,
+                          .size      = offset };
+    memcpy(header.magic, PACK_MAGIC, sizeof(header.magic));
+
+    // Written beside the destination and renamed over it, so that a running server never sees a
+    // partial pack.
+    A3String tmp_path = a3_string_alloc(out_path.len + 4);
+    a3_string_concat(tmp_path, 2, out_path, A3_CS(".tmp"));
+    A3CString tmp = A3_S_CONST(tmp_path);
+    fd        out = open(a3_string_cstr(tmp), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (out < 0)
+        pack_build_fail("create", tmp);
+    if (ftruncate(out, (off_t)offset) < 0)
+        pack_build_fail("size", tmp);
+
+    pack_build_write(out, tmp, &header, sizeof(header), 0);
+    pack_build_write(out, tmp, displacements, n_buckets * sizeof(uint32_t),
+                     pack_displacements_offset());
+    for (uint32_t i = 0; i < BUILD.n_entries; i++) {
+        PackBuildEntry* build = &BUILD.entries[i];
+        PackFile*       file  = build->file;
+        PackEntry       entry = { .path_offset = build->path_offset,
+                                  .path_len    = (uint32_t)build->path.len };
+
+        for (PackVariant v = PACK_VARIANT_IDENTITY; v < PACK_VARIANT_COUNT; v++) {
+            PackFile* body = v == PACK_VARIANT_GZIP ? file->gzip : file;
+            if (!body)
+                continue;
+            entry.bodies[v] = (PackBody) { .offset         = body->offset,
+                                           .size           = (uint64_t)body->stat.st_size,
+                                           .headers_offset = file->headers_offset[v],
+                                           .headers_len    = (uint32_t)file->headers[v].len };
+        }
+
+        pack_build_write(out, tmp, &entry, sizeof(entry),
+                         pack_entries_offset(n_buckets) + (uint64_t)build->slot * sizeof(entry));
+        pack_build_write(out, tmp, build->path.ptr, build->path.len, build->path_offset);
+    }
+    for (size_t i = 0; i < BUILD.n_files; i++) {
+        PackFile* file = &BUILD.files[i];
+        for (PackVariant v = PACK_VARIANT_IDENTITY; v < PACK_VARIANT_COUNT; v++) {
+            if (file->headers[v].ptr)
+                pack_build_write(out, tmp, file->headers[v].ptr, file->headers[v].len,
+                                 file->headers_offset[v]);
+        }
+        pack_build_copy(out, file);
+    }
+
+    if (fsync(out) < 0 || close(out) < 0)
+        pack_build_fail("write", tmp);
+    if (rename(a3_string_cstr(tmp), a3_string_cstr(out_path)) < 0)
+        pack_build_fail("replace", out_path);
+
+    A3_INFO_F("Packed %zu files into " A3_S_F ".", BUILD.n_files, A3_S_FORMAT(out_path));
+    a3_string_free(&tmp_path);
+    free(displacements);
+}
+
+// Pack every file under root into out_path. Any failure is reported and exits, as sc-pack would.
+void pack_build(A3CString root, A3CString out_path) {
+    assert(root.ptr);
+    assert(out_path.ptr);
+
+    BUILD.root = root;
+    while (BUILD.root.len > 1 && BUILD.root.ptr[BUILD.root.len - 1] == '/')
+        BUILD.root.len--;
+    BUILD.root = A3_S_CONST(a3_string_clone(BUILD.root));
+    if ((BUILD.root_fd = open(a3_string_cstr(BUILD.root), O_PATH | O_DIRECTORY | O_CLOEXEC)) < 0)
+        pack_build_fail("open", BUILD.root);
+
+    pack_build_collect();
+    for (size_t i = 0; i < BUILD.n_files; i++)
+        pack_build_hash_file(&BUILD.files[i]);
+    pack_build_entries();
+    pack_build_write_pack(out_path);
+
+    for (size_t i = 0; i < BUILD.n_files; i++) {
+        a3_string_free(&BUILD.files[i].path);
+        for (PackVariant v = PACK_VARIANT_IDENTITY; v < PACK_VARIANT_COUNT; v++) {
+            if (BUILD.files[i].headers[v].ptr)
+                a3_string_free(&BUILD.files[i].headers[v]);
+        }
+    }
+    free(BUILD.files);
+    free(BUILD.entries);
+    close(BUILD.root_fd);
+    a3_string_free((A3String*)&BUILD.root);
+
+    memset(&BUILD, 0, sizeof(BUILD));
+    BUILD.root_fd = -1;
+}
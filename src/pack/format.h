@@ -0,0 +1,106 @@
+/*
+ * SHORT CIRCUIT: PACK FORMAT -- On-disk layout of a packed web root.
+ *
+ * Copyright (c) 2021, Alex O'Brien <3541ax@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Affero General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdalign.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <a3/str.h>
+
+// A pack is one file holding a whole web root, built by sc-pack:
+//
+//   PackHeader
+//   uint32_t displacements[n_buckets]
+//   PackEntry entries[n_entries], each in the slot its path hashes to
+//   paths and response headers
+//   file contents, each starting on a PACK_ALIGN boundary
+//
+// Paths are looked up with a hash-and-displace perfect hash. A path's hash picks a bucket, and the
+// bucket's displacement picks its slot, so a lookup touches one displacement and one entry, and
+// compares one path. Every integer is native-endian, so packs must be built on the same kind of
+// machine which serves them.
+#define PACK_MAGIC   "SCPACK\r\n"
+#define PACK_VERSION 1
+#define PACK_ALIGN   4096
+
+typedef enum PackVariant {
+    PACK_VARIANT_IDENTITY,
+    PACK_VARIANT_GZIP,
+    PACK_VARIANT_COUNT,
+} PackVariant;
+
+typedef struct PackHeader {
+    uint8_t  magic[8];
+    uint32_t version;
+    uint32_t n_entries;
+    uint32_t n_buckets;
+    uint32_t reserved;
+    uint64_t seed;
+    uint64_t size;
+} PackHeader;
+
+// One encoding of a file. The headers are complete header lines, starting with Content-Length. A
+// variant which is not present has no headers.
+typedef struct PackBody {
+    uint64_t offset;
+    uint64_t size;
+    uint64_t headers_offset;
+    uint32_t headers_len;
+    uint32_t reserved;
+} PackBody;
+
+// Directories with an index file have an entry of their own, which shares the index's bodies.
+typedef struct PackEntry {
+    uint64_t path_offset;
+    uint32_t path_len;
+    uint32_t reserved;
+    PackBody bodies[PACK_VARIANT_COUNT];
+} PackEntry;
+
+static inline uint64_t pack_displacements_offset(void) { return sizeof(PackHeader); }
+
+// Entries are aligned for their 64-bit fields.
+static inline uint64_t pack_entries_offset(uint32_t n_buckets) {
+    uint64_t end = pack_displacements_offset() + (uint64_t)n_buckets * sizeof(uint32_t);
+    return (end + alignof(PackEntry) - 1) & ~(uint64_t)(alignof(PackEntry) - 1);
+}
+
+// FNV-1a, seeded, for the bucket.
+static inline uint64_t pack_hash(uint64_t seed, A3CString path) {
+    uint64_t hash = 0xCBF29CE484222325ULL ^ seed;
+    for (size_t i = 0; i < path.len; i++) {
+        hash ^= path.ptr[i];
+        hash *= 0x100000001B3ULL;
+    }
+
+    return hash;
+}
+
+// The slot for a hash, once displaced, with the bits mixed so that neighbouring displacements land
+// far apart.
+static inline uint32_t pack_slot(uint64_t hash, uint32_t displacement, uint32_t n_entries) {
+    uint64_t x = hash + (uint64_t)displacement * 0x9E3779B97F4A7C15ULL;
+    x          = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    x          = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+    x ^= x >> 31;
+
+    return (uint32_t)(x % n_entries);
+}
@@ -0,0 +1,46 @@
+/*
+ * SHORT CIRCUIT: SC-PACK -- Pack a web root into one file.
+ *
+ * Copyright (c) 2021, Alex O'Brien <3541ax@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Affero General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <a3/log.h>
+#include <a3/str.h>
+
+#include "pack/build.h"
+
+static void usage(void) {
+    fprintf(stderr, "USAGE:\n\n"
+                    "sc-pack <web root> <pack>\n"
+                    "Pack every file under the web root into one file, which sc serves with\n"
+                    "--pack. A file with \".gz\" appended to its name is served in its place to\n"
+                    "clients which accept gzip.\n");
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char** argv) {
+    a3_log_init(stderr, A3_LOG_INFO);
+
+    if (argc != 3)
+        usage();
+
+    pack_build(a3_cstring_from(argv[1]), a3_cstring_from(argv[2]));
+
+    return EXIT_SUCCESS;
+}
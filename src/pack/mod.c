@@ -0,0 +1,196 @@
+/*
+ * SHORT CIRCUIT: PACK -- Serve a packed web root from one mapped file.
+ *
+ * Copyright (c) 2021, Alex O'Brien <3541ax@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Affero General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+#define _GNU_SOURCE
+
+#include "pack.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <a3/log.h>
+#include <a3/str.h>
+#include <a3/util.h>
+
+#include "config.h"
+#include "forward.h"
+#include "pack/format.h"
+
+// The whole pack is mapped for the life of the server. Small bodies are sent straight from the
+// mapping, and larger ones are spliced from the file, so one descriptor serves every file.
+static struct {
+    fd                file;
+    const uint8_t*    map;
+    size_t            size;
+    PackHeader const* header;
+    uint32_t const*   displacements;
+    PackEntry const*  entries;
+} PACK = { .file = -1 };
+
+static bool pack_range_valid(uint64_t offset, uint64_t len) {
+    return offset <= PACK.size && len <= PACK.size - offset;
+}
+
+// Header lines are searched up to their newline, so a block must end in one.
+static bool pack_body_valid(PackBody const* body) {
+    assert(body);
+
+    if (body->headers_len > FILE_HANDLE_HEADERS_MAX ||
+        !pack_range_valid(body->headers_offset, body->headers_len) ||
+        !pack_range_valid(body->offset, body->size))
+        return false;
+
+    return !body->headers_len || PACK.map[body->headers_offset + body->headers_len - 1] == '\n';
+}
+
+// Everything the server later reads from the pack is checked once, here, so that a corrupt or
+// truncated pack is refused at startup rather than read out of bounds.
+static bool pack_valid(void) {
+    PackHeader const* header = PACK.header;
+    if (memcmp(header->magic, PACK_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != PACK_VERSION || header->size != PACK.size || !header->n_buckets ||
+        !pack_range_valid(pack_entries_offset(header->n_buckets),
+                          (uint64_t)header->n_entries * sizeof(PackEntry)))
+        return false;
+
+    PACK.displacements = (uint32_t const*)&PACK.map[pack_displacements_offset()];
+    PACK.entries       = (PackEntry const*)&PACK.map[pack_entries_offset(header->n_buckets)];
+    for (uint32_t i = 0; i < header->n_entries; i++) {
+        PackEntry const* entry = &PACK.entries[i];
+        if (!pack_range_valid(entry->path_offset, entry->path_len) ||
+            !pack_body_present(&entry->bodies[PACK_VARIANT_IDENTITY]))
+            return false;
+
+        for (PackVariant v = PACK_VARIANT_IDENTITY; v < PACK_VARIANT_COUNT; v++) {
+            if (!pack_body_valid(&entry->bodies[v]))
+                return false;
+        }
+    }
+
+    return true;
+}
+
+bool pack_open(A3CString path) {
+    assert(path.ptr);
+    assert(PACK.file < 0);
+
+    if ((PACK.file = open(a3_string_cstr(path), O_RDONLY | O_CLOEXEC)) < 0) {
+        A3_ERRNO_F(errno, "Unable to open pack " A3_S_F ".", A3_S_FORMAT(path));
+        return false;
+    }
+
+    struct stat s;
+    if (fstat(PACK.file, &s) < 0) {
+        A3_ERRNO_F(errno, "Unable to stat pack " A3_S_F ".", A3_S_FORMAT(path));
+        goto fail;
+    }
+    if ((size_t)s.st_size < sizeof(PackHeader)) {
+        A3_ERROR_F(A3_S_F " is not a pack.", A3_S_FORMAT(path));
+        goto fail;
+    }
+
+    PACK.size = (size_t)s.st_size;
+    void* map = mmap(NULL, PACK.size, PROT_READ, MAP_SHARED, PACK.file, 0);
+    if (map == MAP_FAILED) {
+        A3_ERRNO_F(errno, "Unable to map pack " A3_S_F ".", A3_S_FORMAT(path));
+        goto fail;
+    }
+
+    PACK.map    = map;
+    PACK.header = map;
+    if (!pack_valid()) {
+        A3_ERROR_F(A3_S_F " is not a valid pack.", A3_S_FORMAT(path));
+        goto fail;
+    }
+
+    // Every request reads the index, so it is worth faulting in now.
+    madvise(map, pack_entries_offset(PACK.header->n_buckets) +
+                     (size_t)PACK.header->n_entries * sizeof(PackEntry),
+            MADV_WILLNEED);
+
+    A3_DEBUG_F("Serving %u paths from pack " A3_S_F ".", PACK.header->n_entries,
+               A3_S_FORMAT(path));
+    return true;
+
+fail:
+    pack_close();
+    return false;
+}
+
+bool pack_loaded(void) { return PACK.map; }
+
+PackEntry const* pack_find(A3CString path) {
+    assert(PACK.map);
+    assert(path.ptr);
+
+    PackHeader const* header = PACK.header;
+    if (!header->n_entries)
+        return NULL;
+
+    uint64_t hash = pack_hash(header->seed, path);
+    uint32_t slot =
+        pack_slot(hash, PACK.displacements[hash % header->n_buckets], header->n_entries);
+
+    PackEntry const* entry      = &PACK.entries[slot];
+    A3CString        entry_path = { .ptr = &PACK.map[entry->path_offset], .len = entry->path_len };
+    if (a3_string_cmp(entry_path, path) != 0)
+        return NULL;
+
+    return entry;
+}
+
+bool pack_body_present(PackBody const* body) {
+    assert(body);
+    return body->headers_len;
+}
+
+A3CString pack_body_headers(PackBody const* body) {
+    assert(PACK.map);
+    assert(body);
+
+    return (A3CString) { .ptr = &PACK.map[body->headers_offset], .len = body->headers_len };
+}
+
+A3CString pack_body_content(PackBody const* body) {
+    assert(PACK.map);
+    assert(body);
+
+    return (A3CString) { .ptr = &PACK.map[body->offset], .len = (size_t)body->size };
+}
+
+fd pack_fd(void) {
+    assert(PACK.file >= 0);
+    return PACK.file;
+}
+
+void pack_close(void) {
+    if (PACK.map)
+        munmap((void*)PACK.map, PACK.size);
+    if (PACK.file >= 0)
+        close(PACK.file);
+
+    memset(&PACK, 0, sizeof(PACK));
+    PACK.file = -1;
+}
@@ -0,0 +1,122 @@
+/*
+ * SHORT CIRCUIT: SKETCH -- Count-min sketch for estimating access frequency.
+ *
+ * Copyright (c) 2021, Alex O'Brien <3541ax@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Affero General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "sketch.h"
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <a3/util.h>
+
+#include "mem.h"
+
+#define SKETCH_COUNTER_MAX 15
+#define SKETCH_COUNTER_BITS 4
+
+// Bytes holding the counters of every row.
+#define SKETCH_BYTES(WIDTH) (SKETCH_DEPTH * (WIDTH) / 2)
+
+// Odd multipliers which spread one hash over the rows.
+static const uint64_t SKETCH_SEEDS[SKETCH_DEPTH] = { 0x9E3779B97F4A7C15ULL, 0xC2B2AE3D27D4EB4FULL,
+                                                     0x165667B19E3779F9ULL, 0xD6E8FEB86659FD93ULL };
+
+void sketch_init(Sketch* sketch, size_t capacity) {
+    assert(sketch);
+    assert(capacity);
+
+    // A power of two, so rows can be indexed with a mask.
+    size_t width = 64;
+    while (width < capacity)
+        width <<= 1;
+
+    sketch->width       = width;
+    sketch->additions   = 0;
+    sketch->sample_size = width * 10;
+    A3_UNWRAPN(sketch->counters, calloc(SKETCH_BYTES(width), sizeof(*sketch->counters)));
+    mem_account(MEM_FILE_CACHE, SKETCH_BYTES(width));
+}
+
+void sketch_destroy(Sketch* sketch) {
+    assert(sketch);
+
+    mem_unaccount(MEM_FILE_CACHE, SKETCH_BYTES(sketch->width));
+    free(sketch->counters);
+    sketch->counters = NULL;
+}
+
+// The index of the counter for a hash in a row. Counter i is in the low nibble of byte i / 2 if i
+// is even, and the high nibble if it is odd.
+static size_t sketch_counter(Sketch* sketch, uint64_t hash, size_t row) {
+    assert(sketch);
+    assert(row < SKETCH_DEPTH);
+
+    uint64_t index = (hash * SKETCH_SEEDS[row]) >> 32;
+    return row * sketch->width + (index & (sketch->width - 1));
+}
+
+static uint8_t sketch_counter_get(Sketch* sketch, size_t counter) {
+    assert(sketch);
+
+    return (sketch->counters[counter / 2] >> ((counter % 2) * SKETCH_COUNTER_BITS)) &
+           SKETCH_COUNTER_MAX;
+}
+
+// Halve every counter, so that the sketch tracks recent popularity. Shifting a whole byte moves
+// the low bit of the high nibble into the low one, so it is masked off.
+static void sketch_age(Sketch* sketch) {
+    assert(sketch);
+
+    for (size_t i = 0; i < SKETCH_BYTES(sketch->width); i++)
+        sketch->counters[i] = (sketch->counters[i] >> 1) & 0x77;
+    sketch->additions /= 2;
+}
+
+void sketch_increment(Sketch* sketch, uint64_t hash) {
+    assert(sketch);
+
+    for (size_t row = 0; row < SKETCH_DEPTH; row++) {
+        size_t   counter = sketch_counter(sketch, hash, row);
+        uint8_t* byte    = &sketch->counters[counter / 2];
+        if (sketch_counter_get(sketch, counter) < SKETCH_COUNTER_MAX)
+            *byte = (uint8_t)(*byte + (1U << ((counter % 2) * SKETCH_COUNTER_BITS)));
+    }
+
+    if (++sketch->additions >= sketch->sample_size)
+        sketch_age(sketch);
+}
+
+uint8_t sketch_estimate(Sketch* sketch, uint64_t hash) {
+    assert(sketch);
+
+    uint8_t ret = SKETCH_COUNTER_MAX;
+    for (size_t row = 0; row < SKETCH_DEPTH; row++)
+        ret = MIN(ret, sketch_counter_get(sketch, sketch_counter(sketch, hash, row)));
+
+    return ret;
+}
+
+// TinyLFU only lets a candidate in if it has been seen more often than the entry it would replace,
+// so a run of one-off requests can't flush the cache.
+bool sketch_admit(Sketch* sketch, uint64_t candidate, uint64_t victim) {
+    assert(sketch);
+
+    return sketch_estimate(sketch, candidate) > sketch_estimate(sketch, victim);
+}
@@ -0,0 +1,41 @@
+/*
+ * SHORT CIRCUIT: SKETCH -- Count-min sketch for estimating access frequency.
+ *
+ * Copyright (c) 2021, Alex O'Brien <3541ax@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Affero General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define SKETCH_DEPTH 4
+
+// Approximate access counts over a sliding history, in 4-bit saturating counters packed two to a
+// byte. All counters are halved periodically, so old popularity fades.
+typedef struct Sketch {
+    uint8_t* counters;
+    size_t   width;
+    size_t   additions;
+    size_t   sample_size;
+} Sketch;
+
+void     sketch_init(Sketch*, size_t capacity);
+void     sketch_destroy(Sketch*);
+void     sketch_increment(Sketch*, uint64_t hash);
+uint8_t  sketch_estimate(Sketch*, uint64_t hash);
+bool     sketch_admit(Sketch*, uint64_t candidate, uint64_t victim);
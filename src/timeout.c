@@ -28,6 +28,7 @@
 #include <a3/log.h>
 #include <a3/util.h>
 
+#include "clock.h"
 #include "event.h"
 #include "forward.h"
 
@@ -58,8 +59,7 @@ static void timeout_handle(EventTarget* target, struct io_uring* uring, void* ct
 
     A3_TRACE("Timeout firing.");
 
-    struct timespec current;
-    A3_UNWRAPSD(clock_gettime(CLOCK_MONOTONIC, &current));
+    struct timespec current = clock_monotonic();
 
     A3LL* peek;
     while ((peek = a3_ll_peek(&timeouts->queue)) &&
@@ -20,15 +20,17 @@
 #include "uri.h"
 
 #include <assert.h>
-#include <ctype.h>
+#include <stdbool.h>
 #include <stdint.h>
-#include <stdlib.h>
 #include <string.h>
 
-#include <a3/buffer.h>
 #include <a3/str.h>
 #include <a3/util.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 static UriScheme uri_scheme_parse(A3CString name) {
 #define _SCHEME(SCHEME, S) { SCHEME, A3_CS(S) },
     static const struct {
@@ -36,9 +38,9 @@ static UriScheme uri_scheme_parse(A3CString name) {
         A3CString name;
     } URI_SCHEMES[] = { URI_SCHEME_ENUM };
 #undef _SCHEME
-    assert(name.ptr && *name.ptr);
+    assert(name.ptr);
 
-    A3_TRYB_MAP(name.ptr && a3_string_isascii(name), URI_SCHEME_INVALID);
+    A3_TRYB_MAP(name.len && a3_string_isascii(name), URI_SCHEME_INVALID);
 
     for (size_t i = 0; i < sizeof(URI_SCHEMES) / sizeof(URI_SCHEMES[0]); i++) {
         if (a3_string_cmpi(name, URI_SCHEMES[i].name) == 0)
@@ -48,95 +50,139 @@ static UriScheme uri_scheme_parse(A3CString name) {
     return URI_SCHEME_INVALID;
 }
 
-static bool uri_decode(A3String str) {
+static size_t uri_find(A3String str, size_t start, A3CString delims) {
     assert(str.ptr);
-    const uint8_t* end = a3_string_end(A3_S_CONST(str));
-
-    for (uint8_t *wp, *rp = wp = str.ptr; wp < end && rp < end && *wp && *rp; wp++) {
-        switch (*rp) {
-        case '%':
-            if (isxdigit(rp[1]) && isxdigit(rp[2])) {
-                uint8_t n = 0;
-                for (uint8_t i = 0; i < 2; i++) {
-                    n *= 16;
-                    uint8_t c = rp[2 - i];
-                    if ('0' <= c && c <= '9')
-                        n += (uint8_t)(c - '0');
-                    else
-                        n += (uint8_t)(toupper(c) - 'A' + 10);
-                }
-
-                if (n == 0)
-                    return false;
-
-                *wp = n;
-                rp += 3;
-            } else {
-                return false;
-            }
+
+    for (size_t i = start; i < str.len; i++)
+        if (memchr(delims.ptr, str.ptr[i], delims.len))
+            return i;
+
+    return str.len;
+}
+
+// Check whether a path can be used as-is: it has nothing to decode and no dot segments.
+static bool uri_path_is_clean(A3CString path) {
+    assert(path.ptr && path.len && *path.ptr == '/');
+
+    size_t i = 1;
+#ifdef __SSE2__
+    // Compare each block against '%' and '+', and against '.' where the previous byte is '/'.
+    const __m128i pct   = _mm_set1_epi8('%');
+    const __m128i plus  = _mm_set1_epi8('+');
+    const __m128i dot   = _mm_set1_epi8('.');
+    const __m128i slash = _mm_set1_epi8('/');
+    for (; i + 16 <= path.len; i += 16) {
+        __m128i cur  = _mm_loadu_si128((const __m128i*)&path.ptr[i]);
+        __m128i prev = _mm_loadu_si128((const __m128i*)&path.ptr[i - 1]);
+        __m128i bad  = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(cur, pct), _mm_cmpeq_epi8(cur, plus)),
+            _mm_and_si128(_mm_cmpeq_epi8(cur, dot), _mm_cmpeq_epi8(prev, slash)));
+        if (_mm_movemask_epi8(bad))
+            return false;
+    }
+#endif
+
+    for (; i < path.len; i++) {
+        uint8_t c = path.ptr[i];
+        if (c == '%' || c == '+' || (c == '.' && path.ptr[i - 1] == '/'))
+            return false;
+    }
+
+    return true;
+}
+
+static int8_t uri_hex_value(uint8_t c) {
+    if ('0' <= c && c <= '9')
+        return (int8_t)(c - '0');
+    c |= 0x20;
+    if ('a' <= c && c <= 'f')
+        return (int8_t)(c - 'a' + 10);
+    return -1;
+}
+
+// Decode in place. The string can only shrink.
+static bool uri_decode(A3String* str) {
+    assert(str && str->ptr);
+
+    size_t wi = 0;
+    for (size_t ri = 0; ri < str->len; wi++) {
+        switch (str->ptr[ri]) {
+        case '%': {
+            A3_TRYB(ri + 2 < str->len);
+            int8_t hi = uri_hex_value(str->ptr[ri + 1]);
+            int8_t lo = uri_hex_value(str->ptr[ri + 2]);
+            A3_TRYB(hi >= 0 && lo >= 0);
+
+            uint8_t n = (uint8_t)(hi << 4 | lo);
+            A3_TRYB(n != 0);
+
+            str->ptr[wi] = n;
+            ri += 3;
             break;
+        }
         case '+':
-            *wp = ' ';
-            rp++;
+            str->ptr[wi] = ' ';
+            ri++;
             break;
         default:
-            *wp = *rp++;
+            str->ptr[wi] = str->ptr[ri++];
             break;
         }
     }
 
+    str->len = wi;
     return true;
 }
 
-static void uri_collapse_dot_segments(A3String str) {
-    assert(str.ptr);
-    assert(*str.ptr == '/');
-
-    size_t segments = 0;
-    for (size_t i = 0; i < str.len; segments += str.ptr[i++] == '/')
-        ;
-    if (!segments)
-        return;
-    size_t* segment_indices = calloc(segments, sizeof(size_t));
-    A3_UNWRAPND(segment_indices);
-
-    size_t segment_index = 0;
-    for (size_t ri, wi = ri = 0; ri < str.len && wi < str.len;) {
-        if (!str.ptr[ri])
-            break;
-        if (str.ptr[ri] == '/') {
-            if (ri + 1 < str.len && str.ptr[ri + 1] == '.') {
-                if (ri + 2 < str.len && str.ptr[ri + 2] == '.') {
-                    ri += 3;
-                    // Go back a segment.
-                    if (segment_index > 0) {
-                        wi = segment_indices[--segment_index] + 1;
-                        // Drop extra slashes.
-                        if (ri < str.len && str.ptr[ri] == '/')
-                            wi--;
-                    } else {
-                        memcpy(&str.ptr[wi], "/..", 3);
-                        wi += 3;
-                    }
-                } else {
-                    // Skip "/.".
-                    ri += 2;
-                }
+// Remove "." and ".." segments in place, as in RFC3986 § 5.2.4. A ".." which would go above the
+// root is kept, so that the caller can reject it.
+static void uri_collapse_dot_segments(A3String* str) {
+    assert(str && str->ptr);
+    assert(*str->ptr == '/');
+
+    uint8_t* p = str->ptr;
+
+    // Output before floor is made up of ".." segments which can't be removed.
+    size_t floor = 0;
+    size_t wi    = 0;
+    for (size_t ri = 0, seg_end; ri < str->len; ri = seg_end) {
+        for (seg_end = ri + 1; seg_end < str->len && p[seg_end] != '/'; seg_end++)
+            ;
+        size_t seg_len = seg_end - ri - 1;
+        bool   last    = seg_end == str->len;
+
+        if (seg_len == 1 && p[ri + 1] == '.') {
+            if (last)
+                p[wi++] = '/';
+        } else if (seg_len == 2 && p[ri + 1] == '.' && p[ri + 2] == '.') {
+            if (wi > floor) {
+                // Go back a segment.
+                do
+                    wi--;
+                while (wi > floor && p[wi] != '/');
+                if (last)
+                    p[wi++] = '/';
             } else {
-                // Create a segment.
-                wi                               = ri++;
-                segment_indices[segment_index++] = wi++;
+                memmove(&p[wi], "/..", 3);
+                wi += 3;
+                floor = wi;
             }
         } else {
-            str.ptr[wi++] = str.ptr[ri++];
+            memmove(&p[wi], &p[ri], seg_end - ri);
+            wi += seg_end - ri;
         }
     }
 
-    free(segment_indices);
+    if (!wi)
+        p[wi++] = '/';
+    str->len = wi;
 }
 
-static bool uri_normalize_path(A3String str) {
-    assert(str.ptr);
+static bool uri_normalize_path(A3String* str) {
+    assert(str && str->ptr);
+
+    if (uri_path_is_clean(A3_S_CONST(*str)))
+        return true;
 
     A3_TRYB(uri_decode(str));
     uri_collapse_dot_segments(str);
@@ -144,76 +190,124 @@ static bool uri_normalize_path(A3String str) {
     return true;
 }
 
+// Parse a URI in place. The components of the result point into the given string, which is
+// modified and must outlive the Uri.
 UriParseResult uri_parse(Uri* ret, A3String str) {
     assert(ret);
     assert(str.ptr);
 
-    A3Buffer  buf_ = { .data = str, .tail = str.len, .head = 0, .max_cap = str.len };
-    A3Buffer* buf  = &buf_;
-
     memset(ret, 0, sizeof(Uri));
     ret->scheme = URI_SCHEME_UNSPECIFIED;
+    A3_TRYB_MAP(str.len, URI_PARSE_BAD_URI);
+
+    size_t pos = 0;
 
     // [<scheme>://][authority]<path>[query][fragment]
-    if (a3_buf_memmem(buf, A3_CS("://")).ptr) {
-        ret->scheme =
-            uri_scheme_parse(A3_S_CONST(a3_buf_token_next(buf, A3_CS("://"), A3_PRES_END_NO)));
-        if (ret->scheme == URI_SCHEME_INVALID)
-            return URI_PARSE_BAD_URI;
+    if (*str.ptr != '/') {
+        size_t colon = uri_find(str, 0, A3_CS(":/?#"));
+        if (colon + 2 < str.len && str.ptr[colon] == ':' && str.ptr[colon + 1] == '/' &&
+            str.ptr[colon + 2] == '/') {
+            ret->scheme = uri_scheme_parse((A3CString) { .ptr = str.ptr, .len = colon });
+            if (ret->scheme == URI_SCHEME_INVALID)
+                return URI_PARSE_BAD_URI;
+            pos = colon + 3;
+        }
     }
 
     // [authority]<path>[query][fragment]
-    if (buf->data.ptr[buf->head] != '/' && ret->scheme != URI_SCHEME_UNSPECIFIED) {
-        ret->authority = a3_string_clone(a3_buf_token_next(buf, A3_CS("/"), A3_PRES_END_NO));
-        A3_TRYB_MAP(ret->authority.ptr, URI_PARSE_BAD_URI);
-        buf->data.ptr[--buf->head] = '/';
+    if (ret->scheme != URI_SCHEME_UNSPECIFIED && pos < str.len && str.ptr[pos] != '/') {
+        size_t end     = uri_find(str, pos, A3_CS("/"));
+        ret->authority = (A3String) { .ptr = &str.ptr[pos], .len = end - pos };
+        pos            = end;
     }
 
     // <path>[query][fragment]
-    ret->path = a3_buf_token_next_copy(buf, A3_CS("#?\r\n"), A3_PRES_END_NO);
-    A3_TRYB_MAP(ret->path.ptr, URI_PARSE_BAD_URI);
-    if (ret->path.len == 0)
+    size_t path_end = uri_find(str, pos, A3_CS("?#"));
+    if (path_end == pos || str.ptr[pos] != '/')
         return URI_PARSE_BAD_URI;
-    A3_TRYB_MAP(uri_normalize_path(ret->path), URI_PARSE_BAD_URI);
-    if (a3_buf_len(buf) == 0)
+    ret->path = (A3String) { .ptr = &str.ptr[pos], .len = path_end - pos };
+    A3_TRYB_MAP(uri_normalize_path(&ret->path), URI_PARSE_BAD_URI);
+    if (path_end == str.len)
         return URI_PARSE_SUCCESS;
 
     // [query][fragment]
-    ret->query = a3_buf_token_next_copy(buf, A3_CS("#"), A3_PRES_END_NO);
-    A3_TRYB_MAP(ret->query.ptr, URI_PARSE_BAD_URI);
-    A3_TRYB_MAP(uri_decode(ret->query), URI_PARSE_BAD_URI);
-    if (a3_buf_len(buf) == 0)
-        return URI_PARSE_SUCCESS;
+    pos = path_end + 1;
+    if (str.ptr[path_end] == '?') {
+        size_t query_end = uri_find(str, pos, A3_CS("#"));
+        ret->query       = (A3String) { .ptr = &str.ptr[pos], .len = query_end - pos };
+        A3_TRYB_MAP(uri_decode(&ret->query), URI_PARSE_BAD_URI);
+        if (query_end == str.len)
+            return URI_PARSE_SUCCESS;
+        pos = query_end + 1;
+    }
 
     // [fragment]
-    ret->fragment = a3_buf_token_next_copy(buf, A3_CS(""), A3_PRES_END_NO);
-    A3_TRYB_MAP(ret->fragment.ptr, URI_PARSE_BAD_URI);
-    uri_decode(ret->fragment);
-    assert(a3_buf_len(buf) == 0);
+    ret->fragment = (A3String) { .ptr = &str.ptr[pos], .len = str.len - pos };
+    uri_decode(&ret->fragment);
 
     return URI_PARSE_SUCCESS;
 }
 
-// Return the path to the pointed-to file if it is a child of the given root
-// path.
-A3String uri_path_if_contained(Uri* uri, A3CString real_root) {
-    assert(uri);
-    assert(real_root.ptr && *real_root.ptr);
+// Write the path to the pointed-to file, relative to the web root, into out. Returns a null string
+// if the path would leave the root. out must have space for the path and a NUL terminator.
+A3String uri_path_relative(Uri* uri, A3String out) {
+    assert(uri && uri->path.ptr && uri->path.len);
+    assert(out.ptr && out.len >= uri->path.len + 1);
 
-    // Ensure there are no directory escaping shenanigans. This occurs after
-    // decoding, so ".." should be the only way such a thing can occur.
+    // Ensure there are no directory escaping shenanigans. Paths from uri_parse have been decoded
+    // and collapsed, so an escaping ".." can only be left at the start.
     //
     // TODO: This only makes sense for static files since parts of the path
     // which are used by an endpoint are perfectly allowed to contain "..".
-    for (size_t i = 0; i < uri->path.len - 1; i++)
-        if (uri->path.ptr[i] == '.' && uri->path.ptr[i + 1] == '.')
-            return A3_S_NULL;
+    //
+    // The kernel enforces containment again when the path is resolved, but failing early is cheap.
+    A3CString path = A3_S_CONST(uri->path);
+    if (path.len >= 3 && memcmp(path.ptr, "/..", 3) == 0 && (path.len == 3 || path.ptr[3] == '/'))
+        return A3_S_NULL;
+
+    if (*path.ptr == '/') {
+        path.ptr++;
+        path.len--;
+    }
+    if (!path.len)
+        path = A3_CS(".");
 
-    if (uri->path.len == 1 && *uri->path.ptr == '/')
-        return a3_string_clone(real_root);
+    memcpy(out.ptr, path.ptr, path.len);
+    out.len          = path.len;
+    out.ptr[out.len] = '\0';
 
-    A3String ret = a3_string_alloc(real_root.len + uri->path.len);
-    a3_string_concat(ret, 2, real_root, uri->path);
+    return out;
+}
+
+// Whether a path relative to the web root is one uri_path_relative gives: collapsing its dot
+// segments leaves it unchanged, it has no empty segments, and it does not leave the root. Paths
+// which do not come from a request, such as those read from a file, are checked with this before
+// they are used as cache keys.
+bool uri_path_is_canonical(A3CString path) {
+    assert(path.ptr);
+
+    if (!path.len || memchr(path.ptr, '\0', path.len))
+        return false;
+
+    A3String abs = a3_string_alloc(path.len + 1);
+    abs.ptr[0]   = '/';
+    memcpy(&abs.ptr[1], path.ptr, path.len);
+
+    bool ret = true;
+    for (size_t i = 1; i < abs.len && ret; i++)
+        ret = abs.ptr[i] != '/' || abs.ptr[i - 1] != '/';
+
+    if (ret) {
+        Uri uri = { .path = abs };
+        uri_collapse_dot_segments(&uri.path);
+
+        A3String out      = a3_string_alloc(uri.path.len + 1);
+        A3String relative = uri_path_relative(&uri, out);
+        ret               = relative.ptr && a3_string_cmp(relative, path) == 0;
+        a3_string_free(&out);
+    }
+
+    a3_string_free(&abs);
     return ret;
 }
 
@@ -222,16 +316,3 @@ bool uri_is_initialized(Uri* uri) {
 
     return uri->path.ptr;
 }
-
-void uri_free(Uri* uri) {
-    assert(uri_is_initialized(uri));
-
-    if (uri->authority.ptr)
-        a3_string_free(&uri->authority);
-    if (uri->path.ptr)
-        a3_string_free(&uri->path);
-    if (uri->query.ptr)
-        a3_string_free(&uri->query);
-    if (uri->fragment.ptr)
-        a3_string_free(&uri->fragment);
-}
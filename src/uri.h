@@ -35,6 +35,7 @@ typedef enum UriScheme {
 #undef _SCHEME
 } UriScheme;
 
+// The components of a Uri are views into the string it was parsed from.
 typedef struct Uri {
     UriScheme scheme;
     A3String  authority;
@@ -51,6 +52,6 @@ typedef enum UriParseResult {
 } UriParseResult;
 
 UriParseResult uri_parse(Uri*, A3String);
-A3String       uri_path_if_contained(Uri*, A3CString real_root);
+A3String       uri_path_relative(Uri*, A3String out);
+bool           uri_path_is_canonical(A3CString);
 bool           uri_is_initialized(Uri*);
-void           uri_free(Uri*);
@@ -0,0 +1,312 @@
+#include <algorithm>
+#include <random>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include <a3/ht.h>
+#include <a3/str.h>
+
+extern "C" {
+#include "config.h"
+#include "http/headers.h"
+}
+
+// Parses a header block into headers, which are destroyed before the next parse and after the
+// test.
+class HeadersTest : public ::testing::Test {
+protected:
+    HttpHeaders headers {};
+    std::string block;
+    bool        parsed = false;
+
+    static void SetUpTestSuite() { http_headers_key_init(); }
+
+    void TearDown() override { reset(); }
+
+    void reset() {
+        if (parsed)
+            http_headers_destroy(&headers);
+        parsed = false;
+    }
+
+    void add(std::vector<std::string> const& names, std::vector<std::string> const& values) {
+        reset();
+        block.clear();
+        for (size_t i = 0; i < names.size(); i++)
+            block += names[i] + ": " + values[i] + "\r\n";
+
+        http_headers_init(&headers);
+        http_headers_rebase(&headers, reinterpret_cast<const uint8_t*>(block.data()));
+        parsed = true;
+
+        size_t pos = 0;
+        for (size_t i = 0; i < names.size(); i++) {
+            A3CString n = { reinterpret_cast<const uint8_t*>(&block[pos]), names[i].size() };
+            A3CString v = { reinterpret_cast<const uint8_t*>(&block[pos + names[i].size() + 2]),
+                            values[i].size() };
+            EXPECT_TRUE(http_header_add(&headers, n, v));
+            pos += names[i].size() + values[i].size() + 4;
+        }
+    }
+
+    void add(std::string const& name, std::string const& value) {
+        add(std::vector<std::string> { name }, std::vector<std::string> { value });
+    }
+
+    std::string get(std::string const& name) {
+        A3CString ret = http_header_get(&headers, a3_cstring_from(name.c_str()));
+        if (!ret.ptr)
+            return "<none>";
+        return std::string(reinterpret_cast<const char*>(ret.ptr), ret.len);
+    }
+};
+
+// The generic table is keyed, so a client can't pick names which collide. These names are
+// anagrams with the same length, first and last byte, so they collide under any hash which
+// ignores byte order or the key. Lookups must stay exact for every key and field count.
+class HeadersTable : public HeadersTest {
+protected:
+    static std::vector<std::string> anagrams(size_t n) {
+        std::vector<std::string> ret;
+        std::string              middle = "abcdef";
+        do {
+            ret.push_back("x-" + middle + "z");
+        } while (ret.size() < n && std::next_permutation(middle.begin(), middle.end()));
+        return ret;
+    }
+
+    static std::vector<uint8_t> key(uint8_t fill) {
+        return std::vector<uint8_t>(A3_HT_HASH_KEY_SIZE, fill);
+    }
+
+    void TearDown() override {
+        HeadersTest::TearDown();
+        http_headers_key_init();
+    }
+};
+
+TEST_F(HeadersTable, colliding_names_stay_distinct) {
+    std::vector<std::string> all = anagrams(HTTP_REQUEST_HEADER_FIELDS_MAX + 1);
+
+    for (uint8_t fill : { 0x00, 0x5A, 0xFF }) {
+        http_headers_key_set(key(fill).data());
+
+        for (size_t n = 1; n <= HTTP_REQUEST_HEADER_FIELDS_MAX; n *= 2) {
+            std::vector<std::string> names(all.begin(), all.begin() + static_cast<ptrdiff_t>(n));
+            std::vector<std::string> values;
+            for (size_t i = 0; i < n; i++)
+                values.push_back("v" + std::to_string(i));
+
+            add(names, values);
+            for (size_t i = 0; i < n; i++)
+                EXPECT_EQ(get(names[i]), values[i]) << "key " << +fill << " n " << n;
+            EXPECT_EQ(get(all[n]), "<none>");
+        }
+    }
+}
+
+// The comparisons made to build the table and look up every name in it. They depend only on the
+// names and the key, so unlike timings they can be compared exactly.
+class HeadersCost : public HeadersTable {
+protected:
+    size_t comparisons(std::vector<std::string> const& names) {
+        add(names, std::vector<std::string>(names.size(), "v"));
+
+        size_t before = http_headers_comparisons();
+        for (std::string const& name : names)
+            EXPECT_EQ(get(name), "v");
+        return http_headers_comparisons() - before;
+    }
+
+    // Distinct names of the same length as the anagrams, from a fixed seed.
+    static std::vector<std::string> random_names(size_t n) {
+        std::mt19937                    rng(3541);
+        std::uniform_int_distribution<> letter('a', 'z');
+        std::set<std::string>           seen;
+        std::vector<std::string>        ret;
+        while (ret.size() < n) {
+            std::string name = "x-";
+            for (size_t i = 0; i < 7; i++)
+                name += static_cast<char>(letter(rng));
+            if (seen.insert(name).second)
+                ret.push_back(name);
+        }
+        return ret;
+    }
+};
+
+// A table whose hash the anagrams defeat makes each lookup compare against every earlier name, so
+// the comparisons per field grow with the field count. With the key, they stay close to those for
+// names with nothing in common.
+TEST_F(HeadersCost, colliding_names_cost_no_more) {
+    std::vector<std::string> colliding = anagrams(HTTP_REQUEST_HEADER_FIELDS_MAX);
+    std::vector<std::string> random    = random_names(HTTP_REQUEST_HEADER_FIELDS_MAX);
+
+    for (uint8_t fill : { 0x00, 0x5A, 0xFF }) {
+        http_headers_key_set(key(fill).data());
+
+        for (size_t n = 1; n <= HTTP_REQUEST_HEADER_FIELDS_MAX; n *= 2) {
+            auto   end            = static_cast<ptrdiff_t>(n);
+            size_t colliding_cost = comparisons({ colliding.begin(), colliding.begin() + end });
+            size_t random_cost    = comparisons({ random.begin(), random.begin() + end });
+
+            EXPECT_LE(colliding_cost, 4 * n) << "key " << +fill << " n " << n;
+            EXPECT_LE(random_cost, 4 * n) << "key " << +fill << " n " << n;
+            EXPECT_LE(colliding_cost, 2 * random_cost + n) << "key " << +fill << " n " << n;
+        }
+    }
+}
+
+TEST_F(HeadersTable, duplicates_combine_under_any_key) {
+    for (uint8_t fill : { 0x00, 0xFF }) {
+        http_headers_key_set(key(fill).data());
+
+        add({ "x-abcdefz", "X-ABCDEFZ", "x-bacdefz", "x-Abcdefz" }, { "a", "b", "c", "d" });
+        EXPECT_EQ(get("X-AbCdEfZ"), "a,b,d");
+        EXPECT_EQ(get("x-bacdefz"), "c");
+    }
+}
+
+TEST_F(HeadersTable, field_count_is_capped) {
+    add(std::vector<std::string>(HTTP_REQUEST_HEADER_FIELDS_MAX, "X-Header"),
+        std::vector<std::string>(HTTP_REQUEST_HEADER_FIELDS_MAX, "value"));
+
+    A3CString name  = { reinterpret_cast<const uint8_t*>(block.data()), 8 };
+    A3CString value = { reinterpret_cast<const uint8_t*>(&block[10]), 5 };
+    EXPECT_FALSE(http_header_add(&headers, name, value));
+}
+
+class HeadersRange : public HeadersTest {
+protected:
+    HttpRangeResult parse(std::string const& value, uint64_t size, HttpRange* out) {
+        add("Range", value);
+        return http_header_range(&headers, size, out);
+    }
+};
+
+TEST_F(HeadersRange, single_ranges) {
+    HttpRange range {};
+
+    EXPECT_EQ(parse("bytes=0-99", 1000, &range), HTTP_RANGE_SATISFIABLE);
+    EXPECT_EQ(range.first, 0U);
+    EXPECT_EQ(range.last, 99U);
+
+    EXPECT_EQ(parse("bytes=900-", 1000, &range), HTTP_RANGE_SATISFIABLE);
+    EXPECT_EQ(range.first, 900U);
+    EXPECT_EQ(range.last, 999U);
+
+    EXPECT_EQ(parse("bytes=-100", 1000, &range), HTTP_RANGE_SATISFIABLE);
+    EXPECT_EQ(range.first, 900U);
+    EXPECT_EQ(range.last, 999U);
+
+    EXPECT_EQ(parse("Bytes=990-2000", 1000, &range), HTTP_RANGE_SATISFIABLE);
+    EXPECT_EQ(range.first, 990U);
+    EXPECT_EQ(range.last, 999U);
+
+    EXPECT_EQ(parse("bytes=-5000", 1000, &range), HTTP_RANGE_SATISFIABLE);
+    EXPECT_EQ(range.first, 0U);
+    EXPECT_EQ(range.last, 999U);
+}
+
+TEST_F(HeadersRange, unsatisfiable) {
+    HttpRange range {};
+
+    EXPECT_EQ(parse("bytes=1000-", 1000, &range), HTTP_RANGE_UNSATISFIABLE);
+    EXPECT_EQ(parse("bytes=-0", 1000, &range), HTTP_RANGE_UNSATISFIABLE);
+    EXPECT_EQ(parse("bytes=0-0", 0, &range), HTTP_RANGE_UNSATISFIABLE);
+}
+
+TEST_F(HeadersRange, ignored) {
+    HttpRange range {};
+
+    EXPECT_EQ(parse("bytes=0-1,5-6", 1000, &range), HTTP_RANGE_NONE);
+    EXPECT_EQ(parse("items=0-1", 1000, &range), HTTP_RANGE_NONE);
+    EXPECT_EQ(parse("bytes=5-1", 1000, &range), HTTP_RANGE_NONE);
+    EXPECT_EQ(parse("bytes=-", 1000, &range), HTTP_RANGE_NONE);
+    EXPECT_EQ(parse("bytes=x", 1000, &range), HTTP_RANGE_NONE);
+}
+
+class HeadersEncoding : public HeadersTest {
+protected:
+    bool accepts(std::string const& value, char const* coding) {
+        add("Accept-Encoding", value);
+        return http_header_accepts_encoding(&headers, a3_cstring_from(coding));
+    }
+};
+
+TEST_F(HeadersEncoding, accepts) {
+    EXPECT_TRUE(accepts("gzip", "gzip"));
+    EXPECT_TRUE(accepts("br, GZIP;q=0.5", "gzip"));
+    EXPECT_TRUE(accepts("*", "gzip"));
+    EXPECT_TRUE(accepts("identity;q=0, *;q=1", "gzip"));
+}
+
+TEST_F(HeadersEncoding, refuses) {
+    EXPECT_FALSE(accepts("br", "gzip"));
+    EXPECT_FALSE(accepts("gzip;q=0", "gzip"));
+    EXPECT_FALSE(accepts("gzip; q=0.000", "gzip"));
+    EXPECT_FALSE(accepts("*, gzip;q=0", "gzip"));
+    EXPECT_FALSE(accepts("gzipped", "gzip"));
+}
+
+class HeadersConditional : public HeadersTest {
+protected:
+    bool matches(char const* name, HttpHeaderKnown header, std::string const& value,
+                 char const* etag) {
+        add(name, value);
+        return http_header_etag_matches(&headers, header, a3_cstring_from(etag));
+    }
+
+    bool date(std::string const& value, time_t* out) {
+        add("If-Modified-Since", value);
+        return http_header_date(&headers, HTTP_HEADER_IF_MODIFIED_SINCE, out);
+    }
+
+    bool if_range(std::string const& value, char const* etag, char const* last_modified) {
+        add("If-Range", value);
+        return http_header_if_range(&headers, a3_cstring_from(etag),
+                                    a3_cstring_from(last_modified));
+    }
+};
+
+TEST_F(HeadersConditional, none_match_is_weak) {
+    EXPECT_TRUE(matches("If-None-Match", HTTP_HEADER_IF_NONE_MATCH, "\"a\"", "\"a\""));
+    EXPECT_TRUE(matches("If-None-Match", HTTP_HEADER_IF_NONE_MATCH, "\"b\", W/\"a\"", "\"a\""));
+    EXPECT_TRUE(matches("If-None-Match", HTTP_HEADER_IF_NONE_MATCH, "*", "\"a\""));
+    EXPECT_FALSE(matches("If-None-Match", HTTP_HEADER_IF_NONE_MATCH, "\"b\"", "\"a\""));
+}
+
+TEST_F(HeadersConditional, match_is_strong) {
+    EXPECT_TRUE(matches("If-Match", HTTP_HEADER_IF_MATCH, "\"b\", \"a\"", "\"a\""));
+    EXPECT_TRUE(matches("If-Match", HTTP_HEADER_IF_MATCH, "*", "\"a\""));
+    EXPECT_FALSE(matches("If-Match", HTTP_HEADER_IF_MATCH, "W/\"a\"", "\"a\""));
+    EXPECT_FALSE(matches("If-Match", HTTP_HEADER_IF_MATCH, "\"a\"", "W/\"a\""));
+}
+
+TEST_F(HeadersConditional, dates) {
+    time_t t = 0;
+
+    EXPECT_TRUE(date("Sun, 06 Nov 1994 08:49:37 GMT", &t));
+    EXPECT_EQ(t, 784111777);
+    EXPECT_TRUE(date("Thu, 01 Jan 1970 00:00:00 GMT", &t));
+    EXPECT_EQ(t, 0);
+
+    EXPECT_FALSE(date("Sunday, 06-Nov-94 08:49:37 GMT", &t));
+    EXPECT_FALSE(date("Sun Nov  6 08:49:37 1994", &t));
+    EXPECT_FALSE(date("Sun, 06 Foo 1994 08:49:37 GMT", &t));
+    EXPECT_FALSE(date("Sun, 06 Nov 1994 08:49:37 UTC", &t));
+}
+
+TEST_F(HeadersConditional, if_range) {
+    char const* date = "Sun, 06 Nov 1994 08:49:37 GMT";
+
+    EXPECT_EQ(http_header_known(A3_CS("If-Range")), HTTP_HEADER_IF_RANGE);
+    EXPECT_TRUE(if_range("\"a\"", "\"a\"", date));
+    EXPECT_FALSE(if_range("\"b\"", "\"a\"", date));
+    EXPECT_FALSE(if_range("W/\"a\"", "W/\"a\"", date));
+    EXPECT_TRUE(if_range(date, "\"a\"", date));
+    EXPECT_FALSE(if_range("Sun, 06 Nov 1994 08:49:38 GMT", "\"a\"", date));
+}
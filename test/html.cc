@@ -0,0 +1,56 @@
+#include <gtest/gtest.h>
+
+#include <a3/str.h>
+
+extern "C" {
+#include "html.h"
+}
+
+class HtmlLinksTest : public ::testing::Test {
+protected:
+    A3String links[8] {};
+    size_t   n_links { 0 };
+
+    void scan(const char* html, const char* page) {
+        n_links = html_links_scan(a3_cstring_from(html), a3_cstring_from(page), links, 8);
+    }
+
+    void TearDown() override {
+        for (size_t i = 0; i < n_links; i++)
+            a3_string_free(&links[i]);
+    }
+};
+
+TEST_F(HtmlLinksTest, subresources) {
+    scan("<link rel=\"stylesheet\" href=\"site.css\"><script src='app.js'></script>"
+         "<IMG SRC=logo.png alt=\"\">",
+         "index.html");
+
+    ASSERT_EQ(n_links, 3U);
+    EXPECT_EQ(a3_string_cmp(links[0], A3_CS("site.css")), 0);
+    EXPECT_EQ(a3_string_cmp(links[1], A3_CS("app.js")), 0);
+    EXPECT_EQ(a3_string_cmp(links[2], A3_CS("logo.png")), 0);
+}
+
+TEST_F(HtmlLinksTest, resolve) {
+    scan("<img src=\"../img/a%20b.png?v=2#x\"><img src=\"/root.png\"><img src=\"./c.png\">"
+         "<img src=\"../../../../etc/passwd\">",
+         "blog/post/index.html");
+
+    ASSERT_EQ(n_links, 3U);
+    EXPECT_EQ(a3_string_cmp(links[0], A3_CS("blog/img/a b.png")), 0);
+    EXPECT_EQ(a3_string_cmp(links[1], A3_CS("root.png")), 0);
+    EXPECT_EQ(a3_string_cmp(links[2], A3_CS("blog/post/c.png")), 0);
+}
+
+TEST_F(HtmlLinksTest, skipped) {
+    scan("<a href=\"next.html\">Next</a><link rel=canonical href=\"/other.html\">"
+         "<img src=\"https://example.com/a.png\"><img src=\"//example.com/b.png\">"
+         "<img src=\"data:image/png;base64,AA\"><!-- <img src=\"c.png\"> -->"
+         "<script>if (a<b) s = '<img src=d.png>';</script><img src=\"e.png\"><img src=\"e.png\">"
+         "<img src=\"trunc",
+         "index.html");
+
+    ASSERT_EQ(n_links, 1U);
+    EXPECT_EQ(a3_string_cmp(links[0], A3_CS("e.png")), 0);
+}
@@ -0,0 +1,91 @@
+#include <cerrno>
+#include <cstdint>
+#include <vector>
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <gtest/gtest.h>
+
+extern "C" {
+#include "iov.h"
+}
+
+class IovTest : public ::testing::Test {
+protected:
+    std::vector<uint8_t> data;
+    iovec                iov[5] {};
+    msghdr               msg {};
+
+    // A head, an empty part, and body parts of uneven sizes.
+    void SetUp() override {
+        data.resize(256 * 1024);
+        for (size_t i = 0; i < data.size(); i++)
+            data[i] = static_cast<uint8_t>(i * 7 + i / 251);
+
+        size_t cuts[] = { 0, 100, 100, 65636, 131172, data.size() };
+        for (size_t i = 0; i < 5; i++)
+            iov[i] = { &data[cuts[i]], cuts[i + 1] - cuts[i] };
+        msg.msg_iov    = iov;
+        msg.msg_iovlen = 5;
+    }
+
+    size_t remaining() const {
+        size_t ret = 0;
+        for (size_t i = 0; i < msg.msg_iovlen; i++)
+            ret += msg.msg_iov[i].iov_len;
+        return ret;
+    }
+};
+
+TEST_F(IovTest, advance) {
+    EXPECT_TRUE(iov_advance(&msg, 0));
+    EXPECT_EQ(msg.msg_iovlen, 5U);
+
+    EXPECT_TRUE(iov_advance(&msg, 150));
+    EXPECT_EQ(msg.msg_iovlen, 3U);
+    EXPECT_EQ(msg.msg_iov[0].iov_base, &data[150]);
+    EXPECT_EQ(remaining(), data.size() - 150);
+
+    EXPECT_TRUE(iov_advance(&msg, 65636 - 150));
+    EXPECT_EQ(msg.msg_iovlen, 2U);
+    EXPECT_EQ(msg.msg_iov[0].iov_base, &data[65636]);
+
+    EXPECT_FALSE(iov_advance(&msg, remaining()));
+    EXPECT_EQ(msg.msg_iovlen, 0U);
+}
+
+// With a small send buffer, most sends are short. Resuming each one must deliver the message
+// intact.
+TEST_F(IovTest, resumes_short_sends) {
+    int fds[2];
+    ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+    int size = 4096;
+    ASSERT_EQ(setsockopt(fds[0], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size)), 0);
+
+    std::vector<uint8_t> received;
+    uint8_t              buf[8192];
+    size_t               short_sends = 0;
+    for (bool more = true; more;) {
+        size_t  want = remaining();
+        ssize_t sent = sendmsg(fds[0], &msg, MSG_DONTWAIT);
+        if (sent < 0) {
+            ASSERT_EQ(errno, EAGAIN);
+        } else {
+            short_sends += static_cast<size_t>(sent) < want;
+            more = iov_advance(&msg, static_cast<size_t>(sent));
+        }
+
+        for (ssize_t n; (n = recv(fds[1], buf, sizeof(buf), MSG_DONTWAIT)) > 0;)
+            received.insert(received.end(), buf, buf + n);
+    }
+
+    close(fds[0]);
+    for (ssize_t n; (n = recv(fds[1], buf, sizeof(buf), 0)) > 0;)
+        received.insert(received.end(), buf, buf + n);
+    close(fds[1]);
+
+    EXPECT_GT(short_sends, 0U);
+    EXPECT_EQ(received, data);
+}
@@ -0,0 +1,123 @@
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <gtest/gtest.h>
+
+#include <a3/str.h>
+
+extern "C" {
+#include "pack.h"
+#include "pack/build.h"
+#include "pack/format.h"
+}
+
+// Builds a pack from a small web root, then loads it as the server would.
+class PackTest : public ::testing::Test {
+protected:
+    std::string root;
+    std::string out;
+    std::string big;
+
+    void write(std::string const& path, std::string const& content) {
+        std::ofstream file(root + "/" + path, std::ios::binary);
+        file << content;
+    }
+
+    void SetUp() override {
+        char dir[] = "/tmp/sc-pack-test-XXXXXX";
+        ASSERT_TRUE(mkdtemp(dir));
+        root = dir;
+        out  = root + ".pack";
+        ASSERT_EQ(mkdir((root + "/sub").c_str(), 0755), 0);
+
+        for (size_t i = 0; i < 3 * PACK_ALIGN + 17; i++)
+            big.push_back(static_cast<char>(i * 31 + i / 7));
+
+        write("index.html", "<p>root</p>");
+        write("style.css", "p { color: red; }");
+        write("style.css.gz", "not really gzip");
+        write("sub/index.html", "<p>sub</p>");
+        write("sub/big.bin", big);
+
+        pack_build(a3_cstring_from(root.c_str()), a3_cstring_from(out.c_str()));
+    }
+
+    void TearDown() override {
+        pack_close();
+        std::system(("rm -rf '" + root + "' '" + out + "'").c_str());
+    }
+
+    static std::string str(A3CString s) {
+        return std::string(reinterpret_cast<const char*>(s.ptr), s.len);
+    }
+
+    static PackBody const* find(char const* path, PackVariant variant = PACK_VARIANT_IDENTITY) {
+        PackEntry const* entry = pack_find(a3_cstring_from(path));
+        if (!entry || !pack_body_present(&entry->bodies[variant]))
+            return nullptr;
+        return &entry->bodies[variant];
+    }
+
+    // Overwrite one byte of the built pack.
+    void corrupt(uint64_t offset, char byte) {
+        int file = open(out.c_str(), O_WRONLY);
+        ASSERT_GE(file, 0);
+        ASSERT_EQ(pwrite(file, &byte, 1, static_cast<off_t>(offset)), 1);
+        close(file);
+    }
+};
+
+TEST_F(PackTest, round_trip) {
+    ASSERT_TRUE(pack_open(a3_cstring_from(out.c_str())));
+
+    PackBody const* body = find("sub/big.bin");
+    ASSERT_TRUE(body);
+    EXPECT_EQ(str(pack_body_content(body)), big);
+    EXPECT_EQ(body->offset % PACK_ALIGN, 0U);
+
+    std::string headers = str(pack_body_headers(body));
+    EXPECT_EQ(headers.rfind("Content-Length: " + std::to_string(big.size()) + "\r\n", 0), 0U);
+    EXPECT_EQ(headers.back(), '\n');
+
+    for (char const* path : { "index.html", "." }) {
+        ASSERT_TRUE(find(path)) << path;
+        EXPECT_EQ(str(pack_body_content(find(path))), "<p>root</p>");
+    }
+    for (char const* path : { "sub/index.html", "sub" }) {
+        ASSERT_TRUE(find(path)) << path;
+        EXPECT_EQ(str(pack_body_content(find(path))), "<p>sub</p>");
+    }
+
+    EXPECT_EQ(str(pack_body_content(find("style.css"))), "p { color: red; }");
+    ASSERT_TRUE(find("style.css", PACK_VARIANT_GZIP));
+    EXPECT_EQ(str(pack_body_content(find("style.css", PACK_VARIANT_GZIP))), "not really gzip");
+    EXPECT_NE(str(pack_body_headers(find("style.css", PACK_VARIANT_GZIP)))
+                  .find("Content-Encoding: gzip\r\n"),
+              std::string::npos);
+    EXPECT_FALSE(find("index.html", PACK_VARIANT_GZIP));
+
+    EXPECT_FALSE(pack_find(A3_CS("missing.html")));
+    EXPECT_FALSE(pack_find(A3_CS("style.css.gz")));
+}
+
+TEST_F(PackTest, unterminated_headers_are_refused) {
+    ASSERT_TRUE(pack_open(a3_cstring_from(out.c_str())));
+    PackBody const* body = find("style.css");
+    ASSERT_TRUE(body);
+    uint64_t last = body->headers_offset + body->headers_len - 1;
+    pack_close();
+
+    corrupt(last, 'x');
+    EXPECT_FALSE(pack_open(a3_cstring_from(out.c_str())));
+}
+
+TEST_F(PackTest, bad_magic_is_refused) {
+    corrupt(0, 'X');
+    EXPECT_FALSE(pack_open(a3_cstring_from(out.c_str())));
+}
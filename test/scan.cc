@@ -0,0 +1,131 @@
+#include <cstdint>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include <a3/str.h>
+
+extern "C" {
+#include "http/scan.h"
+}
+
+// Each vector scanner must agree with the scalar one, particularly where the byte of interest
+// falls at or either side of a 16 or 32-byte block boundary.
+class ScanTest : public ::testing::Test {
+protected:
+    using Scan = std::tuple<HttpScanResult, size_t, size_t>;
+
+    static constexpr size_t LEN = 96;
+
+    std::vector<HttpScanImpl> impls;
+
+    void SetUp() override {
+        for (HttpScanImpl impl : { HTTP_SCAN_IMPL_SSE42, HTTP_SCAN_IMPL_AVX2 }) {
+            if (http_scan_select(impl))
+                impls.push_back(impl);
+        }
+        http_scan_select(HTTP_SCAN_IMPL_SCALAR);
+        if (impls.empty())
+            GTEST_SKIP() << "No vector scanner is supported on this CPU.";
+    }
+
+    void TearDown() override { http_scan_init(); }
+
+    static Scan scan(std::string const& data, uint8_t delim = ':') {
+        HttpLine line;
+        http_line_reset(&line);
+        HttpScanResult result = http_scan_line(
+            { reinterpret_cast<const uint8_t*>(data.data()), data.size() }, delim, &line);
+        return { result, line.delim, line.end };
+    }
+
+    // Feed the data a byte at a time, so every scan resumes from wherever the last one stopped.
+    static std::vector<Scan> scan_resumed(std::string const& data, uint8_t delim = ':') {
+        std::vector<Scan> scans;
+        HttpLine          line;
+        http_line_reset(&line);
+        for (size_t len = 1; len <= data.size(); len++) {
+            HttpScanResult result = http_scan_line(
+                { reinterpret_cast<const uint8_t*>(data.data()), len }, delim, &line);
+            scans.emplace_back(result, line.delim, line.end);
+            if (result != HTTP_SCAN_INCOMPLETE)
+                break;
+        }
+        return scans;
+    }
+
+    // A line of filler, with the given bytes placed at offset, terminated by CRLF.
+    static std::string line(char filler, std::string const& at, size_t offset) {
+        std::string data(LEN, filler);
+        data.replace(offset, at.size(), at);
+        return data + "\r\n";
+    }
+
+    static std::vector<std::string> cases() {
+        std::vector<std::string> data;
+        for (char filler : { 'a', '\t', ' ', '\x80', '\xff' }) {
+            for (std::string const& at :
+                 std::vector<std::string> { ":", "\r\n", "\n", "\r", "\rx", std::string(1, '\0'),
+                                            "\x1f", "\x7f", " ", "~" }) {
+                for (size_t offset = 0; offset + at.size() <= LEN; offset++)
+                    data.push_back(line(filler, at, offset));
+            }
+        }
+        return data;
+    }
+
+    void expect_agreement(bool resumed) {
+        std::vector<std::string> data = cases();
+
+        for (uint8_t delim : { ':', ' ' }) {
+            std::vector<Scan>              expected;
+            std::vector<std::vector<Scan>> expected_resumed;
+            for (auto const& d : data) {
+                if (resumed)
+                    expected_resumed.push_back(scan_resumed(d, delim));
+                else
+                    expected.push_back(scan(d, delim));
+            }
+
+            for (HttpScanImpl impl : impls) {
+                ASSERT_TRUE(http_scan_select(impl));
+                for (size_t i = 0; i < data.size(); i++) {
+                    if (resumed)
+                        EXPECT_EQ(scan_resumed(data[i], delim), expected_resumed[i])
+                            << "impl " << impl << ", case " << i;
+                    else
+                        EXPECT_EQ(scan(data[i], delim), expected[i])
+                            << "impl " << impl << ", case " << i;
+                }
+            }
+            http_scan_select(HTTP_SCAN_IMPL_SCALAR);
+        }
+    }
+};
+
+TEST_F(ScanTest, scalar_baseline) {
+    for (size_t offset : { 15, 16, 31, 32 }) {
+        EXPECT_EQ(scan(line('a', ":", offset)), Scan(HTTP_SCAN_LINE, offset, LEN));
+        EXPECT_EQ(scan(line('a', "\r\n", offset)), Scan(HTTP_SCAN_LINE, offset, offset));
+        EXPECT_EQ(std::get<0>(scan(line('a', "\n", offset))), HTTP_SCAN_INVALID);
+        EXPECT_EQ(std::get<0>(scan(line('a', "\x7f", offset))), HTTP_SCAN_INVALID);
+        EXPECT_EQ(scan(line('\t', "\x80", offset)), Scan(HTTP_SCAN_LINE, LEN, LEN));
+    }
+}
+
+TEST_F(ScanTest, vector_matches_scalar) { expect_agreement(false); }
+
+TEST_F(ScanTest, vector_matches_scalar_resumed) { expect_agreement(true); }
+
+TEST_F(ScanTest, dispatch_matches_scalar) {
+    std::vector<std::string> data = cases();
+    std::vector<Scan>        expected;
+    for (auto const& d : data)
+        expected.push_back(scan(d));
+
+    http_scan_init();
+    for (size_t i = 0; i < data.size(); i++)
+        EXPECT_EQ(scan(data[i]), expected[i]) << "case " << i;
+}
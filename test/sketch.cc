@@ -0,0 +1,82 @@
+#include <cstdint>
+#include <map>
+
+#include <gtest/gtest.h>
+
+extern "C" {
+#include "sketch.h"
+}
+
+class SketchTest : public ::testing::Test {
+protected:
+    Sketch sketch {};
+
+    void SetUp() override { sketch_init(&sketch, 64); }
+    void TearDown() override { sketch_destroy(&sketch); }
+
+    void increment(uint64_t hash, size_t times) {
+        for (size_t i = 0; i < times; i++)
+            sketch_increment(&sketch, hash);
+    }
+};
+
+TEST_F(SketchTest, estimates) {
+    EXPECT_EQ(sketch_estimate(&sketch, 1), 0);
+
+    increment(1, 5);
+    increment(2, 1);
+    EXPECT_EQ(sketch_estimate(&sketch, 1), 5);
+    EXPECT_EQ(sketch_estimate(&sketch, 2), 1);
+    EXPECT_EQ(sketch_estimate(&sketch, 3), 0);
+
+    // Counters saturate rather than wrap.
+    increment(1, 20);
+    EXPECT_EQ(sketch_estimate(&sketch, 1), 15);
+    EXPECT_EQ(sketch_estimate(&sketch, 2), 1);
+}
+
+TEST_F(SketchTest, estimates_never_undercount) {
+    for (uint64_t hash = 1; hash <= 200; hash++)
+        increment(hash, hash % 3 + 1);
+
+    for (uint64_t hash = 1; hash <= 200; hash++)
+        EXPECT_GE(sketch_estimate(&sketch, hash), hash % 3 + 1) << hash;
+}
+
+// Every counter is halved once sample_size increments have been seen, without disturbing the
+// neighbouring counter in the same byte.
+TEST_F(SketchTest, aging_halves_counters) {
+    // The increment which triggers aging is of a saturated key, so it changes no counter itself.
+    uint64_t const saturated = 1000;
+    increment(saturated, 15);
+
+    size_t added = 15;
+    for (uint64_t hash = 1; added < sketch.sample_size - 1; hash++)
+        for (size_t i = 0; i < hash % 7 + 1 && added < sketch.sample_size - 1; i++, added++)
+            sketch_increment(&sketch, hash);
+
+    std::map<uint64_t, uint8_t> before;
+    for (uint64_t hash = 1; hash <= 200; hash++)
+        before[hash] = sketch_estimate(&sketch, hash);
+    EXPECT_EQ(sketch_estimate(&sketch, saturated), 15);
+
+    sketch_increment(&sketch, saturated);
+    EXPECT_EQ(sketch.additions, sketch.sample_size / 2);
+    EXPECT_EQ(sketch_estimate(&sketch, saturated), 7);
+    for (auto const& [hash, estimate] : before)
+        EXPECT_EQ(sketch_estimate(&sketch, hash), estimate / 2) << hash;
+}
+
+TEST_F(SketchTest, cold_candidate_loses_to_hot_victim) {
+    uint64_t const hot  = 1;
+    uint64_t const cold = 2;
+    increment(hot, 10);
+    increment(cold, 1);
+
+    EXPECT_FALSE(sketch_admit(&sketch, cold, hot));
+    EXPECT_TRUE(sketch_admit(&sketch, hot, cold));
+
+    // Ties go to the victim, which is already cached.
+    increment(cold, 9);
+    EXPECT_FALSE(sketch_admit(&sketch, cold, hot));
+}
@@ -2,16 +2,14 @@
 
 #include <a3/str.h>
 
+extern "C" {
 #include "uri.h"
+}
 
 class UriTest : public ::testing::Test {
 protected:
-    Uri uri {};
-
-    void TearDown() override {
-        if (uri_is_initialized(&uri))
-            uri_free(&uri);
-    }
+    Uri     uri {};
+    uint8_t out[256] {};
 };
 
 TEST_F(UriTest, parse_trivial) {
@@ -38,7 +36,6 @@ TEST_F(UriTest, parse_scheme_authority) {
     EXPECT_EQ(a3_string_cmp(A3_S_CONST(uri.path), A3_CS("/test.txt")), 0);
     EXPECT_FALSE(uri.query.ptr);
     EXPECT_FALSE(uri.fragment.ptr);
-    uri_free(&uri);
 
     EXPECT_EQ(uri_parse(&uri, s2), URI_PARSE_SUCCESS);
     EXPECT_EQ(uri.scheme, URI_SCHEME_HTTPS);
@@ -64,18 +61,61 @@ TEST_F(UriTest, parse_components) {
     a3_string_free(&s);
 }
 
-TEST_F(UriTest, path_contained) {
-    uri = { URI_SCHEME_HTTP, A3_S_NULL, a3_string_clone(A3_CS("/index.html")), A3_S_NULL,
-            A3_S_NULL };
+TEST_F(UriTest, parse_normalize) {
+    A3String s1 = a3_string_clone(A3_CS("/a/./b/../c%20d+e"));
+    A3String s2 = a3_string_clone(A3_CS("/a/%2e%2e/../etc/passwd"));
+    A3String s3 = a3_string_clone(A3_CS("/bad%0"));
+
+    EXPECT_EQ(uri_parse(&uri, s1), URI_PARSE_SUCCESS);
+    EXPECT_EQ(a3_string_cmp(A3_S_CONST(uri.path), A3_CS("/a/c d e")), 0);
+
+    EXPECT_EQ(uri_parse(&uri, s2), URI_PARSE_SUCCESS);
+    EXPECT_EQ(a3_string_cmp(A3_S_CONST(uri.path), A3_CS("/../etc/passwd")), 0);
+    EXPECT_FALSE(uri_path_relative(&uri, { out, sizeof(out) }).ptr);
+
+    EXPECT_EQ(uri_parse(&uri, s3), URI_PARSE_BAD_URI);
 
-    A3String path = uri_path_if_contained(&uri, A3_CS("/var/www"));
+    a3_string_free(&s1);
+    a3_string_free(&s2);
+    a3_string_free(&s3);
+}
+
+TEST_F(UriTest, path_relative) {
+    A3String s1 = a3_string_clone(A3_CS("/index.html"));
+    A3String s2 = a3_string_clone(A3_CS("/../../../etc/passwd"));
+    A3String s3 = a3_string_clone(A3_CS("/"));
+
+    uri = { URI_SCHEME_HTTP, A3_S_NULL, s1, A3_S_NULL, A3_S_NULL };
+
+    A3String path = uri_path_relative(&uri, { out, sizeof(out) });
     EXPECT_TRUE(path.ptr);
-    EXPECT_EQ(a3_string_cmp(path, A3_CS("/var/www/index.html")), 0);
-    uri_free(&uri);
-    a3_string_free(&path);
+    EXPECT_EQ(a3_string_cmp(path, A3_CS("index.html")), 0);
 
-    uri  = { URI_SCHEME_HTTP, A3_S_NULL, a3_string_clone(A3_CS("/../../../etc/passwd")), A3_S_NULL,
-            A3_S_NULL };
-    path = uri_path_if_contained(&uri, A3_CS("/var/www"));
+    uri  = { URI_SCHEME_HTTP, A3_S_NULL, s2, A3_S_NULL, A3_S_NULL };
+    path = uri_path_relative(&uri, { out, sizeof(out) });
     EXPECT_FALSE(path.ptr);
+
+    uri  = { URI_SCHEME_HTTP, A3_S_NULL, s3, A3_S_NULL, A3_S_NULL };
+    path = uri_path_relative(&uri, { out, sizeof(out) });
+    EXPECT_EQ(a3_string_cmp(path, A3_CS(".")), 0);
+
+    a3_string_free(&s1);
+    a3_string_free(&s2);
+    a3_string_free(&s3);
+}
+
+TEST_F(UriTest, path_is_canonical) {
+    EXPECT_TRUE(uri_path_is_canonical(A3_CS("index.html")));
+    EXPECT_TRUE(uri_path_is_canonical(A3_CS("a/b.txt")));
+    EXPECT_TRUE(uri_path_is_canonical(A3_CS("a/.well-known/b")));
+
+    EXPECT_FALSE(uri_path_is_canonical(A3_CS("")));
+    EXPECT_FALSE(uri_path_is_canonical(A3_CS("/etc/passwd")));
+    EXPECT_FALSE(uri_path_is_canonical(A3_CS("../etc/passwd")));
+    EXPECT_FALSE(uri_path_is_canonical(A3_CS("a/../../etc/passwd")));
+    EXPECT_FALSE(uri_path_is_canonical(A3_CS("a/../b")));
+    EXPECT_FALSE(uri_path_is_canonical(A3_CS("./a")));
+    EXPECT_FALSE(uri_path_is_canonical(A3_CS("a/.")));
+    EXPECT_FALSE(uri_path_is_canonical(A3_CS("a//b")));
+    EXPECT_FALSE(uri_path_is_canonical({ (const uint8_t*)"a\0b", 3 }));
 }